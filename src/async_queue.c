@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include "async_queue.h"
+
+static void drain(async_queue_t *queue) {
+  async_queue_node_t *node = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+  async_queue_node_t *fifo = NULL;
+  async_queue_node_t *next;
+  uint64_t batch = 0;
+
+  if (node == NULL) {
+    return;
+  }
+
+  // 压入的时候是后进先出，反转一下
+  while (node != NULL) {
+    next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+    batch++;
+  }
+
+  queue->stats.received += batch;
+  if (batch > queue->stats.max_batch) {
+    queue->stats.max_batch = batch;
+  }
+  for (node = fifo; node != NULL; node = next) {
+    next = node->next;
+    queue->msg_cb(queue, node);
+  }
+}
+
+static void async_cb(uv_async_t *handle) {
+  async_queue_t *queue = (async_queue_t *) handle;
+  queue->stats.wakeups++;
+  drain(queue);
+}
+
+int async_queue_init(uv_loop_t *loop, async_queue_t *queue, async_queue_msg_cb msg_cb) {
+  memset(queue, 0, sizeof(*queue));
+  queue->msg_cb = msg_cb;
+  return uv_async_init(loop, &queue->async, async_cb);
+}
+
+int async_queue_push(async_queue_t *queue, async_queue_node_t *node) {
+  async_queue_node_t *head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+  do {
+    node->next = head;
+  } while (!__atomic_compare_exchange_n(&queue->head, &head, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  // 链表原来不是空的，说明前面压入的生产者已经叫过loop，async_cb把链表取走之前不用再叫
+  if (head != NULL) {
+    return 0;
+  }
+  __atomic_add_fetch(&queue->stats.sends, 1, __ATOMIC_RELAXED);
+  return uv_async_send(&queue->async);
+}
+
+static void handle_close_cb(uv_handle_t *handle) {
+  async_queue_t *queue = (async_queue_t *) handle;
+  if (queue->close_cb) {
+    queue->close_cb(queue);
+  }
+}
+
+void async_queue_close(async_queue_t *queue, async_queue_close_cb close_cb) {
+  drain(queue);
+  queue->close_cb = close_cb;
+  uv_close((uv_handle_t *) &queue->async, handle_close_cb);
+}
+
+void async_queue_print_stats(async_queue_t *queue, FILE *stream) {
+  uint64_t received = queue->stats.received;
+  fprintf(stream, "async queue: sends[%llu], wakeups[%llu], received[%llu], max batch[%llu], wakeups per msg[%.4f]\n",
+          (unsigned long long) __atomic_load_n(&queue->stats.sends, __ATOMIC_RELAXED),
+          (unsigned long long) queue->stats.wakeups, (unsigned long long) received,
+          (unsigned long long) queue->stats.max_batch,
+          received ? (double) queue->stats.wakeups / received : 0.0);
+}
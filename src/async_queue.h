@@ -0,0 +1,56 @@
+/*
+ * 带消息队列的uv_async_t
+ * uv_async_send只是"叫醒loop"，libuv会把两次回调之间的多次uv_async_send合并成一次async_cb，
+ * 所以不能把消息放在handle->data或者一个全局缓冲里，多个线程同时发的时候后写的会把先写的覆盖掉。
+ * 这里在uv_async_t旁边放一个无锁的多生产者、单消费者队列：
+ * 1、生产者(任意线程)用CAS把消息压到一个单链表(栈)的头上，不加锁
+ * 2、只有链表从空变成非空的那个生产者才调用uv_async_send，后面的生产者知道loop已经被叫过了，连原子操作和eventfd的写都省了
+ * 3、async_cb里用一次原子交换把整条链表拿走，反转成先进先出的顺序，一条条回调msg_cb
+ * 消费者一次拿走整条链表，不会单独摘某个节点，所以没有ABA问题。
+ * 同一个生产者发的消息保持顺序，不同生产者之间按压入的先后。
+ */
+#ifndef LIBUV_DEMO_ASYNC_QUEUE_H
+#define LIBUV_DEMO_ASYNC_QUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+typedef struct async_queue_s async_queue_t;
+typedef struct async_queue_node_s async_queue_node_t;
+
+// 节点嵌在使用方自己的消息结构里
+struct async_queue_node_s {
+  async_queue_node_t *next;
+};
+
+typedef void (*async_queue_msg_cb)(async_queue_t *queue, async_queue_node_t *node);
+typedef void (*async_queue_close_cb)(async_queue_t *queue);
+
+typedef struct {
+  uint64_t sends;               // uv_async_send的次数，在生产者线程里原子累加
+  uint64_t wakeups;             // async_cb的次数
+  uint64_t received;
+  uint64_t max_batch;           // 一次async_cb最多拿到多少条
+} async_queue_stats_t;
+
+struct async_queue_s {
+  uv_async_t async;
+  void *data;
+  async_queue_node_t *head;     // 生产者压入的一端，后进先出
+  async_queue_msg_cb msg_cb;
+  async_queue_close_cb close_cb;
+  async_queue_stats_t stats;
+};
+
+int async_queue_init(uv_loop_t *loop, async_queue_t *queue, async_queue_msg_cb msg_cb);
+
+// 任意线程都可以调用，node在msg_cb之前不能释放
+int async_queue_push(async_queue_t *queue, async_queue_node_t *node);
+
+// 在loop线程里调用，队列里还没回调的消息先回调完再关
+void async_queue_close(async_queue_t *queue, async_queue_close_cb close_cb);
+
+void async_queue_print_stats(async_queue_t *queue, FILE *stream);
+
+#endif //LIBUV_DEMO_ASYNC_QUEUE_H
@@ -0,0 +1,196 @@
+/*
+ * 多个线程往loop线程发消息的吞吐压测
+ * producers个线程(1~32)一共发messages条消息，统计loop线程每秒收到多少条、async_cb被叫醒了多少次：
+ * 1、shared：原来thread.c的写法，消息写进一个全局变量再uv_async_send，libuv会合并唤醒，收到的比发出的少，丢了多少条也打出来
+ * 2、mutex：消息挂到一个加锁的链表上，每条消息都uv_async_send一次
+ * 3、async_queue：无锁压入，只有链表从空变成非空的时候才uv_async_send，async_cb一次取走一整批
+ * 用法：AsyncQueueBench [messages]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../async_queue.h"
+
+#define MAX_PRODUCERS 32
+
+typedef struct {
+  async_queue_node_t node;
+  uint64_t seq;
+} bench_msg_t;
+
+typedef enum {
+  MODE_SHARED,
+  MODE_MUTEX,
+  MODE_QUEUE
+} bench_mode_t;
+
+static size_t messages = 2000000;
+
+static bench_mode_t mode;
+static int producers;
+static size_t per_producer;
+static bench_msg_t *msgs;
+static int finished_producers;
+
+static uv_async_t async_handle;
+static uint64_t shared_msg;
+static uint64_t async_sends;
+
+static uv_mutex_t mutex;
+static async_queue_node_t *mutex_head;
+static async_queue_node_t *mutex_tail;
+
+static async_queue_t queue;
+
+static uint64_t received;
+static uint64_t wakeups;
+static uint64_t last_seq;
+
+static void producer_done(void) {
+  // 最后一个生产者再叫一次，shared模式下靠这次唤醒知道所有线程都发完了
+  if (__atomic_add_fetch(&finished_producers, 1, __ATOMIC_ACQ_REL) == producers) {
+    uv_async_send(mode == MODE_QUEUE ? &queue.async : &async_handle);
+  }
+}
+
+static void producer(void *arg) {
+  bench_msg_t *msg = &msgs[(size_t) (uintptr_t) arg * per_producer];
+  size_t i;
+
+  for (i = 0; i < per_producer; i++, msg++) {
+    switch (mode) {
+      case MODE_SHARED:
+        __atomic_store_n(&shared_msg, msg->seq, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&async_sends, 1, __ATOMIC_RELAXED);
+        uv_async_send(&async_handle);
+        break;
+      case MODE_MUTEX:
+        msg->node.next = NULL;
+        uv_mutex_lock(&mutex);
+        if (mutex_tail) mutex_tail->next = &msg->node;
+        else mutex_head = &msg->node;
+        mutex_tail = &msg->node;
+        uv_mutex_unlock(&mutex);
+        __atomic_add_fetch(&async_sends, 1, __ATOMIC_RELAXED);
+        uv_async_send(&async_handle);
+        break;
+      case MODE_QUEUE:
+        async_queue_push(&queue, &msg->node);
+        break;
+    }
+  }
+  producer_done();
+}
+
+static int all_done(void) {
+  return __atomic_load_n(&finished_producers, __ATOMIC_ACQUIRE) == producers;
+}
+
+static void shared_cb(uv_async_t *handle) {
+  uint64_t seq = __atomic_load_n(&shared_msg, __ATOMIC_ACQUIRE);
+
+  wakeups++;
+  // 同一条消息被看到两次的时候不算
+  if (seq != last_seq) {
+    last_seq = seq;
+    received++;
+  }
+  if (all_done()) {
+    uv_close((uv_handle_t *) handle, NULL);
+  }
+}
+
+static void mutex_cb(uv_async_t *handle) {
+  async_queue_node_t *node;
+
+  uv_mutex_lock(&mutex);
+  node = mutex_head;
+  mutex_head = mutex_tail = NULL;
+  uv_mutex_unlock(&mutex);
+
+  wakeups++;
+  for (; node != NULL; node = node->next) {
+    received++;
+  }
+  if (all_done() && received == (uint64_t) producers * per_producer) {
+    uv_close((uv_handle_t *) handle, NULL);
+  }
+}
+
+static void queue_msg_cb(async_queue_t *q, async_queue_node_t *node) {
+  received++;
+  if (received == (uint64_t) producers * per_producer) {
+    async_queue_close(q, NULL);
+  }
+}
+
+static void run(uv_loop_t *loop, bench_mode_t m, int n) {
+  static const char *names[] = { "shared", "mutex", "async_queue" };
+  uv_thread_t threads[MAX_PRODUCERS];
+  uint64_t start, total, sends;
+  double elapsed;
+  size_t i;
+  int r;
+
+  mode = m;
+  producers = n;
+  per_producer = messages / n;
+  total = (uint64_t) per_producer * n;
+  finished_producers = 0;
+  received = wakeups = async_sends = 0;
+  last_seq = 0;
+  shared_msg = 0;
+  for (i = 0; i < total; i++) {
+    msgs[i].seq = i + 1;
+  }
+
+  if (mode == MODE_QUEUE) {
+    r = async_queue_init(loop, &queue, queue_msg_cb);
+  } else {
+    r = uv_async_init(loop, &async_handle, mode == MODE_SHARED ? shared_cb : mutex_cb);
+  }
+  CHECK(r, "async init");
+
+  start = uv_hrtime();
+  for (i = 0; i < (size_t) n; i++) {
+    r = uv_thread_create(&threads[i], producer, (void *) (uintptr_t) i);
+    CHECK(r, "uv_thread_create");
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = (uv_hrtime() - start) / 1e9;
+  for (i = 0; i < (size_t) n; i++) {
+    uv_thread_join(&threads[i]);
+  }
+
+  if (mode == MODE_QUEUE) {
+    wakeups = queue.stats.wakeups;
+    sends = queue.stats.sends;
+  } else {
+    sends = async_sends;
+  }
+  printf("  %-12s producers[%2d], %.0f msgs/s, received[%llu/%llu], sends[%llu], wakeups[%llu], "
+         "wakeups per msg[%.3g]\n", names[mode], n, received / elapsed, (unsigned long long) received,
+         (unsigned long long) total, (unsigned long long) sends, (unsigned long long) wakeups,
+         received ? (double) wakeups / received : 0.0);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  int n;
+
+  if (argc > 1) messages = (size_t) atol(argv[1]);
+
+  msgs = calloc(messages, sizeof(bench_msg_t));
+  if (msgs == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+  uv_mutex_init(&mutex);
+
+  printf("messages[%zu], cpus[%d]\n", messages, get_cpu_count());
+  for (n = 1; n <= MAX_PRODUCERS; n *= 2) {
+    run(loop, MODE_SHARED, n);
+    run(loop, MODE_MUTEX, n);
+    run(loop, MODE_QUEUE, n);
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * 对比alloc_cb里直接malloc/free和使用buf_pool的开销
+ * 模拟高并发小请求的场景：
+ * 1、同时有window个连接在读，每个连接借一块64KiB的读缓冲，像read一样写满nread个字节：
+ *    大部分是几十到一千字节的小请求，每BULK_EVERY次有一次把整块读满(大请求)，
+ *    只写开头几十个字节的话malloc出来的64KiB大部分页从来不会被碰到，峰值RSS就量不出区别
+ * 2、每个请求顺带分配一块随机大小的小内存(模拟业务对象)，让堆更容易碎片化
+ * 3、按随机顺序归还缓冲，统计每秒分配次数、读缓冲占用的峰值(pool模式就是buf_pool的peak_bytes)和进程的峰值RSS
+ * 每种模式都在fork出来的子进程里跑，这样峰值RSS互不影响
+ * 用法：BufPoolBench [iterations] [window]
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "uv.h"
+#include "../common.h"
+
+#define SMALL_OBJECTS 4096
+#define BULK_EVERY 8
+
+enum { MODE_MALLOC, MODE_POOL };
+
+static long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  // macOS上ru_maxrss的单位是字节
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+static void run(int mode, long iterations, int window) {
+  buf_pool_t pool;
+  buf_pool_init(&pool, BUF_POOL_SLAB_SIZE, BUF_POOL_MAX_BYTES);
+
+  uv_buf_t *bufs = calloc(window, sizeof(uv_buf_t));
+  char **objects = calloc(SMALL_OBJECTS, sizeof(char *));
+  unsigned int seed = 1;
+  size_t live_bytes = 0;
+  size_t peak_bytes = 0;
+  long i;
+
+  uint64_t start = uv_hrtime();
+
+  for (i = 0; i < iterations; i++) {
+    int slot = rand_r(&seed) % window;
+
+    // 先归还这个连接上一次借的缓冲
+    if (bufs[slot].base != NULL) {
+      if (mode == MODE_POOL) {
+        buf_pool_free(&pool, bufs[slot].base);
+      } else {
+        free(bufs[slot].base);
+        live_bytes -= BUF_POOL_SLAB_SIZE;
+      }
+    }
+
+    if (mode == MODE_POOL) {
+      bufs[slot] = buf_pool_alloc(&pool);
+    } else {
+      bufs[slot] = uv_buf_init(malloc(BUF_POOL_SLAB_SIZE), BUF_POOL_SLAB_SIZE);
+      live_bytes += BUF_POOL_SLAB_SIZE;
+      if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+      }
+    }
+    if (bufs[slot].base == NULL) {
+      CHECK(UV_ENOMEM, "alloc");
+    }
+    size_t nread = rand_r(&seed) % BULK_EVERY == 0 ? bufs[slot].len : 16 + rand_r(&seed) % 1024;
+    memset(bufs[slot].base, 'x', nread);
+
+    int obj = rand_r(&seed) % SMALL_OBJECTS;
+    free(objects[obj]);
+    objects[obj] = malloc(16 + rand_r(&seed) % 512);
+  }
+
+  uint64_t elapsed = uv_hrtime() - start;
+
+  if (mode == MODE_POOL) {
+    peak_bytes = pool.stats.peak_bytes;
+  }
+  printf("%-6s iterations[%ld], window[%d], allocs/sec[%.0f], buffer peak[%zu KiB], peak rss[%ld KiB]\n",
+         mode == MODE_POOL ? "pool" : "malloc", iterations, window,
+         iterations / (elapsed / 1e9), peak_bytes / 1024, peak_rss_kb());
+  if (mode == MODE_POOL) {
+    buf_pool_print_stats(&pool, stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+  int window = argc > 2 ? atoi(argv[2]) : 256;
+  int modes[2] = { MODE_MALLOC, MODE_POOL };
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      run(modes[i], iterations, window);
+      exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * 对比命令分发的开销：原来的strcmp链 vs dispatcher的完美hash
+ * 命令表分别有2、16、128、512条命令，输入是随机挑选的命令(其中10%是不认识的命令)，
+ * 统计每条命令平均花费的纳秒数。strcmp链的最坏情况(不认识的命令)要把整个表比较一遍。
+ * 用法：DispatchBench [iterations]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../dispatcher.h"
+
+#define INPUT_COUNT 4096
+// "Command"加上size_t最长的20位十进制数，snprintf不会截断
+#define NAME_SIZE 32
+
+static const command_reply_t ok_reply = COMMAND_REPLY("ok\n");
+static const command_reply_t unknown_reply = COMMAND_REPLY("Unknown argot\n");
+
+// 和原来tcpserver.c里一样：一个接一个strcmp
+static const command_reply_t *chain_dispatch(const command_t *commands, size_t count, const char *input) {
+  size_t i;
+  for (i = 0; i < count; i++) {
+    if (!strcmp(commands[i].name, input)) {
+      return &commands[i].reply;
+    }
+  }
+  return &unknown_reply;
+}
+
+static void run(size_t count, long iterations) {
+  command_t *commands = calloc(count, sizeof(command_t));
+  char (*names)[NAME_SIZE] = calloc(count, NAME_SIZE);
+  char (*inputs)[NAME_SIZE] = calloc(INPUT_COUNT, NAME_SIZE);
+  uv_buf_t *payloads = calloc(INPUT_COUNT, sizeof(uv_buf_t));
+  dispatcher_t dispatcher;
+  unsigned int seed = 1;
+  uintptr_t sink = 0;
+  size_t i;
+  long n;
+  int r;
+
+  for (i = 0; i < count; i++) {
+    snprintf(names[i], NAME_SIZE, "Command%zu", i);
+    commands[i].name = names[i];
+    commands[i].reply = ok_reply;
+  }
+
+  for (i = 0; i < INPUT_COUNT; i++) {
+    if (rand_r(&seed) % 10 == 0) {
+      snprintf(inputs[i], NAME_SIZE, "Unknown%zu", i);
+    } else {
+      strcpy(inputs[i], names[rand_r(&seed) % count]);
+    }
+    payloads[i] = uv_buf_init(inputs[i], strlen(inputs[i]));
+  }
+
+  r = dispatcher_init(&dispatcher, commands, count);
+  CHECK(r, "dispatcher_init");
+
+  uint64_t start = uv_hrtime();
+  for (n = 0; n < iterations; n++) {
+    sink += (uintptr_t) chain_dispatch(commands, count, inputs[n & (INPUT_COUNT - 1)]);
+  }
+  uint64_t chain_ns = uv_hrtime() - start;
+
+  start = uv_hrtime();
+  for (n = 0; n < iterations; n++) {
+    sink += (uintptr_t) dispatcher_dispatch(&dispatcher, &payloads[n & (INPUT_COUNT - 1)], &unknown_reply, NULL);
+  }
+  uint64_t hash_ns = uv_hrtime() - start;
+
+  printf("commands[%4zu], strcmp chain[%7.1f ns/cmd], perfect hash[%5.1f ns/cmd], slots[%zu] (%lu)\n",
+         count, (double) chain_ns / iterations, (double) hash_ns / iterations,
+         dispatcher.mask + 1, (unsigned long) (sink & 1));
+
+  dispatcher_destroy(&dispatcher);
+  free(payloads);
+  free(inputs);
+  free(names);
+  free(commands);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+  size_t sizes[] = { 2, 16, 128, 512 };
+  size_t i;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    run(sizes[i], iterations);
+  }
+  return 0;
+}
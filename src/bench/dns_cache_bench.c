@@ -0,0 +1,214 @@
+/*
+ * dns_cache和直接uv_getaddrinfo的对比
+ * 域名取自/etc/hosts，解析器只读本地文件、不发网络请求，相当于一个延迟很低、很稳定的DNS服务器，
+ * 测出来的是线程池和libc解析器本身的开销。loop里保持window个查询在途，随机挑域名，一共查lookups次：
+ * 1、uv_getaddrinfo：每次查询都占一个线程池线程
+ * 2、dns_cache：ttl足够长，除了第一次都命中
+ * 3、dns_cache短ttl：ttl只有ttl毫秒、提前一半刷新，看过期、合并和后台刷新的效果
+ * 统计每秒查询数、命中率和查询延迟的p50、p99(按2的幂次分段的上界)。
+ * 用法：DnsCacheBench [lookups] [window] [ttl]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../dns_cache.h"
+
+#define MAX_NAMES 256
+#define HIST_BUCKETS 32
+
+typedef struct {
+  uv_getaddrinfo_t req;
+  dns_lookup_t lookup;
+  uint64_t start;
+} slot_t;
+
+static int64_t lookups = 200000;
+static int window = 64;
+static uint64_t short_ttl = 5;
+
+static char *names[MAX_NAMES];
+static int name_count;
+
+static uv_idle_t idle;
+static slot_t *slots;
+static slot_t **free_slots;
+static int free_count;
+static int64_t issued;
+static int64_t completed;
+static int64_t errors;
+static uint64_t hist[HIST_BUCKETS];
+
+static dns_cache_t cache;
+static int use_cache;
+
+// 把/etc/hosts里的域名都读出来，一个域名只留一次
+static void load_names(void) {
+  char line[1024];
+  char *token, *save;
+  FILE *fp = fopen("/etc/hosts", "r");
+  int i;
+
+  if (fp == NULL) {
+    CHECK(uv_translate_sys_error(errno), "fopen /etc/hosts");
+  }
+  while (fgets(line, sizeof(line), fp) && name_count < MAX_NAMES) {
+    if ((token = strchr(line, '#')) != NULL) {
+      *token = '\0';
+    }
+    // 第一列是地址
+    if (strtok_r(line, " \t\r\n", &save) == NULL) {
+      continue;
+    }
+    while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL && name_count < MAX_NAMES) {
+      for (i = 0; i < name_count && strcmp(names[i], token) != 0; i++) {
+      }
+      if (i == name_count) {
+        names[name_count++] = strdup(token);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+static void idle_cb(uv_idle_t *handle);
+
+static void record(slot_t *slot, int status) {
+  uint64_t usec = (uv_hrtime() - slot->start) / 1000;
+  int i = 0;
+
+  while (usec) {
+    i++;
+    usec >>= 1;
+  }
+  hist[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+  if (status < 0) {
+    errors++;
+  }
+  completed++;
+  free_slots[free_count++] = slot;
+  // 有空位了再让idle发下一批，都在途的时候idle一直开着会让loop空转，抢线程池的CPU
+  if (issued < lookups) {
+    uv_idle_start(&idle, idle_cb);
+  }
+}
+
+static uint64_t percentile(double p) {
+  uint64_t rank = (uint64_t) (p * completed + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS - 1; i++) {
+    seen += hist[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return (uint64_t) 1 << i;
+}
+
+static void addrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+  record((slot_t *) req, status);
+  if (res) {
+    uv_freeaddrinfo(res);
+  }
+}
+
+static void lookup_cb(dns_lookup_t *lookup, int status, const struct addrinfo *res) {
+  record((slot_t *) lookup->data, status);
+}
+
+// 命中缓存的查询是同步回调的，在idle里一批批地发，不会在回调里递归；
+// 每轮最多发window个，loop转起来uv_now才会往前走，短ttl的条目才会过期
+static void idle_cb(uv_idle_t *handle) {
+  slot_t *slot;
+  const char *name;
+  int batch, r;
+
+  for (batch = 0; batch < window && free_count > 0 && issued < lookups; batch++) {
+    slot = free_slots[--free_count];
+    name = names[rand() % name_count];
+    issued++;
+    slot->start = uv_hrtime();
+    if (use_cache) {
+      slot->lookup.data = slot;
+      r = dns_cache_lookup(&cache, &slot->lookup, name, lookup_cb);
+    } else {
+      r = uv_getaddrinfo(handle->loop, &slot->req, addrinfo_cb, name, NULL, NULL);
+    }
+    CHECK(r, "lookup");
+  }
+  if (free_count == 0 || issued == lookups) {
+    uv_idle_stop(handle);
+  }
+}
+
+static void run(uv_loop_t *loop, const char *name, uint64_t ttl) {
+  dns_cache_options_t options = {
+      .capacity = 1024,
+      .ttl = ttl,
+      .negative_ttl = ttl,
+      .refresh_ahead = ttl / 2,
+      .hints = NULL,
+  };
+  uint64_t start;
+  double elapsed;
+  int i, r;
+
+  use_cache = ttl > 0;
+  if (use_cache) {
+    r = dns_cache_init(loop, &cache, &options);
+    CHECK(r, "dns_cache_init");
+  }
+
+  issued = completed = errors = 0;
+  memset(hist, 0, sizeof(hist));
+  free_count = 0;
+  for (i = 0; i < window; i++) {
+    free_slots[free_count++] = &slots[i];
+  }
+
+  start = uv_hrtime();
+  uv_idle_start(&idle, idle_cb);
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = (uv_hrtime() - start) / 1e9;
+
+  printf("  %-22s lookups[%lld], errors[%lld], %.2fs, %.0f lookups/s, p50[<%lluus], p99[<%lluus]\n", name,
+         (long long) completed, (long long) errors, elapsed, completed / elapsed,
+         (unsigned long long) percentile(0.5), (unsigned long long) percentile(0.99));
+  if (use_cache) {
+    printf("  ");
+    dns_cache_print_stats(&cache, stdout);
+    dns_cache_close(&cache, NULL);
+    uv_run(loop, UV_RUN_DEFAULT);
+  }
+}
+
+int main(int argc, char **argv) {
+  char name[32];
+
+  if (argc > 1) lookups = atol(argv[1]);
+  if (argc > 2) window = atoi(argv[2]);
+  if (argc > 3) short_ttl = (uint64_t) atol(argv[3]);
+
+  load_names();
+  if (name_count == 0) {
+    fprintf(stderr, "no names in /etc/hosts\n");
+    return 1;
+  }
+  slots = calloc(window, sizeof(slot_t));
+  free_slots = calloc(window, sizeof(slot_t *));
+  if (slots == NULL || free_slots == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+
+  uv_loop_t *loop = uv_default_loop();
+  uv_idle_init(loop, &idle);
+
+  printf("names[%d], window[%d], threadpool[%s], cpus[%d]\n", name_count, window,
+         getenv("UV_THREADPOOL_SIZE") ? getenv("UV_THREADPOOL_SIZE") : "4", get_cpu_count());
+  run(loop, "uv_getaddrinfo", 0);
+  run(loop, "dns_cache", 60 * 1000);
+  snprintf(name, sizeof(name), "dns_cache ttl[%llums]", (unsigned long long) short_ttl);
+  run(loop, name, short_ttl);
+  return 0;
+}
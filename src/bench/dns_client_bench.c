@@ -0,0 +1,227 @@
+/*
+ * dns_client和uv_getaddrinfo的每秒查询数对比
+ * 假DNS服务器(dns_fake)跑在另一个线程自己的loop上，绑在127.0.0.1:port。loop里保持window个查询在途，一共查queries次：
+ * 1、uv_getaddrinfo：只有port是53、并且/etc/resolv.conf里的nameserver是127.0.0.1时才跑，
+ *    这时libc的解析器查的就是这个假服务器(域名不在/etc/hosts里)，每个在途的查询占一个线程池线程
+ * 2、dns_client：所有查询从一个UDP socket发出去，按ID对回复
+ * 查询的同时用一串首尾相接的uv_fs_stat测线程池的排队情况，统计它的p50、p99，看DNS查询有没有把文件操作饿着。
+ * drop_every大于0时假服务器每drop_every个查询丢一个，看超时重发的效果。
+ * 用法：DnsClientBench [queries] [window] [drop every] [port]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../dns_client.h"
+#include "../dns_fake.h"
+
+#define HIST_BUCKETS 32
+
+typedef struct {
+  uv_getaddrinfo_t req;
+  dns_query_t query;
+} slot_t;
+
+static int64_t queries = 100000;
+static int window = 64;
+static int drop_every;
+static int port = DNS_PORT;
+
+static dns_fake_t fake;
+static uv_loop_t fake_loop;
+static uv_async_t fake_stop;
+static uv_thread_t fake_thread;
+
+static slot_t *slots;
+static int64_t issued;
+static int64_t completed;
+static int64_t errors;
+static uint64_t start_time;
+
+static dns_client_t client;
+static int use_client;
+
+static uv_fs_t stat_req;
+static uint64_t stat_start;
+static uint64_t stat_hist[HIST_BUCKETS];
+static uint64_t stat_count;
+static int stat_running;
+
+static void fake_stop_cb(uv_async_t *handle) {
+  dns_fake_print_stats(&fake, stdout);
+  dns_fake_close(&fake, NULL);
+  uv_close((uv_handle_t *) handle, NULL);
+}
+
+static void fake_run(void *arg) {
+  uv_run(&fake_loop, UV_RUN_DEFAULT);
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p) {
+  uint64_t rank = (uint64_t) (p * total + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS - 1; i++) {
+    seen += hist[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return (uint64_t) 1 << i;
+}
+
+static void stat_cb(uv_fs_t *req) {
+  uint64_t usec = (uv_hrtime() - stat_start) / 1000;
+  int i = 0;
+
+  uv_fs_req_cleanup(req);
+  while (usec) {
+    i++;
+    usec >>= 1;
+  }
+  stat_hist[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+  stat_count++;
+
+  if (stat_running) {
+    stat_start = uv_hrtime();
+    uv_fs_stat(req->loop, req, "/tmp", stat_cb);
+  }
+}
+
+static void issue(uv_loop_t *loop, slot_t *slot);
+
+static void done(uv_loop_t *loop, slot_t *slot, int status) {
+  if (status < 0) {
+    errors++;
+  }
+  completed++;
+  if (issued < queries) {
+    issue(loop, slot);
+  } else if (completed == queries) {
+    stat_running = 0;
+    if (use_client) {
+      dns_client_close(&client, NULL);
+    }
+  }
+}
+
+static void addrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+  if (res) {
+    uv_freeaddrinfo(res);
+  }
+  done(req->loop, (slot_t *) req, status);
+}
+
+static void query_cb(dns_query_t *query, int status) {
+  done(query->client->loop, (slot_t *) query->data, status);
+}
+
+static void issue(uv_loop_t *loop, slot_t *slot) {
+  struct addrinfo hints;
+  char name[64];
+  int r;
+
+  snprintf(name, sizeof(name), "host%lld.bench.test", (long long) (issued % 10000));
+  issued++;
+  if (use_client) {
+    slot->query.data = slot;
+    r = dns_client_query(&client, &slot->query, name, DNS_TYPE_A, query_cb);
+  } else {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    r = uv_getaddrinfo(loop, &slot->req, addrinfo_cb, name, NULL, &hints);
+  }
+  CHECK(r, "query");
+}
+
+static void run(uv_loop_t *loop, const struct sockaddr *server, int client_mode) {
+  double elapsed;
+  int i, r;
+
+  use_client = client_mode;
+  if (use_client) {
+    r = dns_client_init(loop, &client, server, 500, 3);
+    CHECK(r, "dns_client_init");
+  }
+  issued = completed = errors = 0;
+  memset(stat_hist, 0, sizeof(stat_hist));
+  stat_count = 0;
+  stat_running = 1;
+  stat_start = uv_hrtime();
+  r = uv_fs_stat(loop, &stat_req, "/tmp", stat_cb);
+  CHECK(r, "uv_fs_stat");
+
+  start_time = uv_hrtime();
+  for (i = 0; i < window && issued < queries; i++) {
+    issue(loop, &slots[i]);
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = (uv_hrtime() - start_time) / 1e9;
+
+  printf("  %-15s queries[%lld], errors[%lld], %.2fs, %.0f queries/s, fs_stat during run: ops[%llu], "
+         "p50[<%lluus], p99[<%lluus]\n", use_client ? "dns_client" : "uv_getaddrinfo", (long long) completed,
+         (long long) errors, elapsed, completed / elapsed, (unsigned long long) stat_count,
+         (unsigned long long) percentile(stat_hist, stat_count, 0.5),
+         (unsigned long long) percentile(stat_hist, stat_count, 0.99));
+  if (use_client) {
+    printf("  ");
+    dns_client_print_stats(&client, stdout);
+  }
+}
+
+// 系统的解析器是不是查127.0.0.1
+static int resolver_is_local(void) {
+  char line[256];
+  int local = 0;
+  FILE *fp = fopen("/etc/resolv.conf", "r");
+
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "nameserver", 10) == 0) {
+      local = strstr(line, "127.0.0.1") != NULL;
+      break;
+    }
+  }
+  fclose(fp);
+  return local;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  int r;
+
+  if (argc > 1) queries = atol(argv[1]);
+  if (argc > 2) window = atoi(argv[2]);
+  if (argc > 3) drop_every = atoi(argv[3]);
+  if (argc > 4) port = atoi(argv[4]);
+
+  slots = calloc(window, sizeof(slot_t));
+  if (slots == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+
+  uv_ip4_addr("127.0.0.1", port, &addr);
+  uv_loop_init(&fake_loop);
+  r = dns_fake_start(&fake_loop, &fake, (const struct sockaddr *) &addr, drop_every);
+  CHECK(r, "dns_fake_start");
+  uv_async_init(&fake_loop, &fake_stop, fake_stop_cb);
+  uv_thread_create(&fake_thread, fake_run, NULL);
+
+  uv_loop_t *loop = uv_default_loop();
+  printf("queries[%lld], window[%d], drop every[%d], server[127.0.0.1:%d], threadpool[%s], cpus[%d]\n",
+         (long long) queries, window, drop_every, port,
+         getenv("UV_THREADPOOL_SIZE") ? getenv("UV_THREADPOOL_SIZE") : "4", get_cpu_count());
+  if (port == DNS_PORT && resolver_is_local()) {
+    run(loop, (const struct sockaddr *) &addr, 0);
+  } else {
+    printf("  uv_getaddrinfo skipped: the system resolver does not query 127.0.0.1:53\n");
+  }
+  run(loop, (const struct sockaddr *) &addr, 1);
+
+  uv_async_send(&fake_stop);
+  uv_thread_join(&fake_thread);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * 批量反查的吞吐和并发度的关系
+ * 假DNS服务器(dns_fake)在另一个线程里绑127.0.0.1:53，/etc/resolv.conf的nameserver是127.0.0.1时，
+ * libc的getnameinfo查不到/etc/hosts就会向它发PTR查询，它回一个编出来的域名，相当于一个本地的解析器。
+ * 生成unique个不同的10.x.y.z地址，从里面随机挑addresses个作为输入，concurrency从1翻倍到64，
+ * 每次用一个新的dns_reverse(缓存是空的)跑完整批，统计每秒输出的地址数、每秒真正的反查数，并检查输出顺序和输入一致。
+ * uv_getnameinfo在libuv里算慢IO，最多只占线程池一半的线程，所以UV_THREADPOOL_SIZE默认设成128。
+ * 用法：DnsReverseBench [addresses] [unique]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../dns_client.h"
+#include "../dns_fake.h"
+#include "../dns_reverse.h"
+
+static int addresses = 20000;
+static int unique = 5000;
+
+static dns_fake_t fake;
+static uv_loop_t fake_loop;
+static uv_async_t fake_stop;
+static uv_thread_t fake_thread;
+
+static char (*inputs)[16];
+static int outputs;
+static int out_of_order;
+static int failures;
+
+static void fake_stop_cb(uv_async_t *handle) {
+  dns_fake_print_stats(&fake, stdout);
+  dns_fake_close(&fake, NULL);
+  uv_close((uv_handle_t *) handle, NULL);
+}
+
+static void fake_run(void *arg) {
+  uv_run(&fake_loop, UV_RUN_DEFAULT);
+}
+
+static void output_cb(dns_reverse_t *rev, const char *addr, int status, const char *host) {
+  if (strcmp(addr, inputs[outputs]) != 0) {
+    out_of_order++;
+  }
+  if (status < 0) {
+    failures++;
+  }
+  outputs++;
+}
+
+static void done_cb(dns_reverse_t *rev) {
+}
+
+static void run(uv_loop_t *loop, int concurrency) {
+  dns_reverse_t rev;
+  uint64_t start;
+  double elapsed;
+  int i, r;
+
+  outputs = out_of_order = failures = 0;
+  r = dns_reverse_init(loop, &rev, concurrency, output_cb);
+  CHECK(r, "dns_reverse_init");
+
+  start = uv_hrtime();
+  for (i = 0; i < addresses; i++) {
+    r = dns_reverse_add(&rev, inputs[i]);
+    CHECK(r, "dns_reverse_add");
+  }
+  dns_reverse_end(&rev, done_cb);
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = (uv_hrtime() - start) / 1e9;
+
+  printf("  concurrency[%2d] outputs[%d], %.2fs, %.0f addresses/s, %.0f lookups/s, failures[%d], "
+         "out of order[%d], max pending[%llu]\n", concurrency, outputs, elapsed, outputs / elapsed,
+         rev.stats.lookups / elapsed, failures, out_of_order, (unsigned long long) rev.stats.max_pending);
+  dns_reverse_free(&rev);
+}
+
+// 系统的解析器是不是查127.0.0.1
+static int resolver_is_local(void) {
+  char line[256];
+  int local = 0;
+  FILE *fp = fopen("/etc/resolv.conf", "r");
+
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "nameserver", 10) == 0) {
+      local = strstr(line, "127.0.0.1") != NULL;
+      break;
+    }
+  }
+  fclose(fp);
+  return local;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  int concurrency, i, r, n;
+
+  if (argc > 1) addresses = atoi(argv[1]);
+  if (argc > 2) unique = atoi(argv[2]);
+
+  // 要在第一次用线程池之前设置
+  setenv("UV_THREADPOOL_SIZE", "128", 0);
+
+  inputs = calloc(addresses, sizeof(inputs[0]));
+  if (inputs == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+  for (i = 0; i < addresses; i++) {
+    n = rand() % unique;
+    snprintf(inputs[i], sizeof(inputs[i]), "10.%d.%d.%d", (n >> 16) & 255, (n >> 8) & 255, n & 255);
+  }
+
+  uv_ip4_addr("127.0.0.1", DNS_PORT, &addr);
+  uv_loop_init(&fake_loop);
+  r = dns_fake_start(&fake_loop, &fake, (const struct sockaddr *) &addr, 0);
+  CHECK(r, "dns_fake_start");
+  uv_async_init(&fake_loop, &fake_stop, fake_stop_cb);
+  uv_thread_create(&fake_thread, fake_run, NULL);
+  if (!resolver_is_local()) {
+    printf("warning: the system resolver does not query 127.0.0.1:53, lookups go to the real resolver\n");
+  }
+
+  uv_loop_t *loop = uv_default_loop();
+  printf("addresses[%d], unique[%d], threadpool[%s], cpus[%d]\n", addresses, unique,
+         getenv("UV_THREADPOOL_SIZE"), get_cpu_count());
+  for (concurrency = 1; concurrency <= 64; concurrency *= 2) {
+    run(loop, concurrency);
+  }
+
+  uv_async_send(&fake_stop);
+  uv_thread_join(&fake_thread);
+  return 0;
+}
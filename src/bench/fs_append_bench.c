@@ -0,0 +1,233 @@
+/*
+ * fs_append的小记录追加压测
+ * 生产者在idle回调里每轮追加最多BURST条record_size字节的记录，统计每秒追加的记录数，以及从追加到回调的延迟：
+ * 1、write：每条记录一个uv_fs_write(O_APPEND)，最多WINDOW个在途
+ * 2、write+sync：每条记录uv_fs_write之后再uv_fs_fdatasync，最多WINDOW条在途，记录数只跑十分之一
+ * 3、append：fs_append攒批写，不落盘
+ * 4、append sync=0：每批写完落盘
+ * 5、append sync=10ms：最多等10ms落盘
+ * 6、append sync=10ms/1MiB：最多等10ms，或者攒够1MiB就落盘
+ * tmpfs上的fdatasync什么都不做，要看落盘的差别dir得放在真正的磁盘上。
+ * 用法：FsAppendBench [dir] [records] [record size]
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include "uv.h"
+#include "../common.h"
+#include "../fs_append.h"
+
+#define BURST 1024
+#define WINDOW 64
+
+typedef struct {
+  uv_fs_t req;
+  uint64_t start;
+  int sync;
+} record_req_t;
+
+static const char *dir = "/tmp";
+static size_t records = 100000;
+static size_t record_size = 128;
+
+static char path[PATH_MAX];
+static uv_buf_t record;
+static uint64_t *latencies;
+static size_t target;
+static size_t issued;
+static size_t completed;
+static int in_flight;
+
+// per-record模式
+static uv_file file;
+static int per_record_sync;
+static record_req_t window_reqs[WINDOW];
+static record_req_t *free_reqs[WINDOW];
+static int free_count;
+
+// fs_append模式
+static fs_append_t writer;
+static fs_append_req_t *append_reqs;
+static uint64_t *append_start;
+static uv_idle_t producer;
+static int blocked;
+
+static void produce_append(uv_idle_t *handle);
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void record_done(uint64_t start) {
+  latencies[completed++] = uv_hrtime() - start;
+}
+
+static void record_cb(uv_fs_t *req) {
+  record_req_t *r = (record_req_t *) req;
+  int err;
+
+  CHECK(req->result, "record");
+  uv_fs_req_cleanup(req);
+
+  // 先写再落盘
+  if (per_record_sync && !r->sync) {
+    r->sync = 1;
+    err = uv_fs_fdatasync(req->loop, req, file, record_cb);
+    CHECK(err, "uv_fs_fdatasync");
+    return;
+  }
+
+  record_done(r->start);
+  free_reqs[free_count++] = r;
+  in_flight--;
+}
+
+static void append_cb(fs_append_req_t *req, int status) {
+  CHECK(status, "fs_append");
+  record_done(append_start[req - append_reqs]);
+
+  // 有一批写完了，缓冲空出来了，接着追加
+  if (blocked) {
+    blocked = 0;
+    uv_idle_start(&producer, produce_append);
+  }
+}
+
+static void close_cb(fs_append_t *w) {
+}
+
+static void produce_per_record(uv_idle_t *handle) {
+  int i, r;
+
+  for (i = 0; i < BURST && issued < target && free_count > 0; i++) {
+    record_req_t *req = free_reqs[--free_count];
+    req->start = uv_hrtime();
+    req->sync = 0;
+    r = uv_fs_write(handle->loop, &req->req, file, &record, 1, -1, record_cb);
+    CHECK(r, "uv_fs_write");
+    issued++;
+    in_flight++;
+  }
+  if (issued == target && in_flight == 0) {
+    uv_idle_stop(handle);
+  }
+}
+
+static void produce_append(uv_idle_t *handle) {
+  int i, r;
+
+  for (i = 0; i < BURST && issued < target; i++) {
+    append_start[issued] = uv_hrtime();
+    r = fs_append_write(&writer, &append_reqs[issued], &record, 1, append_cb);
+    // 缓冲满了，停下来等有记录回调了再接着追加，不然idle会一直空转抢线程池的CPU
+    if (r == UV_ENOBUFS) {
+      blocked = 1;
+      uv_idle_stop(handle);
+      return;
+    }
+    CHECK(r, "fs_append_write");
+    issued++;
+  }
+  if (issued == target) {
+    uv_idle_stop(handle);
+    fs_append_close(&writer, close_cb);
+  }
+}
+
+static void report(const char *name, uint64_t elapsed, const char *extra) {
+  qsort(latencies, completed, sizeof(uint64_t), compare_u64);
+  printf("%-22s records[%zu], %.0f records/s, p50[%.2fms], p99[%.2fms]%s\n", name, completed,
+         completed / (elapsed / 1e9), latencies[completed / 2] / 1e6, latencies[completed * 99 / 100] / 1e6, extra);
+}
+
+static void run_per_record(uv_loop_t *loop, const char *name, int sync, size_t count) {
+  uv_idle_t idle;
+  uv_fs_t req;
+  uint64_t start;
+  int i;
+
+  unlink(path);
+  file = uv_fs_open(loop, &req, path, O_WRONLY | O_APPEND | O_CREAT, 0644, NULL);
+  CHECK(file, "uv_fs_open");
+  uv_fs_req_cleanup(&req);
+
+  per_record_sync = sync;
+  target = count;
+  issued = completed = 0;
+  in_flight = 0;
+  for (i = 0; i < WINDOW; i++) {
+    free_reqs[i] = &window_reqs[i];
+  }
+  free_count = WINDOW;
+
+  start = uv_hrtime();
+  uv_idle_init(loop, &idle);
+  uv_idle_start(&idle, produce_per_record);
+  uv_run(loop, UV_RUN_DEFAULT);
+  report(name, uv_hrtime() - start, "");
+
+  uv_close((uv_handle_t *) &idle, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_fs_close(loop, &req, file, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+static void run_append(uv_loop_t *loop, const char *name, int64_t sync_ms, uint64_t sync_bytes) {
+  fs_append_options_t options = { sync_ms, sync_bytes, 0 };
+  char extra[128];
+  uint64_t start;
+  int r;
+
+  unlink(path);
+  target = records;
+  issued = completed = 0;
+  blocked = 0;
+
+  start = uv_hrtime();
+  r = fs_append_open(loop, &writer, path, &options);
+  CHECK(r, "fs_append_open");
+  uv_idle_init(loop, &producer);
+  uv_idle_start(&producer, produce_append);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  snprintf(extra, sizeof(extra), ", batches[%llu], syncs[%llu], full[%llu], max batch[%lluKiB]",
+           (unsigned long long) writer.stats.batches, (unsigned long long) writer.stats.syncs,
+           (unsigned long long) writer.stats.full, (unsigned long long) writer.stats.max_batch / 1024);
+  report(name, uv_hrtime() - start, extra);
+
+  uv_close((uv_handle_t *) &producer, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+
+  if (argc > 1) dir = argv[1];
+  if (argc > 2) records = (size_t) atol(argv[2]);
+  if (argc > 3) record_size = (size_t) atol(argv[3]);
+
+  snprintf(path, sizeof(path), "%s/fs_append_bench.%d", dir, uv_os_getpid());
+  record = uv_buf_init(malloc(record_size), record_size);
+  memset(record.base, 'a', record_size);
+  record.base[record_size - 1] = '\n';
+
+  latencies = malloc(records * sizeof(uint64_t));
+  append_reqs = calloc(records, sizeof(fs_append_req_t));
+  append_start = malloc(records * sizeof(uint64_t));
+  if (latencies == NULL || append_reqs == NULL || append_start == NULL) {
+    CHECK(UV_ENOMEM, "malloc");
+  }
+
+  printf("records[%zu], record size[%zu], threadpool[%s]\n", records, record_size,
+         getenv("UV_THREADPOOL_SIZE") ? getenv("UV_THREADPOOL_SIZE") : "4");
+  run_per_record(loop, "write", 0, records);
+  run_per_record(loop, "write+sync", 1, records / 10);
+  run_append(loop, "append", -1, 0);
+  run_append(loop, "append sync=0", 0, 0);
+  run_append(loop, "append sync=10ms", 10, 0);
+  run_append(loop, "append sync=10ms/1MiB", 10, 1024 * 1024);
+
+  unlink(path);
+  return 0;
+}
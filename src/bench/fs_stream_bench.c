@@ -0,0 +1,101 @@
+/*
+ * fs_stream的读吞吐压测
+ * 在dir下生成16MiB起、每次翻4倍、直到max_size的测试文件，对每个文件分别用depth为1、2、4、8、16、32读一遍，统计MB/s。
+ * depth=1就相当于原来读完一块再发下一个请求的写法。
+ * 每次读之前先fdatasync再用posix_fadvise(DONTNEED)把文件从页缓存里踢掉，尽量让每一轮都从磁盘读；
+ * 内核不保证一定踢得掉，tmpfs上也没有磁盘可读，结果里的cold只是尽力而为。
+ * 用法：FsStreamBench [dir] [chunk KiB] [max size MiB]
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include "uv.h"
+#include "../common.h"
+#include "../fs_stream.h"
+
+static const char *dir = "/tmp";
+static size_t chunk_size = 256 * 1024;
+static size_t max_size = 256 * 1024 * 1024;
+
+static void close_cb(fs_stream_t *stream) {
+}
+
+static void chunk_cb(fs_stream_t *stream, int status, const uv_buf_t *chunk, int64_t offset) {
+  CHECK(status, "fs_stream");
+  if (chunk->len == 0) {
+    fs_stream_close(stream, close_cb);
+  }
+}
+
+static void create_file(const char *path, size_t size) {
+  char block[64 * 1024];
+  size_t written = 0;
+  int fd;
+
+  memset(block, 'x', sizeof(block));
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    CHECK(uv_translate_sys_error(errno), "creating test file");
+  }
+  while (written < size) {
+    ssize_t n = write(fd, block, sizeof(block));
+    if (n <= 0) {
+      CHECK(uv_translate_sys_error(errno), "writing test file");
+    }
+    written += n;
+  }
+  close(fd);
+}
+
+static void drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  close(fd);
+}
+
+static double run(uv_loop_t *loop, const char *path, int depth) {
+  fs_stream_t stream;
+  uint64_t start;
+  int r;
+
+  drop_cache(path);
+  start = uv_hrtime();
+  r = fs_stream_open(loop, &stream, path, chunk_size, depth, FS_STREAM_READ, chunk_cb);
+  CHECK(r, "fs_stream_open");
+  uv_run(loop, UV_RUN_DEFAULT);
+  return stream.bytes / ((uv_hrtime() - start) / 1e9) / (1024 * 1024);
+}
+
+int main(int argc, char **argv) {
+  static const int depths[] = { 1, 2, 4, 8, 16, 32 };
+  uv_loop_t *loop = uv_default_loop();
+  char path[PATH_MAX];
+  size_t size;
+  size_t i;
+
+  if (argc > 1) dir = argv[1];
+  if (argc > 2) chunk_size = (size_t) atol(argv[2]) * 1024;
+  if (argc > 3) max_size = (size_t) atol(argv[3]) * 1024 * 1024;
+
+  snprintf(path, sizeof(path), "%s/fs_stream_bench.%d", dir, uv_os_getpid());
+  printf("chunk[%zuKiB], threadpool[%s]\n", chunk_size / 1024,
+         getenv("UV_THREADPOOL_SIZE") ? getenv("UV_THREADPOOL_SIZE") : "4");
+
+  for (size = 16 * 1024 * 1024; size <= max_size; size *= 4) {
+    create_file(path, size);
+    printf("size[%4zuMiB]", size / (1024 * 1024));
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+      printf(", depth %d[%.0fMB/s]", depths[i], run(loop, path, depths[i]));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+
+  unlink(path);
+  return 0;
+}
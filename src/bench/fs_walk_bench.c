@@ -0,0 +1,160 @@
+/*
+ * fs_walk的目录树遍历压测
+ * 第一次运行时在dir下生成files个空文件，每个叶子目录per_dir个文件，叶子目录按每层FANOUT个子目录往下分；
+ * 生成好之后在dir/.fs_walk_bench里记下文件数，下次直接用；换了files或者per_dir要先把dir删掉。
+ * 然后分别用concurrency为1、2、4、8、16、32、64遍历一遍，统计每秒回调的项数，每个concurrency跑两遍：
+ * 只用scandir给出的类型，以及每一项都lstat。
+ * concurrency=1就相当于一个目录扫完再扫下一个的写法。线程池默认只有4个线程，concurrency大于线程数的请求只是在排队，
+ * 所以没有设置UV_THREADPOOL_SIZE时这里设成64。
+ * 默认是热缓存(生成或者上一轮遍历之后dentry和inode都在内存里)，最后一个参数为cold时每轮之前写/proc/sys/vm/drop_caches，需要root。
+ * 用法：FsWalkBench [dir] [files] [files per dir] [warm|cold]
+ */
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "uv.h"
+#include "../common.h"
+#include "../fs_walk.h"
+
+#define FANOUT 16
+
+static const char *dir = "/tmp/fs_walk_bench";
+static size_t files = 1000000;
+static size_t per_dir = 100;
+static int cold;
+
+static void make_dir(const char *path) {
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+    CHECK(uv_translate_sys_error(errno), "mkdir");
+  }
+}
+
+static size_t tree_files(void) {
+  char marker[PATH_MAX];
+  size_t count = 0;
+  FILE *fp;
+
+  snprintf(marker, sizeof(marker), "%s/.fs_walk_bench", dir);
+  fp = fopen(marker, "r");
+  if (fp != NULL) {
+    if (fscanf(fp, "%zu", &count) != 1) {
+      count = 0;
+    }
+    fclose(fp);
+  }
+  return count;
+}
+
+// 第leaf个叶子目录的路径是leaf按FANOUT进制的各位数字，levels层
+static void generate_tree(void) {
+  size_t leaves = (files + per_dir - 1) / per_dir;
+  size_t span = 1, leaf, i;
+  int levels = 0, level, len, fd;
+  uint64_t start = uv_hrtime();
+  char path[PATH_MAX];
+  FILE *fp;
+
+  while (span < leaves) {
+    span *= FANOUT;
+    levels++;
+  }
+
+  make_dir(dir);
+  for (leaf = 0; leaf < leaves; leaf++) {
+    size_t digits = leaf, div = span;
+    len = snprintf(path, sizeof(path), "%s", dir);
+    for (level = 0; level < levels; level++) {
+      div /= FANOUT;
+      len += snprintf(path + len, sizeof(path) - len, "/d%zx", digits / div);
+      digits %= div;
+      make_dir(path);
+    }
+    for (i = 0; i < per_dir && leaf * per_dir + i < files; i++) {
+      snprintf(path + len, sizeof(path) - len, "/f%zu", i);
+      fd = open(path, O_WRONLY | O_CREAT, 0644);
+      if (fd < 0) {
+        CHECK(uv_translate_sys_error(errno), "creating test file");
+      }
+      close(fd);
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/.fs_walk_bench", dir);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    CHECK(uv_translate_sys_error(errno), "writing marker");
+  }
+  fprintf(fp, "%zu\n", files);
+  fclose(fp);
+  printf("generated %zu files in %zu leaf dirs, %d levels, %.1fs\n", files, leaves, levels,
+         (uv_hrtime() - start) / 1e9);
+}
+
+static void drop_caches(void) {
+  FILE *fp;
+
+  sync();
+  fp = fopen("/proc/sys/vm/drop_caches", "w");
+  if (fp == NULL) {
+    CHECK(uv_translate_sys_error(errno), "opening /proc/sys/vm/drop_caches");
+  }
+  fputs("3\n", fp);
+  fclose(fp);
+}
+
+static void entry_cb(fs_walk_t *walker, int status, const fs_walk_entry_t *entry) {
+  CHECK(status, entry->path);
+}
+
+static void done_cb(fs_walk_t *walker, int status) {
+  CHECK(status, "fs_walk");
+}
+
+static void run(uv_loop_t *loop, int concurrency, int stat) {
+  fs_walk_options_t options = { concurrency, 0, stat, NULL, NULL };
+  fs_walk_t walker;
+  uint64_t start;
+  double elapsed;
+  int r;
+
+  if (cold) {
+    drop_caches();
+  }
+
+  start = uv_hrtime();
+  r = fs_walk_start(loop, &walker, dir, &options, entry_cb, done_cb);
+  CHECK(r, "fs_walk_start");
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = (uv_hrtime() - start) / 1e9;
+
+  printf("concurrency[%2d], %-9s entries[%llu], dirs[%llu], %.2fs, %.0f entries/s, max in flight[%d]\n",
+         concurrency, stat ? "lstat," : "scandir,", (unsigned long long) walker.stats.entries,
+         (unsigned long long) walker.stats.dirs, elapsed, walker.stats.entries / elapsed,
+         walker.stats.max_in_flight);
+}
+
+int main(int argc, char **argv) {
+  int concurrency;
+
+  if (argc > 1) dir = argv[1];
+  if (argc > 2) files = (size_t) atol(argv[2]);
+  if (argc > 3) per_dir = (size_t) atol(argv[3]);
+  if (argc > 4) cold = strcmp(argv[4], "cold") == 0;
+  if (per_dir == 0) per_dir = 1;
+
+  // 要在第一次用线程池之前设置
+  setenv("UV_THREADPOOL_SIZE", "64", 0);
+
+  if (tree_files() != files) {
+    generate_tree();
+  }
+
+  uv_loop_t *loop = uv_default_loop();
+  printf("dir[%s], files[%zu], per dir[%zu], threadpool[%s], %s cache\n", dir, files, per_dir,
+         getenv("UV_THREADPOOL_SIZE"), cold ? "cold" : "warm");
+  for (concurrency = 1; concurrency <= 64; concurrency *= 2) {
+    run(loop, concurrency, 0);
+    run(loop, concurrency, 1);
+  }
+  return 0;
+}
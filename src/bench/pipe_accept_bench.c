@@ -0,0 +1,155 @@
+/*
+ * PipeHandle的accept压测
+ * 分别用handoff batch为1(每个连接一次uv_write2，也就是原来的做法)和32(一次sendmsg带多个fd)拉起PipeHandle，
+ * 客户端保持concurrency个并发不停地建连接、连上就关，统计每秒建立的连接数。
+ * master的listen backlog会被打满，所以每秒连接数就是master每秒能accept并转交给worker的连接数。
+ * 用法：PipeAcceptBench [workers] [concurrency] [seconds]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+
+#define HOST "127.0.0.1"
+#define PORT 7000
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+} bench_conn_t;
+
+static int workers = 4;
+static int concurrency = 256;
+static int seconds = 3;
+
+static uv_loop_t *loop;
+static uv_process_t server;
+static struct sockaddr_in addr;
+static bench_conn_t *conns;
+static int active;
+static int stopping;
+static uint64_t accepted;
+static uint64_t errors;
+
+static void start_connect(bench_conn_t *conn);
+
+static void exit_cb(uv_process_t *req, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) req, NULL);
+}
+
+static void close_cb(uv_handle_t *handle) {
+  bench_conn_t *conn = (bench_conn_t *) handle;
+
+  if (!stopping) {
+    start_connect(conn);
+    return;
+  }
+
+  if (--active == 0) {
+    uv_process_kill(&server, SIGTERM);
+  }
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  if (status < 0) {
+    errors++;
+  } else {
+    accepted++;
+  }
+  uv_close((uv_handle_t *) req->handle, close_cb);
+}
+
+static void start_connect(bench_conn_t *conn) {
+  int r;
+
+  r = uv_tcp_init(loop, &conn->handle);
+  CHECK(r, "uv_tcp_init");
+  r = uv_tcp_connect(&conn->connect_req, &conn->handle, (const struct sockaddr *) &addr, connect_cb);
+  CHECK(r, "uv_tcp_connect");
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  stopping = 1;
+  uv_close((uv_handle_t *) handle, NULL);
+}
+
+static void spawn_server(const char *batch) {
+  char exepath[PATH_MAX];
+  size_t size = sizeof(exepath);
+  char count[16];
+  int r;
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+  strcpy(exepath + (strlen(exepath) - strlen("PipeAcceptBench")), "PipeHandle");
+  snprintf(count, sizeof(count), "%d", workers);
+
+  char *args[] = { exepath, "least", count, (char *) batch, NULL };
+
+  // 每个连接都会打一行accept日志，压测时全部丢掉
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_IGNORE;
+  stdio[2].flags = UV_IGNORE;
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  r = uv_spawn(loop, &server, &options);
+  CHECK(r, "spawning PipeHandle");
+}
+
+static void run_batch(const char *batch) {
+  uv_timer_t timer_handle;
+  uint64_t start_time;
+  int r;
+  int i;
+
+  accepted = 0;
+  errors = 0;
+  stopping = 0;
+
+  spawn_server(batch);
+  // 给master和worker一点启动时间
+  usleep(500 * 1000);
+
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  active = concurrency;
+  for (i = 0; i < concurrency; i++) {
+    start_connect(&conns[i]);
+  }
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  printf("handoff batch[%2s], connections[%llu], errors[%llu], accepts/sec[%.0f]\n",
+         batch, (unsigned long long) accepted, (unsigned long long) errors, accepted / elapsed);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  int r;
+
+  if (argc > 1) workers = atoi(argv[1]);
+  if (argc > 2) concurrency = atoi(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+
+  loop = uv_default_loop();
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+  conns = calloc(concurrency, sizeof(bench_conn_t));
+
+  printf("workers[%d], concurrency[%d], seconds[%d]\n", workers, concurrency, seconds);
+  run_batch("1");
+  run_batch("32");
+  return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * PipeHandle的调度策略压测
+ * 依次用rr、least、p2c三种策略拉起PipeHandle，从第一个回复里拿到某个worker的pid，之后每隔stall_ms毫秒
+ * 交替给它发SIGSTOP/SIGCONT，让它一半时间停着不动，模拟一个慢核或者被干扰的进程。
+ * 故障注入全在压测这边做，WorkerHandle本身不带任何压测开关。
+ * 客户端保持concurrency个并发，每个请求都是新建连接、发一行、收到回复就关，统计从发起连接到收到回复的延迟分位数。
+ * round robin会把1/workers的连接分给慢worker，p99直接被它拖住；按负载调度的策略应该能绕开它。
+ * 用法：PipeDispatchBench [workers] [concurrency] [seconds] [stall_ms]
+ */
+#include <stdio.h>
+#include <signal.h>
+#include "uv.h"
+#include "../common.h"
+
+#define HOST "127.0.0.1"
+#define PORT 7000
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  uint64_t start;
+} bench_conn_t;
+
+static int workers = 4;
+static int concurrency = 32;
+static int seconds = 3;
+static int stall_ms = 20;
+
+static uv_loop_t *loop;
+static uv_process_t server;
+static struct sockaddr_in addr;
+static bench_conn_t *conns;
+static int active;
+static int stopping;
+static uint64_t errors;
+
+// 被拖慢的worker，回复的格式是"From worker <pid> => ..."
+static int slow_pid;
+static int slow_stopped;
+static uv_timer_t stall_timer;
+
+static uint64_t *latencies;
+static size_t latency_count;
+static size_t latency_cap;
+
+// 连接回复最多读一次，所有连接共用一块读缓冲
+static char read_buf[64 * 1024];
+
+static void start_request(bench_conn_t *conn);
+
+static void record_latency(uint64_t ns) {
+  if (latency_count == latency_cap) {
+    latency_cap = latency_cap ? latency_cap * 2 : 4096;
+    latencies = realloc(latencies, latency_cap * sizeof(uint64_t));
+    if (latencies == NULL) {
+      fprintf(stderr, "realloc: out of memory\n");
+      exit(1);
+    }
+  }
+  latencies[latency_count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double p) {
+  if (latency_count == 0) {
+    return 0;
+  }
+  size_t i = (size_t) (p * (latency_count - 1));
+  return latencies[i] / 1e6;
+}
+
+static void stall_cb(uv_timer_t *handle) {
+  slow_stopped = !slow_stopped;
+  if (uv_kill(slow_pid, slow_stopped ? SIGSTOP : SIGCONT)) {
+    // worker已经退出了，比如被master回收，就不再干扰
+    slow_stopped = 0;
+    uv_timer_stop(handle);
+  }
+}
+
+static void stall_stop() {
+  uv_timer_stop(&stall_timer);
+  if (slow_stopped) {
+    uv_kill(slow_pid, SIGCONT);
+    slow_stopped = 0;
+  }
+}
+
+static void exit_cb(uv_process_t *req, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) req, NULL);
+}
+
+static void close_cb(uv_handle_t *handle) {
+  bench_conn_t *conn = (bench_conn_t *) handle;
+
+  if (!stopping) {
+    start_request(conn);
+    return;
+  }
+
+  // 压测结束并且所有连接都关了，再把PipeHandle停掉，进程句柄关闭后loop自然退出
+  if (--active == 0) {
+    uv_process_kill(&server, SIGTERM);
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  *buf = uv_buf_init(read_buf, sizeof(read_buf));
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) stream;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread > 0) {
+    record_latency(uv_hrtime() - conn->start);
+    if (slow_pid == 0 && !stopping && sscanf(buf->base, "From worker %d", &slow_pid) == 1) {
+      uv_timer_start(&stall_timer, stall_cb, stall_ms, stall_ms);
+    }
+  } else {
+    errors++;
+  }
+  uv_close((uv_handle_t *) stream, close_cb);
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) {
+    errors++;
+  }
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  uv_buf_t ping = uv_buf_init("ping\n", 5);
+  bench_conn_t *conn = (bench_conn_t *) req->handle;
+  int r;
+
+  if (status < 0) {
+    errors++;
+    uv_close((uv_handle_t *) &conn->handle, close_cb);
+    return;
+  }
+
+  r = uv_read_start((uv_stream_t *) &conn->handle, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  r = uv_write(&conn->write_req, (uv_stream_t *) &conn->handle, &ping, 1, write_cb);
+  CHECK(r, "uv_write");
+}
+
+static void start_request(bench_conn_t *conn) {
+  int r;
+
+  r = uv_tcp_init(loop, &conn->handle);
+  CHECK(r, "uv_tcp_init");
+  conn->start = uv_hrtime();
+  r = uv_tcp_connect(&conn->connect_req, &conn->handle, (const struct sockaddr *) &addr, connect_cb);
+  CHECK(r, "uv_tcp_connect");
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  stopping = 1;
+  stall_stop();
+  uv_close((uv_handle_t *) handle, NULL);
+}
+
+static void spawn_server(const char *policy) {
+  char exepath[PATH_MAX];
+  size_t size = sizeof(exepath);
+  char count[16];
+  int r;
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+  strcpy(exepath + (strlen(exepath) - strlen("PipeDispatchBench")), "PipeHandle");
+  snprintf(count, sizeof(count), "%d", workers);
+
+  char *args[] = { exepath, (char *) policy, count, NULL };
+
+  // 每个连接都会打一行accept日志，压测时全部丢掉
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_IGNORE;
+  stdio[2].flags = UV_IGNORE;
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  r = uv_spawn(loop, &server, &options);
+  CHECK(r, "spawning PipeHandle");
+}
+
+static void run_policy(const char *policy) {
+  uv_timer_t timer_handle;
+  uint64_t start_time;
+  int r;
+  int i;
+
+  latency_count = 0;
+  errors = 0;
+  stopping = 0;
+  slow_pid = 0;
+
+  spawn_server(policy);
+  // 给master和worker一点启动时间
+  usleep(500 * 1000);
+
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+  r = uv_timer_init(loop, &stall_timer);
+  CHECK(r, "uv_timer_init");
+
+  active = concurrency;
+  for (i = 0; i < concurrency; i++) {
+    start_request(&conns[i]);
+  }
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_close((uv_handle_t *) &stall_timer, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+  printf("policy[%-5s], requests[%llu], errors[%llu], requests/sec[%.0f], p50[%.3fms], p99[%.3fms], p999[%.3fms]\n",
+         policy, (unsigned long long) latency_count, (unsigned long long) errors, latency_count / elapsed,
+         percentile_ms(0.50), percentile_ms(0.99), percentile_ms(0.999));
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  static const char *policies[] = { "rr", "least", "p2c" };
+  int r;
+  size_t i;
+
+  if (argc > 1) workers = atoi(argv[1]);
+  if (argc > 2) concurrency = atoi(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+  if (argc > 4) stall_ms = atoi(argv[4]);
+
+  loop = uv_default_loop();
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+  conns = calloc(concurrency, sizeof(bench_conn_t));
+
+  printf("workers[%d], concurrency[%d], seconds[%d], slow worker stall[%dms]\n",
+         workers, concurrency, seconds, stall_ms);
+  for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    run_policy(policies[i]);
+  }
+  return 0;
+}
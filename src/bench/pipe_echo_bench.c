@@ -0,0 +1,134 @@
+/*
+ * WorkerHandle回显路径的吞吐压测，需要先启动PipeHandle
+ * 开connections个连接，每个连接不停地发block字节的数据块，最多有window个数据块还没收到回显，
+ * 跑seconds秒之后统计每秒回显回来的字节数。
+ * worker每读到一次数据就回一个"From worker %d => "前缀加上原样的数据，所以收到的字节数会比发出去的略多一点。
+ * 用法：PipeEchoBench [connections] [block] [seconds] [window]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+
+#define HOST "127.0.0.1"
+#define PORT 7000
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  uint64_t sent;       // 发出去的字节数
+  uint64_t received;   // 收到的字节数，包含worker加的前缀
+} bench_conn_t;
+
+static int connections = 8;
+static size_t block = 1024 * 1024;
+static int seconds = 10;
+static int window = 4;
+
+static uv_buf_t payload;
+static uint64_t total_sent;
+static uint64_t total_received;
+static uint64_t start_time;
+static int stopping;
+
+static char read_buf[256 * 1024];
+
+static void fill_window(bench_conn_t *conn);
+
+static void close_cb(uv_handle_t *handle) {
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  *buf = uv_buf_init(read_buf, sizeof(read_buf));
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  free(req);
+  if (status < 0 && status != UV_ECANCELED) {
+    CHECK(status, "write_cb");
+  }
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) stream;
+
+  if (nread < 0) {
+    if (!stopping) {
+      fprintf(stderr, "read_cb: %s\n", uv_strerror(nread));
+    }
+    uv_close((uv_handle_t *) stream, close_cb);
+    return;
+  }
+
+  conn->received += nread;
+  total_received += nread;
+  if (!stopping) {
+    fill_window(conn);
+  }
+}
+
+// 在途的数据不超过window个数据块，避免把worker的缓冲池写满
+static void fill_window(bench_conn_t *conn) {
+  int r;
+
+  while (conn->sent < conn->received + (uint64_t) window * block) {
+    uv_write_t *req = malloc(sizeof(uv_write_t));
+    r = uv_write(req, (uv_stream_t *) &conn->handle, &payload, 1, write_cb);
+    CHECK(r, "uv_write");
+    conn->sent += block;
+    total_sent += block;
+  }
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  CHECK(status, "connect_cb");
+  bench_conn_t *conn = (bench_conn_t *) req->handle;
+
+  int r = uv_read_start((uv_stream_t *) &conn->handle, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  fill_window(conn);
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  printf("connections[%d], block[%zu], window[%d], sent[%.1fMB/s], echoed[%.1fMB/s]\n",
+         connections, block, window,
+         total_sent / elapsed / (1024 * 1024), total_received / elapsed / (1024 * 1024));
+  stopping = 1;
+  uv_stop(handle->loop);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  struct sockaddr_in addr;
+  int r = 0;
+  int i;
+
+  if (argc > 1) connections = atoi(argv[1]);
+  if (argc > 2) block = (size_t) atol(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+  if (argc > 4) window = atoi(argv[4]);
+
+  payload = uv_buf_init(malloc(block), block);
+  memset(payload.base, 'x', block);
+
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+
+  bench_conn_t *conns = calloc(connections, sizeof(bench_conn_t));
+  for (i = 0; i < connections; i++) {
+    r = uv_tcp_init(loop, &conns[i].handle);
+    CHECK(r, "uv_tcp_init");
+    r = uv_tcp_connect(&conns[i].connect_req, &conns[i].handle, (const struct sockaddr *) &addr, connect_cb);
+    CHECK(r, "uv_tcp_connect");
+  }
+
+  uv_timer_t timer_handle;
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * PipeHandle绑核压测
+ * 依次用none、cpu、numa三种绑核方式拉起PipeHandle，客户端保持concurrency个并发，
+ * 每个请求都是新建连接、发一行、收到回复就关，统计延迟分位数，
+ * 同时从/proc/<pid>/status里读master和所有worker在压测期间的上下文切换次数(主动+被动)。
+ * 用法：PipePinBench [workers] [concurrency] [seconds]，workers为0表示按CPU个数
+ */
+#include <stdio.h>
+#include <dirent.h>
+#include "uv.h"
+#include "../common.h"
+
+#define HOST "127.0.0.1"
+#define PORT 7000
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  uint64_t start;
+} bench_conn_t;
+
+static int workers = 0;
+static int concurrency = 32;
+static int seconds = 3;
+
+static uv_loop_t *loop;
+static uv_process_t server;
+static struct sockaddr_in addr;
+static bench_conn_t *conns;
+static int active;
+static int stopping;
+static uint64_t errors;
+static uint64_t switches_start;
+static uint64_t switches_end;
+
+static uint64_t *latencies;
+static size_t latency_count;
+static size_t latency_cap;
+
+// 连接回复最多读一次，所有连接共用一块读缓冲
+static char read_buf[64 * 1024];
+
+static void start_request(bench_conn_t *conn);
+
+// 一个进程的voluntary_ctxt_switches加nonvoluntary_ctxt_switches
+static uint64_t process_switches(int pid) {
+  char path[64], line[256];
+  unsigned long long value;
+  uint64_t total = 0;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  file = fopen(path, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "voluntary_ctxt_switches: %llu", &value) == 1 ||
+        sscanf(line, "nonvoluntary_ctxt_switches: %llu", &value) == 1) {
+      total += value;
+    }
+  }
+  fclose(file);
+  return total;
+}
+
+// master加上它的所有worker，worker按/proc/<pid>/stat里的父进程号找
+static uint64_t tree_switches(int master) {
+  char path[300], stat[512];
+  struct dirent *entry;
+  uint64_t total = process_switches(master);
+  DIR *proc = opendir("/proc");
+  FILE *file;
+  int pid, ppid;
+
+  if (proc == NULL) {
+    return total;
+  }
+  while ((entry = readdir(proc)) != NULL) {
+    if (sscanf(entry->d_name, "%d", &pid) != 1) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+      continue;
+    }
+    if (fgets(stat, sizeof(stat), file) != NULL) {
+      // 进程名可能带空格，从最后一个')'之后开始解析
+      char *rest = strrchr(stat, ')');
+      if (rest != NULL && sscanf(rest + 1, " %*c %d", &ppid) == 1 && ppid == master) {
+        total += process_switches(pid);
+      }
+    }
+    fclose(file);
+  }
+  closedir(proc);
+  return total;
+}
+
+static void record_latency(uint64_t ns) {
+  if (latency_count == latency_cap) {
+    latency_cap = latency_cap ? latency_cap * 2 : 4096;
+    latencies = realloc(latencies, latency_cap * sizeof(uint64_t));
+    if (latencies == NULL) {
+      fprintf(stderr, "realloc: out of memory\n");
+      exit(1);
+    }
+  }
+  latencies[latency_count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double p) {
+  if (latency_count == 0) {
+    return 0;
+  }
+  size_t i = (size_t) (p * (latency_count - 1));
+  return latencies[i] / 1e6;
+}
+
+static void exit_cb(uv_process_t *req, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) req, NULL);
+}
+
+static void close_cb(uv_handle_t *handle) {
+  bench_conn_t *conn = (bench_conn_t *) handle;
+
+  if (!stopping) {
+    start_request(conn);
+    return;
+  }
+
+  if (--active == 0) {
+    uv_process_kill(&server, SIGTERM);
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  *buf = uv_buf_init(read_buf, sizeof(read_buf));
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) stream;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread > 0) {
+    record_latency(uv_hrtime() - conn->start);
+  } else {
+    errors++;
+  }
+  uv_close((uv_handle_t *) stream, close_cb);
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) {
+    errors++;
+  }
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  uv_buf_t ping = uv_buf_init("ping\n", 5);
+  bench_conn_t *conn = (bench_conn_t *) req->handle;
+  int r;
+
+  if (status < 0) {
+    errors++;
+    uv_close((uv_handle_t *) &conn->handle, close_cb);
+    return;
+  }
+
+  r = uv_read_start((uv_stream_t *) &conn->handle, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  r = uv_write(&conn->write_req, (uv_stream_t *) &conn->handle, &ping, 1, write_cb);
+  CHECK(r, "uv_write");
+}
+
+static void start_request(bench_conn_t *conn) {
+  int r;
+
+  r = uv_tcp_init(loop, &conn->handle);
+  CHECK(r, "uv_tcp_init");
+  conn->start = uv_hrtime();
+  r = uv_tcp_connect(&conn->connect_req, &conn->handle, (const struct sockaddr *) &addr, connect_cb);
+  CHECK(r, "uv_tcp_connect");
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  // 趁进程都还活着的时候取结束时的切换次数
+  switches_end = tree_switches(server.pid);
+  stopping = 1;
+  uv_close((uv_handle_t *) handle, NULL);
+}
+
+static void spawn_server(const char *pin) {
+  char exepath[PATH_MAX];
+  size_t size = sizeof(exepath);
+  char count[16];
+  int r;
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+  strcpy(exepath + (strlen(exepath) - strlen("PipePinBench")), "PipeHandle");
+  snprintf(count, sizeof(count), "%d", workers);
+
+  char *args[] = { exepath, "least", count, "32", (char *) pin, NULL };
+
+  // 每个连接都会打一行accept日志，压测时全部丢掉
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_IGNORE;
+  stdio[2].flags = UV_IGNORE;
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  r = uv_spawn(loop, &server, &options);
+  CHECK(r, "spawning PipeHandle");
+}
+
+static void run_pin(const char *pin) {
+  uv_timer_t timer_handle;
+  uint64_t start_time;
+  int r;
+  int i;
+
+  latency_count = 0;
+  errors = 0;
+  stopping = 0;
+
+  spawn_server(pin);
+  // 给master和worker一点启动时间
+  usleep(500 * 1000);
+
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  switches_start = tree_switches(server.pid);
+  active = concurrency;
+  for (i = 0; i < concurrency; i++) {
+    start_request(&conns[i]);
+  }
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+  printf("pin[%-4s], requests/sec[%.0f], ctx switches/request[%.2f], p50[%.3fms], p99[%.3fms], p999[%.3fms], errors[%llu]\n",
+         pin, latency_count / elapsed,
+         latency_count ? (double) (switches_end - switches_start) / latency_count : 0,
+         percentile_ms(0.50), percentile_ms(0.99), percentile_ms(0.999), (unsigned long long) errors);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  static const char *pins[] = { "none", "cpu", "numa" };
+  int r;
+  size_t i;
+
+  if (argc > 1) workers = atoi(argv[1]);
+  if (argc > 2) concurrency = atoi(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+
+  loop = uv_default_loop();
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+  conns = calloc(concurrency, sizeof(bench_conn_t));
+
+  printf("workers[%d], concurrency[%d], seconds[%d]\n", workers, concurrency, seconds);
+  for (i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+    run_pin(pins[i]);
+  }
+  return 0;
+}
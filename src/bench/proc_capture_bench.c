@@ -0,0 +1,223 @@
+/*
+ * 子进程输出的捕获吞吐
+ * 子进程(自己，emit模式)尽快往stdout写mb MB、每行line字节的文本，最后往stderr写一行汇总。对比三种方式：
+ * devnull：子进程的stdout/stderr直接继承/dev/null，相当于子进程自己能写多快
+ * capture：proc_capture读回父进程、切行、交给回调数行数
+ * slow   ：同样捕获，但回调每交1000行就proc_capture_pause，1ms之后再resume，模拟跟不上的消费者，
+ *          看积压是不是停在high water附近、子进程被管道反压住
+ * starved：池子只有STARVE_SLABS个slab，子进程启动之前就全部借走，之后每STARVE_RELEASE_MS毫秒还一个，
+ *          读一开始只能拿到UV_ENOBUFS，看借不到slab时的停读重试能不能把输出一行不少地读完
+ * 统计MB/s、每秒行数、停读次数、UV_ENOBUFS次数和buf_pool的峰值。
+ * 用法：ProcCaptureBench [mb] [line length] [high water KiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "uv.h"
+#include "../common.h"
+#include "../proc_capture.h"
+
+static int mb = 256;
+static int line_length = 100;
+static size_t high_water = 1024 * 1024;
+
+#define STARVE_SLABS 4
+#define STARVE_RELEASE_MS 5
+
+static char exepath[PATH_MAX];
+static char mb_arg[16];
+static char line_arg[16];
+static uint64_t lines;
+static uint64_t bad_lines;
+static int slow;
+static uv_timer_t resume_timer;
+static uv_buf_t held[STARVE_SLABS];
+static int held_count;
+static uv_timer_t release_timer;
+
+static int emit(int mb, int line_length) {
+  // 一块至少放得下一整行
+  size_t block_size = line_length > 64 * 1024 ? (size_t) line_length : 64 * 1024;
+  size_t per_block = block_size / line_length * line_length;
+  char *block = malloc(block_size);
+  // 只写整行
+  uint64_t total = (uint64_t) mb * 1024 * 1024 / line_length * line_length;
+  uint64_t written = 0;
+  size_t i, n;
+  ssize_t r;
+
+  if (block == NULL) {
+    return 1;
+  }
+  for (i = 0; i < per_block; i++) {
+    block[i] = (i + 1) % line_length == 0 ? '\n' : (char) ('a' + i % 26);
+  }
+  while (written < total) {
+    n = total - written < per_block ? (size_t) (total - written) : per_block;
+    r = write(1, block, n);
+    if (r < 0) {
+      free(block);
+      return 1;
+    }
+    written += r;
+  }
+  free(block);
+  fprintf(stderr, "emitted %llu bytes\n", (unsigned long long) written);
+  return 0;
+}
+
+static void exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) process, NULL);
+}
+
+static double run_devnull(uv_loop_t *loop) {
+  char *args[5] = { exepath, "emit", mb_arg, line_arg, NULL };
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[3];
+  uv_process_t process;
+  uint64_t start;
+  int fd, r;
+
+  fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) {
+    CHECK(uv_translate_sys_error(errno), "open /dev/null");
+  }
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_INHERIT_FD;
+  stdio[1].data.fd = fd;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = fd;
+
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  start = uv_hrtime();
+  r = uv_spawn(loop, &process, &options);
+  CHECK(r, "uv_spawn");
+  uv_run(loop, UV_RUN_DEFAULT);
+  close(fd);
+  return (uv_hrtime() - start) / 1e9;
+}
+
+static void resume_cb(uv_timer_t *handle) {
+  proc_capture_resume((proc_capture_t *) handle->data);
+}
+
+static void release_cb(uv_timer_t *handle) {
+  buf_pool_free((buf_pool_t *) handle->data, held[--held_count].base);
+  if (held_count == 0) {
+    uv_timer_stop(handle);
+  }
+}
+
+static void line_cb(proc_capture_t *capture, int fd, const char *line, size_t len) {
+  if (fd != 1) {
+    return;
+  }
+  if (len != (size_t) line_length - 1) {
+    bad_lines++;
+  }
+  if (++lines % 1000 == 0 && slow) {
+    proc_capture_pause(capture);
+    resume_timer.data = capture;
+    uv_timer_start(&resume_timer, resume_cb, 1, 0);
+  }
+}
+
+static void done_cb(proc_capture_t *capture, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) &resume_timer, NULL);
+  uv_close((uv_handle_t *) &release_timer, NULL);
+}
+
+// starve不为0时池子起步就是空的
+static double run_capture(uv_loop_t *loop, proc_capture_t *capture, buf_pool_t *pool, int starve) {
+  char *args[5] = { exepath, "emit", mb_arg, line_arg, NULL };
+  proc_capture_options_t options;
+  uint64_t start;
+  int r;
+
+  lines = bad_lines = 0;
+  buf_pool_init(pool, PROC_CAPTURE_SLAB_SIZE, starve ? STARVE_SLABS * PROC_CAPTURE_SLAB_SIZE : BUF_POOL_MAX_BYTES);
+  uv_timer_init(loop, &resume_timer);
+  uv_timer_init(loop, &release_timer);
+  release_timer.data = pool;
+  for (held_count = 0; starve && held_count < STARVE_SLABS; held_count++) {
+    held[held_count] = buf_pool_alloc(pool);
+  }
+  if (held_count > 0) {
+    uv_timer_start(&release_timer, release_cb, STARVE_RELEASE_MS, STARVE_RELEASE_MS);
+  }
+
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.pool = pool;
+  options.high_water = high_water;
+
+  start = uv_hrtime();
+  r = proc_capture_spawn(loop, capture, &options, line_cb, done_cb);
+  CHECK(r, "proc_capture_spawn");
+  uv_run(loop, UV_RUN_DEFAULT);
+  return (uv_hrtime() - start) / 1e9;
+}
+
+static void report(const char *name, double elapsed, proc_capture_t *capture, buf_pool_t *pool) {
+  printf("  %-8s %.2fs, %.0f MB/s", name, elapsed, mb / elapsed);
+  if (capture != NULL) {
+    printf(", %.0f lines/s, lines[%llu], bad lines[%llu], split lines[%llu], read stops[%llu], enobufs[%llu], "
+           "max buffered[%zu KiB], pool peak[%zu KiB]", lines / elapsed, (unsigned long long) lines,
+           (unsigned long long) bad_lines, (unsigned long long) capture->stats.split_lines,
+           (unsigned long long) capture->stats.read_stops, (unsigned long long) capture->stats.enobufs,
+           capture->stats.max_buffered / 1024, pool->stats.peak_bytes / 1024);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  size_t size = sizeof(exepath);
+  proc_capture_t capture;
+  buf_pool_t pool;
+  uv_loop_t *loop;
+  double elapsed;
+  int r;
+
+  if (argc > 3 && strcmp(argv[1], "emit") == 0) {
+    return emit(atoi(argv[2]), atoi(argv[3]));
+  }
+
+  if (argc > 1) mb = atoi(argv[1]);
+  if (argc > 2) line_length = atoi(argv[2]);
+  if (argc > 3) high_water = (size_t) atol(argv[3]) * 1024;
+  if (line_length < 2) line_length = 2;
+  snprintf(mb_arg, sizeof(mb_arg), "%d", mb);
+  snprintf(line_arg, sizeof(line_arg), "%d", line_length);
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+  loop = uv_default_loop();
+
+  printf("mb[%d], line length[%d], high water[%zu KiB], cpus[%d]\n", mb, line_length, high_water / 1024,
+         get_cpu_count());
+  elapsed = run_devnull(loop);
+  report("devnull", elapsed, NULL, NULL);
+
+  slow = 0;
+  elapsed = run_capture(loop, &capture, &pool, 0);
+  report("capture", elapsed, &capture, &pool);
+  buf_pool_trim(&pool);
+
+  slow = 1;
+  elapsed = run_capture(loop, &capture, &pool, 0);
+  report("slow", elapsed, &capture, &pool);
+  buf_pool_trim(&pool);
+
+  slow = 0;
+  elapsed = run_capture(loop, &capture, &pool, 1);
+  report("starved", elapsed, &capture, &pool);
+  buf_pool_trim(&pool);
+  return 0;
+}
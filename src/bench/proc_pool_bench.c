@@ -0,0 +1,220 @@
+/*
+ * 预先启动的进程池 vs 每个任务spawn一次
+ * 任务是让子进程忙等若干微秒(100us、1ms、10ms)，再把一行结果写回父进程。
+ * spawn：每个任务uv_spawn一次自己(once <us>)，结果从stdout管道读回来，最多同时children个子进程；
+ * pool：proc_pool起children个常驻的子进程(worker)，任务和结果走stdin/stdout上的长度帧，每个子进程最多max inflight个在途。
+ * 两种方式的并行度一样，差别就是fork/exec、动态链接和进程退出的开销，统计每秒完成的任务数。
+ * 用法：ProcPoolBench [children] [max inflight] [scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "uv.h"
+#include "../common.h"
+#include "../proc_pool.h"
+
+typedef struct {
+  uv_process_t process;
+  uv_pipe_t out;
+  char buf[128];
+  size_t len;
+  int handles;
+} spawn_job_t;
+
+static int children;
+static int max_inflight = 2;
+static int scale = 1;
+
+static char exepath[PATH_MAX];
+static char us_arg[16];
+static int total;
+static int started;
+static int done;
+static int failures;
+
+static size_t spin_handler(const char *job, size_t len, char *result, size_t cap) {
+  char text[32];
+  uint64_t start = uv_hrtime();
+  uint64_t us;
+
+  snprintf(text, sizeof(text), "%.*s", (int) (len < sizeof(text) ? len : sizeof(text) - 1), job);
+  us = strtoull(text, NULL, 10);
+  while (uv_hrtime() - start < us * 1000) {
+  }
+  return (size_t) snprintf(result, cap, "%d %llu", uv_os_getpid(), (unsigned long long) us);
+}
+
+static void start_spawn(uv_loop_t *loop);
+
+static void spawn_close_cb(uv_handle_t *handle) {
+  spawn_job_t *job = (spawn_job_t *) handle->data;
+  uv_loop_t *loop = handle->loop;
+
+  if (--job->handles > 0) {
+    return;
+  }
+  if (job->len == 0) {
+    failures++;
+  }
+  done++;
+  free(job);
+  start_spawn(loop);
+}
+
+static void spawn_exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  uv_close((uv_handle_t *) process, spawn_close_cb);
+}
+
+static void spawn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  spawn_job_t *job = (spawn_job_t *) handle->data;
+  *buf = uv_buf_init(job->buf + job->len, (unsigned int) (sizeof(job->buf) - job->len));
+}
+
+static void spawn_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  spawn_job_t *job = (spawn_job_t *) stream->data;
+
+  if (nread > 0) {
+    job->len += nread;
+  } else if (nread < 0 || job->len == sizeof(job->buf)) {
+    uv_close((uv_handle_t *) stream, spawn_close_cb);
+  }
+}
+
+static void start_spawn(uv_loop_t *loop) {
+  char *args[4] = { exepath, "once", us_arg, NULL };
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[3];
+  spawn_job_t *job;
+  int r;
+
+  if (started == total) {
+    return;
+  }
+  started++;
+  job = calloc(1, sizeof(spawn_job_t));
+  if (job == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+  uv_pipe_init(loop, &job->out, 0);
+  job->out.data = job->process.data = job;
+  job->handles = 2;
+
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+  stdio[1].data.stream = (uv_stream_t *) &job->out;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = 2;
+
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.exit_cb = spawn_exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+  r = uv_spawn(loop, &job->process, &options);
+  CHECK(r, "uv_spawn");
+  r = uv_read_start((uv_stream_t *) &job->out, spawn_alloc_cb, spawn_read_cb);
+  CHECK(r, "uv_read_start");
+}
+
+static double run_spawn(uv_loop_t *loop, int us, int jobs) {
+  uint64_t start;
+  int i;
+
+  snprintf(us_arg, sizeof(us_arg), "%d", us);
+  total = jobs;
+  started = done = failures = 0;
+
+  start = uv_hrtime();
+  for (i = 0; i < children; i++) {
+    start_spawn(loop);
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  return (uv_hrtime() - start) / 1e9;
+}
+
+static void pool_job_cb(proc_job_t *job, int status, const uv_buf_t *result) {
+  if (status < 0 || result->len == 0) {
+    failures++;
+  }
+  if (++done == total) {
+    proc_pool_close((proc_pool_t *) job->data, NULL);
+  }
+}
+
+static double run_pool(uv_loop_t *loop, int us, int jobs) {
+  char *args[3] = { exepath, "worker", NULL };
+  proc_pool_options_t options;
+  proc_pool_t pool;
+  proc_job_t *list;
+  uv_buf_t payload;
+  uint64_t start;
+  int i, r;
+
+  snprintf(us_arg, sizeof(us_arg), "%d", us);
+  total = jobs;
+  done = failures = 0;
+  list = calloc(jobs, sizeof(proc_job_t));
+  if (list == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+
+  // 子进程的启动也算在里面
+  start = uv_hrtime();
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.children = children;
+  options.max_inflight = max_inflight;
+  r = proc_pool_init(loop, &pool, &options);
+  CHECK(r, "proc_pool_init");
+
+  payload = uv_buf_init(us_arg, (unsigned int) strlen(us_arg));
+  for (i = 0; i < jobs; i++) {
+    list[i].data = &pool;
+    r = proc_pool_submit(&pool, &list[i], &payload, pool_job_cb);
+    CHECK(r, "proc_pool_submit");
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  free(list);
+  return (uv_hrtime() - start) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const int task_us[] = { 100, 1000, 10000 };
+  static const int task_jobs[] = { 2000, 1000, 200 };
+  size_t size = sizeof(exepath);
+  uv_loop_t *loop;
+  double spawn_time, pool_time;
+  int i, jobs, r;
+
+  if (argc > 1 && strcmp(argv[1], "worker") == 0) {
+    return proc_pool_serve(spin_handler) < 0 ? 1 : 0;
+  }
+  if (argc > 2 && strcmp(argv[1], "once") == 0) {
+    char result[64];
+    size_t n = spin_handler(argv[2], strlen(argv[2]), result, sizeof(result));
+    fwrite(result, 1, n, stdout);
+    return 0;
+  }
+
+  children = get_cpu_count();
+  if (argc > 1) children = atoi(argv[1]);
+  if (argc > 2) max_inflight = atoi(argv[2]);
+  if (argc > 3) scale = atoi(argv[3]);
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+  loop = uv_default_loop();
+
+  printf("children[%d], max inflight[%d], cpus[%d]\n", children, max_inflight, get_cpu_count());
+  for (i = 0; i < 3; i++) {
+    jobs = task_jobs[i] * scale;
+    spawn_time = run_spawn(loop, task_us[i], jobs);
+    printf("  task[%5dus] spawn: jobs[%d], %.2fs, %.0f jobs/s, failures[%d]\n", task_us[i], jobs, spawn_time,
+           jobs / spawn_time, failures);
+    pool_time = run_pool(loop, task_us[i], jobs);
+    printf("  task[%5dus] pool : jobs[%d], %.2fs, %.0f jobs/s, failures[%d], speedup[%.2fx]\n", task_us[i], jobs,
+           pool_time, jobs / pool_time, failures, spawn_time / pool_time);
+  }
+  return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * TcpHandle文件服务(GET <path>)的吞吐压测，需要先启动TcpHandle
+ * 开connections个连接，每个连接收完一个文件再发下一个GET，跑seconds秒之后统计每秒收到的字节数和文件数。
+ * 对比sendfile和读+uv_write两种方式的时候，分别用TCP_SENDFILE=1和TCP_SENDFILE=0启动服务器各跑一遍：
+ *   TcpHandle 1 /data &
+ *   TcpFileBench big.bin 8 10
+ * 用法：TcpFileBench [path] [connections] [seconds]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+
+#define HOST "127.0.0.1"
+#define PORT 9999
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  char header[32];        // 正在收的"OK <size>\n"
+  size_t header_len;
+  uint64_t remaining;     // 这个文件还没收到的字节数，为0表示在等header
+} bench_conn_t;
+
+static const char *path = "test.txt";
+static int connections = 8;
+static int seconds = 10;
+
+static char request[4096];
+static uv_buf_t request_buf;
+static uint64_t total_bytes;
+static uint64_t total_files;
+static uint64_t start_time;
+static int stopping;
+
+static char read_buf[256 * 1024];
+
+static void close_cb(uv_handle_t *handle) {
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  *buf = uv_buf_init(read_buf, sizeof(read_buf));
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) {
+    CHECK(status, "write_cb");
+  }
+}
+
+static void send_request(bench_conn_t *conn) {
+  int r = uv_write(&conn->write_req, (uv_stream_t *) &conn->handle, &request_buf, 1, write_cb);
+  CHECK(r, "uv_write");
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) stream;
+  const char *p = buf->base;
+  const char *end = buf->base + (nread > 0 ? nread : 0);
+
+  if (nread < 0) {
+    if (!stopping) {
+      fprintf(stderr, "read_cb: %s\n", uv_strerror(nread));
+    }
+    uv_close((uv_handle_t *) stream, close_cb);
+    return;
+  }
+
+  while (p < end) {
+    if (conn->remaining > 0) {
+      size_t n = (size_t) (end - p) < conn->remaining ? (size_t) (end - p) : conn->remaining;
+      p += n;
+      conn->remaining -= n;
+      total_bytes += n;
+      if (conn->remaining == 0) {
+        total_files++;
+        if (!stopping) {
+          send_request(conn);
+        }
+      }
+      continue;
+    }
+
+    // 一个字节一个字节地拼header，header很短，不影响结果
+    if (conn->header_len == sizeof(conn->header) - 1) {
+      fprintf(stderr, "bad reply header\n");
+      exit(1);
+    }
+    conn->header[conn->header_len++] = *p++;
+    if (conn->header[conn->header_len - 1] != '\n') {
+      continue;
+    }
+    conn->header[conn->header_len] = '\0';
+    conn->header_len = 0;
+    if (strncmp(conn->header, "OK ", 3) != 0) {
+      fprintf(stderr, "GET %s: %s", path, conn->header);
+      exit(1);
+    }
+    conn->remaining = strtoull(conn->header + 3, NULL, 10);
+    if (conn->remaining == 0) {
+      total_files++;
+      if (!stopping) {
+        send_request(conn);
+      }
+    }
+  }
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  CHECK(status, "connect_cb");
+  bench_conn_t *conn = (bench_conn_t *) req->handle;
+
+  int r = uv_read_start((uv_stream_t *) &conn->handle, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  send_request(conn);
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  printf("path[%s], connections[%d], received[%.1fMB/s], files[%.1f/s]\n", path, connections,
+         total_bytes / elapsed / (1024 * 1024), total_files / elapsed);
+  stopping = 1;
+  uv_stop(handle->loop);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  struct sockaddr_in addr;
+  int r = 0;
+  int i;
+
+  if (argc > 1) path = argv[1];
+  if (argc > 2) connections = atoi(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+
+  snprintf(request, sizeof(request), "GET %s\n", path);
+  request_buf = uv_buf_init(request, strlen(request));
+
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+
+  bench_conn_t *conns = calloc(connections, sizeof(bench_conn_t));
+  for (i = 0; i < connections; i++) {
+    r = uv_tcp_init(loop, &conns[i].handle);
+    CHECK(r, "uv_tcp_init");
+    r = uv_tcp_connect(&conns[i].connect_req, &conns[i].handle, (const struct sockaddr *) &addr, connect_cb);
+    CHECK(r, "uv_tcp_connect");
+  }
+
+  uv_timer_t timer_handle;
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
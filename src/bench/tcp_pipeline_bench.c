@@ -0,0 +1,196 @@
+/*
+ * TcpHandle的吞吐压测客户端
+ * 开connections个连接，每个连接一次发出depth条命令(pipeline)，收齐depth条回复之后再发下一批，
+ * 跑seconds秒之后统计每秒处理的请求数。depth=1就相当于没有pipeline的一问一答。
+ * 用法：TcpPipelineBench [connections] [depth] [seconds] [line|length]
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../framing.h"
+
+#define HOST "127.0.0.1"
+#define PORT 9999
+
+typedef struct {
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  char read_buf[64 * 1024];
+  size_t pending;       // 这一批还没收到的回复数
+  size_t header_left;   // 长度帧模式下，当前回复头还差几个字节
+  size_t body_left;     // 长度帧模式下，当前回复内容还差几个字节
+  size_t header;
+} bench_conn_t;
+
+static int connections = 16;
+static int depth = 64;
+static int seconds = 10;
+static int length_mode = 0;
+
+static uv_buf_t batch;
+static uint64_t completed;
+static uint64_t start_time;
+static int stopping;
+
+static void send_batch(bench_conn_t *conn);
+
+static void close_cb(uv_handle_t *handle) {
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) handle;
+  *buf = uv_buf_init(conn->read_buf, sizeof(conn->read_buf));
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) {
+    CHECK(status, "write_cb");
+  }
+}
+
+// 数一数这次读到了几条完整的回复
+static size_t count_replies(bench_conn_t *conn, const char *data, size_t len) {
+  size_t count = 0;
+  size_t i;
+
+  if (!length_mode) {
+    for (i = 0; i < len; i++) {
+      if (data[i] == '\n') {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  for (i = 0; i < len;) {
+    if (conn->header_left > 0) {
+      conn->header = (conn->header << 8) | (unsigned char) data[i++];
+      if (--conn->header_left == 0) {
+        conn->body_left = conn->header;
+        if (conn->body_left == 0) {
+          count++;
+          conn->header_left = FRAME_HEADER_SIZE;
+          conn->header = 0;
+        }
+      }
+    } else {
+      size_t n = len - i < conn->body_left ? len - i : conn->body_left;
+      i += n;
+      conn->body_left -= n;
+      if (conn->body_left == 0) {
+        count++;
+        conn->header_left = FRAME_HEADER_SIZE;
+        conn->header = 0;
+      }
+    }
+  }
+  return count;
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  bench_conn_t *conn = (bench_conn_t *) stream;
+
+  if (nread < 0) {
+    if (!stopping) {
+      fprintf(stderr, "read_cb: %s\n", uv_strerror(nread));
+    }
+    uv_close((uv_handle_t *) stream, close_cb);
+    return;
+  }
+
+  size_t count = count_replies(conn, buf->base, nread);
+  conn->pending -= count;
+  completed += count;
+
+  if (conn->pending == 0 && !stopping) {
+    send_batch(conn);
+  }
+}
+
+static void send_batch(bench_conn_t *conn) {
+  int r = uv_write(&conn->write_req, (uv_stream_t *) &conn->handle, &batch, 1, write_cb);
+  CHECK(r, "uv_write");
+  conn->pending = depth;
+}
+
+static void connect_cb(uv_connect_t *req, int status) {
+  CHECK(status, "connect_cb");
+  bench_conn_t *conn = (bench_conn_t *) req->handle;
+  conn->header_left = FRAME_HEADER_SIZE;
+
+  int r = uv_read_start((uv_stream_t *) &conn->handle, alloc_cb, read_cb);
+  CHECK(r, "uv_read_start");
+  send_batch(conn);
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
+  printf("connections[%d], depth[%d], mode[%s], requests[%llu], requests/sec[%.0f]\n",
+         connections, depth, length_mode ? "length" : "line",
+         (unsigned long long) completed, completed / elapsed);
+  stopping = 1;
+  uv_stop(handle->loop);
+}
+
+// 一批请求提前拼好，每次发送都是同一块内存
+static void build_batch() {
+  static const char *commands[] = { "Hello", "Libuv" };
+  size_t cap = (size_t) depth * (FRAME_HEADER_SIZE + 8);
+  char *data = malloc(cap);
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < depth; i++) {
+    const char *command = commands[i % 2];
+    size_t n = strlen(command);
+    if (length_mode) {
+      data[len++] = 0;
+      data[len++] = 0;
+      data[len++] = 0;
+      data[len++] = (char) n;
+      memcpy(data + len, command, n);
+      len += n;
+    } else {
+      memcpy(data + len, command, n);
+      len += n;
+      data[len++] = '\n';
+    }
+  }
+  batch = uv_buf_init(data, len);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  struct sockaddr_in addr;
+  int r = 0;
+  int i;
+
+  if (argc > 1) connections = atoi(argv[1]);
+  if (argc > 2) depth = atoi(argv[2]);
+  if (argc > 3) seconds = atoi(argv[3]);
+  if (argc > 4) length_mode = !strcmp(argv[4], "length");
+
+  build_batch();
+
+  r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ip4_addr");
+
+  bench_conn_t *conns = calloc(connections, sizeof(bench_conn_t));
+  for (i = 0; i < connections; i++) {
+    r = uv_tcp_init(loop, &conns[i].handle);
+    CHECK(r, "uv_tcp_init");
+    r = uv_tcp_connect(&conns[i].connect_req, &conns[i].handle, (const struct sockaddr *) &addr, connect_cb);
+    CHECK(r, "uv_tcp_connect");
+  }
+
+  uv_timer_t timer_handle;
+  r = uv_timer_init(loop, &timer_handle);
+  CHECK(r, "uv_timer_init");
+  r = uv_timer_start(&timer_handle, timer_cb, seconds * 1000, 0);
+  CHECK(r, "uv_timer_start");
+
+  start_time = uv_hrtime();
+  uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
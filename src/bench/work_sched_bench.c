@@ -0,0 +1,205 @@
+/*
+ * work_sched的混合负载压测
+ * 批量任务一直保持BULK_OUTSTANDING个在排队，每个占线程BULK_US微秒；同时每毫秒来一个紧急任务，占线程URGENT_US微秒。
+ * 任务里用nanosleep模拟阻塞IO，单核的机器上也能看出排队的差别。统计紧急任务从提交到after_cb的延迟，以及批量任务每秒完成数：
+ * 1、fifo：两种任务都直接uv_queue_work，紧急任务排在几十个批量任务后面
+ * 2、priority：work_sched，紧急任务的类别优先，批量任务不限线程数，紧急任务最多等一个批量任务跑完
+ * 3、priority+reserve：批量任务最多占线程数-1个线程，总有一个线程留给紧急任务
+ * 没有设置UV_THREADPOOL_SIZE时用threads个线程。
+ * 用法：WorkSchedBench [seconds] [threads]
+ */
+#include <stdio.h>
+#include <time.h>
+#include "uv.h"
+#include "../common.h"
+#include "../work_sched.h"
+
+#define BULK_OUTSTANDING 64
+#define BULK_US 2000
+#define URGENT_US 100
+#define URGENT_SLOTS 4096
+
+typedef struct {
+  work_item_t item;
+  uint64_t submitted;
+  int urgent;
+} job_t;
+
+typedef enum {
+  MODE_FIFO,
+  MODE_PRIORITY,
+  MODE_RESERVE
+} bench_mode_t;
+
+static int seconds = 5;
+static const char *threads = "4";
+
+static bench_mode_t mode;
+static work_sched_t sched;
+static int urgent_class;
+static int bulk_class;
+static job_t bulk_jobs[BULK_OUTSTANDING];
+static job_t urgent_jobs[URGENT_SLOTS];
+static job_t *free_urgent[URGENT_SLOTS];
+static int free_count;
+static uint64_t *latencies;
+static size_t latency_count;
+static size_t latency_cap;
+static uint64_t bulk_done;
+static int outstanding;
+static int stopping;
+static uv_timer_t urgent_timer;
+static uv_timer_t stop_timer;
+
+static void submit(uv_loop_t *loop, job_t *job);
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void block_for(long usec) {
+  struct timespec ts = { 0, usec * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+static void job_work(work_item_t *item) {
+  job_t *job = (job_t *) item;
+  block_for(job->urgent ? URGENT_US : BULK_US);
+}
+
+static void job_done(uv_loop_t *loop, job_t *job, int status) {
+  CHECK(status, "job");
+  outstanding--;
+
+  if (job->urgent) {
+    if (latency_count < latency_cap) {
+      latencies[latency_count++] = (uv_hrtime() - job->submitted) / 1000;
+    }
+    free_urgent[free_count++] = job;
+    return;
+  }
+
+  bulk_done++;
+  if (!stopping) {
+    submit(loop, job);
+  }
+}
+
+static void fifo_work_cb(uv_work_t *req) {
+  job_work((work_item_t *) req);
+}
+
+static void fifo_after_cb(uv_work_t *req, int status) {
+  job_done(req->loop, (job_t *) req, status);
+}
+
+static void sched_after_cb(work_item_t *item, int status) {
+  job_done(item->sched->loop, (job_t *) item, status);
+}
+
+static void submit(uv_loop_t *loop, job_t *job) {
+  int r;
+
+  job->submitted = uv_hrtime();
+  outstanding++;
+  if (mode == MODE_FIFO) {
+    r = uv_queue_work(loop, &job->item.req, fifo_work_cb, fifo_after_cb);
+  } else {
+    r = work_sched_submit(&sched, &job->item, job->urgent ? urgent_class : bulk_class, job_work, sched_after_cb);
+  }
+  CHECK(r, "submit");
+}
+
+static void urgent_cb(uv_timer_t *handle) {
+  if (free_count == 0) {
+    fprintf(stderr, "out of urgent slots\n");
+    exit(1);
+  }
+  submit(handle->loop, free_urgent[--free_count]);
+}
+
+static void drain_cb(uv_timer_t *handle) {
+  if (outstanding > 0) {
+    return;
+  }
+  uv_close((uv_handle_t *) &urgent_timer, NULL);
+  uv_close((uv_handle_t *) &stop_timer, NULL);
+  if (mode != MODE_FIFO) {
+    work_sched_close(&sched, NULL);
+  }
+}
+
+static void stop_cb(uv_timer_t *handle) {
+  stopping = 1;
+  uv_timer_stop(&urgent_timer);
+  // 等在途的任务都回来再关句柄
+  uv_timer_start(handle, drain_cb, 1, 1);
+}
+
+static void run(uv_loop_t *loop, bench_mode_t m, const char *name) {
+  uint64_t start, elapsed;
+  int i, r;
+
+  mode = m;
+  stopping = 0;
+  outstanding = 0;
+  bulk_done = 0;
+  latency_count = 0;
+  free_count = 0;
+  for (i = 0; i < URGENT_SLOTS; i++) {
+    urgent_jobs[i].urgent = 1;
+    free_urgent[free_count++] = &urgent_jobs[i];
+  }
+
+  if (mode != MODE_FIFO) {
+    r = work_sched_init(loop, &sched, 0);
+    CHECK(r, "work_sched_init");
+    urgent_class = work_sched_add_class(&sched, "urgent", 0);
+    bulk_class = work_sched_add_class(&sched, "bulk",
+                                      mode == MODE_RESERVE && sched.max_running > 1 ? sched.max_running - 1 : 0);
+  }
+
+  start = uv_hrtime();
+  for (i = 0; i < BULK_OUTSTANDING; i++) {
+    bulk_jobs[i].urgent = 0;
+    submit(loop, &bulk_jobs[i]);
+  }
+  uv_timer_init(loop, &urgent_timer);
+  uv_timer_start(&urgent_timer, urgent_cb, 1, 1);
+  uv_timer_init(loop, &stop_timer);
+  uv_timer_start(&stop_timer, stop_cb, seconds * 1000, 0);
+  uv_run(loop, UV_RUN_DEFAULT);
+  elapsed = uv_hrtime() - start;
+
+  qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+  printf("%-18s urgent[%zu] p50[%.2fms] p99[%.2fms] max[%.2fms], bulk[%.0f/s]\n", name, latency_count,
+         latencies[latency_count / 2] / 1e3, latencies[latency_count * 99 / 100] / 1e3,
+         latencies[latency_count - 1] / 1e3, bulk_done / (elapsed / 1e9));
+  if (mode != MODE_FIFO) {
+    work_sched_print_stats(&sched, stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) seconds = atoi(argv[1]);
+  if (argc > 2) threads = argv[2];
+
+  // 要在第一次用线程池之前设置
+  setenv("UV_THREADPOOL_SIZE", threads, 0);
+
+  latency_cap = (size_t) seconds * 2000;
+  latencies = malloc(latency_cap * sizeof(uint64_t));
+  if (latencies == NULL) {
+    CHECK(UV_ENOMEM, "malloc");
+  }
+
+  uv_loop_t *loop = uv_default_loop();
+  printf("threadpool[%s], bulk outstanding[%d] x %dus, urgent every 1ms x %dus, %ds per mode\n",
+         getenv("UV_THREADPOOL_SIZE"), BULK_OUTSTANDING, BULK_US, URGENT_US, seconds);
+  run(loop, MODE_FIFO, "fifo");
+  run(loop, MODE_PRIORITY, "priority");
+  run(loop, MODE_RESERVE, "priority+reserve");
+  return 0;
+}
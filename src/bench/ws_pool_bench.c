@@ -0,0 +1,185 @@
+/*
+ * ws_pool和uv_queue_work的小任务吞吐对比
+ * 任务在线程里空转1us、10us、100us(CPU密集)，每种大小跑三种方式，统计每秒完成的任务数：
+ * 1、uv_queue_work：loop线程保持WINDOW个在途，每回调一个再提交一个
+ * 2、ws_pool submit：同样从loop线程提交，走注入队列
+ * 3、ws_pool fork/join：只提交一个根任务，在线程里对半拆子任务直到每个子任务只做一次空转，
+ *    整棵树完成之后才回调一次after_cb，看的是线程之间偷任务的开销
+ * uv_queue_work的线程数用UV_THREADPOOL_SIZE，没有设置时和ws_pool一样用threads个。
+ * 用法：WsPoolBench [threads] [scale]，scale按比例放大每种大小的任务数
+ */
+#include <stdio.h>
+#include "uv.h"
+#include "../common.h"
+#include "../ws_pool.h"
+
+#define WINDOW 4096
+
+typedef struct {
+  ws_task_t task;
+  uv_work_t req;
+  int64_t lo;
+  int64_t hi;
+} job_t;
+
+static int threads;
+static double scale = 1;
+static uint64_t spin_ns;
+static int64_t total;
+static int64_t issued;
+static int64_t completed;
+
+static job_t *jobs;
+static int64_t next_node;
+static ws_pool_t pool;
+
+static void spin(void) {
+  uint64_t end = uv_hrtime() + spin_ns;
+  while (uv_hrtime() < end) {
+  }
+}
+
+static void work_cb(uv_work_t *req) {
+  spin();
+}
+
+static void after_work_cb(uv_work_t *req, int status) {
+  CHECK(status, "uv_queue_work");
+  completed++;
+  if (issued < total) {
+    issued++;
+    status = uv_queue_work(req->loop, req, work_cb, after_work_cb);
+    CHECK(status, "uv_queue_work");
+  }
+}
+
+static void flat_work_cb(ws_task_t *task) {
+  spin();
+}
+
+static void flat_after_cb(ws_task_t *task) {
+  int r;
+
+  completed++;
+  if (issued < total) {
+    issued++;
+    r = ws_pool_submit(&pool, task, flat_work_cb, flat_after_cb);
+    CHECK(r, "ws_pool_submit");
+  }
+}
+
+// 范围大于1就对半拆成两个子任务，节点从jobs里按原子计数分配
+static void split_work_cb(ws_task_t *task) {
+  job_t *job = (job_t *) task;
+  int64_t mid;
+  job_t *left, *right;
+
+  if (job->hi - job->lo == 1) {
+    spin();
+    return;
+  }
+  mid = job->lo + (job->hi - job->lo) / 2;
+  left = &jobs[__atomic_fetch_add(&next_node, 2, __ATOMIC_RELAXED)];
+  right = left + 1;
+  left->lo = job->lo;
+  left->hi = mid;
+  right->lo = mid;
+  right->hi = job->hi;
+  ws_pool_spawn(task, &left->task, split_work_cb, NULL);
+  ws_pool_spawn(task, &right->task, split_work_cb, NULL);
+}
+
+static void split_after_cb(ws_task_t *task) {
+  completed = total;
+}
+
+static void report(const char *name, uint64_t start, const char *extra) {
+  double elapsed = (uv_hrtime() - start) / 1e9;
+  printf("  %-18s tasks[%lld], %.2fs, %.0f tasks/s%s\n", name, (long long) completed, elapsed,
+         completed / elapsed, extra);
+}
+
+static void run_queue_work(uv_loop_t *loop) {
+  uint64_t start = uv_hrtime();
+  int64_t i;
+  int r;
+
+  issued = completed = 0;
+  for (i = 0; i < WINDOW && issued < total; i++) {
+    issued++;
+    r = uv_queue_work(loop, &jobs[i].req, work_cb, after_work_cb);
+    CHECK(r, "uv_queue_work");
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  report("uv_queue_work", start, "");
+}
+
+static void run_ws(uv_loop_t *loop, int fork_join) {
+  char extra[128];
+  uint64_t start = uv_hrtime();
+  int64_t i;
+  int r;
+
+  r = ws_pool_init(loop, &pool, threads);
+  CHECK(r, "ws_pool_init");
+
+  issued = completed = 0;
+  if (fork_join) {
+    jobs[0].lo = 0;
+    jobs[0].hi = total;
+    next_node = 1;
+    r = ws_pool_submit(&pool, &jobs[0].task, split_work_cb, split_after_cb);
+    CHECK(r, "ws_pool_submit");
+  } else {
+    for (i = 0; i < WINDOW && issued < total; i++) {
+      issued++;
+      r = ws_pool_submit(&pool, &jobs[i].task, flat_work_cb, flat_after_cb);
+      CHECK(r, "ws_pool_submit");
+    }
+  }
+  while (completed < total) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+
+  snprintf(extra, sizeof(extra), ", wakeups[%llu]", (unsigned long long) pool.wakeups);
+  report(fork_join ? "ws_pool fork/join" : "ws_pool submit", start, extra);
+  ws_pool_print_stats(&pool, stdout);
+  ws_pool_close(&pool, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    uint64_t us;
+    int64_t tasks;
+  } sizes[] = { { 1, 200000 }, { 10, 100000 }, { 100, 20000 } };
+  char size[16];
+  size_t i;
+
+  threads = get_cpu_count();
+  if (argc > 1) threads = atoi(argv[1]);
+  if (argc > 2) scale = atof(argv[2]);
+
+  // 要在第一次用线程池之前设置
+  snprintf(size, sizeof(size), "%d", threads);
+  setenv("UV_THREADPOOL_SIZE", size, 0);
+
+  uv_loop_t *loop = uv_default_loop();
+  printf("threads[%d], threadpool[%s], cpus[%d]\n", threads, getenv("UV_THREADPOOL_SIZE"), get_cpu_count());
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    spin_ns = sizes[i].us * 1000;
+    total = (int64_t) (sizes[i].tasks * scale);
+    // fork/join的树有2 * total - 1个节点
+    jobs = calloc(2 * total, sizeof(job_t));
+    if (jobs == NULL) {
+      CHECK(UV_ENOMEM, "calloc");
+    }
+
+    printf("%lluus tasks:\n", (unsigned long long) sizes[i].us);
+    run_queue_work(loop);
+    run_ws(loop, 0);
+    run_ws(loop, 1);
+    free(jobs);
+  }
+  return 0;
+}
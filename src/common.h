@@ -1,6 +1,14 @@
+#ifndef LIBUV_DEMO_COMMON_H
+#define LIBUV_DEMO_COMMON_H
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "uv.h"
 
 #define CHECK(r, msg) if (r < 0) {                                                       \
@@ -22,3 +30,240 @@ typedef struct {
   char string[30];
   int number;
 } thread_args_t;
+
+/*
+ * 按loop共享的读缓冲池
+ * libuv每次读数据之前都会调用alloc_cb，suggested_size一般是64KiB，如果每次都malloc然后在read_cb里free，
+ * 大量小请求的时候分配器就成了热点，而且RSS会被切得很碎。这里的做法是：
+ * 1、所有缓冲都是固定大小的slab，用完之后挂回free_list，下次alloc_cb直接复用
+ * 2、max_bytes是池子向系统申请内存的上限(高水位)，超过之后返回空buf，libuv会用UV_ENOBUFS回调read_cb。
+ *    unix上libuv这时不会停掉fd的监听，可读的fd每轮都会再来一次，loop会空转，所以read_cb里要调用buf_pool_wait停读，
+ *    排进池子的等待链表；有slab归还的时候池子在idle阶段回调每个等待者的resume，由它决定要不要重新uv_read_start。
+ *    等待者被关闭之前要buf_pool_unwait，只有buf_pool_attach过的池子才会重试
+ * 3、stats记录分配、复用、分配失败的次数以及内存峰值，方便在定时器里打印
+ * 池子通过loop->data挂在loop上，所以同一个loop上的所有句柄共享一个池子，不同loop(线程)之间互不干扰，也就不需要加锁
+ */
+#define BUF_POOL_SLAB_SIZE  (64 * 1024)
+#define BUF_POOL_MAX_BYTES  (64 * 1024 * 1024)
+
+typedef struct buf_pool_slab_s {
+  struct buf_pool_slab_s *next;
+} buf_pool_slab_t;
+
+typedef struct buf_pool_waiter_s buf_pool_waiter_t;
+typedef void (*buf_pool_resume_cb)(buf_pool_waiter_t *waiter);
+
+// 因为借不到slab停读的流，一般嵌在连接的结构体里
+struct buf_pool_waiter_s {
+  void *data;
+  buf_pool_resume_cb resume;
+  buf_pool_waiter_t *prev;
+  buf_pool_waiter_t *next;
+  int waiting;
+};
+
+typedef struct {
+  uint64_t allocs;      // alloc的总次数
+  uint64_t frees;       // 归还的总次数
+  uint64_t reuses;      // 命中free_list的次数
+  uint64_t exhausted;   // 超过高水位分配失败的次数
+  uint64_t stalls;      // 借不到slab停读的次数
+  size_t in_use;        // 当前借出去的slab个数
+  size_t total_bytes;   // 当前向系统申请的字节数
+  size_t peak_bytes;    // total_bytes的峰值
+} buf_pool_stats_t;
+
+typedef struct {
+  size_t slab_size;
+  size_t max_bytes;
+  size_t free_count;
+  buf_pool_slab_t *free_list;
+  buf_pool_stats_t stats;
+  buf_pool_waiter_t *waiters;
+  uv_idle_t retry;      // buf_pool_attach的时候初始化
+  int retry_ready;
+} buf_pool_t;
+
+static inline void buf_pool_init(buf_pool_t *pool, size_t slab_size, size_t max_bytes) {
+  memset(pool, 0, sizeof(*pool));
+  // slab至少要能放下free_list的指针
+  pool->slab_size = slab_size < sizeof(buf_pool_slab_t) ? sizeof(buf_pool_slab_t) : slab_size;
+  pool->max_bytes = max_bytes;
+}
+
+// 把等待链表整个摘下来再逐个resume，resume里又借不到的会重新排进来，等下一次归还
+static inline void buf_pool_retry_cb(uv_idle_t *handle) {
+  buf_pool_t *pool = (buf_pool_t *) handle->data;
+  buf_pool_waiter_t *waiter = pool->waiters;
+  buf_pool_waiter_t *next;
+
+  uv_idle_stop(handle);
+  pool->waiters = NULL;
+  for (; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    waiter->prev = waiter->next = NULL;
+    waiter->waiting = 0;
+    waiter->resume(waiter);
+  }
+}
+
+static inline void buf_pool_schedule_retry(buf_pool_t *pool) {
+  if (pool->waiters != NULL && pool->retry_ready && !uv_is_active((uv_handle_t *) &pool->retry)) {
+    uv_idle_start(&pool->retry, buf_pool_retry_cb);
+  }
+}
+
+// 把池子挂到loop上，之后的alloc_cb通过handle->loop就能找到它
+static inline void buf_pool_attach(uv_loop_t *loop, buf_pool_t *pool) {
+  loop->data = pool;
+  uv_idle_init(loop, &pool->retry);
+  pool->retry.data = pool;
+  pool->retry_ready = 1;
+}
+
+// read_cb收到UV_ENOBUFS时调用：停读，等有slab归还之后回调resume
+static inline void buf_pool_wait(buf_pool_t *pool, buf_pool_waiter_t *waiter, uv_stream_t *stream,
+                                 buf_pool_resume_cb resume) {
+  uv_read_stop(stream);
+  waiter->resume = resume;
+  if (waiter->waiting) {
+    return;
+  }
+  waiter->waiting = 1;
+  waiter->prev = NULL;
+  waiter->next = pool->waiters;
+  if (pool->waiters) pool->waiters->prev = waiter;
+  pool->waiters = waiter;
+  pool->stats.stalls++;
+  // 借不到也可能是malloc失败，这时池子里已经有空闲的slab了就不用等归还
+  if (pool->free_list != NULL) {
+    buf_pool_schedule_retry(pool);
+  }
+}
+
+static inline void buf_pool_unwait(buf_pool_t *pool, buf_pool_waiter_t *waiter) {
+  if (!waiter->waiting) {
+    return;
+  }
+  if (waiter->prev) waiter->prev->next = waiter->next;
+  else pool->waiters = waiter->next;
+  if (waiter->next) waiter->next->prev = waiter->prev;
+  waiter->prev = waiter->next = NULL;
+  waiter->waiting = 0;
+}
+
+static inline buf_pool_t *buf_pool_from_loop(uv_loop_t *loop) {
+  return (buf_pool_t *) loop->data;
+}
+
+static inline uv_buf_t buf_pool_alloc(buf_pool_t *pool) {
+  buf_pool_slab_t *slab = pool->free_list;
+
+  if (slab != NULL) {
+    pool->free_list = slab->next;
+    pool->free_count--;
+    pool->stats.reuses++;
+  } else {
+    if (pool->stats.total_bytes + pool->slab_size > pool->max_bytes) {
+      pool->stats.exhausted++;
+      return uv_buf_init(NULL, 0);
+    }
+
+    slab = malloc(pool->slab_size);
+    if (slab == NULL) {
+      pool->stats.exhausted++;
+      return uv_buf_init(NULL, 0);
+    }
+
+    pool->stats.total_bytes += pool->slab_size;
+    if (pool->stats.total_bytes > pool->stats.peak_bytes) {
+      pool->stats.peak_bytes = pool->stats.total_bytes;
+    }
+  }
+
+  pool->stats.allocs++;
+  pool->stats.in_use++;
+  return uv_buf_init((char *) slab, pool->slab_size);
+}
+
+static inline void buf_pool_free(buf_pool_t *pool, char *base) {
+  if (base == NULL) {
+    return;
+  }
+
+  buf_pool_slab_t *slab = (buf_pool_slab_t *) base;
+  slab->next = pool->free_list;
+  pool->free_list = slab;
+  pool->free_count++;
+  pool->stats.frees++;
+  pool->stats.in_use--;
+  buf_pool_schedule_retry(pool);
+}
+
+// 把空闲的slab还给系统，借出去的slab不受影响
+static inline void buf_pool_trim(buf_pool_t *pool) {
+  while (pool->free_list != NULL) {
+    buf_pool_slab_t *slab = pool->free_list;
+    pool->free_list = slab->next;
+    free(slab);
+    pool->stats.total_bytes -= pool->slab_size;
+  }
+  pool->free_count = 0;
+}
+
+static inline void buf_pool_print_stats(buf_pool_t *pool, FILE *stream) {
+  fprintf(stream, "buf pool: allocs[%llu], frees[%llu], reuses[%llu], exhausted[%llu], stalls[%llu], in_use[%zu], "
+                  "free[%zu], total[%zu KiB], peak[%zu KiB]\n",
+          (unsigned long long) pool->stats.allocs, (unsigned long long) pool->stats.frees,
+          (unsigned long long) pool->stats.reuses, (unsigned long long) pool->stats.exhausted,
+          (unsigned long long) pool->stats.stalls,
+          pool->stats.in_use, pool->free_count, pool->stats.total_bytes / 1024, pool->stats.peak_bytes / 1024);
+}
+
+// 可以直接作为uv_read_start/uv_udp_recv_start的alloc_cb，suggested_size被忽略，统一给slab_size大小
+static inline void buf_pool_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  *buf = buf_pool_alloc(buf_pool_from_loop(handle->loop));
+}
+
+/*
+ * 创建一个打开了SO_REUSEPORT并且已经bind好的socket，之后交给uv_tcp_open/uv_udp_open接管
+ * libuv(v1.31)的bind接口没有SO_REUSEPORT选项，多个loop想监听同一个HOST:PORT，让内核在它们之间分发连接/数据包，
+ * 只能自己创建socket
+ */
+static inline int reuseport_socket(int type, const struct sockaddr *addr, socklen_t addrlen, uv_os_sock_t *sock) {
+  // 失败的时候*sock是-1
+  *sock = -1;
+#ifdef SO_REUSEPORT
+  int on = 1;
+  int fd = socket(addr->sa_family, type, 0);
+  if (fd < 0) {
+    return uv_translate_sys_error(errno);
+  }
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+      bind(fd, addr, addrlen)) {
+    int err = uv_translate_sys_error(errno);
+    close(fd);
+    return err;
+  }
+
+  *sock = fd;
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+static inline int get_cpu_count() {
+  int r;
+  uv_cpu_info_t *info;
+  int cpu_count;
+  r = uv_cpu_info(&info, &cpu_count);
+  CHECK(r, "obtaining cpu info");
+
+  uv_free_cpu_info(info, cpu_count);
+  return cpu_count;
+}
+
+#endif //LIBUV_DEMO_COMMON_H
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dispatcher.h"
+
+// 一个桶最多尝试这么多个种子
+#define DISPATCHER_MAX_SEEDS (1 << 20)
+
+// FNV-1a，种子混进初始值
+static uint32_t command_hash(const char *name, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+typedef struct {
+  size_t bucket;
+  size_t size;
+  size_t *members;
+} dispatcher_bucket_t;
+
+// 大的桶先放，这时候空槽还多，容易找到种子
+static int bucket_compare(const void *a, const void *b) {
+  const dispatcher_bucket_t *x = a;
+  const dispatcher_bucket_t *y = b;
+  return (int) y->size - (int) x->size;
+}
+
+static size_t next_power_of_two(size_t n) {
+  size_t size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+int dispatcher_init(dispatcher_t *dispatcher, const command_t *commands, size_t count) {
+  size_t bucket_count = next_power_of_two(count > 0 ? count : 1);
+  size_t slot_count = next_power_of_two(count > 0 ? count * 2 : 1);
+  size_t i, j, k;
+
+  memset(dispatcher, 0, sizeof(*dispatcher));
+  dispatcher->commands = commands;
+  dispatcher->count = count;
+  dispatcher->bucket_mask = bucket_count - 1;
+  dispatcher->mask = slot_count - 1;
+
+  for (i = 0; i < count; i++) {
+    for (j = i + 1; j < count; j++) {
+      if (!strcmp(commands[i].name, commands[j].name)) {
+        return UV_EINVAL;
+      }
+    }
+  }
+
+  dispatcher->seeds = calloc(bucket_count, sizeof(uint32_t));
+  dispatcher->slots = calloc(slot_count, sizeof(command_t *));
+  dispatcher_bucket_t *buckets = calloc(bucket_count, sizeof(dispatcher_bucket_t));
+  size_t *members = calloc(count ? count : 1, sizeof(size_t));
+  size_t *targets = calloc(count ? count : 1, sizeof(size_t));
+  if (!dispatcher->seeds || !dispatcher->slots || !buckets || !members || !targets) {
+    free(buckets);
+    free(members);
+    free(targets);
+    dispatcher_destroy(dispatcher);
+    return UV_ENOMEM;
+  }
+
+  // 第一层：用种子0把命令分到桶里
+  for (i = 0; i < count; i++) {
+    buckets[command_hash(commands[i].name, strlen(commands[i].name), 0) & dispatcher->bucket_mask].size++;
+  }
+  for (i = 0, k = 0; i < bucket_count; i++) {
+    buckets[i].bucket = i;
+    buckets[i].members = members + k;
+    k += buckets[i].size;
+    buckets[i].size = 0;
+  }
+  for (i = 0; i < count; i++) {
+    dispatcher_bucket_t *bucket =
+        &buckets[command_hash(commands[i].name, strlen(commands[i].name), 0) & dispatcher->bucket_mask];
+    bucket->members[bucket->size++] = i;
+  }
+  qsort(buckets, bucket_count, sizeof(dispatcher_bucket_t), bucket_compare);
+
+  // 第二层：给每个桶找一个种子，让桶里的命令都落在空槽里，并且互相不冲突
+  int r = 0;
+  for (i = 0; i < bucket_count && buckets[i].size > 0; i++) {
+    dispatcher_bucket_t *bucket = &buckets[i];
+    uint32_t seed;
+
+    for (seed = 1; seed <= DISPATCHER_MAX_SEEDS; seed++) {
+      for (j = 0; j < bucket->size; j++) {
+        const char *name = commands[bucket->members[j]].name;
+        targets[j] = command_hash(name, strlen(name), seed) & dispatcher->mask;
+        if (dispatcher->slots[targets[j]] != NULL) {
+          break;
+        }
+        for (k = 0; k < j && targets[k] != targets[j]; k++) {
+        }
+        if (k < j) {
+          break;
+        }
+      }
+      if (j == bucket->size) {
+        break;
+      }
+    }
+
+    if (seed > DISPATCHER_MAX_SEEDS) {
+      r = UV_E2BIG;
+      break;
+    }
+
+    dispatcher->seeds[bucket->bucket] = seed;
+    for (j = 0; j < bucket->size; j++) {
+      dispatcher->slots[targets[j]] = &commands[bucket->members[j]];
+    }
+  }
+
+  free(buckets);
+  free(members);
+  free(targets);
+  if (r < 0) {
+    dispatcher_destroy(dispatcher);
+  }
+  return r;
+}
+
+void dispatcher_destroy(dispatcher_t *dispatcher) {
+  free(dispatcher->seeds);
+  free(dispatcher->slots);
+  dispatcher->seeds = NULL;
+  dispatcher->slots = NULL;
+}
+
+const command_t *dispatcher_lookup(const dispatcher_t *dispatcher, const char *name, size_t len) {
+  uint32_t seed = dispatcher->seeds[command_hash(name, len, 0) & dispatcher->bucket_mask];
+  const command_t *command = dispatcher->slots[command_hash(name, len, seed) & dispatcher->mask];
+
+  if (command != NULL && strlen(command->name) == len && !memcmp(command->name, name, len)) {
+    return command;
+  }
+  return NULL;
+}
+
+const command_reply_t *dispatcher_dispatch(const dispatcher_t *dispatcher, const uv_buf_t *payload,
+                                           const command_reply_t *unknown, void *ctx) {
+  const char *space = memchr(payload->base, ' ', payload->len);
+  size_t name_len = space ? (size_t) (space - payload->base) : payload->len;
+  const command_t *command = dispatcher_lookup(dispatcher, payload->base, name_len);
+
+  if (command == NULL) {
+    return unknown;
+  }
+
+  if (command->handler == NULL) {
+    return &command->reply;
+  }
+
+  uv_buf_t args = space ? uv_buf_init((char *) space + 1, payload->len - name_len - 1) : uv_buf_init(NULL, 0);
+  return command->handler(command, &args, ctx);
+}
@@ -0,0 +1,61 @@
+/*
+ * 命令分发
+ * 命令表是一个静态数组，每条命令有名字、可选的处理函数以及预先编码好的回复：
+ * 1、回复在编译期就准备好了行帧(带\n)和长度帧(4字节头+内容)两种格式，写回客户端的时候直接引用静态内存，不需要拷贝
+ * 2、启动时根据命令表生成一个完美hash表(hash and displace)：命令先按hash分到桶里，再给每个桶找一个种子，
+ *    让桶里的命令用这个种子再hash一次之后落在互不冲突的槽里。查找一条命令只需要算两次hash、比较一次字符串，
+ *    不再随着命令个数线性增长
+ * 3、处理函数可以返回别的静态回复，也可以返回NULL表示自己负责回复(比如需要异步处理的命令)
+ */
+#ifndef LIBUV_DEMO_DISPATCHER_H
+#define LIBUV_DEMO_DISPATCHER_H
+
+#include <stdint.h>
+#include "uv.h"
+#include "framing.h"
+
+typedef struct {
+  uv_buf_t line;                    // 行帧的回复，带\n
+  uv_buf_t body;                    // 长度帧的回复内容，不带\n
+  char header[FRAME_HEADER_SIZE];   // 长度帧的头
+} command_reply_t;
+
+// 编译期把一个以\n结尾的字符串常量编码成两种格式的回复
+#define COMMAND_REPLY(text) {                                                     \
+  { .base = (char *) (text), .len = sizeof(text) - 1 },                           \
+  { .base = (char *) (text), .len = sizeof(text) - 2 },                           \
+  { (char) ((sizeof(text) - 2) >> 24), (char) ((sizeof(text) - 2) >> 16),         \
+    (char) ((sizeof(text) - 2) >> 8), (char) (sizeof(text) - 2) }                 \
+}
+
+typedef struct command_s command_t;
+
+// args是命令名后面的参数(可能为空)，ctx是dispatcher_dispatch传进来的调用方上下文
+typedef const command_reply_t *(*command_handler_t)(const command_t *command, const uv_buf_t *args, void *ctx);
+
+struct command_s {
+  const char *name;
+  command_handler_t handler;  // 为NULL时直接回复reply
+  command_reply_t reply;
+};
+
+typedef struct {
+  const command_t *commands;
+  size_t count;
+  uint32_t *seeds;            // 每个桶的种子
+  size_t bucket_mask;
+  const command_t **slots;
+  size_t mask;
+} dispatcher_t;
+
+// 为命令表生成完美hash，命令重名返回UV_EINVAL
+int dispatcher_init(dispatcher_t *dispatcher, const command_t *commands, size_t count);
+void dispatcher_destroy(dispatcher_t *dispatcher);
+
+const command_t *dispatcher_lookup(const dispatcher_t *dispatcher, const char *name, size_t len);
+
+// 把"命令 参数"形式的一帧拆开，找到命令并调用处理函数，返回要回复的内容；找不到命令时返回unknown
+const command_reply_t *dispatcher_dispatch(const dispatcher_t *dispatcher, const uv_buf_t *payload,
+                                           const command_reply_t *unknown, void *ctx);
+
+#endif //LIBUV_DEMO_DISPATCHER_H
@@ -1,55 +1,319 @@
 /*
  * 使用libuv进行DNS查询
  * 使用uv_getaddrinfo查询域名的对应的IP地址
- * 使用uv_getnameinfo查询IP地址对应的域名              
+ * 使用uv_getnameinfo查询IP地址对应的域名
+ * 查询走dns_cache：同一个域名同时发起的几次查询只提交一次uv_getaddrinfo，第二轮查询直接命中缓存，
+ * 解析失败的域名也会被缓存一段时间
+ * 第一个参数是@server的时候不走线程池，用dns_client直接在loop上向server(IP，端口53)查每个域名的A和AAAA记录，
+ * 打印全部地址；@fake在本进程里起一个假DNS服务器(127.0.0.1:DNS_FAKE_PORT)，big开头的域名会走TCP，nx开头的不存在
+ * 第一个参数是-r的时候批量反查：从文件(没有给或者是-时从标准输入)每行取第一列的IP地址，
+ * 用dns_reverse同时最多concurrency个uv_getnameinfo去查，重复的地址只查一次，按输入的顺序输出"地址\t域名"
+ * 用法：DNSHandle [host...]
+ *      DNSHandle @server|@fake [host...]
+ *      DNSHandle -r [file|-] [concurrency]
  */
 #include <stdio.h>
 #include "uv.h"
 #include "common.h"
+#include "dns_cache.h"
+#include "dns_client.h"
+#include "dns_fake.h"
+#include "dns_reverse.h"
+
+#define DNS_FAKE_PORT 5353
+
+// 批量反查的输入每次读这么多，没输出的地址超过REVERSE_MAX_PENDING就先停读，输出到一半以下再接着读
+#define REVERSE_READ_SIZE (64 * 1024)
+#define REVERSE_MAX_PENDING 4096
+
+#define LOOKUPS_PER_HOST 3
+#define MAX_HOSTS 16
+
+static dns_cache_t cache;
+static dns_lookup_t lookups[MAX_HOSTS * LOOKUPS_PER_HOST];
+static const char *hosts[MAX_HOSTS];
+static int host_count;
+static int pending;
+static int round;
+
+static dns_client_t client;
+static dns_query_t queries[MAX_HOSTS * 2];
+static dns_fake_t fake;
+static int use_fake;
+
+static dns_reverse_t rev;
+static uv_fs_t reverse_req;
+static uv_file reverse_file;
+static char reverse_buf[REVERSE_READ_SIZE];
+static size_t reverse_len;        // reverse_buf里还没凑成一行的部分
+static int reverse_paused;
 
 void name_cb(uv_getnameinfo_t* req, int status, const char* hostname, const char* service) {
   CHECK(status, "name_cb");
 
   printf("resolve the host name: %s\n", req->host);
 //  printf("resolve the service: %s\n", req->service);
+  free(req);
 }
 
-void addr_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
-  CHECK(status, "addr_cb");
+static void start_round(void);
 
+void addr_cb(dns_lookup_t *lookup, int status, const struct addrinfo *res) {
+  int index = (int) (lookup - lookups);
+  const char *host = hosts[index / LOOKUPS_PER_HOST];
   char addr[17] = {"\0"};
+  int r = 0;
 
-  uv_ip4_name((struct sockaddr_in *) res->ai_addr, addr, 16);
+  if (status < 0) {
+    printf("round %d: resolve %s failed: %s\n", round, host, uv_strerror(status));
+  } else {
+    uv_ip4_name((struct sockaddr_in *) res->ai_addr, addr, 16);
+    printf("round %d: resolve %s ip: %s\n", round, host, addr);
 
-  printf("resolve ip: %s\n", addr);
+    // 每个域名第一轮的第一个结果再反查一次，res在回调返回之后可能被缓存释放，uv_getnameinfo会复制地址
+    if (round == 1 && index % LOOKUPS_PER_HOST == 0) {
+      uv_getnameinfo_t *nameinfo_req = malloc(sizeof(uv_getnameinfo_t));
+      if (nameinfo_req == NULL) {
+        CHECK(UV_ENOMEM, "malloc");
+      }
 
-  uv_getnameinfo_t nameinfo_req;
-  int r = 0;
+//      struct sockaddr_in host;
+//      uv_ip4_addr("47.96.8.45", 80, &host);
+
+      r = uv_getnameinfo(lookup->cache->loop, nameinfo_req, name_cb, res->ai_addr, 0);
+      CHECK(r, "uv_getnameinfo");
+    }
+  }
+
+  if (--pending == 0) {
+    if (round == 1) {
+      start_round();
+    } else {
+      dns_cache_print_stats(&cache, stdout);
+      dns_cache_close(&cache, NULL);
+    }
+  }
+}
+
+// 每个域名同时查LOOKUPS_PER_HOST次
+static void start_round(void) {
+  int total = host_count * LOOKUPS_PER_HOST;
+  int i, r;
+
+  // 命中缓存的查询在dns_cache_lookup里直接回调，pending要先设好
+  round++;
+  pending = total;
+  for (i = 0; i < total; i++) {
+    r = dns_cache_lookup(&cache, &lookups[i], hosts[i / LOOKUPS_PER_HOST], addr_cb);
+    CHECK(r, "dns_cache_lookup");
+  }
+}
+
+void query_cb(dns_query_t *query, int status) {
+  const char *host = hosts[(query - queries) / 2];
+  char addr[INET6_ADDRSTRLEN];
+  int i;
+
+  if (status < 0) {
+    printf("%s %s: %s\n", host, query->type == DNS_TYPE_A ? "A" : "AAAA", uv_strerror(status));
+  } else {
+    for (i = 0; i < query->naddrs; i++) {
+      uv_inet_ntop(query->addrs[i].family, query->addrs[i].addr, addr, sizeof(addr));
+      printf("%s %s: %s ttl[%u]\n", host, query->type == DNS_TYPE_A ? "A" : "AAAA", addr, query->ttl);
+    }
+  }
+
+  if (--pending == 0) {
+    dns_client_print_stats(&client, stdout);
+    dns_client_close(&client, NULL);
+    if (use_fake) {
+      dns_fake_print_stats(&fake, stdout);
+      dns_fake_close(&fake, NULL);
+    }
+  }
+}
+
+// 每个域名的A和AAAA记录同时查，都从同一个UDP socket发出去
+static void native_lookup(uv_loop_t *loop, const char *server) {
+  struct sockaddr_in addr;
+  int i, r;
+
+  if (strcmp(server, "fake") == 0) {
+    use_fake = 1;
+    uv_ip4_addr("127.0.0.1", DNS_FAKE_PORT, &addr);
+    r = dns_fake_start(loop, &fake, (const struct sockaddr *) &addr, 0);
+    CHECK(r, "dns_fake_start");
+  } else {
+    r = uv_ip4_addr(server, DNS_PORT, &addr);
+    CHECK(r, "uv_ip4_addr");
+  }
+
+  r = dns_client_init(loop, &client, (const struct sockaddr *) &addr, 1000, 2);
+  CHECK(r, "dns_client_init");
+
+  pending = host_count * 2;
+  for (i = 0; i < host_count; i++) {
+    r = dns_client_query(&client, &queries[2 * i], hosts[i], DNS_TYPE_A, query_cb);
+    CHECK(r, "dns_client_query");
+    r = dns_client_query(&client, &queries[2 * i + 1], hosts[i], DNS_TYPE_AAAA, query_cb);
+    CHECK(r, "dns_client_query");
+  }
+}
 
-//  struct sockaddr_in host;
-//  uv_ip4_addr("47.96.8.45", 80, &host);
+static void reverse_drain();
+static void reverse_read();
 
-  r = uv_getnameinfo(req->loop, &nameinfo_req, name_cb, res->ai_addr, 0);
-  CHECK(r, "uv_getnameinfo");
+void reverse_output_cb(dns_reverse_t *rev, const char *addr, int status, const char *host) {
+  if (status < 0) {
+    printf("%s\t!%s\n", addr, uv_err_name(status));
+  } else {
+    printf("%s\t%s\n", addr, host);
+  }
 
-  uv_freeaddrinfo(res);
+  if (reverse_paused && rev->pending < REVERSE_MAX_PENDING / 2) {
+    reverse_paused = 0;
+    reverse_drain();
+  }
 }
 
-int main() {
+void reverse_done_cb(dns_reverse_t *rev) {
+  dns_reverse_print_stats(rev, stderr);
+  dns_reverse_free(rev);
+}
+
+// 日志的第一列一般就是客户端地址
+static void reverse_add_line(char *line) {
+  char *token, *save;
+  int r;
+
+  token = strtok_r(line, " \t\r\n", &save);
+  if (token != NULL) {
+    r = dns_reverse_add(&rev, token);
+    CHECK(r, "dns_reverse_add");
+  }
+}
+
+// 把缓冲里完整的行交给dns_reverse，没输出的地址到了上限就停下，剩下的行留着等输出追上来
+static void reverse_drain() {
+  char *line = reverse_buf, *end = reverse_buf + reverse_len, *newline;
+
+  while (rev.pending < REVERSE_MAX_PENDING && (newline = memchr(line, '\n', end - line)) != NULL) {
+    *newline = '\0';
+    reverse_add_line(line);
+    line = newline + 1;
+  }
+  // 一整块都没有换行的超长行，和fgets一样截成一行处理
+  if (line == reverse_buf && reverse_len == sizeof(reverse_buf) - 1) {
+    reverse_buf[reverse_len] = '\0';
+    reverse_add_line(reverse_buf);
+    line = end;
+  }
+  reverse_len = end - line;
+  memmove(reverse_buf, line, reverse_len);
+
+  // 输出被前面慢的地址卡住的时候，再读下去只会把内存堆起来
+  if (rev.pending >= REVERSE_MAX_PENDING) {
+    reverse_paused = 1;
+    return;
+  }
+  reverse_read();
+}
+
+static void reverse_read_cb(uv_fs_t *req) {
+  ssize_t result = req->result;
+
+  uv_fs_req_cleanup(req);
+  CHECK(result, "reading addresses");
+
+  if (result == 0) {
+    // 最后一行可能没有换行符
+    if (reverse_len > 0) {
+      reverse_buf[reverse_len] = '\0';
+      reverse_add_line(reverse_buf);
+    }
+    if (reverse_file != 0) {
+      uv_fs_close(req->loop, req, reverse_file, NULL);
+      uv_fs_req_cleanup(req);
+    }
+    dns_reverse_end(&rev, reverse_done_cb);
+    return;
+  }
+
+  reverse_len += result;
+  reverse_drain();
+}
+
+static void reverse_read() {
+  // 留一个字节给最后一行补'\0'
+  uv_buf_t buf = uv_buf_init(reverse_buf + reverse_len, (unsigned int) (sizeof(reverse_buf) - 1 - reverse_len));
+  int r;
+
+  r = uv_fs_read(rev.loop, &reverse_req, reverse_file, &buf, 1, -1, reverse_read_cb);
+  CHECK(r, "uv_fs_read");
+}
+
+// 输入在loop上一块一块地读，标准输入是管道或者终端的时候也不会在uv_run之前就阻塞住
+static void batch_reverse(uv_loop_t *loop, const char *path, int concurrency) {
+  int r;
+
+  reverse_file = 0;
+  if (path != NULL && strcmp(path, "-") != 0) {
+    r = uv_fs_open(loop, &reverse_req, path, O_RDONLY, 0, NULL);
+    CHECK(r, "uv_fs_open");
+    reverse_file = (uv_file) reverse_req.result;
+    uv_fs_req_cleanup(&reverse_req);
+  }
+
+  r = dns_reverse_init(loop, &rev, concurrency, reverse_output_cb);
+  CHECK(r, "dns_reverse_init");
+  reverse_read();
+}
+
+int main(int argc, char **argv) {
   uv_loop_t *loop = uv_default_loop();
+  const char *server = NULL;
 
   struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
 
   // 这些宏定义都是些什么意思？AF(Address Family)、PF(Protocol Family), http://man7.org/linux/man-pages/man2/socket.2.html
   hints.ai_family = PF_INET;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = IPPROTO_TCP;
 
+  dns_cache_options_t options = {
+      .capacity = 1024,
+      .ttl = 60 * 1000,
+      .negative_ttl = 5 * 1000,
+      .refresh_ahead = 10 * 1000,
+      .hints = &hints,
+  };
+
+  if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+    batch_reverse(loop, argc > 2 ? argv[2] : NULL, argc > 3 ? atoi(argv[3]) : 16);
+    return uv_run(loop, UV_RUN_DEFAULT);
+  }
+
   int r = 0;
-  uv_getaddrinfo_t addrinfo_req;
-  r = uv_getaddrinfo(loop, &addrinfo_req, addr_cb, "blog.5udou.cn", NULL, &hints);
+  r = dns_cache_init(loop, &cache, &options);
+  CHECK(r, "dns_cache_init");
 
-  CHECK(r, "uv_getaddrinfo");
+  for (int i = 1; i < argc && host_count < MAX_HOSTS; i++) {
+    if (i == 1 && argv[i][0] == '@') {
+      server = argv[i] + 1;
+      continue;
+    }
+    hosts[host_count++] = argv[i];
+  }
+  if (host_count == 0) {
+    hosts[host_count++] = "blog.5udou.cn";
+    hosts[host_count++] = server && strcmp(server, "fake") == 0 ? "big.example" : "localhost";
+  }
+  if (server) {
+    native_lookup(loop, server);
+  } else {
+    start_round();
+  }
 
   uv_run(loop, UV_RUN_DEFAULT);
 }
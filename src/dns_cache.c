@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dns_cache.h"
+
+static void addrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res);
+
+// FNV-1a
+static uint32_t hash_host(const char *host) {
+  uint32_t hash = 2166136261u;
+  while (*host) {
+    hash ^= (unsigned char) *host++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static dns_entry_t *find(dns_cache_t *cache, const char *host, uint32_t hash) {
+  dns_entry_t *entry = cache->buckets[hash & cache->bucket_mask];
+  for (; entry != NULL; entry = entry->hash_next) {
+    if (entry->hash == hash && strcmp(entry->host, host) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void lru_unlink(dns_cache_t *cache, dns_entry_t *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else cache->lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(dns_cache_t *cache, dns_entry_t *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = entry;
+  else cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+static void entry_free(dns_entry_t *entry) {
+  if (entry->res) {
+    uv_freeaddrinfo(entry->res);
+  }
+  free(entry->host);
+  free(entry);
+}
+
+static void remove_entry(dns_cache_t *cache, dns_entry_t *entry) {
+  dns_entry_t **pp = &cache->buckets[entry->hash & cache->bucket_mask];
+  while (*pp != entry) {
+    pp = &(*pp)->hash_next;
+  }
+  *pp = entry->hash_next;
+  lru_unlink(cache, entry);
+  cache->count--;
+  entry_free(entry);
+}
+
+// 从最久没用的开始淘汰，在途的条目还有人在等，跳过
+static void evict(dns_cache_t *cache) {
+  dns_entry_t *entry = cache->lru_tail;
+  dns_entry_t *prev;
+
+  while (cache->count > cache->options.capacity && entry != NULL) {
+    prev = entry->lru_prev;
+    if (!entry->resolving) {
+      remove_entry(cache, entry);
+      cache->stats.evictions++;
+    }
+    entry = prev;
+  }
+}
+
+static void release(dns_cache_t *cache) {
+  while (cache->lru_head != NULL) {
+    remove_entry(cache, cache->lru_head);
+  }
+  free(cache->buckets);
+  cache->buckets = NULL;
+  if (cache->close_cb) {
+    cache->close_cb(cache);
+  }
+}
+
+// 回调都返回之后才淘汰或者释放，回调里拿到的addrinfo在回调期间一直有效
+static void maybe_release(dns_cache_t *cache) {
+  if (cache->callbacks > 0) {
+    return;
+  }
+  if (cache->closing) {
+    if (cache->resolving == 0) {
+      release(cache);
+    }
+    return;
+  }
+  evict(cache);
+}
+
+static void finish(dns_cache_t *cache, dns_lookup_t *lookup, int status, const struct addrinfo *res) {
+  uint64_t usec = (uv_hrtime() - lookup->start) / 1000;
+  int i = 0;
+
+  while (usec) {
+    i++;
+    usec >>= 1;
+  }
+  cache->stats.latency[i < DNS_HIST_BUCKETS ? i : DNS_HIST_BUCKETS - 1]++;
+
+  cache->callbacks++;
+  lookup->cb(lookup, status, res);
+  cache->callbacks--;
+}
+
+static int resolve(dns_cache_t *cache, dns_entry_t *entry) {
+  int r;
+
+  entry->req.data = entry;
+  r = uv_getaddrinfo(cache->loop, &entry->req, addrinfo_cb, entry->host, NULL, &cache->hints);
+  if (r == 0) {
+    entry->resolving = 1;
+    cache->resolving++;
+  }
+  return r;
+}
+
+static void flush_waiters(dns_cache_t *cache, dns_entry_t *entry, int status, const struct addrinfo *res) {
+  dns_lookup_t *lookup = entry->waiters_head;
+  dns_lookup_t *next;
+
+  entry->waiters_head = entry->waiters_tail = NULL;
+  for (; lookup != NULL; lookup = next) {
+    next = lookup->next;
+    finish(cache, lookup, status, res);
+  }
+}
+
+static void addrinfo_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+  dns_entry_t *entry = (dns_entry_t *) req->data;
+  dns_cache_t *cache = entry->cache;
+  uint64_t now = uv_now(cache->loop);
+  int r;
+
+  if (status == 0) {
+    if (entry->res) {
+      uv_freeaddrinfo(entry->res);
+    }
+    entry->res = res;
+    entry->status = 0;
+    entry->expire = now + cache->options.ttl;
+  } else if (status != UV_EAI_CANCELED) {
+    if (entry->status == 0 && entry->expire > now) {
+      // 提前刷新失败，旧的结果还没过期，接着用
+      cache->stats.refresh_failures++;
+    } else {
+      if (entry->res) {
+        uv_freeaddrinfo(entry->res);
+        entry->res = NULL;
+      }
+      entry->status = status;
+      entry->expire = now + cache->options.negative_ttl;
+    }
+  }
+
+  // 回调期间entry->resolving还是1，不会被淘汰；回调里再查同一个域名会挂到waiters上
+  if (status == UV_EAI_CANCELED) {
+    flush_waiters(cache, entry, status, NULL);
+  } else {
+    flush_waiters(cache, entry, entry->status, entry->res);
+  }
+  entry->resolving = 0;
+  cache->resolving--;
+
+  if (entry->waiters_head != NULL && !cache->closing) {
+    r = resolve(cache, entry);
+    if (r < 0) {
+      flush_waiters(cache, entry, r, NULL);
+    } else {
+      cache->stats.misses++;
+    }
+  }
+  maybe_release(cache);
+}
+
+int dns_cache_init(uv_loop_t *loop, dns_cache_t *cache, const dns_cache_options_t *options) {
+  size_t buckets = 16;
+
+  memset(cache, 0, sizeof(*cache));
+  cache->loop = loop;
+  cache->options = *options;
+  if (cache->options.capacity == 0) {
+    cache->options.capacity = 1;
+  }
+  if (options->hints) {
+    cache->hints = *options->hints;
+  }
+  cache->options.hints = &cache->hints;
+
+  while (buckets < cache->options.capacity) {
+    buckets <<= 1;
+  }
+  cache->buckets = calloc(buckets, sizeof(dns_entry_t *));
+  if (cache->buckets == NULL) {
+    return UV_ENOMEM;
+  }
+  cache->bucket_mask = buckets - 1;
+  return 0;
+}
+
+int dns_cache_lookup(dns_cache_t *cache, dns_lookup_t *lookup, const char *host, dns_lookup_cb cb) {
+  uint32_t hash = hash_host(host);
+  uint64_t now = uv_now(cache->loop);
+  dns_entry_t *entry;
+  int r;
+
+  lookup->cache = cache;
+  lookup->cb = cb;
+  lookup->start = uv_hrtime();
+  lookup->next = NULL;
+  cache->stats.lookups++;
+
+  if (cache->closing) {
+    finish(cache, lookup, UV_ECANCELED, NULL);
+    return 0;
+  }
+
+  entry = find(cache, host, hash);
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(dns_entry_t));
+    if (entry == NULL) {
+      return UV_ENOMEM;
+    }
+    entry->host = strdup(host);
+    if (entry->host == NULL) {
+      free(entry);
+      return UV_ENOMEM;
+    }
+    entry->hash = hash;
+    entry->cache = cache;
+    entry->hash_next = cache->buckets[hash & cache->bucket_mask];
+    cache->buckets[hash & cache->bucket_mask] = entry;
+    cache->count++;
+  } else {
+    lru_unlink(cache, entry);
+  }
+  lru_push_front(cache, entry);
+
+  if (entry->expire > now) {
+    cache->stats.hits++;
+    if (entry->status < 0) {
+      cache->stats.negative_hits++;
+    } else if (cache->options.refresh_ahead && !entry->resolving &&
+               now + cache->options.refresh_ahead >= entry->expire) {
+      if (resolve(cache, entry) == 0) {
+        cache->stats.refreshes++;
+      }
+    }
+    finish(cache, lookup, entry->status, entry->res);
+    maybe_release(cache);
+    return 0;
+  }
+
+  if (entry->waiters_tail) entry->waiters_tail->next = lookup;
+  else entry->waiters_head = lookup;
+  entry->waiters_tail = lookup;
+
+  // 过期了但是后台刷新还没回来，也一起等
+  if (entry->resolving) {
+    cache->stats.coalesced++;
+    return 0;
+  }
+
+  r = resolve(cache, entry);
+  if (r < 0) {
+    entry->waiters_head = entry->waiters_tail = NULL;
+    if (entry->expire == 0) {
+      remove_entry(cache, entry);
+    }
+    return r;
+  }
+  cache->stats.misses++;
+  maybe_release(cache);
+  return 0;
+}
+
+void dns_cache_close(dns_cache_t *cache, dns_cache_close_cb close_cb) {
+  dns_entry_t *entry;
+
+  cache->closing = 1;
+  cache->close_cb = close_cb;
+  // 已经在线程里跑的取消不了，等它回调
+  for (entry = cache->lru_head; entry != NULL; entry = entry->lru_next) {
+    if (entry->resolving) {
+      uv_cancel((uv_req_t *) &entry->req);
+    }
+  }
+  maybe_release(cache);
+}
+
+uint64_t dns_cache_latency_percentile(const dns_cache_t *cache, double p) {
+  uint64_t total = 0;
+  uint64_t rank, seen = 0;
+  int i;
+
+  for (i = 0; i < DNS_HIST_BUCKETS; i++) {
+    total += cache->stats.latency[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  rank = (uint64_t) (p * total + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (i = 0; i < DNS_HIST_BUCKETS; i++) {
+    seen += cache->stats.latency[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return i < DNS_HIST_BUCKETS ? (uint64_t) 1 << i : (uint64_t) 1 << (DNS_HIST_BUCKETS - 1);
+}
+
+void dns_cache_print_stats(dns_cache_t *cache, FILE *stream) {
+  dns_cache_stats_t *stats = &cache->stats;
+
+  fprintf(stream, "dns cache: lookups[%llu], hits[%llu], hit rate[%.2f%%], negative hits[%llu], misses[%llu], "
+                  "coalesced[%llu], refreshes[%llu], refresh failures[%llu], evictions[%llu], entries[%zu], "
+                  "latency p50[<%lluus], p99[<%lluus]\n",
+          (unsigned long long) stats->lookups, (unsigned long long) stats->hits,
+          stats->lookups ? 100.0 * stats->hits / stats->lookups : 0.0,
+          (unsigned long long) stats->negative_hits, (unsigned long long) stats->misses,
+          (unsigned long long) stats->coalesced, (unsigned long long) stats->refreshes,
+          (unsigned long long) stats->refresh_failures, (unsigned long long) stats->evictions, cache->count,
+          (unsigned long long) dns_cache_latency_percentile(cache, 0.5),
+          (unsigned long long) dns_cache_latency_percentile(cache, 0.99));
+}
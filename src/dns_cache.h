@@ -0,0 +1,103 @@
+/*
+ * 带缓存的uv_getaddrinfo
+ * uv_getaddrinfo每次都要占一个线程池线程去跑libc的解析器(读/etc/hosts、发DNS请求)，
+ * 同一个域名一秒钟解析几千次的时候，线程池和解析器都被重复的请求占满了。这里的做法是：
+ * 1、结果按域名缓存ttl毫秒，缓存满了按LRU淘汰；解析失败的结果也缓存negative_ttl毫秒，不存在的域名不会被反复查询
+ * 2、同一个域名已经有一个uv_getaddrinfo在途的时候，后来的查询挂在它后面等同一个结果，不再提交新的请求
+ * 3、命中的条目离过期不到refresh_ahead毫秒时，后台提前再解析一次，这期间的查询继续用旧的结果，热点域名不会因为过期而卡一下
+ * 4、统计命中率，以及每次查询从发起到回调的延迟(按2的幂次分段，单位微秒)
+ * getaddrinfo拿不到DNS记录里的TTL，所以ttl由使用方指定。
+ * 命中的时候在dns_cache_lookup里直接回调，没命中的时候在uv_getaddrinfo的回调里回调；
+ * 回调里拿到的addrinfo属于缓存，只在回调期间有效，要留着用的话自己复制一份。
+ */
+#ifndef LIBUV_DEMO_DNS_CACHE_H
+#define LIBUV_DEMO_DNS_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+#define DNS_HIST_BUCKETS 32
+
+typedef struct dns_cache_s dns_cache_t;
+typedef struct dns_entry_s dns_entry_t;
+typedef struct dns_lookup_s dns_lookup_t;
+
+typedef void (*dns_lookup_cb)(dns_lookup_t *lookup, int status, const struct addrinfo *res);
+typedef void (*dns_cache_close_cb)(dns_cache_t *cache);
+
+typedef struct {
+  size_t capacity;              // 最多缓存多少个域名
+  uint64_t ttl;                 // 毫秒
+  uint64_t negative_ttl;        // 毫秒
+  uint64_t refresh_ahead;       // 毫秒，0表示不提前刷新
+  const struct addrinfo *hints; // 所有查询共用，NULL表示不限制
+} dns_cache_options_t;
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t negative_hits;       // 命中的是失败的结果，也算在hits里
+  uint64_t misses;              // 提交了uv_getaddrinfo的查询
+  uint64_t coalesced;           // 没命中，但是挂在在途的请求后面
+  uint64_t refreshes;           // 后台提前刷新的次数
+  uint64_t refresh_failures;    // 刷新失败，旧的结果继续用到过期
+  uint64_t evictions;
+  uint64_t latency[DNS_HIST_BUCKETS];  // 第i档是[2^(i-1), 2^i)微秒
+} dns_cache_stats_t;
+
+struct dns_lookup_s {
+  void *data;
+  dns_cache_t *cache;
+  dns_lookup_cb cb;
+  uint64_t start;
+  dns_lookup_t *next;
+};
+
+struct dns_entry_s {
+  char *host;
+  uint32_t hash;
+  dns_cache_t *cache;
+  dns_entry_t *hash_next;
+  dns_entry_t *lru_prev;
+  dns_entry_t *lru_next;
+  struct addrinfo *res;
+  int status;                   // 0或者解析失败的错误码
+  uint64_t expire;              // uv_now，0表示还没有结果
+  uv_getaddrinfo_t req;
+  int resolving;
+  dns_lookup_t *waiters_head;
+  dns_lookup_t *waiters_tail;
+};
+
+struct dns_cache_s {
+  uv_loop_t *loop;
+  void *data;
+  dns_cache_options_t options;
+  struct addrinfo hints;
+  dns_entry_t **buckets;
+  size_t bucket_mask;
+  dns_entry_t *lru_head;        // 最近用过的在前面
+  dns_entry_t *lru_tail;
+  size_t count;
+  size_t resolving;
+  int callbacks;                // 正在执行的回调层数，回调里还可以接着查询
+  int closing;
+  dns_cache_close_cb close_cb;
+  dns_cache_stats_t stats;
+};
+
+int dns_cache_init(uv_loop_t *loop, dns_cache_t *cache, const dns_cache_options_t *options);
+
+// 关闭之后的查询以UV_ECANCELED回调
+int dns_cache_lookup(dns_cache_t *cache, dns_lookup_t *lookup, const char *host, dns_lookup_cb cb);
+
+// 取消在途的解析，等它们都回调完之后释放缓存再调用close_cb，没有在途的解析时直接调用
+void dns_cache_close(dns_cache_t *cache, dns_cache_close_cb close_cb);
+
+// 延迟的百分位数，单位微秒，返回的是所在分段的上界
+uint64_t dns_cache_latency_percentile(const dns_cache_t *cache, double p);
+
+void dns_cache_print_stats(dns_cache_t *cache, FILE *stream);
+
+#endif //LIBUV_DEMO_DNS_CACHE_H
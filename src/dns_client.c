@@ -0,0 +1,514 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dns_client.h"
+
+struct dns_tcp_s {
+  uv_tcp_t tcp;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  dns_query_t *query;           // 查询先结束(超时、取消)的时候置成NULL
+  uint8_t out[2 + DNS_MAX_QUERY];  // 查询结束之后写请求可能还没完成，报文复制一份
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+};
+
+static uint16_t get16(const uint8_t *p) {
+  return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t) (v >> 8);
+  p[1] = (uint8_t) v;
+}
+
+// xorshift32，ID不能是顺序的，否则很容易猜到下一个去伪造回复
+static uint16_t next_random(dns_client_t *client) {
+  uint32_t x = client->rand_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  client->rand_state = x;
+  return (uint16_t) (x >> 16);
+}
+
+static dns_query_t *find(dns_client_t *client, uint16_t id) {
+  dns_query_t *query = client->buckets[id % DNS_ID_BUCKETS];
+  while (query != NULL && query->id != id) {
+    query = query->id_next;
+  }
+  return query;
+}
+
+static void id_remove(dns_client_t *client, dns_query_t *query) {
+  dns_query_t **pp = &client->buckets[query->id % DNS_ID_BUCKETS];
+  while (*pp != query) {
+    pp = &(*pp)->id_next;
+  }
+  *pp = query->id_next;
+}
+
+static void list_remove(dns_client_t *client, dns_query_t *query) {
+  if (query->prev) query->prev->next = query->next;
+  else client->head = query->next;
+  if (query->next) query->next->prev = query->prev;
+  else client->tail = query->prev;
+  query->prev = query->next = NULL;
+}
+
+static void timer_cb(uv_timer_t *handle);
+
+// 超时时间都一样，重新计时的查询放到链表尾上就还是有序的
+static void list_append(dns_client_t *client, dns_query_t *query) {
+  uint64_t now = uv_now(client->loop);
+
+  query->deadline = now + client->timeout;
+  query->prev = client->tail;
+  query->next = NULL;
+  if (client->tail) {
+    client->tail->next = query;
+  } else {
+    client->head = query;
+    // 定时器只对着链表头，头被摘掉之后定时器会早一点醒，再对着新的头
+    uv_timer_start(&client->timer, timer_cb, client->timeout, 0);
+  }
+  client->tail = query;
+}
+
+static void tcp_close_cb(uv_handle_t *handle) {
+  dns_tcp_t *tcp = (dns_tcp_t *) handle;
+  free(tcp->buf);
+  free(tcp);
+}
+
+static void tcp_abort(dns_tcp_t *tcp) {
+  tcp->query = NULL;
+  if (!uv_is_closing((uv_handle_t *) &tcp->tcp)) {
+    uv_close((uv_handle_t *) &tcp->tcp, tcp_close_cb);
+  }
+}
+
+static void complete(dns_query_t *query, int status) {
+  dns_client_t *client = query->client;
+
+  id_remove(client, query);
+  list_remove(client, query);
+  if (query->tcp) {
+    tcp_abort(query->tcp);
+    query->tcp = NULL;
+  }
+  client->inflight--;
+  client->stats.completed++;
+  if (status == UV_ETIMEDOUT) {
+    client->stats.timeouts++;
+  }
+  query->cb(query, status);
+}
+
+static int skip_name(const uint8_t *msg, size_t len, size_t *off) {
+  size_t p = *off;
+
+  while (p < len) {
+    if (msg[p] == 0) {
+      *off = p + 1;
+      return 0;
+    }
+    // 压缩指针指向前面出现过的名字，它就是这个名字的结尾
+    if ((msg[p] & 0xC0) == 0xC0) {
+      if (p + 2 > len) {
+        return -1;
+      }
+      *off = p + 2;
+      return 0;
+    }
+    if (msg[p] & 0xC0) {
+      return -1;
+    }
+    p += msg[p] + 1;
+  }
+  return -1;
+}
+
+// 回复里的问题要和发出去的一样，域名不区分大小写
+static int same_question(dns_query_t *query, const uint8_t *msg, size_t len) {
+  const uint8_t *question = query->packet + 12;
+  size_t qlen = query->packet_len - 12;
+  size_t i;
+
+  if (len < 12 + qlen) {
+    return 0;
+  }
+  for (i = 0; i < qlen; i++) {
+    if (tolower(question[i]) != tolower(msg[12 + i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// 返回0表示成功，1表示被截断，负数是要回调给使用方的错误码
+static int parse(dns_query_t *query, const uint8_t *msg, size_t len) {
+  uint16_t flags = get16(msg + 2);
+  uint16_t ancount = get16(msg + 6);
+  size_t off = query->packet_len;  // 跳过报文头和问题
+  uint16_t type, rdlength;
+  uint32_t ttl;
+  int i;
+
+  if (flags & 0x0200) {
+    return 1;
+  }
+  switch (flags & 0x000F) {
+    case 0:
+      break;
+    case 3:
+      return UV_EAI_NONAME;
+    case 2:
+      return UV_EAI_AGAIN;
+    default:
+      return UV_EAI_FAIL;
+  }
+
+  query->naddrs = 0;
+  query->ttl = UINT32_MAX;
+  for (i = 0; i < ancount; i++) {
+    if (skip_name(msg, len, &off) < 0 || off + 10 > len) {
+      return UV_EAI_FAIL;
+    }
+    type = get16(msg + off);
+    ttl = get32(msg + off + 4);
+    rdlength = get16(msg + off + 8);
+    off += 10;
+    if (off + rdlength > len) {
+      return UV_EAI_FAIL;
+    }
+    // CNAME之类的记录跳过，只收集问的那个类型
+    if (type == query->type && query->naddrs < DNS_MAX_ADDRS &&
+        rdlength == (type == DNS_TYPE_A ? 4 : 16)) {
+      query->addrs[query->naddrs].family = type == DNS_TYPE_A ? AF_INET : AF_INET6;
+      memcpy(query->addrs[query->naddrs].addr, msg + off, rdlength);
+      query->naddrs++;
+      if (ttl < query->ttl) {
+        query->ttl = ttl;
+      }
+    }
+    off += rdlength;
+  }
+  if (query->naddrs == 0) {
+    query->ttl = 0;
+    return UV_EAI_NODATA;
+  }
+  return 0;
+}
+
+static void tcp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  dns_tcp_t *tcp = (dns_tcp_t *) handle;
+  uint8_t *grown;
+
+  if (tcp->cap - tcp->len < 4096) {
+    grown = realloc(tcp->buf, tcp->cap + 64 * 1024);
+    if (grown == NULL) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    tcp->buf = grown;
+    tcp->cap += 64 * 1024;
+  }
+  *buf = uv_buf_init((char *) tcp->buf + tcp->len, (unsigned int) (tcp->cap - tcp->len));
+}
+
+static void tcp_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  dns_tcp_t *tcp = (dns_tcp_t *) stream;
+  dns_query_t *query = tcp->query;
+  size_t msg_len;
+  int r;
+
+  if (query == NULL) {
+    return;
+  }
+  if (nread < 0) {
+    complete(query, UV_EAI_FAIL);
+    return;
+  }
+  tcp->len += nread;
+  if (tcp->len < 2) {
+    return;
+  }
+  msg_len = get16(tcp->buf);
+  if (tcp->len < 2 + msg_len) {
+    return;
+  }
+
+  if (msg_len < 12 || get16(tcp->buf + 2) != query->id || !same_question(query, tcp->buf + 2, msg_len)) {
+    query->client->stats.mismatched++;
+    complete(query, UV_EAI_FAIL);
+    return;
+  }
+  r = parse(query, tcp->buf + 2, msg_len);
+  complete(query, r == 1 ? UV_EAI_FAIL : r);
+}
+
+static void tcp_write_cb(uv_write_t *req, int status) {
+  dns_tcp_t *tcp = (dns_tcp_t *) req->data;
+  if (status < 0 && tcp->query) {
+    complete(tcp->query, UV_EAI_FAIL);
+  }
+}
+
+static void tcp_connect_cb(uv_connect_t *req, int status) {
+  dns_tcp_t *tcp = (dns_tcp_t *) req->data;
+  dns_query_t *query = tcp->query;
+  uv_buf_t buf;
+
+  if (query == NULL) {
+    return;
+  }
+  if (status == 0) {
+    // 长度前缀和报文在同一块缓冲里，一次写出去
+    put16(tcp->out, (uint16_t) query->packet_len);
+    memcpy(tcp->out + 2, query->packet, query->packet_len);
+    buf = uv_buf_init((char *) tcp->out, (unsigned int) (2 + query->packet_len));
+    tcp->write_req.data = tcp;
+    status = uv_write(&tcp->write_req, (uv_stream_t *) &tcp->tcp, &buf, 1, tcp_write_cb);
+  }
+  if (status == 0) {
+    status = uv_read_start((uv_stream_t *) &tcp->tcp, tcp_alloc_cb, tcp_read_cb);
+  }
+  if (status < 0) {
+    complete(query, UV_EAI_FAIL);
+  }
+}
+
+// 被截断的回复改走TCP，重新开始计时，TCP上不再重试
+static void start_tcp(dns_query_t *query) {
+  dns_client_t *client = query->client;
+  dns_tcp_t *tcp = calloc(1, sizeof(dns_tcp_t));
+  int r;
+
+  if (tcp == NULL) {
+    complete(query, UV_ENOMEM);
+    return;
+  }
+  r = uv_tcp_init(client->loop, &tcp->tcp);
+  if (r < 0) {
+    free(tcp);
+    complete(query, r);
+    return;
+  }
+  tcp->query = query;
+  query->tcp = tcp;
+  query->state = DNS_QUERY_TCP;
+  client->stats.tcp_fallbacks++;
+  list_remove(client, query);
+  list_append(client, query);
+
+  tcp->connect_req.data = tcp;
+  r = uv_tcp_connect(&tcp->connect_req, &tcp->tcp, (const struct sockaddr *) &client->server, tcp_connect_cb);
+  if (r < 0) {
+    complete(query, r);
+  }
+}
+
+static void send_query(dns_client_t *client, dns_query_t *query) {
+  uv_buf_t buf = uv_buf_init((char *) query->packet, (unsigned int) query->packet_len);
+
+  client->stats.sent++;
+  // 发不出去就当作丢包，等超时重发
+  uv_udp_try_send(&client->udp, &buf, 1, NULL);
+}
+
+static void timer_cb(uv_timer_t *handle) {
+  dns_client_t *client = (dns_client_t *) handle->data;
+  uint64_t now = uv_now(client->loop);
+  dns_query_t *query;
+
+  while ((query = client->head) != NULL && query->deadline <= now) {
+    if (query->state == DNS_QUERY_TCP || query->attempts >= client->retries) {
+      complete(query, UV_ETIMEDOUT);
+      continue;
+    }
+    query->attempts++;
+    client->stats.retries++;
+    list_remove(client, query);
+    list_append(client, query);
+    send_query(client, query);
+  }
+  if (client->head != NULL) {
+    uv_timer_start(&client->timer, timer_cb, client->head->deadline - now, 0);
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  dns_client_t *client = (dns_client_t *) handle->data;
+  *buf = uv_buf_init(client->recv_buf, sizeof(client->recv_buf));
+}
+
+static void recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                    unsigned flags) {
+  dns_client_t *client = (dns_client_t *) handle->data;
+  const uint8_t *msg = (const uint8_t *) buf->base;
+  dns_query_t *query;
+  int r;
+
+  // 服务器端口不通的ICMP错误也从这里上来，忽略，等超时
+  if (nread <= 0) {
+    return;
+  }
+  client->stats.received++;
+
+  // 要是回复(QR=1)，ID和问题都对得上
+  if (nread < 12 || !(msg[2] & 0x80) || (query = find(client, get16(msg))) == NULL ||
+      query->state != DNS_QUERY_UDP || !same_question(query, msg, nread)) {
+    client->stats.mismatched++;
+    return;
+  }
+
+  r = parse(query, msg, nread);
+  if (r == 1) {
+    start_tcp(query);
+  } else {
+    complete(query, r);
+  }
+}
+
+int dns_client_init(uv_loop_t *loop, dns_client_t *client, const struct sockaddr *server, uint64_t timeout,
+                    int retries) {
+  int r;
+
+  memset(client, 0, sizeof(*client));
+  client->loop = loop;
+  client->timeout = timeout;
+  client->retries = retries;
+  client->rand_state = (uint32_t) uv_hrtime() | 1;
+  memcpy(&client->server, server,
+         server->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+  r = uv_udp_init(loop, &client->udp);
+  if (r < 0) {
+    return r;
+  }
+  client->udp.data = client;
+  client->handles++;
+  uv_timer_init(loop, &client->timer);
+  client->timer.data = client;
+  client->handles++;
+
+  // connect之后内核只把服务器发来的包交上来
+  r = uv_udp_connect(&client->udp, server);
+  if (r == 0) {
+    r = uv_udp_recv_start(&client->udp, alloc_cb, recv_cb);
+  }
+  return r;
+}
+
+// 把域名编码成长度+标签的格式，末尾的点可有可无
+static int encode_name(uint8_t *p, const char *name, size_t *len) {
+  size_t off = 0;
+  const char *label = name;
+  const char *dot;
+  size_t n;
+
+  if (*name == '\0' || strcmp(name, ".") == 0) {
+    return UV_EINVAL;
+  }
+  while (*label) {
+    dot = strchr(label, '.');
+    n = dot ? (size_t) (dot - label) : strlen(label);
+    if (n == 0 || n > 63 || off + n + 2 > 255) {
+      return UV_EINVAL;
+    }
+    p[off++] = (uint8_t) n;
+    memcpy(p + off, label, n);
+    off += n;
+    label += n;
+    if (*label == '.') {
+      label++;
+    }
+  }
+  p[off++] = 0;
+  *len = off;
+  return 0;
+}
+
+int dns_client_query(dns_client_t *client, dns_query_t *query, const char *name, int type, dns_query_cb cb) {
+  uint8_t *packet = query->packet;
+  size_t name_len;
+  int r;
+
+  if (client->closing) {
+    return UV_ECANCELED;
+  }
+  if (type != DNS_TYPE_A && type != DNS_TYPE_AAAA) {
+    return UV_EINVAL;
+  }
+  // ID只有16位
+  if (client->inflight >= UINT16_MAX) {
+    return UV_ENOBUFS;
+  }
+  r = encode_name(packet + 12, name, &name_len);
+  if (r < 0) {
+    return r;
+  }
+
+  query->client = client;
+  query->cb = cb;
+  query->type = (uint16_t) type;
+  query->state = DNS_QUERY_UDP;
+  query->attempts = 0;
+  query->tcp = NULL;
+  query->naddrs = 0;
+  query->ttl = 0;
+  do {
+    query->id = next_random(client);
+  } while (find(client, query->id) != NULL);
+
+  // 报文头：ID、RD=1、一个问题
+  memset(packet, 0, 12);
+  put16(packet, query->id);
+  put16(packet + 2, 0x0100);
+  put16(packet + 4, 1);
+  put16(packet + 12 + name_len, (uint16_t) type);
+  put16(packet + 12 + name_len + 2, 1);
+  query->packet_len = 12 + name_len + 4;
+
+  query->id_next = client->buckets[query->id % DNS_ID_BUCKETS];
+  client->buckets[query->id % DNS_ID_BUCKETS] = query;
+  list_append(client, query);
+  client->inflight++;
+  client->stats.queries++;
+  send_query(client, query);
+  return 0;
+}
+
+static void handle_close_cb(uv_handle_t *handle) {
+  dns_client_t *client = (dns_client_t *) handle->data;
+  if (--client->handles == 0 && client->close_cb) {
+    client->close_cb(client);
+  }
+}
+
+void dns_client_close(dns_client_t *client, dns_client_close_cb close_cb) {
+  client->closing = 1;
+  client->close_cb = close_cb;
+  while (client->head != NULL) {
+    complete(client->head, UV_ECANCELED);
+  }
+  uv_close((uv_handle_t *) &client->udp, handle_close_cb);
+  uv_close((uv_handle_t *) &client->timer, handle_close_cb);
+}
+
+void dns_client_print_stats(dns_client_t *client, FILE *stream) {
+  dns_client_stats_t *stats = &client->stats;
+
+  fprintf(stream, "dns client: queries[%llu], sent[%llu], retries[%llu], received[%llu], mismatched[%llu], "
+                  "tcp fallbacks[%llu], timeouts[%llu], completed[%llu], inflight[%zu]\n",
+          (unsigned long long) stats->queries, (unsigned long long) stats->sent,
+          (unsigned long long) stats->retries, (unsigned long long) stats->received,
+          (unsigned long long) stats->mismatched, (unsigned long long) stats->tcp_fallbacks,
+          (unsigned long long) stats->timeouts, (unsigned long long) stats->completed, client->inflight);
+}
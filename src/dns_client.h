@@ -0,0 +1,111 @@
+/*
+ * 跑在loop上的DNS客户端，不占线程池
+ * uv_getaddrinfo和getaddrinfo都是在一个线程里阻塞着等解析器，一批查询涌进来的时候线程池被它们占满，
+ * 同一个线程池里的文件读写只能排队。这里自己拼DNS报文，直接在loop上收发：
+ * 1、所有查询共用一个connect到服务器的uv_udp_t，报文头里的ID区分是哪个查询的回复，可以同时发很多个(pipeline)；
+ *    回复的ID和问题(域名、类型)都对得上才认，对不上的丢掉，ID是随机的，不容易被伪造
+ * 2、超时没有回复就重发，重发retries次之后以UV_ETIMEDOUT回调；超时时间都一样，所以在途的查询按发送顺序排成一个链表，
+ *    整个客户端只用一个定时器对着链表头
+ * 3、UDP的回复超过512字节时服务器会把TC位置上、只给一部分，这时对这个查询单独建一个TCP连接，按两字节长度前缀重新查一次
+ * 4、回复里所有的A/AAAA记录都返回，不只是第一个，同时给出这些记录里最小的TTL，可以直接给缓存用
+ * UDP发送用uv_udp_try_send，内核发送缓冲满了就当作丢包，等超时重发，查询结构里不用挂着发送请求。
+ */
+#ifndef LIBUV_DEMO_DNS_CLIENT_H
+#define LIBUV_DEMO_DNS_CLIENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+#define DNS_PORT 53
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_MAX_ADDRS 64
+// 12字节报文头 + 最长255字节的域名 + 类型和类别
+#define DNS_MAX_QUERY (12 + 255 + 4)
+#define DNS_UDP_SIZE 512
+#define DNS_ID_BUCKETS 256
+
+typedef struct dns_client_s dns_client_t;
+typedef struct dns_query_s dns_query_t;
+typedef struct dns_tcp_s dns_tcp_t;
+
+// 失败时status是UV_EAI_NONAME(域名不存在)、UV_EAI_NODATA(没有这个类型的记录)、UV_EAI_AGAIN(服务器出错)、
+// UV_EAI_FAIL(其他错误)、UV_ETIMEDOUT或者UV_ECANCELED
+typedef void (*dns_query_cb)(dns_query_t *query, int status);
+typedef void (*dns_client_close_cb)(dns_client_t *client);
+
+typedef struct {
+  int family;                   // AF_INET或者AF_INET6
+  uint8_t addr[16];
+} dns_addr_t;
+
+typedef enum {
+  DNS_QUERY_UDP,
+  DNS_QUERY_TCP
+} dns_query_state_t;
+
+struct dns_query_s {
+  void *data;
+  dns_client_t *client;
+  dns_query_cb cb;
+  uint16_t id;
+  uint16_t type;
+  dns_query_state_t state;
+  int attempts;
+  uint64_t deadline;
+  dns_query_t *prev;            // 超时链表
+  dns_query_t *next;
+  dns_query_t *id_next;
+  dns_tcp_t *tcp;
+  uint8_t packet[DNS_MAX_QUERY];
+  size_t packet_len;
+  // 结果
+  int naddrs;
+  uint32_t ttl;
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+};
+
+typedef struct {
+  uint64_t queries;
+  uint64_t sent;                // 发出去的UDP报文，包括重发
+  uint64_t retries;
+  uint64_t received;            // 收到的UDP报文
+  uint64_t mismatched;          // ID或者问题对不上、格式不对的回复
+  uint64_t tcp_fallbacks;
+  uint64_t timeouts;
+  uint64_t completed;
+} dns_client_stats_t;
+
+struct dns_client_s {
+  uv_loop_t *loop;
+  void *data;
+  uv_udp_t udp;
+  uv_timer_t timer;
+  struct sockaddr_storage server;
+  uint64_t timeout;             // 毫秒
+  int retries;
+  uint32_t rand_state;
+  dns_query_t *buckets[DNS_ID_BUCKETS];
+  dns_query_t *head;            // 最早超时的在前面
+  dns_query_t *tail;
+  size_t inflight;
+  int closing;
+  int handles;
+  dns_client_close_cb close_cb;
+  dns_client_stats_t stats;
+  char recv_buf[64 * 1024];
+};
+
+int dns_client_init(uv_loop_t *loop, dns_client_t *client, const struct sockaddr *server, uint64_t timeout,
+                    int retries);
+
+// type是DNS_TYPE_A或者DNS_TYPE_AAAA，name不合法时返回UV_EINVAL，结果在回调里从query->addrs取
+int dns_client_query(dns_client_t *client, dns_query_t *query, const char *name, int type, dns_query_cb cb);
+
+// 在途的查询以UV_ECANCELED回调，句柄都关掉之后调用close_cb
+void dns_client_close(dns_client_t *client, dns_client_close_cb close_cb);
+
+void dns_client_print_stats(dns_client_t *client, FILE *stream);
+
+#endif //LIBUV_DEMO_DNS_CLIENT_H
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dns_fake.h"
+#include "dns_client.h"
+
+#define DNS_FAKE_CONN_BUF (2 + 65535)
+#define DNS_TYPE_PTR 12
+
+struct dns_fake_conn_s {
+  uv_tcp_t tcp;
+  dns_fake_t *fake;
+  dns_fake_conn_t *prev;
+  dns_fake_conn_t *next;
+  size_t len;
+  uint8_t buf[DNS_FAKE_CONN_BUF];
+};
+
+typedef struct {
+  uv_write_t req;
+  uint8_t data[4096];
+} fake_write_t;
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t) (v >> 8);
+  p[1] = (uint8_t) v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t) (v >> 16));
+  put16(p + 2, (uint16_t) v);
+}
+
+static int has_prefix(const uint8_t *label, const char *prefix) {
+  size_t n = strlen(prefix);
+  size_t i;
+
+  if (label[0] < n) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (tolower(label[1 + i]) != prefix[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// 把查询改写成回复写到out里，返回回复的长度，0表示查询不合法、不回复
+static size_t answer(dns_fake_t *fake, const uint8_t *query, size_t len, uint8_t *out, size_t cap, int udp) {
+  size_t off = 12;
+  size_t qend, n;
+  uint32_t hash = 2166136261u;
+  uint16_t qtype, count = 0;
+  int nx, big, i;
+
+  // 只认标准查询，并且只有一个问题
+  if (len < 12 || (query[2] & 0xF8) != 0 || query[4] != 0 || query[5] != 1) {
+    fake->stats.malformed++;
+    return 0;
+  }
+  while (off < len && query[off] != 0) {
+    if (query[off] & 0xC0) {
+      fake->stats.malformed++;
+      return 0;
+    }
+    for (i = 1; i <= query[off] && off + i < len; i++) {
+      hash = (hash ^ (uint8_t) tolower(query[off + i])) * 16777619u;
+    }
+    off += query[off] + 1;
+  }
+  qend = off + 1 + 4;
+  if (qend > len || qend > cap) {
+    fake->stats.malformed++;
+    return 0;
+  }
+  qtype = (uint16_t) (query[off + 1] << 8 | query[off + 2]);
+  nx = has_prefix(query + 12, "nx");
+  big = has_prefix(query + 12, "big");
+
+  // 报文头和问题原样带回去，QR=1、RA=1，RD照抄
+  memcpy(out, query, qend);
+  put16(out + 2, (uint16_t) (0x8080 | (query[2] & 0x01) << 8 | (nx ? 3 : 0)));
+  memset(out + 6, 0, 6);
+  n = qend;
+
+  if (!nx && (qtype == DNS_TYPE_A || qtype == DNS_TYPE_AAAA)) {
+    count = big ? DNS_FAKE_BIG_RECORDS : (qtype == DNS_TYPE_A ? 2 : 1);
+    for (i = 0; i < count; i++) {
+      size_t rdlength = qtype == DNS_TYPE_A ? 4 : 16;
+      if (n + 12 + rdlength > cap) {
+        count = (uint16_t) i;
+        break;
+      }
+      // 名字用压缩指针指向问题里的域名
+      put16(out + n, 0xC00C);
+      put16(out + n + 2, qtype);
+      put16(out + n + 4, 1);
+      put32(out + n + 6, DNS_FAKE_TTL);
+      put16(out + n + 10, (uint16_t) rdlength);
+      n += 12;
+      if (qtype == DNS_TYPE_A) {
+        out[n] = 10;
+        out[n + 1] = (uint8_t) (hash >> 16);
+        out[n + 2] = (uint8_t) (hash >> 8);
+        out[n + 3] = (uint8_t) (hash + i);
+      } else {
+        memset(out + n, 0, 16);
+        out[n] = 0xfd;
+        put32(out + n + 8, hash);
+        put32(out + n + 12, (uint32_t) i + 1);
+      }
+      n += rdlength;
+    }
+  } else if (!nx && qtype == DNS_TYPE_PTR && n + 12 + 16 <= cap) {
+    // 反查回一个用地址的hash编出来的域名：h<8位十六进制>.fake
+    count = 1;
+    put16(out + n, 0xC00C);
+    put16(out + n + 2, qtype);
+    put16(out + n + 4, 1);
+    put32(out + n + 6, DNS_FAKE_TTL);
+    put16(out + n + 10, 16);
+    n += 12;
+    out[n] = 9;
+    snprintf((char *) out + n + 1, 10, "h%08x", hash);
+    out[n + 10] = 4;
+    memcpy(out + n + 11, "fake", 4);
+    out[n + 15] = 0;
+    n += 16;
+  }
+  put16(out + 6, count);
+
+  if (udp && n > DNS_UDP_SIZE) {
+    fake->stats.truncated++;
+    out[2] |= 0x02;
+    put16(out + 6, 0);
+    n = qend;
+  }
+  fake->stats.answered++;
+  return n;
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  dns_fake_t *fake = (dns_fake_t *) handle->data;
+  *buf = uv_buf_init(fake->recv_buf, sizeof(fake->recv_buf));
+}
+
+static void recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                    unsigned flags) {
+  dns_fake_t *fake = (dns_fake_t *) handle->data;
+  uv_buf_t reply;
+  size_t n;
+
+  if (nread <= 0 || addr == NULL) {
+    return;
+  }
+  fake->stats.queries++;
+  if (fake->drop_every > 0 && fake->stats.queries % fake->drop_every == 0) {
+    fake->stats.dropped++;
+    return;
+  }
+  n = answer(fake, (const uint8_t *) buf->base, nread, fake->send_buf, sizeof(fake->send_buf), 1);
+  if (n > 0) {
+    reply = uv_buf_init((char *) fake->send_buf, (unsigned int) n);
+    uv_udp_try_send(handle, &reply, 1, addr);
+  }
+}
+
+static void maybe_closed(dns_fake_t *fake) {
+  if (--fake->handles == 0 && fake->close_cb) {
+    fake->close_cb(fake);
+  }
+}
+
+static void conn_close_cb(uv_handle_t *handle) {
+  dns_fake_conn_t *conn = (dns_fake_conn_t *) handle;
+  dns_fake_t *fake = conn->fake;
+
+  if (conn->prev) conn->prev->next = conn->next;
+  else fake->conns = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  free(conn);
+  maybe_closed(fake);
+}
+
+static void conn_close(dns_fake_conn_t *conn) {
+  if (!uv_is_closing((uv_handle_t *) &conn->tcp)) {
+    uv_close((uv_handle_t *) &conn->tcp, conn_close_cb);
+  }
+}
+
+static void conn_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  dns_fake_conn_t *conn = (dns_fake_conn_t *) handle;
+  *buf = uv_buf_init((char *) conn->buf + conn->len, (unsigned int) (sizeof(conn->buf) - conn->len));
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  free(req);
+}
+
+static void conn_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  dns_fake_conn_t *conn = (dns_fake_conn_t *) stream;
+  dns_fake_t *fake = conn->fake;
+  size_t msg_len, consumed = 0, n;
+  fake_write_t *w;
+  uv_buf_t reply;
+
+  if (nread < 0) {
+    conn_close(conn);
+    return;
+  }
+  conn->len += nread;
+
+  // 一次可能收到好几个查询
+  while (conn->len - consumed >= 2) {
+    msg_len = (size_t) conn->buf[consumed] << 8 | conn->buf[consumed + 1];
+    if (conn->len - consumed < 2 + msg_len) {
+      break;
+    }
+    fake->stats.queries++;
+    fake->stats.tcp_queries++;
+    w = malloc(sizeof(fake_write_t));
+    if (w == NULL) {
+      conn_close(conn);
+      return;
+    }
+    n = answer(fake, conn->buf + consumed + 2, msg_len, w->data + 2, sizeof(w->data) - 2, 0);
+    if (n == 0) {
+      free(w);
+      conn_close(conn);
+      return;
+    }
+    put16(w->data, (uint16_t) n);
+    reply = uv_buf_init((char *) w->data, (unsigned int) (2 + n));
+    if (uv_write(&w->req, stream, &reply, 1, write_cb) < 0) {
+      free(w);
+      conn_close(conn);
+      return;
+    }
+    consumed += 2 + msg_len;
+  }
+  memmove(conn->buf, conn->buf + consumed, conn->len - consumed);
+  conn->len -= consumed;
+}
+
+static void connection_cb(uv_stream_t *server, int status) {
+  dns_fake_t *fake = (dns_fake_t *) server->data;
+  dns_fake_conn_t *conn;
+
+  if (status < 0 || fake->closing) {
+    return;
+  }
+  conn = malloc(sizeof(dns_fake_conn_t));
+  if (conn == NULL) {
+    return;
+  }
+  conn->fake = fake;
+  conn->len = 0;
+  uv_tcp_init(fake->loop, &conn->tcp);
+  fake->handles++;
+  conn->prev = NULL;
+  conn->next = fake->conns;
+  if (fake->conns) fake->conns->prev = conn;
+  fake->conns = conn;
+
+  if (uv_accept(server, (uv_stream_t *) &conn->tcp) < 0 ||
+      uv_read_start((uv_stream_t *) &conn->tcp, conn_alloc_cb, conn_read_cb) < 0) {
+    conn_close(conn);
+  }
+}
+
+int dns_fake_start(uv_loop_t *loop, dns_fake_t *fake, const struct sockaddr *addr, int drop_every) {
+  int r;
+
+  memset(fake, 0, sizeof(*fake));
+  fake->loop = loop;
+  fake->drop_every = drop_every;
+
+  uv_udp_init(loop, &fake->udp);
+  fake->udp.data = fake;
+  fake->handles++;
+  uv_tcp_init(loop, &fake->tcp);
+  fake->tcp.data = fake;
+  fake->handles++;
+
+  r = uv_udp_bind(&fake->udp, addr, UV_UDP_REUSEADDR);
+  if (r == 0) {
+    r = uv_udp_recv_start(&fake->udp, alloc_cb, recv_cb);
+  }
+  if (r == 0) {
+    r = uv_tcp_bind(&fake->tcp, addr, 0);
+  }
+  if (r == 0) {
+    r = uv_listen((uv_stream_t *) &fake->tcp, 128, connection_cb);
+  }
+  return r;
+}
+
+static void handle_close_cb(uv_handle_t *handle) {
+  maybe_closed((dns_fake_t *) handle->data);
+}
+
+void dns_fake_close(dns_fake_t *fake, dns_fake_close_cb close_cb) {
+  dns_fake_conn_t *conn;
+
+  fake->closing = 1;
+  fake->close_cb = close_cb;
+  for (conn = fake->conns; conn != NULL; conn = conn->next) {
+    conn_close(conn);
+  }
+  uv_close((uv_handle_t *) &fake->udp, handle_close_cb);
+  uv_close((uv_handle_t *) &fake->tcp, handle_close_cb);
+}
+
+void dns_fake_print_stats(dns_fake_t *fake, FILE *stream) {
+  dns_fake_stats_t *stats = &fake->stats;
+
+  fprintf(stream, "dns fake: queries[%llu], answered[%llu], dropped[%llu], truncated[%llu], tcp queries[%llu], "
+                  "malformed[%llu]\n",
+          (unsigned long long) stats->queries, (unsigned long long) stats->answered,
+          (unsigned long long) stats->dropped, (unsigned long long) stats->truncated,
+          (unsigned long long) stats->tcp_queries, (unsigned long long) stats->malformed);
+}
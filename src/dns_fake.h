@@ -0,0 +1,56 @@
+/*
+ * 本地的假DNS服务器，给dns_client做演示和压测用
+ * 同一个地址上同时监听UDP和TCP，不查任何真实的数据，按域名直接编出回复：
+ * 1、A查询回两个10.x.y.z的地址，AAAA查询回一个fd00::开头的地址，地址由域名的hash决定，TTL是300秒
+ * 2、第一个标签以nx开头的域名回NXDOMAIN，以big开头的回DNS_FAKE_BIG_RECORDS条记录，超过512字节，
+ *    UDP上只回报文头和问题、把TC位置上，客户端要改走TCP才能拿到全部记录
+ * 3、PTR查询(反查)回一个h<8位十六进制>.fake的域名，同样由地址的hash决定
+ * 4、drop_every大于0时每drop_every个UDP查询丢掉一个，模拟丢包
+ * UDP回复用uv_udp_try_send，发不出去就丢掉；TCP上一个连接可以连续发多个查询，关闭服务器时连接也一起关掉。
+ */
+#ifndef LIBUV_DEMO_DNS_FAKE_H
+#define LIBUV_DEMO_DNS_FAKE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+#define DNS_FAKE_BIG_RECORDS 40
+#define DNS_FAKE_TTL 300
+
+typedef struct dns_fake_s dns_fake_t;
+typedef struct dns_fake_conn_s dns_fake_conn_t;
+
+typedef void (*dns_fake_close_cb)(dns_fake_t *fake);
+
+typedef struct {
+  uint64_t queries;             // UDP和TCP收到的查询
+  uint64_t answered;
+  uint64_t dropped;
+  uint64_t truncated;
+  uint64_t tcp_queries;
+  uint64_t malformed;
+} dns_fake_stats_t;
+
+struct dns_fake_s {
+  uv_loop_t *loop;
+  void *data;
+  uv_udp_t udp;
+  uv_tcp_t tcp;
+  dns_fake_conn_t *conns;
+  int drop_every;
+  int closing;
+  int handles;                  // 包括TCP连接
+  dns_fake_close_cb close_cb;
+  dns_fake_stats_t stats;
+  char recv_buf[64 * 1024];
+  uint8_t send_buf[4096];       // uv_udp_try_send同步拷贝到内核，可以复用
+};
+
+int dns_fake_start(uv_loop_t *loop, dns_fake_t *fake, const struct sockaddr *addr, int drop_every);
+
+void dns_fake_close(dns_fake_t *fake, dns_fake_close_cb close_cb);
+
+void dns_fake_print_stats(dns_fake_t *fake, FILE *stream);
+
+#endif //LIBUV_DEMO_DNS_FAKE_H
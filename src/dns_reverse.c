@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dns_reverse.h"
+
+struct dns_reverse_entry_s {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } addr;
+  char name[INET6_ADDRSTRLEN];
+  uint32_t hash;
+  dns_reverse_entry_t *hash_next;
+  dns_reverse_entry_t *queue_next;
+  int done;
+  int status;
+  char *host;
+};
+
+struct dns_reverse_item_s {
+  dns_reverse_entry_t *entry;   // 非法输入时是NULL
+  char *text;                   // 非法输入的原文
+  dns_reverse_item_t *next;
+};
+
+struct dns_reverse_req_s {
+  uv_getnameinfo_t req;
+  dns_reverse_t *rev;
+  dns_reverse_entry_t *entry;
+  dns_reverse_req_t *next;
+};
+
+static void pump(dns_reverse_t *rev);
+
+static const uint8_t *addr_bytes(const dns_reverse_entry_t *entry, size_t *len) {
+  if (entry->addr.sa.sa_family == AF_INET) {
+    *len = sizeof(entry->addr.in.sin_addr);
+    return (const uint8_t *) &entry->addr.in.sin_addr;
+  }
+  *len = sizeof(entry->addr.in6.sin6_addr);
+  return (const uint8_t *) &entry->addr.in6.sin6_addr;
+}
+
+// FNV-1a，地址族也算进去
+static uint32_t hash_entry(const dns_reverse_entry_t *entry) {
+  uint32_t hash = 2166136261u ^ (uint32_t) entry->addr.sa.sa_family;
+  size_t len, i;
+  const uint8_t *bytes = addr_bytes(entry, &len);
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int same_addr(const dns_reverse_entry_t *a, const dns_reverse_entry_t *b) {
+  size_t len_a, len_b;
+  const uint8_t *bytes_a = addr_bytes(a, &len_a);
+  const uint8_t *bytes_b = addr_bytes(b, &len_b);
+
+  return a->addr.sa.sa_family == b->addr.sa.sa_family && memcmp(bytes_a, bytes_b, len_a) == 0;
+}
+
+// 条目数超过桶数的两倍时扩容
+static void grow(dns_reverse_t *rev) {
+  size_t count = rev->bucket_count * 2;
+  dns_reverse_entry_t **buckets = calloc(count, sizeof(dns_reverse_entry_t *));
+  dns_reverse_entry_t *entry, *next;
+  size_t i;
+
+  if (buckets == NULL) {
+    return;
+  }
+  for (i = 0; i < rev->bucket_count; i++) {
+    for (entry = rev->buckets[i]; entry != NULL; entry = next) {
+      next = entry->hash_next;
+      entry->hash_next = buckets[entry->hash & (count - 1)];
+      buckets[entry->hash & (count - 1)] = entry;
+    }
+  }
+  free(rev->buckets);
+  rev->buckets = buckets;
+  rev->bucket_count = count;
+}
+
+static void flush(dns_reverse_t *rev) {
+  dns_reverse_item_t *item;
+  dns_reverse_done_cb done_cb;
+
+  // 输出回调里还可以dns_reverse_add，不要重入
+  if (rev->flushing) {
+    return;
+  }
+  rev->flushing = 1;
+  while ((item = rev->items_head) != NULL && (item->entry == NULL || item->entry->done)) {
+    rev->items_head = item->next;
+    if (rev->items_head == NULL) {
+      rev->items_tail = NULL;
+    }
+    rev->pending--;
+    if (item->entry == NULL) {
+      rev->output_cb(rev, item->text, UV_EINVAL, NULL);
+    } else {
+      rev->output_cb(rev, item->entry->name, item->entry->status, item->entry->host);
+    }
+    free(item->text);
+    free(item);
+  }
+  rev->flushing = 0;
+
+  if (rev->ended && rev->items_head == NULL && rev->done_cb) {
+    done_cb = rev->done_cb;
+    rev->done_cb = NULL;
+    done_cb(rev);
+  }
+}
+
+static void nameinfo_cb(uv_getnameinfo_t *req, int status, const char *hostname, const char *service) {
+  dns_reverse_req_t *r = (dns_reverse_req_t *) req;
+  dns_reverse_t *rev = r->rev;
+  dns_reverse_entry_t *entry = r->entry;
+
+  if (status == 0) {
+    entry->host = strdup(hostname);
+    if (entry->host == NULL) {
+      status = UV_ENOMEM;
+    }
+  }
+  if (status < 0) {
+    rev->stats.failures++;
+  }
+  entry->status = status;
+  entry->done = 1;
+
+  r->next = rev->free_reqs;
+  rev->free_reqs = r;
+  rev->inflight--;
+  pump(rev);
+  flush(rev);
+}
+
+static void pump(dns_reverse_t *rev) {
+  dns_reverse_entry_t *entry;
+  dns_reverse_req_t *r;
+  int status;
+
+  while (rev->free_reqs != NULL && (entry = rev->queue_head) != NULL) {
+    rev->queue_head = entry->queue_next;
+    if (rev->queue_head == NULL) {
+      rev->queue_tail = NULL;
+    }
+    r = rev->free_reqs;
+    rev->free_reqs = r->next;
+    r->entry = entry;
+
+    status = uv_getnameinfo(rev->loop, &r->req, nameinfo_cb, &entry->addr.sa, NI_NAMEREQD);
+    if (status < 0) {
+      rev->stats.failures++;
+      entry->status = status;
+      entry->done = 1;
+      r->next = rev->free_reqs;
+      rev->free_reqs = r;
+      continue;
+    }
+    rev->inflight++;
+  }
+}
+
+int dns_reverse_init(uv_loop_t *loop, dns_reverse_t *rev, int concurrency, dns_reverse_output_cb output_cb) {
+  int i;
+
+  memset(rev, 0, sizeof(*rev));
+  rev->loop = loop;
+  rev->concurrency = concurrency > 0 ? concurrency : 1;
+  rev->output_cb = output_cb;
+
+  rev->bucket_count = 1024;
+  rev->buckets = calloc(rev->bucket_count, sizeof(dns_reverse_entry_t *));
+  rev->reqs = calloc(rev->concurrency, sizeof(dns_reverse_req_t));
+  if (rev->buckets == NULL || rev->reqs == NULL) {
+    free(rev->buckets);
+    free(rev->reqs);
+    return UV_ENOMEM;
+  }
+  for (i = 0; i < rev->concurrency; i++) {
+    rev->reqs[i].rev = rev;
+    rev->reqs[i].next = rev->free_reqs;
+    rev->free_reqs = &rev->reqs[i];
+  }
+  return 0;
+}
+
+int dns_reverse_add(dns_reverse_t *rev, const char *addr) {
+  dns_reverse_item_t *item = calloc(1, sizeof(dns_reverse_item_t));
+  dns_reverse_entry_t key, *entry;
+
+  if (item == NULL) {
+    return UV_ENOMEM;
+  }
+  rev->stats.inputs++;
+
+  memset(&key, 0, sizeof(key));
+  if (uv_ip4_addr(addr, 0, &key.addr.in) == 0 || uv_ip6_addr(addr, 0, &key.addr.in6) == 0) {
+    key.hash = hash_entry(&key);
+    for (entry = rev->buckets[key.hash & (rev->bucket_count - 1)]; entry != NULL; entry = entry->hash_next) {
+      if (entry->hash == key.hash && same_addr(entry, &key)) {
+        break;
+      }
+    }
+
+    if (entry != NULL) {
+      rev->stats.duplicates++;
+    } else {
+      entry = malloc(sizeof(dns_reverse_entry_t));
+      if (entry == NULL) {
+        free(item);
+        return UV_ENOMEM;
+      }
+      *entry = key;
+      // uv_ip_name要libuv 1.43，这里按地址族自己选
+      if (entry->addr.sa.sa_family == AF_INET) {
+        uv_ip4_name(&entry->addr.in, entry->name, sizeof(entry->name));
+      } else {
+        uv_ip6_name(&entry->addr.in6, entry->name, sizeof(entry->name));
+      }
+      entry->hash_next = rev->buckets[key.hash & (rev->bucket_count - 1)];
+      rev->buckets[key.hash & (rev->bucket_count - 1)] = entry;
+      if (++rev->entry_count > rev->bucket_count * 2) {
+        grow(rev);
+      }
+
+      if (rev->queue_tail) rev->queue_tail->queue_next = entry;
+      else rev->queue_head = entry;
+      rev->queue_tail = entry;
+      rev->stats.lookups++;
+    }
+    item->entry = entry;
+  } else {
+    rev->stats.invalid++;
+    item->text = strdup(addr);
+    if (item->text == NULL) {
+      free(item);
+      return UV_ENOMEM;
+    }
+  }
+
+  if (rev->items_tail) rev->items_tail->next = item;
+  else rev->items_head = item;
+  rev->items_tail = item;
+  if (++rev->pending > rev->stats.max_pending) {
+    rev->stats.max_pending = rev->pending;
+  }
+
+  pump(rev);
+  flush(rev);
+  return 0;
+}
+
+void dns_reverse_end(dns_reverse_t *rev, dns_reverse_done_cb done_cb) {
+  rev->ended = 1;
+  rev->done_cb = done_cb;
+  flush(rev);
+}
+
+void dns_reverse_free(dns_reverse_t *rev) {
+  dns_reverse_entry_t *entry, *next;
+  size_t i;
+
+  for (i = 0; i < rev->bucket_count; i++) {
+    for (entry = rev->buckets[i]; entry != NULL; entry = next) {
+      next = entry->hash_next;
+      free(entry->host);
+      free(entry);
+    }
+  }
+  free(rev->buckets);
+  free(rev->reqs);
+  rev->buckets = NULL;
+  rev->reqs = NULL;
+  rev->entry_count = 0;
+}
+
+void dns_reverse_print_stats(dns_reverse_t *rev, FILE *stream) {
+  dns_reverse_stats_t *stats = &rev->stats;
+
+  fprintf(stream, "dns reverse: inputs[%llu], invalid[%llu], lookups[%llu], duplicates[%llu], failures[%llu], "
+                  "max pending[%llu], concurrency[%d]\n",
+          (unsigned long long) stats->inputs, (unsigned long long) stats->invalid,
+          (unsigned long long) stats->lookups, (unsigned long long) stats->duplicates,
+          (unsigned long long) stats->failures, (unsigned long long) stats->max_pending, rev->concurrency);
+}
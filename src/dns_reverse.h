@@ -0,0 +1,71 @@
+/*
+ * 批量反查IP地址对应的域名
+ * 从日志里摘出来的几千个地址大部分是重复的，一个个串行调用getnameinfo太慢，全部同时交给uv_getnameinfo又会把线程池占满。这里的做法是：
+ * 1、同时在途的uv_getnameinfo不超过concurrency个，请求结构预先分配好，多出来的地址排队
+ * 2、地址先规范成二进制作为key，同一个地址只反查一次，结果一直缓存着，后面重复的直接用
+ * 3、输出按输入的顺序：每个输入排成一个链表，链表头的结果出来了就往外吐，后面已经出来的结果等前面的
+ * 不是合法IP的输入按顺序以UV_EINVAL输出，不去查。
+ * 反查用NI_NAMEREQD，查不到域名的时候返回错误，不会把数字地址当成域名返回。
+ * 输出回调可能在dns_reverse_add里直接调用(前面都输出完了、这个地址又已经有结果的时候)。
+ */
+#ifndef LIBUV_DEMO_DNS_REVERSE_H
+#define LIBUV_DEMO_DNS_REVERSE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+typedef struct dns_reverse_s dns_reverse_t;
+typedef struct dns_reverse_entry_s dns_reverse_entry_t;
+typedef struct dns_reverse_item_s dns_reverse_item_t;
+typedef struct dns_reverse_req_s dns_reverse_req_t;
+
+// addr是规范化之后的地址，非法输入时是原样的输入；status为0时host是反查到的域名
+typedef void (*dns_reverse_output_cb)(dns_reverse_t *rev, const char *addr, int status, const char *host);
+typedef void (*dns_reverse_done_cb)(dns_reverse_t *rev);
+
+typedef struct {
+  uint64_t inputs;
+  uint64_t invalid;
+  uint64_t lookups;             // 去重之后真正交给uv_getnameinfo的
+  uint64_t duplicates;          // 命中缓存或者等在同一个在途请求上的
+  uint64_t failures;
+  uint64_t max_pending;         // 还没输出的输入最多有多少个，输出被前面慢的地址卡住时会变大
+} dns_reverse_stats_t;
+
+struct dns_reverse_s {
+  uv_loop_t *loop;
+  void *data;
+  int concurrency;
+  int inflight;
+  dns_reverse_req_t *reqs;
+  dns_reverse_req_t *free_reqs;
+  dns_reverse_entry_t **buckets;
+  size_t bucket_count;
+  size_t entry_count;
+  dns_reverse_entry_t *queue_head;  // 等着提交的地址
+  dns_reverse_entry_t *queue_tail;
+  dns_reverse_item_t *items_head;   // 按输入顺序等着输出的
+  dns_reverse_item_t *items_tail;
+  uint64_t pending;
+  int ended;
+  int flushing;
+  dns_reverse_output_cb output_cb;
+  dns_reverse_done_cb done_cb;
+  dns_reverse_stats_t stats;
+};
+
+int dns_reverse_init(uv_loop_t *loop, dns_reverse_t *rev, int concurrency, dns_reverse_output_cb output_cb);
+
+// 加一个要反查的地址，字符串会被解析，调用之后可以释放
+int dns_reverse_add(dns_reverse_t *rev, const char *addr);
+
+// 不会再有输入了，全部输出之后调用done_cb
+void dns_reverse_end(dns_reverse_t *rev, dns_reverse_done_cb done_cb);
+
+// done_cb之后调用，释放缓存和请求
+void dns_reverse_free(dns_reverse_t *rev);
+
+void dns_reverse_print_stats(dns_reverse_t *rev, FILE *stream);
+
+#endif //LIBUV_DEMO_DNS_REVERSE_H
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "fd_cache.h"
+
+// FNV-1a
+static uint32_t path_hash(const char *path) {
+  uint32_t h = 2166136261u;
+  while (*path) {
+    h ^= (unsigned char) *path++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t next_power_of_two(size_t n) {
+  size_t size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+int fd_cache_init(fd_cache_t *cache, uv_loop_t *loop, size_t capacity, uint64_t valid_ms) {
+  size_t bucket_count = next_power_of_two(capacity > 0 ? capacity * 2 : 2);
+
+  memset(cache, 0, sizeof(*cache));
+  cache->loop = loop;
+  cache->capacity = capacity > 0 ? capacity : 1;
+  cache->valid_ms = valid_ms;
+  cache->mask = bucket_count - 1;
+  cache->buckets = calloc(bucket_count, sizeof(fd_cache_entry_t *));
+  return cache->buckets ? 0 : UV_ENOMEM;
+}
+
+static fd_cache_entry_t *lookup(fd_cache_t *cache, const char *path, uint32_t hash) {
+  fd_cache_entry_t *entry = cache->buckets[hash & cache->mask];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+    entry = entry->next_bucket;
+  }
+  return entry;
+}
+
+static void lru_unlink(fd_cache_t *cache, fd_cache_entry_t *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else cache->lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(fd_cache_t *cache, fd_cache_entry_t *entry) {
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = entry;
+  else cache->lru_tail = entry;
+  cache->lru_head = entry;
+}
+
+// 从表里摘掉，之后的acquire再也找不到它，已经拿到它的使用方照常用到release为止
+static void detach(fd_cache_entry_t *entry) {
+  fd_cache_t *cache = entry->cache;
+  fd_cache_entry_t **link = &cache->buckets[entry->hash & cache->mask];
+
+  if (!entry->cached) {
+    return;
+  }
+  while (*link != entry) {
+    link = &(*link)->next_bucket;
+  }
+  *link = entry->next_bucket;
+  lru_unlink(cache, entry);
+  entry->cached = 0;
+  cache->count--;
+}
+
+static void entry_close_cb(uv_fs_t *req) {
+  fd_cache_entry_t *entry = req->data;
+  uv_fs_req_cleanup(req);
+  free(entry->path);
+  free(entry);
+}
+
+// 已经摘掉并且没人用了才能关fd
+static void destroy(fd_cache_entry_t *entry) {
+  if (entry->file >= 0) {
+    entry->req.data = entry;
+    if (uv_fs_close(entry->cache->loop, &entry->req, entry->file, entry_close_cb) == 0) {
+      return;
+    }
+  }
+  free(entry->path);
+  free(entry);
+}
+
+void fd_cache_release(fd_cache_entry_t *entry) {
+  if (--entry->refs == 0 && !entry->cached) {
+    destroy(entry);
+  }
+}
+
+static fd_cache_entry_t *create(fd_cache_t *cache, const char *path, uint32_t hash) {
+  fd_cache_entry_t *entry = calloc(1, sizeof(fd_cache_entry_t));
+  if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->cache = cache;
+  entry->hash = hash;
+  entry->file = -1;
+  entry->state = FD_ENTRY_OPENING;
+  entry->cached = 1;
+  entry->waiters_tail = &entry->waiters;
+  entry->next_bucket = cache->buckets[hash & cache->mask];
+  cache->buckets[hash & cache->mask] = entry;
+  lru_push_front(cache, entry);
+  cache->count++;
+  return entry;
+}
+
+// 超过容量时从尾部淘汰，open/stat在途的entry上还挂着等待的请求，跳过
+static void evict(fd_cache_t *cache) {
+  fd_cache_entry_t *entry = cache->lru_tail;
+
+  while (cache->count > cache->capacity && entry != NULL) {
+    fd_cache_entry_t *prev = entry->lru_prev;
+    if (entry->state == FD_ENTRY_READY) {
+      detach(entry);
+      cache->stats.evicted++;
+      if (entry->refs == 0) {
+        destroy(entry);
+      }
+    }
+    entry = prev;
+  }
+}
+
+// 把结果告诉所有等待的请求，回调里可能马上release，先自己拿住一个引用，免得entry在循环中间被释放
+static void wake(fd_cache_entry_t *entry, int status) {
+  fd_cache_waiter_t *waiter = entry->waiters;
+
+  entry->waiters = NULL;
+  entry->waiters_tail = &entry->waiters;
+  entry->refs++;
+  while (waiter != NULL) {
+    fd_cache_waiter_t *next = waiter->next;
+    if (status == 0) {
+      entry->refs++;
+    }
+    waiter->cb(status == 0 ? entry : NULL, status, waiter->arg);
+    free(waiter);
+    waiter = next;
+  }
+  fd_cache_release(entry);
+}
+
+static void fail(fd_cache_entry_t *entry, int status) {
+  detach(entry);
+  wake(entry, status);
+}
+
+static void record_stat(fd_cache_entry_t *entry, const uv_stat_t *st) {
+  entry->size = st->st_size;
+  entry->ino = st->st_ino;
+  entry->mtime = st->st_mtim;
+  entry->validated_at = uv_now(entry->cache->loop);
+}
+
+static void fstat_cb(uv_fs_t *req) {
+  fd_cache_entry_t *entry = req->data;
+  uv_stat_t st = req->statbuf;
+  int status = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+  if (status == 0 && !S_ISREG(st.st_mode)) {
+    // 目录、管道、设备的fd缓存起来没有意义，sendfile也用不了
+    status = S_ISDIR(st.st_mode) ? UV_EISDIR : UV_EINVAL;
+  }
+  if (status < 0) {
+    fail(entry, status);
+    return;
+  }
+
+  record_stat(entry, &st);
+  entry->state = FD_ENTRY_READY;
+  wake(entry, 0);
+  evict(entry->cache);
+}
+
+static void open_cb(uv_fs_t *req) {
+  fd_cache_entry_t *entry = req->data;
+  int r = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+  if (r < 0) {
+    fail(entry, r);
+    return;
+  }
+
+  entry->file = r;
+  r = uv_fs_fstat(entry->cache->loop, &entry->req, entry->file, fstat_cb);
+  if (r) {
+    fail(entry, r);
+  }
+}
+
+static int start_open(fd_cache_entry_t *entry) {
+  entry->req.data = entry;
+  return uv_fs_open(entry->cache->loop, &entry->req, entry->path, O_RDONLY, 0, open_cb);
+}
+
+static void stat_cb(uv_fs_t *req) {
+  fd_cache_entry_t *entry = req->data;
+  fd_cache_t *cache = entry->cache;
+  fd_cache_entry_t *fresh;
+  uv_stat_t st = req->statbuf;
+  int status = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+
+  if (status == 0 && st.st_ino == entry->ino && (uint64_t) st.st_size == entry->size &&
+      st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+    cache->stats.revalidated++;
+    entry->validated_at = uv_now(cache->loop);
+    entry->state = FD_ENTRY_READY;
+    wake(entry, 0);
+    return;
+  }
+
+  // 文件变了：旧的entry摘掉，等待的请求转到重新打开的entry上
+  cache->stats.invalidated++;
+  entry->state = FD_ENTRY_READY;
+  detach(entry);
+  if (status < 0) {
+    wake(entry, status);
+    return;
+  }
+
+  fresh = create(cache, entry->path, entry->hash);
+  if (fresh == NULL) {
+    wake(entry, UV_ENOMEM);
+    return;
+  }
+  fresh->waiters = entry->waiters;
+  fresh->waiters_tail = entry->waiters_tail;
+  entry->waiters = NULL;
+  entry->waiters_tail = &entry->waiters;
+  if (entry->refs == 0) {
+    destroy(entry);
+  }
+
+  status = start_open(fresh);
+  if (status) {
+    fail(fresh, status);
+  }
+}
+
+int fd_cache_acquire(fd_cache_t *cache, const char *path, fd_cache_cb cb, void *arg) {
+  uint32_t hash = path_hash(path);
+  fd_cache_entry_t *entry = lookup(cache, path, hash);
+  fd_cache_waiter_t *waiter;
+  int r;
+
+  if (entry != NULL) {
+    lru_unlink(cache, entry);
+    lru_push_front(cache, entry);
+
+    if (entry->state == FD_ENTRY_READY && uv_now(cache->loop) - entry->validated_at < cache->valid_ms) {
+      cache->stats.hits++;
+      entry->refs++;
+      cb(entry, 0, arg);
+      return 0;
+    }
+  }
+
+  waiter = malloc(sizeof(fd_cache_waiter_t));
+  if (waiter == NULL) {
+    return UV_ENOMEM;
+  }
+  waiter->cb = cb;
+  waiter->arg = arg;
+  waiter->next = NULL;
+
+  if (entry == NULL) {
+    cache->stats.misses++;
+    entry = create(cache, path, hash);
+    if (entry == NULL) {
+      free(waiter);
+      return UV_ENOMEM;
+    }
+    r = start_open(entry);
+  } else if (entry->state == FD_ENTRY_READY) {
+    entry->state = FD_ENTRY_VALIDATING;
+    entry->req.data = entry;
+    r = uv_fs_stat(cache->loop, &entry->req, entry->path, stat_cb);
+    if (r) {
+      entry->state = FD_ENTRY_READY;
+    }
+  } else {
+    r = 0;
+  }
+
+  if (r) {
+    // 请求没发出去，刚建的entry上没有别的等待者，直接删掉
+    if (entry->state == FD_ENTRY_OPENING && entry->waiters == NULL) {
+      detach(entry);
+      destroy(entry);
+    }
+    free(waiter);
+    return r;
+  }
+
+  *entry->waiters_tail = waiter;
+  entry->waiters_tail = &waiter->next;
+  return 0;
+}
+
+void fd_cache_print_stats(fd_cache_t *cache, FILE *stream) {
+  fprintf(stream, "fd cache: entries[%zu], hits[%llu], misses[%llu], revalidated[%llu], invalidated[%llu], "
+                  "evicted[%llu]\n",
+          cache->count, (unsigned long long) cache->stats.hits, (unsigned long long) cache->stats.misses,
+          (unsigned long long) cache->stats.revalidated, (unsigned long long) cache->stats.invalidated,
+          (unsigned long long) cache->stats.evicted);
+}
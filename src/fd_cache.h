@@ -0,0 +1,84 @@
+/*
+ * 打开文件的LRU缓存
+ * 同一个文件被反复读的时候，每次open+fstat+close都要在线程池里走三趟。这里按路径缓存已经打开的fd：
+ * 1、命中并且上次校验还在valid_ms之内的，直接在fd_cache_acquire里回调，不进线程池
+ * 2、超过valid_ms的先uv_fs_stat一下路径，inode、大小、修改时间都没变就接着用；
+ *    变了(被改写、被rename替换、被删除)就把旧的entry从表里摘掉，重新打开
+ * 3、同一个路径同时只有一个open/stat在途，后来的请求挂在等待队列上，结果出来之后一起回调
+ * 4、entry个数超过capacity时从最久没用的一端淘汰，还有人在用的entry先从表里摘掉，最后一次release的时候再关fd
+ * 只缓存普通文件，打开失败的结果不缓存。一个缓存只能在一个loop上用，没有加锁。
+ */
+#ifndef LIBUV_DEMO_FD_CACHE_H
+#define LIBUV_DEMO_FD_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+typedef struct fd_cache_s fd_cache_t;
+typedef struct fd_cache_entry_s fd_cache_entry_t;
+
+// status < 0时entry为NULL；成功时entry已经被引用了一次，用完要fd_cache_release
+typedef void (*fd_cache_cb)(fd_cache_entry_t *entry, int status, void *arg);
+
+typedef struct fd_cache_waiter_s {
+  fd_cache_cb cb;
+  void *arg;
+  struct fd_cache_waiter_s *next;
+} fd_cache_waiter_t;
+
+typedef enum {
+  FD_ENTRY_OPENING,     // open或者fstat在途
+  FD_ENTRY_READY,
+  FD_ENTRY_VALIDATING   // 超过valid_ms了，stat在途
+} fd_entry_state_t;
+
+struct fd_cache_entry_s {
+  fd_cache_t *cache;
+  char *path;
+  uint32_t hash;
+  uv_file file;
+  uint64_t size;          // 打开或者上次校验时的大小
+  uint64_t ino;
+  uv_timespec_t mtime;
+  fd_entry_state_t state;
+  int refs;
+  int cached;             // 还在表里，为0表示已经被淘汰或者失效，等最后一次release
+  uint64_t validated_at;  // 上次确认没变的时间(uv_now)
+  fd_cache_entry_t *next_bucket;
+  fd_cache_entry_t *lru_prev;
+  fd_cache_entry_t *lru_next;
+  fd_cache_waiter_t *waiters;
+  fd_cache_waiter_t **waiters_tail;
+  uv_fs_t req;
+};
+
+typedef struct {
+  uint64_t hits;          // 直接命中
+  uint64_t misses;        // 需要打开
+  uint64_t revalidated;   // stat之后发现没变
+  uint64_t invalidated;   // stat之后发现变了或者没了
+  uint64_t evicted;
+} fd_cache_stats_t;
+
+struct fd_cache_s {
+  uv_loop_t *loop;
+  size_t capacity;
+  uint64_t valid_ms;
+  fd_cache_entry_t **buckets;
+  size_t mask;
+  size_t count;
+  fd_cache_entry_t *lru_head;   // 最近用过的在头上
+  fd_cache_entry_t *lru_tail;
+  fd_cache_stats_t stats;
+};
+
+int fd_cache_init(fd_cache_t *cache, uv_loop_t *loop, size_t capacity, uint64_t valid_ms);
+
+// 拿到path对应的fd之后回调cb，命中的时候cb在这个函数返回之前就会被调用；返回值只表示请求有没有发出去
+int fd_cache_acquire(fd_cache_t *cache, const char *path, fd_cache_cb cb, void *arg);
+void fd_cache_release(fd_cache_entry_t *entry);
+
+void fd_cache_print_stats(fd_cache_t *cache, FILE *stream);
+
+#endif //LIBUV_DEMO_FD_CACHE_H
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include "framing.h"
+
+void frame_ring_init(frame_ring_t *ring) {
+  memset(ring, 0, sizeof(*ring));
+}
+
+void frame_ring_attach(frame_ring_t *ring, char *base, size_t size) {
+  ring->base = base;
+  ring->size = size;
+  ring->head = ring->tail = ring->scanned = 0;
+}
+
+char *frame_ring_detach(frame_ring_t *ring) {
+  char *base = ring->base;
+  ring->base = NULL;
+  return base;
+}
+
+int frame_ring_empty(frame_ring_t *ring) {
+  return ring->head == ring->tail;
+}
+
+void frame_ring_release(frame_ring_t *ring) {
+  free(ring->scratch);
+  ring->scratch = NULL;
+}
+
+uv_buf_t frame_ring_writable(frame_ring_t *ring) {
+  size_t used = ring->tail - ring->head;
+  size_t offset = ring->tail & (ring->size - 1);
+  size_t len = ring->size - used;
+
+  // 只能给到环尾为止，剩下的部分下一次alloc_cb再从头给
+  if (offset + len > ring->size) {
+    len = ring->size - offset;
+  }
+
+  return uv_buf_init(ring->base + offset, len);
+}
+
+void frame_ring_commit(frame_ring_t *ring, size_t nread) {
+  ring->tail += nread;
+}
+
+static unsigned char ring_byte(frame_ring_t *ring, size_t pos) {
+  return (unsigned char) ring->base[pos & (ring->size - 1)];
+}
+
+// 取出[start, start + len)这一段，连续的话直接返回指针，跨环尾的话拼到scratch里
+static char *ring_view(frame_ring_t *ring, size_t start, size_t len) {
+  size_t offset = start & (ring->size - 1);
+
+  if (offset + len <= ring->size) {
+    return ring->base + offset;
+  }
+
+  // scratch只要能放下一个最大的帧就够了
+  if (ring->scratch == NULL) {
+    ring->scratch = malloc(FRAME_MAX_SIZE(ring));
+    if (ring->scratch == NULL) {
+      return NULL;
+    }
+  }
+
+  size_t first = ring->size - offset;
+  memcpy(ring->scratch, ring->base + offset, first);
+  memcpy(ring->scratch + first, ring->base, len - first);
+  ring->linearized++;
+  return ring->scratch;
+}
+
+// 从scanned开始找\n，找到返回它的位置，找不到返回tail
+static size_t ring_find_newline(frame_ring_t *ring) {
+  while (ring->scanned < ring->tail) {
+    size_t offset = ring->scanned & (ring->size - 1);
+    size_t len = ring->tail - ring->scanned;
+    if (offset + len > ring->size) {
+      len = ring->size - offset;
+    }
+
+    char *nl = memchr(ring->base + offset, '\n', len);
+    if (nl != NULL) {
+      return ring->scanned + (nl - (ring->base + offset));
+    }
+    ring->scanned += len;
+  }
+
+  return ring->tail;
+}
+
+int frame_ring_parse(frame_ring_t *ring, frame_cb cb, void *arg) {
+  int count = 0;
+  int r;
+  frame_t frame;
+
+  while (ring->head < ring->tail) {
+    size_t available = ring->tail - ring->head;
+    size_t frame_len;
+
+    if (ring_byte(ring, ring->head) == 0) {
+      // 长度帧：先要凑齐4字节的头
+      if (available < FRAME_HEADER_SIZE) {
+        break;
+      }
+
+      size_t len = ((size_t) ring_byte(ring, ring->head) << 24) |
+                   ((size_t) ring_byte(ring, ring->head + 1) << 16) |
+                   ((size_t) ring_byte(ring, ring->head + 2) << 8) |
+                   (size_t) ring_byte(ring, ring->head + 3);
+      frame_len = FRAME_HEADER_SIZE + len;
+      if (frame_len > FRAME_MAX_SIZE(ring)) {
+        return UV_E2BIG;
+      }
+      if (available < frame_len) {
+        break;
+      }
+
+      char *base = ring_view(ring, ring->head + FRAME_HEADER_SIZE, len);
+      if (base == NULL) {
+        return UV_ENOMEM;
+      }
+
+      frame.type = FRAME_LENGTH;
+      frame.payload = uv_buf_init(base, len);
+    } else {
+      // 行帧：找到\n才算完整
+      if (ring->scanned < ring->head) {
+        ring->scanned = ring->head;
+      }
+
+      size_t nl = ring_find_newline(ring);
+      if (nl == ring->tail) {
+        if (available >= FRAME_MAX_SIZE(ring)) {
+          return UV_E2BIG;
+        }
+        break;
+      }
+
+      frame_len = nl - ring->head + 1;
+      if (frame_len > FRAME_MAX_SIZE(ring)) {
+        return UV_E2BIG;
+      }
+
+      size_t len = frame_len - 1;
+      char *base = ring_view(ring, ring->head, len);
+      if (base == NULL) {
+        return UV_ENOMEM;
+      }
+      if (len > 0 && base[len - 1] == '\r') {
+        len--;
+      }
+
+      frame.type = FRAME_LINE;
+      frame.payload = uv_buf_init(base, len);
+    }
+
+    ring->head += frame_len;
+    ring->frames++;
+    count++;
+    r = cb(&frame, arg);
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  // 环形缓冲空了就把位置拨回开头，下一次read可以拿到整块连续空间
+  if (ring->head == ring->tail) {
+    ring->head = ring->tail = ring->scanned = 0;
+  }
+
+  return count;
+}
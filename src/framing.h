@@ -0,0 +1,70 @@
+/*
+ * tcp流的分帧
+ * tcp是字节流，一次read可能包含多条命令(客户端pipeline或者内核合并)，也可能只包含半条命令，
+ * 所以不能直接对读到的buf做strcmp。这里给每个连接一个环形缓冲：
+ * 1、alloc_cb直接把环形缓冲里的空闲区域交给libuv，数据读进来就在最终位置，不需要再拷贝
+ * 2、每次read之后从头往后切出所有完整的帧，不完整的帧留在原地等下一次read补齐
+ * 3、只有极少数跨过环尾的帧才会被拼接到scratch里，交给回调的始终是一段连续内存
+ * 环形缓冲的内存由调用方提供(attach/detach)，连接空闲、缓冲里没有残留数据的时候可以把内存还回去，
+ * 这样大量空闲连接不会各自占着一块读缓冲。
+ * 支持两种帧格式，按每一帧的第一个字节区分：
+ * - 行帧：以\n结尾(可以带\r)，比如 "Hello\n"
+ * - 长度帧：4字节大端长度 + 内容，长度不超过FRAME_MAX_SIZE，所以第一个字节一定是0，不会和文本命令混淆
+ */
+#ifndef LIBUV_DEMO_FRAMING_H
+#define LIBUV_DEMO_FRAMING_H
+
+#include <stdint.h>
+#include "uv.h"
+
+#define FRAME_HEADER_SIZE 4
+
+typedef enum {
+  FRAME_LINE,
+  FRAME_LENGTH
+} frame_type_t;
+
+typedef struct {
+  frame_type_t type;
+  // 帧的内容(不包含\r\n或者长度头)，只在回调期间有效
+  uv_buf_t payload;
+} frame_t;
+
+typedef struct {
+  char *base;         // 为NULL表示当前没有挂载内存
+  size_t size;        // 必须是2的幂
+  size_t head;        // 下一帧开始的位置(单调递增，用的时候对size取模)
+  size_t tail;        // 已经写入数据的末尾
+  size_t scanned;     // 行帧已经找过\n的位置，避免每次read都从头扫描
+  char *scratch;      // 跨越环尾的帧拼到这里，第一次用到的时候才分配
+  uint64_t frames;      // 累计切出的帧数
+  uint64_t linearized;  // 需要拼接的帧数
+} frame_ring_t;
+
+// 返回负数表示调用方不想再要后面的帧了，frame_ring_parse会停下并原样返回这个错误
+typedef int (*frame_cb)(frame_t *frame, void *arg);
+
+// 单个帧(包括头部)最多占环形缓冲的一半，保证有半帧未读完的时候还能继续读
+#define FRAME_MAX_SIZE(ring) ((ring)->size / 2)
+
+void frame_ring_init(frame_ring_t *ring);
+
+// 挂载/卸下环形缓冲的内存，只有frame_ring_empty为真的时候才能detach
+void frame_ring_attach(frame_ring_t *ring, char *base, size_t size);
+char *frame_ring_detach(frame_ring_t *ring);
+int frame_ring_empty(frame_ring_t *ring);
+
+// 释放scratch，连接关闭的时候调用
+void frame_ring_release(frame_ring_t *ring);
+
+// 环形缓冲中可以写入的连续区域，给alloc_cb用
+uv_buf_t frame_ring_writable(frame_ring_t *ring);
+
+// read_cb里告诉环形缓冲读到了多少字节
+void frame_ring_commit(frame_ring_t *ring, size_t nread);
+
+// 切出所有完整的帧并依次回调，返回帧数；帧超过FRAME_MAX_SIZE时返回UV_E2BIG，scratch分配失败返回UV_ENOMEM，
+// 回调返回负数时返回回调的错误
+int frame_ring_parse(frame_ring_t *ring, frame_cb cb, void *arg);
+
+#endif //LIBUV_DEMO_FRAMING_H
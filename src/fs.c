@@ -4,85 +4,167 @@
  * 2、使用open请求调用uv_fs_open打开文件，并传入回调
  * 3、回调中再重复上述动作继续分别调用uv_fs_read、uv_fs_close、uv_fs_write等方法
  * 4、所有操作结束之后，记得释放所有的文件请求：uv_fs_req_cleanup，并释放分配过的所有内存：free
+ *
+ * 一次读1KiB、读完再发下一个请求的写法读不动几个G的日志文件，这里把open_cb/read_cb这条链封装成了fs_stream：
+ * 同时有depth个uv_fs_read在线程池里按offset递增读后面的块，读好的块按文件顺序交给chunk_cb，细节见fs_stream.h。
+ * mmap和mmap-random模式直接把映射里的视图交给chunk_cb，不是普通文件的时候自动退回到读的方式。
+ * 设置了环境变量FS_AUDIT_LOG时，每读到一块就往这个文件追加一行审计记录，用fs_append攒批写、每10ms落一次盘(见fs_append.h)。
+ * 启动时要扫一整棵目录树的话用fs_walk：同时有concurrency个uv_fs_scandir/uv_fs_lstat在线程池里，目录项边扫边交给回调，
+ * 可以按glob过滤(以!开头的模式表示排除)、限制深度，细节见fs_walk.h。
+ * 用法：FsHandle [path] [chunk size] [depth] [read|mmap|mmap-random]
+ *      FsHandle walk [dir] [concurrency] [max depth] [[!]glob...]
  */
 #include <stdio.h>
 #include "uv.h"
 #include "common.h"
+#include "fs_stream.h"
+#include "fs_append.h"
+#include "fs_walk.h"
 
 static const char *filename = "/Users/linxiaowu/Github/libuv-demo/src/test.txt";
 
-void read_cb(uv_fs_t *read_req) {
-  int r = 0;
-  CHECK(read_req->result, "read_cb");
-
-   uv_context_t *context = read_req->data;
-
-  fprintf(stderr, "[%d] => %s", uv_os_getpid(), context->buf.base);
-
-  // 关闭文件
-  uv_fs_t close_req;
-  r = uv_fs_close(uv_default_loop(), &close_req, context->open_req->result, NULL);
+static uint64_t start_time;
 
-  CHECK(r, "uv_fs_close");
+static fs_append_t audit_log;
+static int auditing;
 
-  // 操作完成，记得释放所有用到的内存
-  uv_fs_req_cleanup(&close_req);
-  uv_fs_req_cleanup(context->open_req);
-  uv_fs_req_cleanup(read_req);
+void close_cb(fs_stream_t *stream) {
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
 
+  printf("[%d] => %s %llu bytes in %.3fs (%.1f MB/s)\n", uv_os_getpid(), stream->mapped ? "mapped" : "read",
+         (unsigned long long) stream->bytes, elapsed, stream->bytes / elapsed / (1024 * 1024));
+  // 操作完成，所有请求和内存都在fs_stream_close里释放了
   printf("[%d] => close all requests and handles successfully!\n", uv_os_getpid());
 
-  free(context->buf.base);
-  free(context);
+  // 缓冲里剩下的审计记录写完、落盘之后再关
+  if (auditing) {
+    fs_append_close(&audit_log, NULL);
+  }
 }
 
-void open_cb(uv_fs_t* open_req) {
-  CHECK(open_req->result, "open_cb");
-
-  fprintf(stderr, "[%d] => opened %s, result: %zd\n", uv_os_getpid(), open_req->path, open_req->result);
-
-  uv_fs_t *read_req = malloc(sizeof(uv_fs_t));
-
-  read_req->data = open_req->data;
-  uv_context_t *context = open_req->data;
-
-  int r = 0;
-  /* 读取文件
-   * 这里有个很神奇的地方：offset这个参数决定了我调用系统层的哪个函数，当我传了-1的时候，通过查看代码发现
-   * 有两种组合，即下面的代码:
-   * if (req->nbufs == 1)
-   *    result = read(req->file, req->bufs[0].base, req->bufs[0].len);
-   *  else
-   *    result = readv(req->file, (struct iovec*) req->bufs, req->nbufs);
-   * 然后nbufs = 1的时候，调用read函数没问题，但是如果调用下面的readv，那么就会报错：EINVAL(-22): invalid argument
-   * 代码调试跟踪并阅读linux关于这个函数的说明并不能找到问题的原因
-   */
-  r = uv_fs_read(uv_default_loop(), read_req, open_req->result, &context->buf, context->buf.len, 0, read_cb);
-  CHECK(r, "open_cb");
+void audit(int64_t offset, size_t len) {
+  char line[128];
+  uv_buf_t buf;
+  int r;
+
+  buf = uv_buf_init(line, snprintf(line, sizeof(line), "[%d] read %s at %lld, %zu bytes\n", uv_os_getpid(),
+                                   filename, (long long) offset, len));
+  r = fs_append_write(&audit_log, NULL, &buf, 1, NULL);
+  if (r < 0) {
+    fprintf(stderr, "[%d] => audit log: [%s: %s]\n", uv_os_getpid(), uv_err_name(r), uv_strerror(r));
+  }
 }
 
-int main() {
-  uv_loop_t *loop = uv_default_loop();
+void chunk_cb(fs_stream_t *stream, int status, const uv_buf_t *chunk, int64_t offset) {
+  if (status < 0) {
+    fprintf(stderr, "[%d] => reading %s at %lld: [%s: %s]\n", uv_os_getpid(), filename,
+            (long long) offset, uv_err_name(status), uv_strerror(status));
+    fs_stream_close(stream, close_cb);
+    return;
+  }
+
+  // 读到文件末尾
+  if (chunk->len == 0) {
+    fs_stream_close(stream, close_cb);
+    return;
+  }
+
+  if (offset == 0) {
+    fprintf(stderr, "[%d] => ", uv_os_getpid());
+  }
+  if (auditing) {
+    audit(offset, chunk->len);
+  }
+  fwrite(chunk->base, 1, chunk->len, stderr);
+}
 
-  uv_fs_t *open_req = malloc(sizeof(uv_fs_t));
+void walk_entry_cb(fs_walk_t *walker, int status, const fs_walk_entry_t *entry) {
+  if (status < 0) {
+    fprintf(stderr, "[%d] => walking %s: [%s: %s]\n", uv_os_getpid(), entry->path, uv_err_name(status),
+            uv_strerror(status));
+    return;
+  }
+  printf("%s%s\n", entry->path, entry->type == UV_DIRENT_DIR ? "/" : "");
+}
 
-  uv_context_t *context = malloc(sizeof(uv_context_t));
+void walk_done_cb(fs_walk_t *walker, int status) {
+  double elapsed = (uv_hrtime() - start_time) / 1e9;
 
-  // 分配一块buf存储读取的数据
-  size_t buf_size = sizeof(char) * 1024;
-  char *buf = malloc(buf_size);
+  fprintf(stderr, "[%d] => %llu entries in %llu dirs, %llu errors, %.3fs (%.0f entries/s), max in flight[%d], "
+                  "max pending[%zu]\n", uv_os_getpid(),
+          (unsigned long long) walker->stats.entries, (unsigned long long) walker->stats.dirs,
+          (unsigned long long) walker->stats.errors, elapsed, walker->stats.entries / elapsed,
+          walker->stats.max_in_flight, walker->stats.max_pending);
+  CHECK(status, "fs_walk");
+}
 
-  // 将上述两块内存的指针赋值给context，以便后面使用
-  context->open_req = open_req;
-  context->buf = uv_buf_init(buf, buf_size);
+int walk(uv_loop_t *loop, int argc, char **argv) {
+  static fs_walk_t walker;
+  fs_walk_options_t options = { 0, 0, 0, NULL, NULL };
+  const char *root = argc > 2 ? argv[2] : ".";
+  const char **include = calloc(argc, sizeof(char *));
+  const char **exclude = calloc(argc, sizeof(char *));
+  int includes = 0, excludes = 0;
+  int i, r;
+
+  if (argc > 3) options.concurrency = atoi(argv[3]);
+  if (argc > 4) options.max_depth = atoi(argv[4]);
+  for (i = 5; i < argc; i++) {
+    if (argv[i][0] == '!') {
+      exclude[excludes++] = argv[i] + 1;
+    } else {
+      include[includes++] = argv[i];
+    }
+  }
+  options.include = includes > 0 ? include : NULL;
+  options.exclude = excludes > 0 ? exclude : NULL;
+
+  start_time = uv_hrtime();
+  r = fs_walk_start(loop, &walker, root, &options, walk_entry_cb, walk_done_cb);
+  CHECK(r, "fs_walk_start");
+  return uv_run(loop, UV_RUN_DEFAULT);
+}
 
-  // 将context挂载到open_req->data中，我们在其回调中可以用到
-  open_req->data = context;
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  size_t chunk_size = 0;
+  int depth = 0;
+  fs_stream_mode_t mode = FS_STREAM_READ;
+
+  if (argc > 1 && strcmp(argv[1], "walk") == 0) {
+    return walk(loop, argc, argv);
+  }
+  if (argc > 1) filename = argv[1];
+  if (argc > 2) chunk_size = (size_t) atol(argv[2]);
+  if (argc > 3) depth = atoi(argv[3]);
+  if (argc > 4) {
+    if (strcmp(argv[4], "mmap") == 0) {
+      mode = FS_STREAM_MMAP_SEQUENTIAL;
+    } else if (strcmp(argv[4], "mmap-random") == 0) {
+      mode = FS_STREAM_MMAP_RANDOM;
+    } else if (strcmp(argv[4], "read") != 0) {
+      fprintf(stderr, "usage: %s [path] [chunk size] [depth] [read|mmap|mmap-random]\n"
+                      "       %s walk [dir] [concurrency] [max depth] [[!]glob...]\n", argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  fs_stream_t stream;
+
+  if (getenv("FS_AUDIT_LOG") != NULL) {
+    fs_append_options_t options = { 10, 0, 0 };
+    int r = fs_append_open(loop, &audit_log, getenv("FS_AUDIT_LOG"), &options);
+    CHECK(r, "fs_append_open");
+    auditing = 1;
+  }
 
   int r = 0;
-  // 首先先打开文件
-  r = uv_fs_open(loop, open_req, filename, O_RDONLY, S_IRUSR, open_cb);
-  CHECK(r, "uv_fs_open");
+  start_time = uv_hrtime();
+  r = fs_stream_open(loop, &stream, filename, chunk_size, depth, mode, chunk_cb);
+  CHECK(r, "fs_stream_open");
+
+  fprintf(stderr, "[%d] => streaming %s, chunk %zu bytes, depth %d\n", uv_os_getpid(), filename,
+          stream.chunk_size, stream.depth);
 
-  uv_run(loop, UV_RUN_DEFAULT);
+  return uv_run(loop, UV_RUN_DEFAULT);
 }
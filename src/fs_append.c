@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "fs_append.h"
+
+static void start_write(fs_append_t *writer);
+static void maybe_sync(fs_append_t *writer);
+static void maybe_finish_close(fs_append_t *writer);
+
+// 按追加的顺序回调已经写完(或者落了盘)的记录，回调里可能接着追加，所以每次都从表头重新取
+static void complete_upto(fs_append_t *writer, uint64_t upto) {
+  fs_append_req_t *req;
+
+  while ((req = writer->reqs_head) != NULL && req->end <= upto) {
+    writer->reqs_head = req->next;
+    if (writer->reqs_head == NULL) {
+      writer->reqs_tail = NULL;
+    }
+    req->cb(req, 0);
+  }
+}
+
+static void release_chunks(fs_append_t *writer, uv_buf_t *chunks, size_t *count) {
+  size_t i;
+  for (i = 0; i < *count; i++) {
+    buf_pool_free(&writer->pool, chunks[i].base);
+  }
+  *count = 0;
+}
+
+// 出错之后缓冲里的数据都丢掉，所有还没回调的记录都以这个错误回调
+static void fail(fs_append_t *writer, int status) {
+  fs_append_req_t *req;
+
+  if (writer->error == 0) {
+    writer->error = status;
+  }
+  release_chunks(writer, writer->staging, &writer->staging_count);
+  if (!writer->writing) {
+    release_chunks(writer, writer->inflight, &writer->inflight_count);
+  }
+
+  while ((req = writer->reqs_head) != NULL) {
+    writer->reqs_head = req->next;
+    if (writer->reqs_head == NULL) {
+      writer->reqs_tail = NULL;
+    }
+    req->cb(req, writer->error);
+  }
+  maybe_finish_close(writer);
+}
+
+static void closed_one(fs_append_t *writer) {
+  if (--writer->pending_closes == 0 && writer->close_cb) {
+    writer->close_cb(writer);
+  }
+}
+
+static void close_handle_cb(uv_handle_t *handle) {
+  closed_one(handle->data);
+}
+
+static void close_file_cb(uv_fs_t *req) {
+  fs_append_t *writer = req->data;
+  uv_fs_req_cleanup(req);
+  closed_one(writer);
+}
+
+// 缓冲写空、最后一次fdatasync回来之后关文件和句柄
+static void maybe_finish_close(fs_append_t *writer) {
+  if (!writer->closing || writer->released || writer->opening || writer->writing || writer->syncing) {
+    return;
+  }
+  if (!writer->error && (writer->staging_count > 0 ||
+                         (writer->options.sync_ms >= 0 && writer->synced < writer->written))) {
+    return;
+  }
+
+  writer->released = 1;
+  free(writer->staging);
+  free(writer->inflight);
+  free(writer->iov);
+  writer->staging = writer->inflight = writer->iov = NULL;
+  buf_pool_trim(&writer->pool);
+
+  // 两个句柄加一个文件，都关完之后才回调close_cb
+  writer->pending_closes = 3;
+  uv_close((uv_handle_t *) &writer->sync_timer, close_handle_cb);
+  uv_close((uv_handle_t *) &writer->flush_handle, close_handle_cb);
+  writer->close_req.data = writer;
+  if (writer->file < 0 || uv_fs_close(writer->loop, &writer->close_req, writer->file, close_file_cb)) {
+    writer->pending_closes--;
+  }
+  writer->file = -1;
+}
+
+static void sync_cb(uv_fs_t *req) {
+  fs_append_t *writer = req->data;
+  int r = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+  writer->syncing = 0;
+  if (r < 0) {
+    fail(writer, r);
+    return;
+  }
+
+  writer->synced = writer->sync_target;
+  writer->stats.syncs++;
+  complete_upto(writer, writer->synced);
+  // fdatasync的时候又写进去了一些，看看是不是马上要再落一次盘
+  maybe_sync(writer);
+  maybe_finish_close(writer);
+}
+
+static void start_sync(fs_append_t *writer) {
+  int r;
+
+  uv_timer_stop(&writer->sync_timer);
+  writer->sync_target = writer->written;
+  writer->sync_req.data = writer;
+  r = uv_fs_fdatasync(writer->loop, &writer->sync_req, writer->file, sync_cb);
+  if (r) {
+    fail(writer, r);
+    return;
+  }
+  writer->syncing = 1;
+}
+
+static void sync_timer_cb(uv_timer_t *handle) {
+  fs_append_t *writer = handle->data;
+  if (!writer->syncing && !writer->error) {
+    start_sync(writer);
+  }
+}
+
+static void maybe_sync(fs_append_t *writer) {
+  uint64_t pending = writer->written - writer->synced;
+
+  if (writer->error) {
+    return;
+  }
+  if (writer->options.sync_ms < 0) {
+    complete_upto(writer, writer->written);
+    return;
+  }
+  if (writer->syncing || pending == 0) {
+    return;
+  }
+
+  if (writer->options.sync_ms == 0 || writer->closing ||
+      (writer->options.sync_bytes > 0 && pending >= writer->options.sync_bytes)) {
+    start_sync(writer);
+    return;
+  }
+
+  // 计时从第一字节没落盘的数据开始，后面的批次不会把它往后推
+  if (!uv_is_active((uv_handle_t *) &writer->sync_timer)) {
+    uv_timer_start(&writer->sync_timer, sync_timer_cb, (uint64_t) writer->options.sync_ms, 0);
+  }
+}
+
+static void write_cb(uv_fs_t *req);
+
+// 发出这一批里还没写的部分，第一次就是整批
+static void issue_write(fs_append_t *writer) {
+  uv_buf_t *bufs = writer->inflight;
+  size_t count = writer->inflight_count;
+  uint64_t skip = writer->inflight_done;
+  size_t i;
+  int r;
+
+  if (skip > 0) {
+    if (writer->iov_cap < count) {
+      writer->iov = realloc(writer->iov, count * sizeof(uv_buf_t));
+      writer->iov_cap = count;
+    }
+    for (i = 0; i < count && skip >= writer->inflight[i].len; i++) {
+      skip -= writer->inflight[i].len;
+    }
+    memcpy(writer->iov, writer->inflight + i, (count - i) * sizeof(uv_buf_t));
+    writer->iov[0].base += skip;
+    writer->iov[0].len -= skip;
+    bufs = writer->iov;
+    count -= i;
+  }
+
+  // 文件是O_APPEND打开的，offset传-1，每次都追加在末尾
+  writer->write_req.data = writer;
+  r = uv_fs_write(writer->loop, &writer->write_req, writer->file, bufs, (unsigned int) count, -1, write_cb);
+  if (r) {
+    release_chunks(writer, writer->inflight, &writer->inflight_count);
+    fail(writer, r);
+    return;
+  }
+  writer->writing = 1;
+}
+
+static void write_cb(uv_fs_t *req) {
+  fs_append_t *writer = req->data;
+  ssize_t result = req->result;
+
+  uv_fs_req_cleanup(req);
+  writer->writing = 0;
+  if (result < 0) {
+    release_chunks(writer, writer->inflight, &writer->inflight_count);
+    fail(writer, (int) result);
+    return;
+  }
+
+  writer->written += result;
+  writer->inflight_done += result;
+  // 磁盘快满的时候可能只写进去一部分
+  if (writer->inflight_done < writer->inflight_bytes) {
+    issue_write(writer);
+    return;
+  }
+
+  release_chunks(writer, writer->inflight, &writer->inflight_count);
+  maybe_sync(writer);
+  // 写的过程中攒下的记录接着作为下一批写
+  start_write(writer);
+  maybe_finish_close(writer);
+}
+
+static void start_write(fs_append_t *writer) {
+  uv_buf_t *chunks;
+  size_t cap;
+
+  if (writer->writing || writer->opening || writer->error || writer->staging_count == 0) {
+    return;
+  }
+
+  // 正在攒的块变成这一批，空的数组拿来接着攒
+  chunks = writer->inflight;
+  cap = writer->inflight_cap;
+  writer->inflight = writer->staging;
+  writer->inflight_cap = writer->staging_cap;
+  writer->inflight_count = writer->staging_count;
+  writer->staging = chunks;
+  writer->staging_cap = cap;
+  writer->staging_count = 0;
+
+  writer->inflight_bytes = writer->staged - writer->written;
+  writer->inflight_done = 0;
+  writer->stats.batches++;
+  if (writer->inflight_bytes > writer->stats.max_batch) {
+    writer->stats.max_batch = writer->inflight_bytes;
+  }
+  issue_write(writer);
+}
+
+// check阶段在所有I/O回调之后，这一轮追加的记录在这里合成一批
+static void flush_cb(uv_check_t *handle) {
+  fs_append_t *writer = handle->data;
+  uv_check_stop(handle);
+  start_write(writer);
+}
+
+static void open_cb(uv_fs_t *req) {
+  fs_append_t *writer = req->data;
+  int r = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+  writer->opening = 0;
+  if (r < 0) {
+    fail(writer, r);
+    return;
+  }
+  writer->file = r;
+  start_write(writer);
+  maybe_finish_close(writer);
+}
+
+int fs_append_open(uv_loop_t *loop, fs_append_t *writer, const char *path, const fs_append_options_t *options) {
+  int r;
+
+  memset(writer, 0, sizeof(*writer));
+  writer->loop = loop;
+  writer->file = -1;
+  if (options) {
+    writer->options = *options;
+  } else {
+    writer->options.sync_ms = -1;
+  }
+  buf_pool_init(&writer->pool, FS_APPEND_CHUNK_SIZE,
+                writer->options.max_bytes ? writer->options.max_bytes : FS_APPEND_DEFAULT_MAX_BYTES);
+
+  uv_timer_init(loop, &writer->sync_timer);
+  writer->sync_timer.data = writer;
+  uv_check_init(loop, &writer->flush_handle);
+  writer->flush_handle.data = writer;
+
+  writer->open_req.data = writer;
+  r = uv_fs_open(loop, &writer->open_req, path, O_WRONLY | O_APPEND | O_CREAT, 0644, open_cb);
+  if (r) {
+    uv_fs_req_cleanup(&writer->open_req);
+    return r;
+  }
+  writer->opening = 1;
+  return 0;
+}
+
+// 最后一块剩下的空间，加上池子还能借出来的块
+static uint64_t available(fs_append_t *writer) {
+  buf_pool_t *pool = &writer->pool;
+  uint64_t room = 0;
+
+  if (writer->staging_count > 0) {
+    room = pool->slab_size - writer->staging[writer->staging_count - 1].len;
+  }
+  room += (uint64_t) pool->free_count * pool->slab_size;
+  if (pool->max_bytes > pool->stats.total_bytes) {
+    room += (pool->max_bytes - pool->stats.total_bytes) / pool->slab_size * pool->slab_size;
+  }
+  return room;
+}
+
+// 这条记录拷到一半内存不够了：新借的块还回去，原来最后一块恢复到拷之前的长度，不能留下半条记录
+static void unstage(fs_append_t *writer, size_t count, size_t last_len) {
+  while (writer->staging_count > count) {
+    buf_pool_free(&writer->pool, writer->staging[--writer->staging_count].base);
+  }
+  if (count > 0) {
+    writer->staging[count - 1].len = last_len;
+  }
+}
+
+int fs_append_write(fs_append_t *writer, fs_append_req_t *req, const uv_buf_t bufs[], unsigned int nbufs,
+                    fs_append_cb cb) {
+  uint64_t total = 0;
+  size_t start_count = writer->staging_count;
+  size_t start_len = start_count ? writer->staging[start_count - 1].len : 0;
+  unsigned int i;
+
+  if (writer->error) {
+    return writer->error;
+  }
+  if (writer->closing) {
+    return UV_EPIPE;
+  }
+
+  for (i = 0; i < nbufs; i++) {
+    total += bufs[i].len;
+  }
+  // 先确认放得下，不会拷了一半才发现缓冲满了
+  if (total > available(writer)) {
+    writer->stats.full++;
+    return UV_ENOBUFS;
+  }
+
+  for (i = 0; i < nbufs; i++) {
+    const char *p = bufs[i].base;
+    size_t left = bufs[i].len;
+
+    while (left > 0) {
+      uv_buf_t *chunk = writer->staging_count ? &writer->staging[writer->staging_count - 1] : NULL;
+      size_t n;
+
+      if (chunk == NULL || chunk->len == writer->pool.slab_size) {
+        if (writer->staging_count == writer->staging_cap) {
+          size_t cap = writer->staging_cap ? writer->staging_cap * 2 : 16;
+          uv_buf_t *staging = realloc(writer->staging, cap * sizeof(uv_buf_t));
+          if (staging == NULL) {
+            unstage(writer, start_count, start_len);
+            return UV_ENOMEM;
+          }
+          writer->staging = staging;
+          writer->staging_cap = cap;
+        }
+        // len记的是块里已经用了多少
+        chunk = &writer->staging[writer->staging_count];
+        *chunk = buf_pool_alloc(&writer->pool);
+        if (chunk->base == NULL) {
+          unstage(writer, start_count, start_len);
+          return UV_ENOMEM;
+        }
+        writer->staging_count++;
+        chunk->len = 0;
+      }
+
+      n = writer->pool.slab_size - chunk->len;
+      if (n > left) {
+        n = left;
+      }
+      memcpy(chunk->base + chunk->len, p, n);
+      chunk->len += n;
+      p += n;
+      left -= n;
+    }
+  }
+
+  writer->staged += total;
+  writer->stats.records++;
+
+  if (cb != NULL) {
+    req->writer = writer;
+    req->cb = cb;
+    req->end = writer->staged;
+    req->next = NULL;
+    if (writer->reqs_tail) {
+      writer->reqs_tail->next = req;
+    } else {
+      writer->reqs_head = req;
+    }
+    writer->reqs_tail = req;
+  }
+
+  // 写请求在途的时候，write_cb里会接着写
+  if (!writer->writing) {
+    uv_check_start(&writer->flush_handle, flush_cb);
+  }
+  return 0;
+}
+
+void fs_append_close(fs_append_t *writer, fs_append_close_cb close_cb) {
+  if (writer->closing) {
+    return;
+  }
+  writer->closing = 1;
+  writer->close_cb = close_cb;
+
+  uv_check_stop(&writer->flush_handle);
+  start_write(writer);
+  maybe_sync(writer);
+  maybe_finish_close(writer);
+}
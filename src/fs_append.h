@@ -0,0 +1,105 @@
+/*
+ * 只追加的异步写文件(审计日志之类)
+ * 每条记录一个uv_fs_write的话，小记录的大部分时间都花在线程池往返和系统调用上，需要落盘的时候每条再来一次fdatasync更慢。
+ * 这里把很多调用方的记录攒起来一起写：
+ * 1、fs_append_write把记录拷进一串固定大小的块(buf_pool)，块的总量有上限，放不下时返回UV_ENOBUFS，
+ *    调用方可以等自己前面的记录回调(说明那一批写完、块已经还回去了)之后再试
+ * 2、同一轮事件循环里追加的记录在check阶段合成一次向量写(uv_fs_write，多个uv_buf_t)，
+ *    同时只有一个写请求在途，写的过程中追加的记录等这次写完之后作为下一批一起写
+ * 3、group commit：sync_ms < 0时不fdatasync，写进页缓存就回调；sync_ms == 0时每批写完马上fdatasync；
+ *    sync_ms > 0时最多等sync_ms毫秒，或者没落盘的数据超过sync_bytes(为0表示不看字节数)就fdatasync。
+ *    fdatasync在途的时候后面的批次照常写，等下一次fdatasync一起落盘
+ * 4、每条记录的回调在它所在的那一批写完(需要落盘时是落盘)之后按追加的顺序一起调用
+ * 出错之后所有还没回调的记录都以这个错误回调，之后的fs_append_write也直接返回这个错误。
+ */
+#ifndef LIBUV_DEMO_FS_APPEND_H
+#define LIBUV_DEMO_FS_APPEND_H
+
+#include <stdint.h>
+#include "uv.h"
+#include "common.h"
+
+#define FS_APPEND_CHUNK_SIZE (64 * 1024)
+#define FS_APPEND_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+typedef struct fs_append_s fs_append_t;
+typedef struct fs_append_req_s fs_append_req_t;
+
+typedef void (*fs_append_cb)(fs_append_req_t *req, int status);
+typedef void (*fs_append_close_cb)(fs_append_t *writer);
+
+struct fs_append_req_s {
+  void *data;
+  fs_append_t *writer;
+  fs_append_cb cb;
+  uint64_t end;               // 这条记录写完之后文件里追加了多少字节
+  fs_append_req_t *next;
+};
+
+typedef struct {
+  int64_t sync_ms;            // <0不落盘，0每批落盘，>0最多等这么久
+  uint64_t sync_bytes;        // 没落盘的数据超过这么多就提前落盘，0表示不看字节数
+  size_t max_bytes;           // 缓冲的上限，0表示FS_APPEND_DEFAULT_MAX_BYTES
+} fs_append_options_t;
+
+typedef struct {
+  uint64_t records;
+  uint64_t batches;           // uv_fs_write的次数
+  uint64_t syncs;             // fdatasync的次数
+  uint64_t full;              // 缓冲满了返回UV_ENOBUFS的次数
+  uint64_t max_batch;         // 一批最多写了多少字节
+} fs_append_stats_t;
+
+struct fs_append_s {
+  void *data;
+  uv_loop_t *loop;
+  uv_file file;
+  fs_append_options_t options;
+  buf_pool_t pool;
+  // 正在攒的块，和正在写的块，写完之后两个数组交换
+  uv_buf_t *staging;
+  size_t staging_count;
+  size_t staging_cap;
+  uv_buf_t *inflight;
+  size_t inflight_count;
+  size_t inflight_cap;
+  uv_buf_t *iov;              // 短写之后剩下的部分
+  size_t iov_cap;
+  uint64_t inflight_bytes;
+  uint64_t inflight_done;
+  // 逻辑上追加过、写进文件、落了盘的字节数
+  uint64_t staged;
+  uint64_t written;
+  uint64_t synced;
+  uint64_t sync_target;
+  fs_append_req_t *reqs_head; // 还没回调的记录，按追加的顺序
+  fs_append_req_t *reqs_tail;
+  int opening;
+  int writing;
+  int syncing;
+  int closing;
+  int released;               // 已经开始关文件和句柄
+  int pending_closes;
+  int error;
+  uv_fs_t open_req;
+  uv_fs_t write_req;
+  uv_fs_t sync_req;
+  uv_fs_t close_req;
+  uv_timer_t sync_timer;
+  uv_check_t flush_handle;
+  fs_append_close_cb close_cb;
+  fs_append_stats_t stats;
+};
+
+// 以O_APPEND打开(没有就创建)path，打开完成之前追加的记录先放在缓冲里
+int fs_append_open(uv_loop_t *loop, fs_append_t *writer, const char *path, const fs_append_options_t *options);
+
+// 把bufs拷进缓冲，req在回调之前不能释放；cb为NULL时req也可以为NULL
+// 内存不够时返回UV_ENOMEM，这条记录一个字节都不会留在缓冲里，writer也还能接着用
+int fs_append_write(fs_append_t *writer, fs_append_req_t *req, const uv_buf_t bufs[], unsigned int nbufs,
+                    fs_append_cb cb);
+
+// 写完(需要落盘时落完盘)缓冲里所有的记录之后关闭文件，最后回调close_cb
+void fs_append_close(fs_append_t *writer, fs_append_close_cb close_cb);
+
+#endif //LIBUV_DEMO_FS_APPEND_H
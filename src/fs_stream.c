@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fs_stream.h"
+
+static void issue_reads(fs_stream_t *stream);
+
+static void fail(fs_stream_t *stream, int status, int64_t offset) {
+  uv_buf_t empty = uv_buf_init(NULL, 0);
+  stream->finished = 1;
+  stream->chunk_cb(stream, status, &empty, offset);
+}
+
+static void finish_close(fs_stream_t *stream) {
+  int i;
+
+  for (i = 0; i < stream->depth; i++) {
+    if (stream->slots[i].ready) {
+      uv_fs_req_cleanup(&stream->slots[i].req);
+    }
+  }
+  // 所有槽位的缓冲是一次分配的，挂在第0个槽位上
+  free(stream->slots[0].buf.base);
+  free(stream->slots);
+  stream->slots = NULL;
+  uv_fs_req_cleanup(&stream->open_req);
+
+  if (stream->map != NULL) {
+    munmap(stream->map, stream->map_size);
+    stream->map = NULL;
+  }
+
+  if (stream->close_cb) {
+    stream->close_cb(stream);
+  }
+}
+
+static void close_file_cb(uv_fs_t *req) {
+  fs_stream_t *stream = req->data;
+  uv_fs_req_cleanup(req);
+  finish_close(stream);
+}
+
+// 线程池里的请求还会往槽位的缓冲里写，全部回来之后才能关文件、释放内存
+static void maybe_finish_close(fs_stream_t *stream) {
+  int r;
+
+  if (!stream->closing || stream->in_flight > 0 || stream->released) {
+    return;
+  }
+  stream->released = 1;
+
+  if (stream->file < 0) {
+    finish_close(stream);
+    return;
+  }
+
+  stream->close_req.data = stream;
+  r = uv_fs_close(stream->loop, &stream->close_req, stream->file, close_file_cb);
+  stream->file = -1;
+  if (r) {
+    finish_close(stream);
+  }
+}
+
+// 按文件顺序把已经读好的块交给使用方，直到遇到一个还没读完的槽位
+static void deliver(fs_stream_t *stream) {
+  fs_stream_slot_t *slot;
+  ssize_t result;
+  uv_buf_t chunk;
+
+  while (!stream->finished && !stream->closing) {
+    slot = &stream->slots[stream->deliver_chunk % stream->depth];
+    if (!slot->ready) {
+      break;
+    }
+
+    slot->ready = 0;
+    result = slot->req.result;
+    uv_fs_req_cleanup(&slot->req);
+    stream->deliver_chunk++;
+
+    if (result < 0) {
+      fail(stream, (int) result, slot->offset);
+      return;
+    }
+
+    // 顺序读的时候请求不带offset，位置就是已经交出去的字节数
+    if (stream->sequential) {
+      slot->offset = (int64_t) stream->bytes;
+    }
+
+    if (result > 0) {
+      chunk = uv_buf_init(slot->buf.base, (unsigned int) result);
+      stream->bytes += result;
+      stream->chunk_cb(stream, 0, &chunk, slot->offset);
+    }
+
+    // 普通文件只有到末尾才会短读，后面已经发出去的请求结果都不要了；管道只有读到0才是末尾
+    if ((result == 0 || (!stream->sequential && (size_t) result < stream->chunk_size)) && !stream->closing) {
+      chunk = uv_buf_init(NULL, 0);
+      stream->finished = 1;
+      stream->chunk_cb(stream, 0, &chunk, slot->offset + result);
+      return;
+    }
+  }
+
+  issue_reads(stream);
+}
+
+static void read_cb(uv_fs_t *req) {
+  fs_stream_slot_t *slot = req->data;
+  fs_stream_t *stream = slot->stream;
+
+  slot->reading = 0;
+  stream->in_flight--;
+
+  if (stream->finished || stream->closing) {
+    uv_fs_req_cleanup(req);
+    maybe_finish_close(stream);
+    return;
+  }
+
+  slot->ready = 1;
+  deliver(stream);
+}
+
+// 槽位都占满之前一直往后发读请求，第k块用第k % depth个槽位
+static void issue_reads(fs_stream_t *stream) {
+  fs_stream_slot_t *slot;
+  int r;
+
+  int depth = stream->sequential ? 1 : stream->depth;
+
+  while (!stream->finished && !stream->closing &&
+         stream->next_chunk - stream->deliver_chunk < depth) {
+    slot = &stream->slots[stream->next_chunk % stream->depth];
+    slot->offset = stream->next_chunk * (int64_t) stream->chunk_size;
+    slot->req.data = slot;
+
+    // offset传-1的时候libuv用read/readv从文件当前位置读；这里每个请求都带上明确的offset，
+    // 走pread，并发的请求之间才不会互相挪动文件位置。管道没有位置可言，只能传-1
+    r = uv_fs_read(stream->loop, &slot->req, stream->file, &slot->buf, 1,
+                   stream->sequential ? -1 : slot->offset, read_cb);
+    if (r) {
+      fail(stream, r, slot->offset);
+      return;
+    }
+
+    slot->reading = 1;
+    stream->in_flight++;
+    stream->next_chunk++;
+  }
+}
+
+// 每轮idle交出depth块映射里的视图，期间其他句柄的事件照常处理
+static void map_idle_cb(uv_idle_t *handle) {
+  fs_stream_t *stream = handle->data;
+  size_t len, ahead;
+  uv_buf_t chunk;
+  int i;
+
+  for (i = 0; i < stream->depth && !stream->closing; i++) {
+    if (stream->map_offset >= stream->map_size) {
+      uv_idle_stop(handle);
+      chunk = uv_buf_init(NULL, 0);
+      stream->finished = 1;
+      stream->chunk_cb(stream, 0, &chunk, (int64_t) stream->map_size);
+      return;
+    }
+
+    len = stream->map_size - stream->map_offset;
+    if (len > stream->chunk_size) {
+      len = stream->chunk_size;
+    }
+
+    // 让内核提前把后面depth块读进页缓存，轮到它们的时候尽量不用在loop线程上等磁盘
+    ahead = stream->map_offset + len;
+    if (ahead < stream->map_size && stream->mode == FS_STREAM_MMAP_SEQUENTIAL) {
+      size_t window = stream->chunk_size * stream->depth;
+      if (window > stream->map_size - ahead) {
+        window = stream->map_size - ahead;
+      }
+      madvise(stream->map + ahead, window, MADV_WILLNEED);
+    }
+
+    chunk = uv_buf_init(stream->map + stream->map_offset, (unsigned int) len);
+    stream->bytes += len;
+    stream->chunk_cb(stream, 0, &chunk, (int64_t) stream->map_offset);
+
+    // 交出去的视图回调之后就失效了，解除映射的页，页缓存还在，只是不再算进常驻内存
+    madvise(stream->map + stream->map_offset, len, MADV_DONTNEED);
+    stream->map_offset += len;
+  }
+}
+
+static int map_file(fs_stream_t *stream, size_t size) {
+  long page = sysconf(_SC_PAGESIZE);
+  char *map;
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, stream->file, 0);
+  if (map == MAP_FAILED) {
+    return uv_translate_sys_error(errno);
+  }
+  madvise(map, size, stream->mode == FS_STREAM_MMAP_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+  // 交出去的视图都从页边界开始
+  if (page > 0 && stream->chunk_size % page) {
+    stream->chunk_size += page - stream->chunk_size % page;
+  }
+
+  stream->map = map;
+  stream->map_size = size;
+  stream->mapped = 1;
+  uv_idle_init(stream->loop, &stream->idle);
+  stream->idle.data = stream;
+  uv_idle_start(&stream->idle, map_idle_cb);
+  return 0;
+}
+
+static void fstat_cb(uv_fs_t *req) {
+  fs_stream_t *stream = req->data;
+  uv_stat_t *st = &req->statbuf;
+
+  stream->in_flight--;
+  if (stream->closing) {
+    uv_fs_req_cleanup(req);
+    maybe_finish_close(stream);
+    return;
+  }
+
+  if (req->result == 0 && !S_ISREG(st->st_mode) && !S_ISBLK(st->st_mode)) {
+    stream->sequential = 1;
+  }
+
+  // 管道、设备和/proc这类大小报0的文件没法按大小映射，退回到读的方式
+  if (stream->mode != FS_STREAM_READ && req->result == 0 && S_ISREG(st->st_mode) &&
+      st->st_size > 0 && (uint64_t) st->st_size <= SIZE_MAX) {
+    map_file(stream, (size_t) st->st_size);
+  }
+  uv_fs_req_cleanup(req);
+
+  if (!stream->mapped) {
+    issue_reads(stream);
+  }
+}
+
+static void idle_close_cb(uv_handle_t *handle) {
+  fs_stream_t *stream = handle->data;
+  stream->in_flight--;
+  maybe_finish_close(stream);
+}
+
+static void open_cb(uv_fs_t *req) {
+  fs_stream_t *stream = req->data;
+  stream->in_flight--;
+
+  if (req->result < 0) {
+    if (stream->closing) {
+      maybe_finish_close(stream);
+    } else {
+      fail(stream, (int) req->result, 0);
+    }
+    return;
+  }
+
+  stream->file = (uv_file) req->result;
+  if (stream->closing) {
+    maybe_finish_close(stream);
+    return;
+  }
+
+  // 先看看是什么文件：能不能pread、能不能mmap
+  stream->stat_req.data = stream;
+  if (uv_fs_fstat(stream->loop, &stream->stat_req, stream->file, fstat_cb) == 0) {
+    stream->in_flight++;
+    return;
+  }
+  issue_reads(stream);
+}
+
+int fs_stream_open(uv_loop_t *loop, fs_stream_t *stream, const char *path,
+                   size_t chunk_size, int depth, fs_stream_mode_t mode, fs_stream_chunk_cb chunk_cb) {
+  char *buffers;
+  int i, r;
+
+  memset(stream, 0, sizeof(*stream));
+  stream->loop = loop;
+  stream->file = -1;
+  stream->chunk_size = chunk_size ? chunk_size : FS_STREAM_DEFAULT_CHUNK_SIZE;
+  stream->depth = depth > 0 ? depth : FS_STREAM_DEFAULT_DEPTH;
+  stream->mode = mode;
+  stream->chunk_cb = chunk_cb;
+
+  stream->slots = calloc(stream->depth, sizeof(fs_stream_slot_t));
+  buffers = malloc(stream->chunk_size * stream->depth);
+  if (stream->slots == NULL || buffers == NULL) {
+    free(stream->slots);
+    free(buffers);
+    return UV_ENOMEM;
+  }
+  for (i = 0; i < stream->depth; i++) {
+    stream->slots[i].stream = stream;
+    stream->slots[i].buf = uv_buf_init(buffers + i * stream->chunk_size, (unsigned int) stream->chunk_size);
+  }
+
+  // 打开请求在途的时候也算一个in_flight，这时候close要等它回来
+  stream->open_req.data = stream;
+  stream->in_flight = 1;
+  r = uv_fs_open(loop, &stream->open_req, path, O_RDONLY, 0, open_cb);
+  if (r) {
+    uv_fs_req_cleanup(&stream->open_req);
+    free(buffers);
+    free(stream->slots);
+    stream->slots = NULL;
+  }
+  return r;
+}
+
+void fs_stream_close(fs_stream_t *stream, fs_stream_close_cb close_cb) {
+  int i;
+
+  if (stream->closing) {
+    return;
+  }
+  stream->closing = 1;
+  stream->close_cb = close_cb;
+
+  // 还在排队的读请求直接取消，已经在线程里跑的取消不了，只能等它回来
+  for (i = 0; i < stream->depth; i++) {
+    if (stream->slots[i].reading) {
+      uv_cancel((uv_req_t *) &stream->slots[i].req);
+    }
+  }
+  if (stream->mapped) {
+    stream->in_flight++;
+    uv_close((uv_handle_t *) &stream->idle, idle_close_cb);
+  }
+  maybe_finish_close(stream);
+}
@@ -0,0 +1,87 @@
+/*
+ * 大文件的流式读取
+ * 一次uv_fs_read只读一块、读完再发下一个，线程池里永远只有一个请求在跑，磁盘大部分时间都在等。
+ * 这里同时保持depth个uv_fs_read在线程池里，各自读文件里连续的下一块(offset递增)：
+ * 1、第k块固定用第k % depth个槽位(请求+缓冲)，槽位只有在它上一块交给使用方之后才会被重新发出
+ * 2、读请求完成的顺序是乱的，先完成的块在槽位里等着，按文件顺序依次回调chunk_cb
+ * 3、遇到第一次短读(读到的字节数小于chunk_size)就认为到了文件末尾，之后已经发出去的请求结果都丢弃，
+ *    所以正在增长的日志文件也不会读出中间缺一段的数据
+ * 4、管道、字符设备这类不能pread的文件同一时间只有一个请求，不带offset顺序读，短读很正常，读到0字节才算末尾
+ * chunk_cb里拿到的数据只在回调期间有效，回调返回之后这块缓冲就会被用来读后面的数据。
+ *
+ * 读多写少的普通文件还可以用mmap模式，省掉线程池往返和从页缓存到用户缓冲的那次拷贝：
+ * 1、打开之后先fstat，只有普通文件并且大小不为0才mmap，管道、字符设备、/proc下大小为0的文件以及mmap失败时退回到读的方式
+ * 2、整个文件按fstat时的大小映射，用madvise给出顺序(MADV_SEQUENTIAL)或者随机(MADV_RANDOM)访问的提示
+ * 3、每轮idle回调交出depth块，直接是映射里按页对齐的一段，不拷贝；同时对后面depth块做MADV_WILLNEED让内核提前读，
+ *    交出去的块再MADV_DONTNEED，几个G的文件也不会把常驻内存撑大
+ * 缺页是在loop线程上同步发生的，冷缓存下一次缺页可能要等磁盘，所以对延迟敏感的loop还是用读的方式更稳；
+ * 映射期间文件被截短的话访问会收到SIGBUS，只适合读的时候不会被别人截短的文件。
+ */
+#ifndef LIBUV_DEMO_FS_STREAM_H
+#define LIBUV_DEMO_FS_STREAM_H
+
+#include <stdint.h>
+#include "uv.h"
+
+#define FS_STREAM_DEFAULT_CHUNK_SIZE (256 * 1024)
+#define FS_STREAM_DEFAULT_DEPTH 4
+
+typedef enum {
+  FS_STREAM_READ,             // 线程池里的uv_fs_read
+  FS_STREAM_MMAP_SEQUENTIAL,  // mmap + MADV_SEQUENTIAL
+  FS_STREAM_MMAP_RANDOM       // mmap + MADV_RANDOM，关掉内核预读
+} fs_stream_mode_t;
+
+typedef struct fs_stream_s fs_stream_t;
+
+// 按文件顺序回调每一块数据，offset是这块数据在文件里的位置。
+// status < 0表示打开或者读取出错，chunk->len == 0表示读到了文件末尾，这两种回调之后不会再有数据
+typedef void (*fs_stream_chunk_cb)(fs_stream_t *stream, int status, const uv_buf_t *chunk, int64_t offset);
+typedef void (*fs_stream_close_cb)(fs_stream_t *stream);
+
+typedef struct {
+  uv_fs_t req;
+  fs_stream_t *stream;
+  uv_buf_t buf;
+  int64_t offset;
+  int reading;  // 请求还在线程池里
+  int ready;    // 读完了，等着按顺序交给使用方
+} fs_stream_slot_t;
+
+struct fs_stream_s {
+  void *data;
+  uv_loop_t *loop;
+  uv_file file;
+  size_t chunk_size;
+  int depth;
+  fs_stream_slot_t *slots;
+  int64_t next_chunk;     // 下一个要发出读请求的块号
+  int64_t deliver_chunk;  // 下一个要交给使用方的块号
+  int in_flight;          // 还在线程池里的读请求
+  int finished;           // 已经回调过末尾或者错误
+  int closing;
+  int released;           // 收尾已经开始，文件正在关闭或者已经关掉
+  uint64_t bytes;         // 已经交给使用方的字节数
+  fs_stream_mode_t mode;
+  int mapped;             // 实际用的是mmap，为0时可能是退回到了读的方式
+  int sequential;         // 不能pread的文件，一次一个请求顺序读
+  char *map;
+  size_t map_size;
+  size_t map_offset;      // 下一块在映射里的位置
+  uv_idle_t idle;
+  uv_fs_t open_req;
+  uv_fs_t stat_req;
+  uv_fs_t close_req;
+  fs_stream_chunk_cb chunk_cb;
+  fs_stream_close_cb close_cb;
+};
+
+// 打开path并开始读，chunk_size为0或者depth<=0时用默认值，mmap模式下chunk_size会向上对齐到页大小。
+// 返回值只表示uv_fs_open有没有发出去，打开失败会通过chunk_cb的status告诉使用方
+int fs_stream_open(uv_loop_t *loop, fs_stream_t *stream, const char *path,
+                   size_t chunk_size, int depth, fs_stream_mode_t mode, fs_stream_chunk_cb chunk_cb);
+
+// 读完、出错或者中途不想读了都要调用，等线程池里的请求都回来之后关闭文件、释放缓冲，最后回调close_cb
+void fs_stream_close(fs_stream_t *stream, fs_stream_close_cb close_cb);
+
+#endif //LIBUV_DEMO_FS_STREAM_H
@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include "fs_walk.h"
+
+static void pump(fs_walk_t *walker);
+
+static void fail(fs_walk_t *walker, int status) {
+  if (walker->error == 0) {
+    walker->error = status;
+  }
+  walker->stopping = 1;
+}
+
+static int descend(fs_walk_t *walker, int depth) {
+  return walker->options.max_depth <= 0 || depth < walker->options.max_depth;
+}
+
+static int match_any(fs_walk_t *walker, const char **patterns, const char *path, const char *name) {
+  const char *relative = path + walker->root_len;
+
+  if (*relative == '/') {
+    relative++;
+  }
+  for (; *patterns != NULL; patterns++) {
+    if (strchr(*patterns, '/') != NULL ? fnmatch(*patterns, relative, FNM_PATHNAME) == 0
+                                       : fnmatch(*patterns, name, 0) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uv_dirent_type_t type_from_mode(uint64_t mode) {
+  if (S_ISREG(mode)) return UV_DIRENT_FILE;
+  if (S_ISDIR(mode)) return UV_DIRENT_DIR;
+  if (S_ISLNK(mode)) return UV_DIRENT_LINK;
+  if (S_ISFIFO(mode)) return UV_DIRENT_FIFO;
+  if (S_ISSOCK(mode)) return UV_DIRENT_SOCKET;
+  if (S_ISCHR(mode)) return UV_DIRENT_CHAR;
+  if (S_ISBLK(mode)) return UV_DIRENT_BLOCK;
+  return UV_DIRENT_UNKNOWN;
+}
+
+static void emit(fs_walk_t *walker, int status, const char *path, const char *name, uv_dirent_type_t type,
+                 int depth, const uv_stat_t *st) {
+  fs_walk_entry_t entry = { path, name, type, depth, st };
+
+  // 停了之后回来的请求不再回调
+  if (walker->stopping) {
+    return;
+  }
+
+  if (status < 0) {
+    walker->stats.errors++;
+  } else {
+    walker->stats.entries++;
+  }
+  walker->entry_cb(walker, status, &entry);
+}
+
+static int push_dir(fs_walk_t *walker, const char *path, size_t len, int depth) {
+  fs_walk_dir_t *dir = malloc(sizeof(fs_walk_dir_t) + len);
+  if (dir == NULL) {
+    return UV_ENOMEM;
+  }
+
+  memset(dir, 0, sizeof(*dir));
+  dir->walker = walker;
+  dir->depth = depth;
+  dir->path_len = len;
+  memcpy(dir->path, path, len);
+  dir->path[len] = '\0';
+
+  dir->next = walker->pending;
+  walker->pending = dir;
+  if (++walker->pending_count > walker->stats.max_pending) {
+    walker->stats.max_pending = walker->pending_count;
+  }
+  return 0;
+}
+
+static void dir_error(fs_walk_t *walker, int status, fs_walk_dir_t *dir) {
+  const char *slash = strrchr(dir->path, '/');
+  emit(walker, status, dir->path, slash != NULL && slash[1] != '\0' ? slash + 1 : dir->path, UV_DIRENT_DIR,
+       dir->depth, NULL);
+}
+
+static void count_request(fs_walk_t *walker) {
+  if (++walker->in_flight > walker->stats.max_in_flight) {
+    walker->stats.max_in_flight = walker->in_flight;
+  }
+}
+
+static void scandir_cb(uv_fs_t *req) {
+  fs_walk_dir_t *dir = (fs_walk_dir_t *) req;
+  fs_walk_t *walker = dir->walker;
+
+  walker->in_flight--;
+  if (req->result < 0) {
+    dir_error(walker, (int) req->result, dir);
+    uv_fs_req_cleanup(req);
+    free(dir);
+  } else if (walker->open_tail != NULL) {
+    walker->open_tail->next = dir;
+    walker->open_tail = dir;
+  } else {
+    walker->open_head = walker->open_tail = dir;
+  }
+  pump(walker);
+}
+
+static void start_scandir(fs_walk_t *walker) {
+  fs_walk_dir_t *dir = walker->pending;
+  int r;
+
+  walker->pending = dir->next;
+  walker->pending_count--;
+  dir->next = NULL;
+
+  r = uv_fs_scandir(walker->loop, &dir->req, dir->path, 0, scandir_cb);
+  if (r) {
+    dir_error(walker, r, dir);
+    uv_fs_req_cleanup(&dir->req);
+    free(dir);
+    return;
+  }
+  walker->stats.dirs++;
+  count_request(walker);
+}
+
+static void stat_cb(uv_fs_t *req) {
+  fs_walk_stat_t *slot = (fs_walk_stat_t *) req;
+  fs_walk_t *walker = slot->walker;
+  uv_stat_t st = req->statbuf;
+  uv_dirent_type_t type = slot->type;
+  int status = (int) req->result;
+  int r;
+
+  uv_fs_req_cleanup(req);
+  walker->in_flight--;
+
+  if (status < 0) {
+    emit(walker, status, slot->path, slot->path + slot->name_offset, type, slot->depth, NULL);
+  } else {
+    if (type == UV_DIRENT_UNKNOWN) {
+      type = type_from_mode(st.st_mode);
+    }
+    if (slot->report) {
+      emit(walker, 0, slot->path, slot->path + slot->name_offset, type, slot->depth,
+           walker->options.stat ? &st : NULL);
+    }
+    if (type == UV_DIRENT_DIR && descend(walker, slot->depth) && !walker->stopping) {
+      r = push_dir(walker, slot->path, strlen(slot->path), slot->depth);
+      if (r) {
+        fail(walker, r);
+      }
+    }
+  }
+
+  free(slot->path);
+  slot->path = NULL;
+  slot->next_free = walker->free_slots;
+  walker->free_slots = slot;
+  pump(walker);
+}
+
+static int start_stat(fs_walk_t *walker, size_t len, size_t name_offset, uv_dirent_type_t type, int depth,
+                      int report) {
+  fs_walk_stat_t *slot = walker->free_slots;
+  int r;
+
+  slot->path = malloc(len + 1);
+  if (slot->path == NULL) {
+    return UV_ENOMEM;
+  }
+  memcpy(slot->path, walker->scratch, len + 1);
+  slot->name_offset = name_offset;
+  slot->type = type;
+  slot->depth = depth;
+  slot->report = report;
+
+  r = uv_fs_lstat(walker->loop, &slot->req, slot->path, stat_cb);
+  if (r) {
+    free(slot->path);
+    slot->path = NULL;
+    return r;
+  }
+  walker->free_slots = slot->next_free;
+  walker->stats.stats++;
+  count_request(walker);
+  return 0;
+}
+
+// 处理目录里取出来的一项，需要lstat但是线程池里已经有concurrency个请求时返回UV_EBUSY，这一项留着下次再处理
+static int visit(fs_walk_t *walker, fs_walk_dir_t *dir) {
+  const uv_dirent_t *ent = &dir->ent;
+  size_t name_len = strlen(ent->name);
+  size_t sep = dir->path[dir->path_len - 1] != '/';
+  size_t len = dir->path_len + sep + name_len;
+  int depth = dir->depth + 1;
+  const char *path = walker->scratch;
+  const char *name = walker->scratch + dir->path_len + sep;
+  int report;
+
+  if (len >= sizeof(walker->scratch)) {
+    emit(walker, UV_ENAMETOOLONG, dir->path, ent->name, ent->type, depth, NULL);
+    return 0;
+  }
+  memcpy(walker->scratch, dir->path, dir->path_len);
+  walker->scratch[dir->path_len] = '/';
+  memcpy(walker->scratch + dir->path_len + sep, ent->name, name_len + 1);
+
+  if (walker->options.exclude != NULL && match_any(walker, walker->options.exclude, path, name)) {
+    return 0;
+  }
+  report = walker->options.include == NULL || match_any(walker, walker->options.include, path, name);
+
+  // 文件系统没给出类型的时候要lstat才知道是不是目录
+  if ((report && walker->options.stat) || (ent->type == UV_DIRENT_UNKNOWN && descend(walker, depth))) {
+    if (walker->in_flight >= walker->options.concurrency) {
+      return UV_EBUSY;
+    }
+    return start_stat(walker, len, name - path, ent->type, depth, report);
+  }
+
+  if (report) {
+    emit(walker, 0, path, name, ent->type, depth, NULL);
+  }
+  if (ent->type == UV_DIRENT_DIR && descend(walker, depth) && !walker->stopping) {
+    return push_dir(walker, path, len, depth);
+  }
+  return 0;
+}
+
+static void free_dirs(fs_walk_dir_t *dir, int scanned) {
+  while (dir != NULL) {
+    fs_walk_dir_t *next = dir->next;
+    if (scanned) {
+      uv_fs_req_cleanup(&dir->req);
+    }
+    free(dir);
+    dir = next;
+  }
+}
+
+static void idle_close_cb(uv_handle_t *handle) {
+  fs_walk_t *walker = handle->data;
+  if (walker->done_cb) {
+    walker->done_cb(walker, walker->error);
+  }
+}
+
+// 线程池里的请求都回来了，并且没有剩下要做的(或者已经停了)才收尾
+static void maybe_finish(fs_walk_t *walker) {
+  if (walker->released || walker->in_flight > 0) {
+    return;
+  }
+  if (!walker->stopping && (walker->pending != NULL || walker->open_head != NULL)) {
+    return;
+  }
+  walker->released = 1;
+
+  free_dirs(walker->pending, 0);
+  free_dirs(walker->open_head, 1);
+  walker->pending = walker->open_head = walker->open_tail = NULL;
+  free(walker->stat_slots);
+  walker->stat_slots = walker->free_slots = NULL;
+  uv_close((uv_handle_t *) &walker->idle, idle_close_cb);
+}
+
+static void idle_cb(uv_idle_t *handle) {
+  uv_idle_stop(handle);
+  pump(handle->data);
+}
+
+// 有空位先发scandir，再从扫描完的目录里取目录项，直到没有空位、没有事情做或者这一轮的预算用完
+static void pump(fs_walk_t *walker) {
+  int budget = FS_WALK_BUDGET;
+  fs_walk_dir_t *dir;
+  int r;
+
+  while (!walker->stopping) {
+    if (walker->pending != NULL && walker->in_flight < walker->options.concurrency) {
+      start_scandir(walker);
+      continue;
+    }
+
+    dir = walker->open_head;
+    if (dir == NULL) {
+      break;
+    }
+    if (budget-- == 0) {
+      uv_idle_start(&walker->idle, idle_cb);
+      return;
+    }
+
+    if (!dir->held) {
+      // 取下一项的时候libuv会释放上一项的名字，所以留着等lstat的项不能往后取
+      if (uv_fs_scandir_next(&dir->req, &dir->ent) == UV_EOF) {
+        walker->open_head = dir->next;
+        if (walker->open_head == NULL) {
+          walker->open_tail = NULL;
+        }
+        uv_fs_req_cleanup(&dir->req);
+        free(dir);
+        continue;
+      }
+      dir->held = 1;
+    }
+
+    r = visit(walker, dir);
+    if (r == UV_EBUSY) {
+      break;
+    }
+    dir->held = 0;
+    if (r) {
+      fail(walker, r);
+    }
+  }
+  maybe_finish(walker);
+}
+
+int fs_walk_start(uv_loop_t *loop, fs_walk_t *walker, const char *root, const fs_walk_options_t *options,
+                  fs_walk_entry_cb entry_cb, fs_walk_done_cb done_cb) {
+  size_t len = strlen(root);
+  int i, r;
+
+  memset(walker, 0, sizeof(*walker));
+  walker->loop = loop;
+  walker->entry_cb = entry_cb;
+  walker->done_cb = done_cb;
+  if (options != NULL) {
+    walker->options = *options;
+  }
+  if (walker->options.concurrency <= 0) {
+    walker->options.concurrency = FS_WALK_DEFAULT_CONCURRENCY;
+  }
+
+  // 去掉末尾的'/'，拼子路径和算相对路径的时候就不用特殊处理，"/"本身保留
+  while (len > 1 && root[len - 1] == '/') {
+    len--;
+  }
+  if (len == 0) {
+    return UV_EINVAL;
+  }
+  if (len >= sizeof(walker->scratch)) {
+    return UV_ENAMETOOLONG;
+  }
+  walker->root_len = len;
+
+  walker->stat_slots = calloc(walker->options.concurrency, sizeof(fs_walk_stat_t));
+  if (walker->stat_slots == NULL) {
+    return UV_ENOMEM;
+  }
+  for (i = 0; i < walker->options.concurrency; i++) {
+    walker->stat_slots[i].walker = walker;
+    walker->stat_slots[i].next_free = i + 1 < walker->options.concurrency ? &walker->stat_slots[i + 1] : NULL;
+  }
+  walker->free_slots = walker->stat_slots;
+
+  r = push_dir(walker, root, len, 0);
+  if (r) {
+    free(walker->stat_slots);
+    return r;
+  }
+
+  uv_idle_init(loop, &walker->idle);
+  walker->idle.data = walker;
+  pump(walker);
+  return 0;
+}
+
+void fs_walk_stop(fs_walk_t *walker) {
+  if (walker->released) {
+    return;
+  }
+  fail(walker, UV_ECANCELED);
+  // 可能是在entry_cb里调用的，收尾放到idle回调里，免得把正在处理的目录释放掉
+  uv_idle_start(&walker->idle, idle_cb);
+}
@@ -0,0 +1,113 @@
+/*
+ * 目录树的并发遍历
+ * 一个目录scandir完再scandir下一个，线程池里永远只有一个请求，几十万个目录的树启动时要扫很久。
+ * 这里同时保持最多concurrency个uv_fs_scandir/uv_fs_lstat在线程池里：
+ * 1、还没扫描的目录放在一个栈里(深度优先，待扫描的目录不会像广度优先那样一层层堆起来)，有空位就发scandir
+ * 2、scandir完成的目录挂到队列里，目录项在loop线程上用uv_fs_scandir_next一项项取出来，按过滤条件交给entry_cb，
+ *    子目录压进栈里；目录项的类型在scandir里就有，只有要求stat或者文件系统给不出类型(UV_DIRENT_UNKNOWN)时才发lstat
+ * 3、需要lstat但是没有空位的目录项先留在目录里，等有请求回来再接着取，线程池里的请求数不会超过concurrency
+ * 4、一轮最多在loop线程上处理FS_WALK_BUDGET个目录项，剩下的放到idle回调里，几百万项的大目录也不会长时间卡住loop
+ * 过滤：
+ * 1、exclude匹配的项不回调，是目录的话也不进去
+ * 2、设置了include时只回调匹配的项，不匹配的目录照样进去
+ * 3、模式里有'/'时匹配相对root的路径(FNM_PATHNAME)，否则只匹配名字，都用fnmatch
+ * 4、max_depth > 0时只回调深度不超过max_depth的项，root下直接的子项深度为1
+ * 符号链接用lstat，不跟进去，所以不会绕圈。
+ * 某个目录扫不了或者某一项stat失败时以status < 0回调这一项，遍历照常继续；
+ * 所有请求都回来之后回调done_cb，status只在内存不够或者调用了fs_walk_stop时不为0。
+ */
+#ifndef LIBUV_DEMO_FS_WALK_H
+#define LIBUV_DEMO_FS_WALK_H
+
+#include <stdint.h>
+#include <limits.h>
+#include "uv.h"
+
+#define FS_WALK_DEFAULT_CONCURRENCY 16
+#define FS_WALK_BUDGET 4096
+
+typedef struct fs_walk_s fs_walk_t;
+typedef struct fs_walk_dir_s fs_walk_dir_t;
+typedef struct fs_walk_stat_s fs_walk_stat_t;
+
+typedef struct {
+  const char *path;           // root开头的完整路径
+  const char *name;           // path里最后一段
+  uv_dirent_type_t type;
+  int depth;
+  const uv_stat_t *stat;      // options.stat为1时才有，否则为NULL
+} fs_walk_entry_t;
+
+// entry和里面的指针只在回调期间有效
+typedef void (*fs_walk_entry_cb)(fs_walk_t *walker, int status, const fs_walk_entry_t *entry);
+typedef void (*fs_walk_done_cb)(fs_walk_t *walker, int status);
+
+typedef struct {
+  int concurrency;            // 线程池里最多同时有多少个请求，<=0时用FS_WALK_DEFAULT_CONCURRENCY
+  int max_depth;              // <=0表示不限深度
+  int stat;                   // 每个回调的项都lstat一次
+  const char **include;       // 以NULL结尾，NULL表示全部回调
+  const char **exclude;       // 以NULL结尾
+} fs_walk_options_t;
+
+typedef struct {
+  uint64_t dirs;              // scandir的次数
+  uint64_t entries;           // 回调的项数
+  uint64_t stats;             // lstat的次数
+  uint64_t errors;
+  int max_in_flight;
+  size_t max_pending;         // 待扫描的目录栈最深的时候
+} fs_walk_stats_t;
+
+struct fs_walk_dir_s {
+  uv_fs_t req;                // scandir请求，目录项一直留在里面，取完之后才释放
+  fs_walk_t *walker;
+  fs_walk_dir_t *next;
+  int depth;
+  int held;                   // ent是已经取出来、在等空位发lstat的目录项
+  uv_dirent_t ent;
+  size_t path_len;
+  char path[1];
+};
+
+struct fs_walk_stat_s {
+  uv_fs_t req;
+  fs_walk_t *walker;
+  fs_walk_stat_t *next_free;
+  uv_dirent_type_t type;
+  int depth;
+  int report;                 // 过滤之后要回调
+  size_t name_offset;
+  char *path;
+};
+
+struct fs_walk_s {
+  void *data;
+  uv_loop_t *loop;
+  fs_walk_options_t options;
+  size_t root_len;
+  fs_walk_dir_t *pending;     // 待扫描的目录栈
+  size_t pending_count;
+  fs_walk_dir_t *open_head;   // 扫描完、目录项还没取完的目录
+  fs_walk_dir_t *open_tail;
+  fs_walk_stat_t *stat_slots;
+  fs_walk_stat_t *free_slots;
+  int in_flight;
+  int stopping;
+  int released;
+  int error;
+  uv_idle_t idle;
+  fs_walk_entry_cb entry_cb;
+  fs_walk_done_cb done_cb;
+  fs_walk_stats_t stats;
+  char scratch[PATH_MAX];     // 不需要lstat的项在这里拼路径
+};
+
+// 从root开始遍历，root本身不回调；options为NULL时全部用默认值，模式数组在done_cb之前不能释放
+int fs_walk_start(uv_loop_t *loop, fs_walk_t *walker, const char *root, const fs_walk_options_t *options,
+                  fs_walk_entry_cb entry_cb, fs_walk_done_cb done_cb);
+
+// 不再发新的请求、不再回调entry_cb，在途的请求回来之后以UV_ECANCELED回调done_cb，entry_cb里也可以调用
+void fs_walk_stop(fs_walk_t *walker);
+
+#endif //LIBUV_DEMO_FS_WALK_H
@@ -5,7 +5,17 @@
  * 使用管道你要想象出需要有管道输入源和输出方，比如讲标准输入作为管道的输入方，文件作为输出方，这种模式都是可行的。
  * 下面的例子我们将tcp流作为管道的输入方，然后将该信息流输出到随机的一个进程中的标准输出以观察该模型。
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
 #include "uv.h"
 #include "../common.h"
 
@@ -16,29 +26,429 @@
 #define NOIPC 0
 #define IPC   1
 
+// fds handed to one worker in a single sendmsg. libuv reads at most 64 fds per
+// recvmsg (60 on macOS) and the kernel drops whatever does not fit, so stay below
+#define HANDOFF_BATCH_MAX 32
+
+// respawn delay doubles for every crash within WORKER_STABLE_MS of starting
+#define RESPAWN_MIN_MS   100
+#define RESPAWN_MAX_MS   10000
+#define WORKER_STABLE_MS 5000
+// a retiring worker gets this long to finish its connections before SIGTERM
+#define DRAIN_TIMEOUT_MS 30000
+
 uv_loop_t *loop;
 
+typedef enum {
+  DISPATCH_ROUND_ROBIN,
+  DISPATCH_LEAST_CONN,
+  DISPATCH_P2C
+} dispatch_policy_t;
+
+typedef enum {
+  PIN_NONE,  // placement left to the scheduler
+  PIN_CPU,   // master and every worker on a core of their own
+  PIN_NUMA   // master on its own core, each worker free within its NUMA node
+} pin_mode_t;
+
+typedef enum {
+  WORKER_RUNNING,   // takes new connections
+  WORKER_RETIRING,  // IPC pipe closed, finishing its connections before it exits
+  WORKER_EXITED     // process gone, handles closing
+} worker_state_t;
+
 struct child_worker {
   uv_process_t req;
   uv_process_options_t options;
   uv_pipe_t pipe;
-} *workers;
-
+  uv_timer_t drain_timer;
+  int id;
+  worker_state_t state;
+  // a handoff failed on the pipe itself, e.g. EPIPE: still running, but no
+  // more connections go its way until it exits and the slot is respawned
+  int broken;
+  // set by the first load report, the worker is up and reading its pipe
+  int ready;
+  uint64_t started;
+  // handles still to close before the struct can be freed
+  int closing;
+  // last load report read back from the worker, see report_load in worker.c
+  int connections;
+  int pending_writes;
+  uint64_t accepted;
+  // handles written to the pipe; sent - accepted are still in flight
+  uint64_t sent;
+  char report[64];
+  size_t report_len;
+  // report reads stopped on an exhausted buffer pool, resumed when a slab comes back
+  buf_pool_waiter_t report_waiter;
+  // clients accepted this loop tick, flushed together by flush_cb
+  uv_pipe_t *handoff[HANDOFF_BATCH_MAX];
+  int handoff_count;
+  struct child_worker *next_dirty;
+  int dirty;
+};
+
+// a slot outlives the processes in it: a crashed worker is respawned in place
+// and a rolling restart puts a replacement in while the old one drains
+struct worker_slot {
+  struct child_worker *worker;  // NULL while waiting for a respawn
+  uv_timer_t respawn_timer;
+  int failures;                 // quick crashes in a row, drives the backoff
+#ifdef __linux__
+  // placement planned once at startup, every process in the slot gets it
+  cpu_set_t cpus;
+#endif
+} *slots;
+
+pin_mode_t pin_mode = PIN_NONE;
+
+dispatch_policy_t policy = DISPATCH_LEAST_CONN;
 int round_robin_counter;
 int child_worker_count;
 
+// rolling restart state, restart_slot is the slot currently being replaced
+int restarting;
+int restart_slot;
+uv_signal_t hup_handle;
+
 char exepath[PATH_MAX];
 
 uv_buf_t dummy_buf;
 
+// handoffs per flush, 1 sends every client on its own as soon as it is accepted
+int handoff_batch = HANDOFF_BATCH_MAX;
+uv_check_t flush_handle;
+struct child_worker *dirty_workers;
+// uv_write2 requests for the fallback path are recycled instead of malloced
+buf_pool_t handoff_req_pool;
+
+// read buffers come from a per-loop slab pool instead of one malloc per read
+buf_pool_t buf_pool;
+
 void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  buf->base = malloc(size);
-  buf->len = size;
+  buf_pool_alloc_cb(handle, size, buf);
 }
 
-void on_exit(uv_process_t* req, int64_t exit_status, int term_signal) {
-  fprintf(stderr, "Process exited with status %lld, signal %d\n", exit_status, term_signal);
-  uv_close((uv_handle_t*) req, NULL);
+void free_handle_cb(uv_handle_t *handle) {
+  free(handle);
+}
+
+void worker_closed_cb(uv_handle_t *handle) {
+  struct child_worker *worker = (struct child_worker*) handle->data;
+  if (--worker->closing == 0)
+    free(worker);
+}
+
+int is_live(const struct child_worker *worker) {
+  return worker != NULL && worker->state == WORKER_RUNNING && !worker->broken;
+}
+
+void mark_broken(struct child_worker *worker, int err) {
+  if (!worker->broken)
+    fprintf(stderr, "handing connections to worker %d: %s, no longer dispatching to it\n",
+            worker->id, uv_strerror(err));
+  worker->broken = 1;
+}
+
+// handles the worker has not accepted yet count as load, so a worker that is
+// stuck and cannot report still looks busy to the master
+int64_t worker_load(const struct child_worker *worker) {
+  return (int64_t) worker->connections + worker->pending_writes +
+         (int64_t) (worker->sent - worker->accepted);
+}
+
+// only running workers are candidates, returns NULL when none is left
+struct child_worker* pick_worker() {
+  struct child_worker *best, *other;
+  int i;
+
+  switch (policy) {
+  case DISPATCH_P2C:
+    // power of two choices: sample two distinct slots, keep the lighter live one
+    if (child_worker_count > 1) {
+      i = rand() % child_worker_count;
+      best = slots[i].worker;
+      other = slots[(i + 1 + rand() % (child_worker_count - 1)) % child_worker_count].worker;
+      if (!is_live(best) || (is_live(other) && worker_load(other) < worker_load(best)))
+        best = other;
+      if (is_live(best))
+        return best;
+    }
+    // both samples are down, fall back to a full scan
+    /* fall through */
+
+  case DISPATCH_LEAST_CONN:
+    // start the scan at a rotating offset so ties still spread round robin
+    best = NULL;
+    for (i = 0; i < child_worker_count; i++) {
+      other = slots[(round_robin_counter + i) % child_worker_count].worker;
+      if (is_live(other) && (best == NULL || worker_load(other) < worker_load(best)))
+        best = other;
+    }
+    round_robin_counter = (round_robin_counter + 1) % child_worker_count;
+    return best;
+
+  default:
+    // a dead slot's turn goes to the next live worker
+    for (i = 0; i < child_worker_count; i++) {
+      other = slots[round_robin_counter].worker;
+      round_robin_counter = (round_robin_counter + 1) % child_worker_count;
+      if (is_live(other))
+        return other;
+    }
+    return NULL;
+  }
+}
+
+void restart_step();
+
+void parse_report(struct child_worker *worker) {
+  int connections, pending_writes;
+  uint64_t accepted;
+
+  worker->report[worker->report_len] = '\0';
+  if (sscanf(worker->report, "load %d %d %" SCNu64, &connections, &pending_writes, &accepted) != 3) {
+    fprintf(stderr, "worker %d: malformed load report '%s'\n", worker->id, worker->report);
+    return;
+  }
+
+  worker->connections = connections;
+  worker->pending_writes = pending_writes;
+  worker->accepted = accepted;
+
+  // the rolling restart moves on once the replacement is up
+  if (!worker->ready) {
+    worker->ready = 1;
+    if (restarting && worker->id == restart_slot && worker->state == WORKER_RUNNING)
+      restart_step();
+  }
+}
+
+void report_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+void resume_reports(buf_pool_waiter_t *waiter) {
+  struct child_worker *worker = (struct child_worker*) waiter->data;
+  if (!uv_is_closing((uv_handle_t*) &worker->pipe))
+    uv_read_start((uv_stream_t*) &worker->pipe, alloc_cb, report_read_cb);
+}
+
+void report_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  struct child_worker *worker = (struct child_worker*) stream->data;
+  ssize_t i;
+
+  // the pipe stays readable, stop instead of spinning until a slab is returned
+  if (nread == UV_ENOBUFS) {
+    buf_pool_wait(buf_pool_from_loop(stream->loop), &worker->report_waiter, stream, resume_reports);
+    return;
+  }
+
+  if (nread < 0) {
+    if (nread != UV_EOF)
+      fprintf(stderr, "worker %d: report read error %s\n", worker->id, uv_err_name(nread));
+    buf_pool_free(buf_pool_from_loop(stream->loop), buf->base);
+    uv_read_stop(stream);
+    return;
+  }
+
+  // reports are "load <connections> <pending writes> <accepted>\n" lines and
+  // may arrive split or batched, so accumulate until a newline shows up
+  for (i = 0; i < nread; i++) {
+    if (buf->base[i] == '\n') {
+      parse_report(worker);
+      worker->report_len = 0;
+    } else if (worker->report_len < sizeof(worker->report) - 1) {
+      worker->report[worker->report_len++] = buf->base[i];
+    }
+  }
+
+  buf_pool_free(buf_pool_from_loop(stream->loop), buf->base);
+}
+
+void dispatch_client(uv_pipe_t *client);
+void requeue_handoffs(struct child_worker *worker);
+
+void handoff_cb(uv_write_t *req, int status) {
+  struct child_worker *worker = (struct child_worker*) req->handle->data;
+  uv_pipe_t *client = (uv_pipe_t*) req->data;
+
+  buf_pool_free(&handoff_req_pool, (char*) req);
+  if (status == 0) {
+    // the worker holds its own dup of the fd now, drop the master's copy
+    uv_close((uv_handle_t*) client, free_handle_cb);
+    return;
+  }
+
+  // never reached the worker, so it must not stay counted as in flight
+  worker->sent--;
+  if (status == UV_ECANCELED) {
+    // the pipe was closed under it by a retire or an exit, try another worker
+    dispatch_client(client);
+    return;
+  }
+
+  // the pipe itself failed, the client is fine and goes to another worker
+  mark_broken(worker, status);
+  dispatch_client(client);
+}
+
+// one uv_write2 per client, libuv queues them until the pipe is writable
+void write_handoffs(struct child_worker *worker) {
+  int i, r;
+
+  for (i = 0; i < worker->handoff_count; i++) {
+    uv_pipe_t *client = worker->handoff[i];
+    uv_buf_t slab = buf_pool_alloc(&handoff_req_pool);
+    uv_write_t *write_req = (uv_write_t*) slab.base;
+    if (write_req == NULL) {
+      CHECK(UV_ENOMEM, "handoff_req_pool");
+    }
+
+    write_req->data = client;
+    r = uv_write2(write_req, (uv_stream_t*) &worker->pipe, &dummy_buf, 1 /*nbufs*/, (uv_stream_t*) client, handoff_cb);
+    if (r) {
+      worker->sent--;
+      buf_pool_free(&handoff_req_pool, (char*) write_req);
+      mark_broken(worker, r);
+      dispatch_client(client);
+    }
+  }
+}
+
+// all of the worker's pending clients in one sendmsg with an SCM_RIGHTS array;
+// returns 0 when sent, or a libuv error code
+int send_handoffs(struct child_worker *worker) {
+  char control[CMSG_SPACE(HANDOFF_BATCH_MAX * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  uv_os_fd_t pipe_fd, fd;
+  int *fds;
+  int i, flags = 0;
+  ssize_t n;
+
+  if (uv_fileno((uv_handle_t*) &worker->pipe, &pipe_fd))
+    return UV_EBADF;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = dummy_buf.base;
+  iov.iov_len = dummy_buf.len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(worker->handoff_count * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(worker->handoff_count * sizeof(int));
+  fds = (int*) CMSG_DATA(cmsg);
+  for (i = 0; i < worker->handoff_count; i++) {
+    uv_fileno((uv_handle_t*) worker->handoff[i], &fd);
+    fds[i] = fd;
+  }
+
+#ifdef MSG_NOSIGNAL
+  // a dead worker should surface as EPIPE, not kill the master
+  flags = MSG_NOSIGNAL;
+#endif
+  do
+    n = sendmsg(pipe_fd, &msg, flags);
+  while (n == -1 && errno == EINTR);
+
+  if (n == -1)
+    return uv_translate_sys_error(errno);
+  return 0;
+}
+
+void flush_handoffs(struct child_worker *worker) {
+  int i, r;
+
+  if (worker->handoff_count == 0)
+    return;
+
+  // bypassing libuv is only safe while nothing is queued on the pipe, or
+  // the batch would overtake handles still sitting in its write queue
+  r = UV_EAGAIN;
+  if (worker->handoff_count > 1 && uv_stream_get_write_queue_size((uv_stream_t*) &worker->pipe) == 0)
+    r = send_handoffs(worker);
+
+  if (r == 0) {
+    // the kernel holds a reference to every fd in flight, close ours now
+    for (i = 0; i < worker->handoff_count; i++)
+      uv_close((uv_handle_t*) worker->handoff[i], free_handle_cb);
+  } else if (r == UV_EAGAIN || r == UV_ENOBUFS) {
+    write_handoffs(worker);
+  } else {
+    mark_broken(worker, r);
+    requeue_handoffs(worker);
+    return;
+  }
+
+  worker->handoff_count = 0;
+}
+
+void flush_cb(uv_check_t *handle) {
+  struct child_worker *worker;
+
+  while ((worker = dirty_workers) != NULL) {
+    dirty_workers = worker->next_dirty;
+    worker->next_dirty = NULL;
+    worker->dirty = 0;
+    flush_handoffs(worker);
+  }
+  uv_check_stop(handle);
+}
+
+void dispatch_client(uv_pipe_t *client) {
+  struct child_worker *worker = pick_worker();
+
+  if (worker == NULL) {
+    fprintf(stderr, "no live worker, dropping connection\n");
+    uv_close((uv_handle_t*) client, free_handle_cb);
+    return;
+  }
+
+  worker->sent++;
+  worker->handoff[worker->handoff_count++] = client;
+  if (worker->handoff_count >= handoff_batch) {
+    flush_handoffs(worker);
+    return;
+  }
+
+  // accepts arrive in bursts within one loop tick, flush them after the poll phase
+  if (!worker->dirty) {
+    worker->dirty = 1;
+    worker->next_dirty = dirty_workers;
+    dirty_workers = worker;
+  }
+  uv_check_start(&flush_handle, flush_cb);
+}
+
+// clients accepted for a worker that is leaving dispatch go to the others
+void requeue_handoffs(struct child_worker *worker) {
+  int i, count = worker->handoff_count;
+
+  worker->handoff_count = 0;
+  worker->sent -= count;
+  for (i = 0; i < count; i++)
+    dispatch_client(worker->handoff[i]);
+}
+
+void unlink_dirty(struct child_worker *worker) {
+  struct child_worker **link;
+
+  if (!worker->dirty)
+    return;
+  for (link = &dirty_workers; *link != NULL; link = &(*link)->next_dirty) {
+    if (*link == worker) {
+      *link = worker->next_dirty;
+      break;
+    }
+  }
+  worker->dirty = 0;
+  worker->next_dirty = NULL;
 }
 
 void connection_cb(uv_stream_t *server, int status) {
@@ -54,16 +464,9 @@ void connection_cb(uv_stream_t *server, int status) {
   r = uv_accept(server, (uv_stream_t*) client);
 
   if (r == 0) {
-    uv_write_t *write_req = (uv_write_t*) malloc(sizeof(uv_write_t));
-    dummy_buf = uv_buf_init(".", 1);
-
-    struct child_worker *worker = &workers[round_robin_counter];
-
-    uv_write2(write_req, (uv_stream_t*) &worker->pipe, &dummy_buf, 1 /*nbufs*/, (uv_stream_t*) client, NULL);
-
-    round_robin_counter = (round_robin_counter + 1) % child_worker_count;
+    dispatch_client(client);
   } else {
-    uv_close((uv_handle_t*) client, NULL);
+    uv_close((uv_handle_t*) client, free_handle_cb);
   }
 }
 
@@ -77,60 +480,363 @@ char* exepath_for_worker() {
   return exepath;
 }
 
-int get_cpu_count() {
-  int r;
-  uv_cpu_info_t *info;
-  int cpu_count;
-  r = uv_cpu_info(&info, &cpu_count);
-  CHECK(r, "obtaining cpu info");
+#ifdef __linux__
+// "0-3,8,10-11" as found in sysfs cpulist files
+void parse_cpulist(const char *list, cpu_set_t *set) {
+  char *end;
+  long first, last;
+
+  CPU_ZERO(set);
+  for (;;) {
+    first = last = strtol(list, &end, 10);
+    if (end == list)
+      return;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+    }
+    for (; first <= last && first < CPU_SETSIZE; first++)
+      CPU_SET(first, set);
+    if (*end != ',')
+      return;
+    list = end + 1;
+  }
+}
+
+// fills cpu_node from /sys/devices/system/node/node*/cpulist and returns the
+// highest node id; without that directory every cpu stays on node 0
+int read_numa_nodes(int *cpu_node) {
+  char path[300], list[4096];
+  struct dirent *entry;
+  cpu_set_t set;
+  int node, cpu, max_node = 0;
+  DIR *dir;
+  FILE *file;
+
+  dir = opendir("/sys/devices/system/node");
+  if (dir == NULL)
+    return 0;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) != 1)
+      continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+    file = fopen(path, "r");
+    if (file == NULL)
+      continue;
+    if (fgets(list, sizeof(list), file) != NULL) {
+      parse_cpulist(list, &set);
+      for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+          cpu_node[cpu] = node;
+      if (node > max_node)
+        max_node = node;
+    }
+    fclose(file);
+  }
+
+  closedir(dir);
+  return max_node;
+}
+#endif
+
+// pins the master to the first usable cpu and decides each slot's cpus. cpus
+// are taken node by node, so neighbouring workers share a node and its cache
+void plan_placement() {
+#ifdef __linux__
+  static int cpu_node[CPU_SETSIZE];
+  static int order[CPU_SETSIZE];
+  cpu_set_t usable, master;
+  int count = 0, pool_count, *pool;
+  int i, j, cpu, node, max_node;
+
+  if (pin_mode == PIN_NONE)
+    return;
+
+  // start from what we may run on, so taskset and cgroup limits are honoured
+  if (sched_getaffinity(0, sizeof(usable), &usable)) {
+    fprintf(stderr, "reading cpu affinity: %s, not pinning\n", strerror(errno));
+    pin_mode = PIN_NONE;
+    return;
+  }
+
+  max_node = read_numa_nodes(cpu_node);
+  for (node = 0; node <= max_node; node++)
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &usable) && cpu_node[cpu] == node)
+        order[count++] = cpu;
+
+  CPU_ZERO(&master);
+  CPU_SET(order[0], &master);
+  if (sched_setaffinity(0, sizeof(master), &master))
+    fprintf(stderr, "pinning master: %s\n", strerror(errno));
+  else
+    fprintf(stderr, "Master pinned to cpu %d (node %d)\n", order[0], cpu_node[order[0]]);
+
+  // the accept loop keeps its core to itself unless it is the only one
+  pool = count > 1 ? order + 1 : order;
+  pool_count = count > 1 ? count - 1 : count;
+
+  for (i = 0; i < child_worker_count; i++) {
+    cpu = pool[i % pool_count];
+    CPU_ZERO(&slots[i].cpus);
+    if (pin_mode == PIN_CPU) {
+      CPU_SET(cpu, &slots[i].cpus);
+      fprintf(stderr, "Worker %d placed on cpu %d (node %d)\n", i, cpu, cpu_node[cpu]);
+    } else {
+      for (j = 0; j < pool_count; j++)
+        if (cpu_node[pool[j]] == cpu_node[cpu])
+          CPU_SET(pool[j], &slots[i].cpus);
+      fprintf(stderr, "Worker %d placed on node %d (%d cpus)\n", i, cpu_node[cpu], CPU_COUNT(&slots[i].cpus));
+    }
+  }
+#else
+  if (pin_mode != PIN_NONE) {
+    fprintf(stderr, "cpu pinning is only supported on Linux, not pinning\n");
+    pin_mode = PIN_NONE;
+  }
+#endif
+}
+
+// libuv has no affinity option for uv_spawn, so the new child is moved right after
+void pin_worker(struct child_worker *worker) {
+#ifdef __linux__
+  if (pin_mode == PIN_NONE)
+    return;
+  if (sched_setaffinity(worker->req.pid, sizeof(cpu_set_t), &slots[worker->id].cpus))
+    fprintf(stderr, "pinning worker %d: %s\n", worker->id, strerror(errno));
+#endif
+}
 
-  uv_free_cpu_info(info, cpu_count);
-  return cpu_count;
+void on_exit(uv_process_t* req, int64_t exit_status, int term_signal);
+int spawn_worker(int id);
+
+void close_worker(struct child_worker *worker) {
+  unlink_dirty(worker);
+  buf_pool_unwait(&buf_pool, &worker->report_waiter);
+  if (!uv_is_closing((uv_handle_t*) &worker->pipe))
+    uv_close((uv_handle_t*) &worker->pipe, worker_closed_cb);
+  uv_close((uv_handle_t*) &worker->drain_timer, worker_closed_cb);
+  uv_close((uv_handle_t*) &worker->req, worker_closed_cb);
+}
+
+void respawn_cb(uv_timer_t *handle) {
+  struct worker_slot *slot = (struct worker_slot*) handle->data;
+  spawn_worker((int) (slot - slots));
+}
+
+// quick tells whether the last attempt died young, only then does the delay grow
+void schedule_respawn(int id, int quick) {
+  struct worker_slot *slot = &slots[id];
+  uint64_t delay = RESPAWN_MIN_MS;
+  int i;
+
+  slot->failures = quick ? slot->failures + 1 : 0;
+  for (i = 1; i < slot->failures && delay < RESPAWN_MAX_MS; i++)
+    delay *= 2;
+  if (delay > RESPAWN_MAX_MS)
+    delay = RESPAWN_MAX_MS;
+
+  fprintf(stderr, "Respawning worker %d in %" PRIu64 "ms\n", id, delay);
+  uv_timer_start(&slot->respawn_timer, respawn_cb, delay, 0);
+}
+
+void on_exit(uv_process_t* req, int64_t exit_status, int term_signal) {
+  struct child_worker *worker = (struct child_worker*) req->data;
+  int quick = uv_hrtime() - worker->started < (uint64_t) WORKER_STABLE_MS * 1000000;
+
+  fprintf(stderr, "Worker %d (pid %d) exited with status %lld, signal %d\n",
+          worker->id, req->pid, (long long) exit_status, term_signal);
+
+  if (worker->state == WORKER_RUNNING) {
+    // not asked to leave: take the slot out of dispatch before anything else lands on it
+    slots[worker->id].worker = NULL;
+    worker->state = WORKER_EXITED;
+    requeue_handoffs(worker);
+    schedule_respawn(worker->id, quick);
+  }
+  worker->state = WORKER_EXITED;
+  close_worker(worker);
 }
 
-void setup_workers() {
+// returns 0 once the worker is in its slot, otherwise a respawn is already scheduled
+int spawn_worker(int id) {
   int r;
-  exepath_for_worker();
+  struct child_worker *worker = (struct child_worker*) calloc(1, sizeof(struct child_worker));
+  if (worker == NULL) {
+    CHECK(UV_ENOMEM, "allocating worker");
+  }
 
-  char* args[2];
+  // the worker id is passed as argv[1], mostly for logging
+  char id_arg[16];
+  char* args[3];
+  snprintf(id_arg, sizeof(id_arg), "%d", id);
   args[0] = exepath;
-  args[1] = NULL;
+  args[1] = id_arg;
+  args[2] = NULL;
+
+  worker->id = id;
+  worker->state = WORKER_RUNNING;
+  worker->started = uv_hrtime();
+  worker->closing = 3;
+
+  // pipe is acting as IPC channel, handles go down and load reports come back
+  uv_pipe_init(loop, &worker->pipe, IPC);
+  worker->pipe.data = worker;
+  worker->report_waiter.data = worker;
+  uv_timer_init(loop, &worker->drain_timer);
+  worker->drain_timer.data = worker;
+
+  uv_stdio_container_t child_stdio[3];
+  child_stdio[STDIN].flags       =  UV_CREATE_PIPE | UV_READABLE_PIPE | UV_WRITABLE_PIPE;
+  child_stdio[STDIN].data.stream =  (uv_stream_t*) &worker->pipe;
+  child_stdio[STDOUT].flags      =  UV_IGNORE;
+  child_stdio[STDERR].flags      =  UV_INHERIT_FD;
+  child_stdio[STDERR].data.fd    =  STDERR;
+
+  worker->options.stdio_count =  3;
+  worker->options.stdio       =  child_stdio;
+  worker->options.exit_cb     =  on_exit;
+  worker->options.file        =  exepath;
+  worker->options.args        =  args;
+
+  r = uv_spawn(loop, &worker->req, &worker->options);
+  worker->req.data = worker;
+  if (r) {
+    fprintf(stderr, "spawning worker %d: %s\n", id, uv_strerror(r));
+    // a failed spawn still leaves handles that have to be closed
+    worker->state = WORKER_EXITED;
+    close_worker(worker);
+    schedule_respawn(id, 1);
+    return r;
+  }
 
-  round_robin_counter = 0;
-  int cpu_count = get_cpu_count();
-  child_worker_count = cpu_count;
+  pin_worker(worker);
 
-  workers = calloc(sizeof(struct child_worker), cpu_count);
-  while (cpu_count--) {
-    struct child_worker *worker = &workers[cpu_count];
-    // pipe is acting as IPC channel
-    uv_pipe_init(loop, &worker->pipe, IPC);
+  r = uv_read_start((uv_stream_t*) &worker->pipe, alloc_cb, report_read_cb);
+  CHECK(r, "reading worker load reports");
 
-    uv_stdio_container_t child_stdio[3];
-    child_stdio[STDIN].flags       =  UV_CREATE_PIPE | UV_READABLE_PIPE;
-    child_stdio[STDIN].data.stream =  (uv_stream_t*) &worker->pipe;
-    child_stdio[STDOUT].flags      =  UV_IGNORE;
-    child_stdio[STDERR].flags      =  UV_INHERIT_FD;
-    child_stdio[STDERR].data.fd    =  STDERR;
+  slots[id].worker = worker;
+  fprintf(stderr, "Started worker %d\n", worker->req.pid);
+  return 0;
+}
+
+void drain_timeout_cb(uv_timer_t *handle) {
+  struct child_worker *worker = (struct child_worker*) handle->data;
+  fprintf(stderr, "Worker %d (pid %d) still has %d connections after %dms, terminating\n",
+          worker->id, worker->req.pid, worker->connections, DRAIN_TIMEOUT_MS);
+  uv_process_kill(&worker->req, SIGTERM);
+}
+
+void retire_worker(struct child_worker *worker) {
+  worker->state = WORKER_RETIRING;
+  requeue_handoffs(worker);
+  buf_pool_unwait(&buf_pool, &worker->report_waiter);
+  // EOF on the IPC pipe tells the worker to accept what is already in the
+  // pipe and exit once those connections are done; see on_new_connection
+  uv_close((uv_handle_t*) &worker->pipe, worker_closed_cb);
+  uv_timer_start(&worker->drain_timer, drain_timeout_cb, DRAIN_TIMEOUT_MS, 0);
+}
 
-    worker->options.stdio_count =  3;
-    worker->options.stdio       =  child_stdio;
-    worker->options.exit_cb     =  on_exit;
-    worker->options.file        =  exepath;
-    worker->options.args        =  args;
+// replace one slot at a time, the next step runs when the replacement reports in
+void restart_step() {
+  struct child_worker *old;
 
-    r = uv_spawn(loop, &worker->req, &worker->options);
-    CHECK(r, "spawning worker");
+  while (++restart_slot < child_worker_count) {
+    old = slots[restart_slot].worker;
+    // an empty slot is waiting on a respawn, which starts the new binary anyway
+    if (old == NULL)
+      continue;
 
-    fprintf(stderr, "Started worker %d\n", worker->req.pid);
+    slots[restart_slot].worker = NULL;
+    retire_worker(old);
+    slots[restart_slot].failures = 0;
+    spawn_worker(restart_slot);
+    return;
+  }
+
+  restarting = 0;
+  fprintf(stderr, "Rolling restart done\n");
+}
+
+void sighup_cb(uv_signal_t *handle, int signum) {
+  if (restarting) {
+    fprintf(stderr, "Rolling restart already running at worker %d\n", restart_slot);
+    return;
   }
+
+  fprintf(stderr, "Rolling restart of %d workers\n", child_worker_count);
+  restarting = 1;
+  restart_slot = -1;
+  restart_step();
 }
 
-int main() {
+void setup_workers(int count) {
+  int i;
+  exepath_for_worker();
+
+  round_robin_counter = 0;
+  child_worker_count = count > 0 ? count : get_cpu_count();
+
+  slots = calloc(sizeof(struct worker_slot), child_worker_count);
+  plan_placement();
+  for (i = 0; i < child_worker_count; i++) {
+    uv_timer_init(loop, &slots[i].respawn_timer);
+    slots[i].respawn_timer.data = &slots[i];
+    spawn_worker(i);
+  }
+}
+
+// PipeHandle [rr|least|p2c] [workers] [handoff batch] [none|cpu|numa]
+int main(int argc, char **argv) {
   int r;
   loop = uv_default_loop();
 
-  setup_workers();
+  if (argc > 1) {
+    if (strcmp(argv[1], "rr") == 0)
+      policy = DISPATCH_ROUND_ROBIN;
+    else if (strcmp(argv[1], "least") == 0)
+      policy = DISPATCH_LEAST_CONN;
+    else if (strcmp(argv[1], "p2c") == 0)
+      policy = DISPATCH_P2C;
+    else {
+      fprintf(stderr, "usage: %s [rr|least|p2c] [workers] [handoff batch] [none|cpu|numa]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc > 3) {
+    handoff_batch = atoi(argv[3]);
+    if (handoff_batch < 1 || handoff_batch > HANDOFF_BATCH_MAX) {
+      fprintf(stderr, "handoff batch must be between 1 and %d\n", HANDOFF_BATCH_MAX);
+      return 1;
+    }
+  }
+  if (argc > 4) {
+    if (strcmp(argv[4], "none") == 0)
+      pin_mode = PIN_NONE;
+    else if (strcmp(argv[4], "cpu") == 0)
+      pin_mode = PIN_CPU;
+    else if (strcmp(argv[4], "numa") == 0)
+      pin_mode = PIN_NUMA;
+    else {
+      fprintf(stderr, "pinning must be one of none, cpu or numa\n");
+      return 1;
+    }
+  }
+  srand((unsigned) uv_hrtime());
+  dummy_buf = uv_buf_init(".", 1);
+
+  buf_pool_init(&buf_pool, BUF_POOL_SLAB_SIZE, BUF_POOL_MAX_BYTES);
+  buf_pool_attach(loop, &buf_pool);
+  buf_pool_init(&handoff_req_pool, sizeof(uv_write_t), SIZE_MAX);
+  uv_check_init(loop, &flush_handle);
+
+  // a worker that dies mid-write must surface as EPIPE, not kill the master
+  signal(SIGPIPE, SIG_IGN);
+  uv_signal_init(loop, &hup_handle);
+  uv_signal_start(&hup_handle, sighup_cb, SIGHUP);
+
+  setup_workers(argc > 2 ? atoi(argv[2]) : 0);
 
   struct sockaddr_in bind_addr;
   r = uv_ip4_addr("0.0.0.0", 7000, &bind_addr);
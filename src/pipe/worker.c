@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <assert.h>
 #include "uv.h"
 #include "../common.h"
@@ -14,43 +15,174 @@
 
 uv_loop_t *loop;
 uv_pipe_t queue;
+int worker_id;
+
+// load figures reported back to the master over the IPC pipe
+int connections;
+int pending_writes;
+uint64_t accepted;
+uv_check_t report_handle;
+char last_report[64];
+
+// read buffers come from a per-loop slab pool instead of one malloc per read
+buf_pool_t buf_pool;
+
+// a connection stopped on an exhausted pool waits on its waiter until a slab
+// comes back, the handle stays first so uv_tcp_t* and client_t* convert
+typedef struct {
+  uv_tcp_t handle;
+  buf_pool_waiter_t waiter;
+} client_t;
+buf_pool_waiter_t queue_waiter;
+
+// replies are the prefix plus the read buffer as-is; the prefix never changes,
+// so it is formatted once and every write points at the same bytes
+char reply_prefix[32];
+uv_buf_t reply_prefix_buf;
+// uv_write_t for replies are recycled, req->data carries the read buffer
+buf_pool_t write_req_pool;
 
 void alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  buf->base = malloc(size);
-  buf->len = size;
+  buf_pool_alloc_cb(handle, size, buf);
+}
+
+void report_write_cb(uv_write_t *req, int status) {
+  write_req_t *report = (write_req_t*) req;
+  if (status && status != UV_ECANCELED)
+    fprintf(stderr, "Worker %d: load report %s\n", worker_id, uv_err_name(status));
+  free(report->buf.base);
+  free(report);
+}
+
+// runs once per loop iteration after any load change, so a burst of accepts
+// or writes costs a single report instead of one per event
+void report_cb(uv_check_t *handle) {
+  char line[64];
+  int len;
+
+  uv_check_stop(handle);
+  if (uv_is_closing((uv_handle_t*) &queue) || !uv_is_writable((uv_stream_t*) &queue))
+    return;
+
+  len = snprintf(line, sizeof(line), "load %d %d %" PRIu64 "\n", connections, pending_writes, accepted);
+  if (strcmp(line, last_report) == 0)
+    return;
+  strcpy(last_report, line);
+
+  write_req_t *report = (write_req_t*) malloc(sizeof(write_req_t));
+  report->buf = uv_buf_init(malloc(len), len);
+  memcpy(report->buf.base, line, len);
+  uv_write(&report->req, (uv_stream_t*) &queue, &report->buf, 1, report_write_cb);
+}
+
+void report_load() {
+  if (!uv_is_closing((uv_handle_t*) &report_handle))
+    uv_check_start(&report_handle, report_cb);
+}
+
+void free_handle_cb(uv_handle_t *handle) {
+  free(handle);
+}
+
+void close_cb(uv_handle_t *handle) {
+  buf_pool_unwait(buf_pool_from_loop(handle->loop), &((client_t*) handle)->waiter);
+  connections--;
+  report_load();
+  free(handle);
 }
 
 void write_cb(uv_write_t* req, int status) {
-  CHECK(status, "async write");
+  // a client that resets mid-reply must not take the whole worker down
+  if (status && status != UV_ECANCELED)
+    fprintf(stderr, "Worker %d: write error %s\n", worker_id, uv_err_name(status));
   char *base = (char*) req->data;
-  free(base);
-  free(req);
+  buf_pool_free(buf_pool_from_loop(req->handle->loop), base);
+  buf_pool_free(&write_req_pool, (char*) req);
+  pending_writes--;
+  report_load();
+}
+
+void read_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf);
+
+void resume_client(buf_pool_waiter_t *waiter) {
+  uv_stream_t *client = (uv_stream_t*) waiter->data;
+  if (!uv_is_closing((uv_handle_t*) client))
+    uv_read_start(client, alloc_cb, read_cb);
 }
 
 void read_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
+  if (nread == UV_ENOBUFS) {
+    // pool is at its high-water mark; the fd stays readable, so keep reading
+    // and the loop spins, stop until a slab is returned instead
+    buf_pool_wait(buf_pool_from_loop(client->loop), &((client_t*) client)->waiter, client, resume_client);
+    return;
+  }
+
   if (nread < 0) {
-    fprintf(stderr, "read error: [%s: %s]\n", uv_err_name((nread)), uv_strerror((nread)));
-    uv_close((uv_handle_t*) client, NULL);
+    if (nread != UV_EOF)
+      fprintf(stderr, "read error: [%s: %s]\n", uv_err_name((nread)), uv_strerror((nread)));
+    buf_pool_free(buf_pool_from_loop(client->loop), buf->base);
+    uv_close((uv_handle_t*) client, close_cb);
     return;
   }
 
-  uv_write_t *req = (uv_write_t*) malloc(sizeof(uv_write_t));
+  if (nread == 0) {
+    buf_pool_free(buf_pool_from_loop(client->loop), buf->base);
+    return;
+  }
 
-  int len = strlen(buf->base);
-  char tmp[len];
-  strncpy(tmp, buf->base, len);
-  sprintf(buf->base, "From worker %d => %s", getpid(), tmp);
+  uv_buf_t slab = buf_pool_alloc(&write_req_pool);
+  uv_write_t *req = (uv_write_t*) slab.base;
+  if (req == NULL) {
+    CHECK(UV_ENOMEM, "write_req_pool");
+  }
 
+  // prefix and payload go out in one vectored write, the read buffer is
+  // echoed in place and only the nread bytes libuv filled are sent
+  uv_buf_t bufs[2];
+  bufs[0] = reply_prefix_buf;
+  bufs[1] = uv_buf_init(buf->base, nread);
   req->data = (void*) buf->base;
 
-  uv_write(req, (uv_stream_t*)client, buf, 1, write_cb);
+  int r = uv_write(req, (uv_stream_t*)client, bufs, 2, write_cb);
+  if (r) {
+    fprintf(stderr, "Worker %d: write error %s\n", worker_id, uv_err_name(r));
+    buf_pool_free(buf_pool_from_loop(client->loop), buf->base);
+    buf_pool_free(&write_req_pool, (char*) req);
+    uv_close((uv_handle_t*) client, close_cb);
+    return;
+  }
+
+  pending_writes++;
+  report_load();
+}
+
+void on_new_connection(uv_stream_t *q, ssize_t nread, const uv_buf_t *buf);
+
+void resume_queue(buf_pool_waiter_t *waiter) {
+  if (!uv_is_closing((uv_handle_t*) &queue))
+    uv_read_start((uv_stream_t*) &queue, alloc_cb, on_new_connection);
 }
 
 void on_new_connection(uv_stream_t *q, ssize_t nread, const uv_buf_t *buf) {
+  // the payload is just the dummy byte, only the pending handle matters
+  buf_pool_free(buf_pool_from_loop(q->loop), buf->base);
+
+  if (nread == UV_ENOBUFS) {
+    buf_pool_wait(buf_pool_from_loop(q->loop), &queue_waiter, q, resume_queue);
+    return;
+  }
+
   if (nread < 0) {
     if (nread != UV_EOF)
       fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+    else
+      fprintf(stderr, "Worker %d: pipe closed, draining %d connections\n", worker_id, connections);
+    // the master retired us or is gone: no new handles and nobody reads reports,
+    // the loop exits once the open connections are done
+    buf_pool_unwait(buf_pool_from_loop(q->loop), &queue_waiter);
     uv_close((uv_handle_t*) q, NULL);
+    uv_close((uv_handle_t*) &report_handle, NULL);
     return;
   }
 
@@ -60,31 +192,53 @@ void on_new_connection(uv_stream_t *q, ssize_t nread, const uv_buf_t *buf) {
     return;
   }
 
-  uv_handle_type pending = uv_pipe_pending_type(pipe);
-  assert(pending == UV_TCP);
-
-  uv_tcp_t *client = (uv_tcp_t*) malloc(sizeof(uv_tcp_t));
-  uv_tcp_init(loop, client);
-  if (uv_accept(q, (uv_stream_t*) client) == 0) {
-    uv_os_fd_t fd;
-    uv_fileno((const uv_handle_t*) client, &fd);
-    fprintf(stderr, "Worker %d: Accepted fd %d\n", getpid(), fd);
-    uv_read_start((uv_stream_t*) client, alloc_cb, read_cb);
-  }
-  else {
-    uv_close((uv_handle_t*) client, NULL);
+  // the master batches several fds into one message, libuv queues all but
+  // the first and they have to be drained here or they stay pending forever
+  while (uv_pipe_pending_count(pipe) > 0) {
+    uv_handle_type pending = uv_pipe_pending_type(pipe);
+    assert(pending == UV_TCP);
+
+    uv_tcp_t *client = (uv_tcp_t*) calloc(1, sizeof(client_t));
+    ((client_t*) client)->waiter.data = client;
+    uv_tcp_init(loop, client);
+    if (uv_accept(q, (uv_stream_t*) client) == 0) {
+      uv_os_fd_t fd;
+      uv_fileno((const uv_handle_t*) client, &fd);
+      fprintf(stderr, "Worker %d: Accepted fd %d\n", getpid(), fd);
+      accepted++;
+      connections++;
+      uv_read_start((uv_stream_t*) client, alloc_cb, read_cb);
+    }
+    else {
+      uv_close((uv_handle_t*) client, free_handle_cb);
+    }
   }
+  report_load();
 }
 
-int main(void) {
+// WorkerHandle <id>, spawned by PipeHandle
+int main(int argc, char **argv) {
   loop = uv_default_loop();
   int r = 0;
 
+  worker_id = argc > 1 ? atoi(argv[1]) : 0;
+
+  buf_pool_init(&buf_pool, BUF_POOL_SLAB_SIZE, BUF_POOL_MAX_BYTES);
+  buf_pool_attach(loop, &buf_pool);
+  buf_pool_init(&write_req_pool, sizeof(uv_write_t), SIZE_MAX);
+
+  int len = snprintf(reply_prefix, sizeof(reply_prefix), "From worker %d => ", getpid());
+  reply_prefix_buf = uv_buf_init(reply_prefix, len);
+
   uv_pipe_init(loop, &queue, IPC);
   uv_pipe_open(&queue, STDIN);
+  uv_check_init(loop, &report_handle);
 
   r = uv_read_start((uv_stream_t*)&queue, alloc_cb, on_new_connection);
   CHECK(r, "uv_read_start");
 
+  // the first report tells the master this worker is up
+  report_load();
+
   return uv_run(loop, UV_RUN_DEFAULT);
 }
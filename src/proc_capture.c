@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+#include "proc_capture.h"
+
+// 块头放在slab开头，数据紧跟在后面
+struct proc_capture_chunk_s {
+  proc_capture_chunk_t *next;
+  size_t len;
+  size_t off;
+};
+
+static void update(proc_capture_stream_t *stream);
+
+static void emit(proc_capture_stream_t *stream, const char *line, size_t len) {
+  proc_capture_t *capture = stream->capture;
+
+  capture->stats.lines[stream->fd - 1]++;
+  capture->line_cb(capture, stream->fd, line, len);
+}
+
+// 半行拷进行缓冲，返回拷了多少字节。缓冲满了还有数据要放才把满的这段当成一行交出去，
+// 正好max_line字节的行等'\n'来了整行交；交完这段line_cb暂停了的话就停在这里，剩下的等resume
+static size_t append_partial(proc_capture_stream_t *stream, const char *data, size_t len) {
+  proc_capture_t *capture = stream->capture;
+  size_t max_line = capture->options.max_line;
+  size_t done = 0;
+  size_t n;
+
+  while (done < len) {
+    if (stream->line_len == max_line) {
+      capture->stats.split_lines++;
+      stream->line_len = 0;
+      emit(stream, stream->line, max_line);
+      if (capture->paused) {
+        break;
+      }
+    }
+    n = max_line - stream->line_len;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy(stream->line + stream->line_len, data + done, n);
+    stream->line_len += n;
+    done += n;
+  }
+  return done;
+}
+
+static void deliver(proc_capture_stream_t *stream) {
+  proc_capture_t *capture = stream->capture;
+  proc_capture_chunk_t *chunk;
+  const char *base, *p, *end, *nl;
+  size_t n;
+
+  // line_cb里resume的话，外面这一层接着交就行了
+  if (stream->delivering) {
+    return;
+  }
+  stream->delivering = 1;
+  while (!capture->paused && (chunk = stream->head) != NULL) {
+    base = (const char *) (chunk + 1) + chunk->off;
+    p = base;
+    end = (const char *) (chunk + 1) + chunk->len;
+    while (!capture->paused && p < end) {
+      nl = memchr(p, '\n', end - p);
+      if (nl == NULL) {
+        p += append_partial(stream, p, end - p);
+        break;
+      }
+      // 前面有半行，或者这一行本身超过了max_line，都要经过行缓冲
+      if (stream->line_len > 0 || (size_t) (nl - p) > capture->options.max_line) {
+        p += append_partial(stream, p, nl - p);
+        if (p < nl) {
+          break;
+        }
+        n = stream->line_len;
+        stream->line_len = 0;
+        emit(stream, stream->line, n);
+      } else {
+        emit(stream, p, nl - p);
+      }
+      p = nl + 1;
+    }
+
+    n = p - base;
+    chunk->off += n;
+    stream->buffered -= n;
+    if (chunk->off == chunk->len) {
+      stream->head = chunk->next;
+      if (stream->head == NULL) {
+        stream->tail = NULL;
+      }
+      buf_pool_free(capture->pool, (char *) chunk);
+    }
+  }
+  stream->delivering = 0;
+}
+
+static void handle_closed(proc_capture_t *capture) {
+  int i;
+
+  if (--capture->handles > 0) {
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    free(capture->streams[i].line);
+    capture->streams[i].line = NULL;
+  }
+  if (capture->pool == &capture->own_pool) {
+    buf_pool_trim(capture->pool);
+  }
+  if (!capture->failed && capture->done_cb) {
+    capture->done_cb(capture, capture->exit_status, capture->term_signal);
+  }
+}
+
+static void close_cb(uv_handle_t *handle) {
+  handle_closed((proc_capture_t *) handle->data);
+}
+
+// 管道的data指向流
+static void pipe_close_cb(uv_handle_t *handle) {
+  handle_closed(((proc_capture_stream_t *) handle->data)->capture);
+}
+
+static void maybe_done(proc_capture_t *capture) {
+  if (capture->closing || !capture->exited || !capture->streams[0].done || !capture->streams[1].done) {
+    return;
+  }
+  capture->closing = 1;
+  uv_close((uv_handle_t *) &capture->retry_timer, close_cb);
+}
+
+// 积压交完之后把最后不带'\n'的半行交出去，关掉管道
+static void finish(proc_capture_stream_t *stream) {
+  proc_capture_t *capture = stream->capture;
+  size_t n;
+
+  if (stream->line_len > 0) {
+    n = stream->line_len;
+    stream->line_len = 0;
+    emit(stream, stream->line, n);
+  }
+  stream->done = 1;
+  uv_close((uv_handle_t *) &stream->pipe, pipe_close_cb);
+  maybe_done(capture);
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  proc_capture_stream_t *stream = (proc_capture_stream_t *) handle->data;
+  uv_buf_t slab = buf_pool_alloc(stream->capture->pool);
+
+  if (slab.base == NULL) {
+    *buf = slab;
+    return;
+  }
+  *buf = uv_buf_init(slab.base + sizeof(proc_capture_chunk_t),
+                     (unsigned int) (slab.len - sizeof(proc_capture_chunk_t)));
+}
+
+static void retry_cb(uv_timer_t *handle) {
+  proc_capture_t *capture = (proc_capture_t *) handle->data;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (capture->streams[i].starved) {
+      capture->streams[i].starved = 0;
+      update(&capture->streams[i]);
+    }
+  }
+}
+
+static void read_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
+  proc_capture_stream_t *stream = (proc_capture_stream_t *) handle->data;
+  proc_capture_t *capture = stream->capture;
+  proc_capture_chunk_t *chunk = NULL;
+
+  if (buf->base != NULL) {
+    chunk = (proc_capture_chunk_t *) (buf->base - sizeof(proc_capture_chunk_t));
+  }
+  if (nread > 0) {
+    chunk->next = NULL;
+    chunk->len = nread;
+    chunk->off = 0;
+    if (stream->tail) stream->tail->next = chunk;
+    else stream->head = chunk;
+    stream->tail = chunk;
+    stream->buffered += nread;
+    capture->stats.bytes[stream->fd - 1] += nread;
+    if (stream->buffered > capture->stats.max_buffered) {
+      capture->stats.max_buffered = stream->buffered;
+    }
+    deliver(stream);
+    update(stream);
+    return;
+  }
+
+  if (chunk != NULL) {
+    buf_pool_free(capture->pool, (char *) chunk);
+  }
+  if (nread == UV_ENOBUFS) {
+    capture->stats.enobufs++;
+    stream->starved = 1;
+    uv_read_stop(handle);
+    stream->reading = 0;
+    if (!uv_is_active((uv_handle_t *) &capture->retry_timer) &&
+        uv_timer_start(&capture->retry_timer, retry_cb, 1, 0) < 0) {
+      // 定时器起不来就不等了，直接重新开始读
+      stream->starved = 0;
+      update(stream);
+    }
+    return;
+  }
+  // EOF或者出错都当成流结束
+  if (nread < 0) {
+    uv_read_stop(handle);
+    stream->reading = 0;
+    stream->eof = 1;
+    update(stream);
+  }
+}
+
+static void update(proc_capture_stream_t *stream) {
+  proc_capture_t *capture = stream->capture;
+  size_t high_water = capture->options.high_water;
+
+  if (stream->done) {
+    return;
+  }
+  if (stream->eof) {
+    if (stream->head == NULL && !capture->paused) {
+      finish(stream);
+    }
+    return;
+  }
+  if (stream->reading && stream->buffered >= high_water) {
+    uv_read_stop((uv_stream_t *) &stream->pipe);
+    stream->reading = 0;
+    capture->stats.read_stops++;
+  } else if (!stream->reading && !stream->starved && stream->buffered <= high_water / 2) {
+    if (uv_read_start((uv_stream_t *) &stream->pipe, alloc_cb, read_cb) == 0) {
+      stream->reading = 1;
+    }
+  }
+}
+
+static void exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  proc_capture_t *capture = (proc_capture_t *) process->data;
+
+  capture->exited = 1;
+  capture->exit_status = exit_status;
+  capture->term_signal = term_signal;
+  uv_close((uv_handle_t *) process, close_cb);
+  maybe_done(capture);
+}
+
+int proc_capture_spawn(uv_loop_t *loop, proc_capture_t *capture, const proc_capture_options_t *options,
+                       proc_capture_line_cb line_cb, proc_capture_done_cb done_cb) {
+  uv_process_options_t process_options;
+  uv_stdio_container_t stdio[3];
+  int i, r;
+
+  memset(capture, 0, sizeof(*capture));
+  capture->loop = loop;
+  capture->options = *options;
+  capture->line_cb = line_cb;
+  capture->done_cb = done_cb;
+  if (capture->options.high_water == 0) {
+    capture->options.high_water = PROC_CAPTURE_DEFAULT_HIGH_WATER;
+  }
+  if (capture->options.max_line == 0) {
+    capture->options.max_line = PROC_CAPTURE_DEFAULT_MAX_LINE;
+  }
+  capture->pool = capture->options.pool;
+  if (capture->pool == NULL) {
+    // 每个流积压到high_water之后最多再多读一个slab
+    buf_pool_init(&capture->own_pool, PROC_CAPTURE_SLAB_SIZE,
+                  2 * (capture->options.high_water + 2 * PROC_CAPTURE_SLAB_SIZE));
+    capture->pool = &capture->own_pool;
+  }
+  if (capture->pool->slab_size <= sizeof(proc_capture_chunk_t)) {
+    return UV_EINVAL;
+  }
+
+  for (i = 0; i < 2; i++) {
+    capture->streams[i].capture = capture;
+    capture->streams[i].fd = i + 1;
+    capture->streams[i].line = malloc(capture->options.max_line);
+    if (capture->streams[i].line == NULL) {
+      free(capture->streams[0].line);
+      free(capture->streams[1].line);
+      return UV_ENOMEM;
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    uv_pipe_init(loop, &capture->streams[i].pipe, 0);
+    capture->streams[i].pipe.data = &capture->streams[i];
+    stdio[i + 1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[i + 1].data.stream = (uv_stream_t *) &capture->streams[i].pipe;
+  }
+  stdio[0].flags = UV_IGNORE;
+  uv_timer_init(loop, &capture->retry_timer);
+  capture->retry_timer.data = capture;
+  capture->process.data = capture;
+  capture->handles = 4;
+
+  memset(&process_options, 0, sizeof(process_options));
+  process_options.file = capture->options.file;
+  process_options.args = capture->options.args;
+  process_options.exit_cb = exit_cb;
+  process_options.stdio = stdio;
+  process_options.stdio_count = 3;
+  r = uv_spawn(loop, &capture->process, &process_options);
+  if (r < 0) {
+    capture->failed = 1;
+    capture->closing = 1;
+    uv_close((uv_handle_t *) &capture->process, close_cb);
+    uv_close((uv_handle_t *) &capture->retry_timer, close_cb);
+    for (i = 0; i < 2; i++) {
+      uv_close((uv_handle_t *) &capture->streams[i].pipe, pipe_close_cb);
+    }
+    return r;
+  }
+
+  for (i = 0; i < 2; i++) {
+    update(&capture->streams[i]);
+  }
+  return 0;
+}
+
+void proc_capture_pause(proc_capture_t *capture) {
+  capture->paused = 1;
+}
+
+void proc_capture_resume(proc_capture_t *capture) {
+  int i;
+
+  capture->paused = 0;
+  for (i = 0; i < 2; i++) {
+    if (!capture->streams[i].done) {
+      deliver(&capture->streams[i]);
+      // deliver里又暂停了的话积压还在，update会按水位决定要不要读
+      update(&capture->streams[i]);
+    }
+  }
+}
+
+void proc_capture_print_stats(proc_capture_t *capture, FILE *stream) {
+  proc_capture_stats_t *stats = &capture->stats;
+
+  fprintf(stream, "proc capture: stdout[%llu bytes, %llu lines], stderr[%llu bytes, %llu lines], split lines[%llu], "
+                  "read stops[%llu], enobufs[%llu], max buffered[%zu KiB]\n",
+          (unsigned long long) stats->bytes[0], (unsigned long long) stats->lines[0],
+          (unsigned long long) stats->bytes[1], (unsigned long long) stats->lines[1],
+          (unsigned long long) stats->split_lines, (unsigned long long) stats->read_stops,
+          (unsigned long long) stats->enobufs, stats->max_buffered / 1024);
+}
@@ -0,0 +1,98 @@
+/*
+ * 把子进程的stdout/stderr读回父进程，按行交给回调
+ * UV_INHERIT_FD的话父进程拿不到子进程的输出；子进程每秒输出几百MB的时候，每次read都malloc、再拼成字符串也扛不住。
+ * 这里的做法是：
+ * 1、stdout和stderr各一个uv_pipe_t，alloc_cb从buf_pool借slab，slab开头放一个块头，数据直接读进后面，不再拷贝
+ * 2、边读边切行：完整落在一个slab里的行直接把slab里的指针交给line_cb；跨slab的半行拷到每个流自己的行缓冲里拼好再交，
+ *    超过max_line的行切成几段交(stats.split_lines)，行尾的'\n'不交
+ * 3、line_cb里可以调用proc_capture_pause暂停交付(当前这行或者切出来的这一段之后生效)，之后读到的slab先挂在流的队列里；
+ *    一个流没交付的数据超过high_water就uv_read_stop，子进程写满管道之后自己会阻塞，内存有上限；
+ *    proc_capture_resume把积压的交完，降到high_water一半以下再uv_read_start
+ * 4、buf_pool借不到slab时libuv以UV_ENOBUFS回调，这时也先停读，1ms之后再试
+ * 5、两个流都到了EOF、积压都交完、子进程也退出了之后关掉所有句柄，回调done_cb
+ * 子进程的stdin是UV_IGNORE。
+ */
+#ifndef LIBUV_DEMO_PROC_CAPTURE_H
+#define LIBUV_DEMO_PROC_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+#include "common.h"
+
+#define PROC_CAPTURE_SLAB_SIZE (64 * 1024)
+#define PROC_CAPTURE_DEFAULT_HIGH_WATER (1024 * 1024)
+#define PROC_CAPTURE_DEFAULT_MAX_LINE (64 * 1024)
+
+typedef struct proc_capture_s proc_capture_t;
+typedef struct proc_capture_chunk_s proc_capture_chunk_t;
+
+// fd是1(stdout)或者2(stderr)，line只在回调期间有效
+typedef void (*proc_capture_line_cb)(proc_capture_t *capture, int fd, const char *line, size_t len);
+typedef void (*proc_capture_done_cb)(proc_capture_t *capture, int64_t exit_status, int term_signal);
+
+typedef struct {
+  proc_capture_t *capture;
+  uv_pipe_t pipe;
+  int fd;
+  int reading;
+  int eof;
+  int done;
+  int starved;                  // buf_pool借不到slab，等重试
+  int delivering;
+  proc_capture_chunk_t *head;   // 读到了还没交付的slab
+  proc_capture_chunk_t *tail;
+  size_t buffered;
+  char *line;                   // 跨slab的半行
+  size_t line_len;
+} proc_capture_stream_t;
+
+typedef struct {
+  const char *file;
+  char **args;
+  buf_pool_t *pool;             // slab从哪借，NULL就用自己的池子；slab_size要比块头大
+  size_t high_water;            // 每个流最多积压多少字节，0表示PROC_CAPTURE_DEFAULT_HIGH_WATER
+  size_t max_line;              // 0表示PROC_CAPTURE_DEFAULT_MAX_LINE
+} proc_capture_options_t;
+
+typedef struct {
+  uint64_t bytes[2];            // 下标0是stdout，1是stderr
+  uint64_t lines[2];
+  uint64_t split_lines;         // 超过max_line被切开的次数
+  uint64_t read_stops;          // 因为积压超过high_water停读的次数
+  uint64_t enobufs;             // buf_pool借不到slab的次数
+  size_t max_buffered;          // 一个流最多积压过多少字节
+} proc_capture_stats_t;
+
+struct proc_capture_s {
+  void *data;
+  uv_loop_t *loop;
+  proc_capture_options_t options;
+  buf_pool_t own_pool;
+  buf_pool_t *pool;
+  uv_process_t process;
+  proc_capture_stream_t streams[2];
+  uv_timer_t retry_timer;
+  int paused;
+  int exited;
+  int closing;
+  int failed;                   // spawn失败，句柄关完之后不回调done_cb
+  int handles;
+  int64_t exit_status;
+  int term_signal;
+  proc_capture_line_cb line_cb;
+  proc_capture_done_cb done_cb;
+  proc_capture_stats_t stats;
+};
+
+// 启动子进程开始读它的输出；失败时返回错误，capture要等loop再跑一轮、句柄关完之后才能释放
+int proc_capture_spawn(uv_loop_t *loop, proc_capture_t *capture, const proc_capture_options_t *options,
+                       proc_capture_line_cb line_cb, proc_capture_done_cb done_cb);
+
+void proc_capture_pause(proc_capture_t *capture);
+
+void proc_capture_resume(proc_capture_t *capture);
+
+void proc_capture_print_stats(proc_capture_t *capture, FILE *stream);
+
+#endif //LIBUV_DEMO_PROC_CAPTURE_H
@@ -0,0 +1,469 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include "proc_pool.h"
+
+static int spawn_child(proc_pool_t *pool, proc_child_t *child);
+static void dispatch(proc_pool_t *pool);
+static void child_close_cb(uv_handle_t *handle);
+
+static void put32(char *p, uint32_t v) {
+  p[0] = (char) (v >> 24);
+  p[1] = (char) (v >> 16);
+  p[2] = (char) (v >> 8);
+  p[3] = (char) v;
+}
+
+static uint32_t get32(const char *p) {
+  const unsigned char *u = (const unsigned char *) p;
+  return (uint32_t) u[0] << 24 | (uint32_t) u[1] << 16 | (uint32_t) u[2] << 8 | u[3];
+}
+
+static void fail_job(proc_pool_t *pool, proc_job_t *job, int status) {
+  pool->stats.failed++;
+  job->cb(job, status, NULL);
+}
+
+// 还活着、没满的子进程里挑在途最少的
+static proc_child_t *pick(proc_pool_t *pool) {
+  proc_child_t *best = NULL;
+  proc_child_t *child;
+  int i;
+
+  for (i = 0; i < pool->options.children; i++) {
+    child = &pool->children[i];
+    if (child->alive && child->inflight < pool->options.max_inflight &&
+        (best == NULL || child->inflight < best->inflight)) {
+      best = child;
+    }
+  }
+  return best;
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  // 写失败说明子进程已经不在了，在途的任务在它的句柄关完之后统一失败
+}
+
+static int send_job(proc_child_t *child, proc_job_t *job) {
+  uv_buf_t bufs[2];
+  int r;
+
+  put32(job->header, (uint32_t) job->payload.len);
+  bufs[0] = uv_buf_init(job->header, FRAME_HEADER_SIZE);
+  bufs[1] = job->payload;
+  job->write_req.data = job;
+  r = uv_write(&job->write_req, (uv_stream_t *) &child->in, bufs, 2, write_cb);
+  if (r < 0) {
+    return r;
+  }
+
+  job->child = child;
+  job->next = NULL;
+  if (child->tail) child->tail->next = job;
+  else child->head = job;
+  child->tail = job;
+  child->inflight++;
+  return 0;
+}
+
+static void close_stdin(proc_child_t *child) {
+  if (!uv_is_closing((uv_handle_t *) &child->in)) {
+    uv_close((uv_handle_t *) &child->in, child_close_cb);
+  }
+}
+
+static int result_cb(frame_t *frame, void *arg) {
+  proc_child_t *child = (proc_child_t *) arg;
+  proc_pool_t *pool = child->pool;
+  proc_job_t *job = child->head;
+
+  // 子进程写了不是长度帧的东西，或者多回了结果，协议乱了，后面的帧也对不上任务了，
+  // 停止切帧，在途的任务等句柄关完之后统一失败
+  if (frame->type != FRAME_LENGTH || job == NULL) {
+    child->broken = 1;
+    return UV_EPROTO;
+  }
+  child->head = job->next;
+  if (child->head == NULL) {
+    child->tail = NULL;
+  }
+  child->inflight--;
+  child->completed++;
+  pool->stats.completed++;
+  job->cb(job, 0, &frame->payload);
+
+  if (pool->closing && child->inflight == 0) {
+    close_stdin(child);
+  }
+  return 0;
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  proc_child_t *child = (proc_child_t *) handle->data;
+  *buf = frame_ring_writable(&child->ring);
+}
+
+// 不再派任务也不再读结果，等它退出之后重启
+static void drop_child(proc_child_t *child) {
+  child->alive = 0;
+  child->broken = 1;
+  uv_read_stop((uv_stream_t *) &child->out);
+  uv_process_kill(&child->process, SIGTERM);
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  proc_child_t *child = (proc_child_t *) stream->data;
+  proc_pool_t *pool = child->pool;
+
+  // 每次读完都会切帧，环满了还凑不出一帧只能是协议乱了；不停读的话可读的fd会让loop空转
+  if (nread == UV_ENOBUFS) {
+    drop_child(child);
+    dispatch(pool);
+    return;
+  }
+  // EOF之后exit_cb会来
+  if (nread < 0) {
+    uv_read_stop(stream);
+    return;
+  }
+  if (nread == 0) {
+    return;
+  }
+  frame_ring_commit(&child->ring, nread);
+  if (frame_ring_parse(&child->ring, result_cb, child) < 0) {
+    drop_child(child);
+  }
+  dispatch(pool);
+}
+
+static void child_close_cb(uv_handle_t *handle) {
+  proc_child_t *child = (proc_child_t *) handle->data;
+  proc_pool_t *pool = child->pool;
+  proc_job_t *job, *next;
+  int i;
+
+  if (--child->handles > 0) {
+    return;
+  }
+
+  // 写请求的回调都已经回来了，在途的任务可以交还给使用方
+  job = child->head;
+  child->head = child->tail = NULL;
+  child->inflight = 0;
+  for (; job != NULL; job = next) {
+    next = job->next;
+    fail_job(pool, job, child->broken ? UV_EPROTO : UV_EPIPE);
+  }
+  frame_ring_release(&child->ring);
+
+  // 重启失败的话句柄关完还会回到这里，那时exited是0
+  if (child->exited && !pool->closing) {
+    if (spawn_child(pool, child) == 0) {
+      pool->stats.respawns++;
+      dispatch(pool);
+    }
+    return;
+  }
+
+  pool->running--;
+  if (pool->closing) {
+    if (pool->running == 0) {
+      if (pool->close_cb) {
+        pool->close_cb(pool);
+      }
+      for (i = 0; i < pool->options.children; i++) {
+        free(pool->children[i].ring_buf);
+      }
+      free(pool->children);
+      pool->children = NULL;
+    }
+    return;
+  }
+
+  // 一个活着的子进程都没有了，排队的任务等不到了
+  for (i = 0; i < pool->options.children; i++) {
+    if (pool->children[i].handles > 0) {
+      return;
+    }
+  }
+  while ((job = pool->queue_head) != NULL) {
+    pool->queue_head = job->next;
+    pool->queue_len--;
+    fail_job(pool, job, UV_ESRCH);
+  }
+  pool->queue_tail = NULL;
+}
+
+static void close_child(proc_child_t *child) {
+  child->alive = 0;
+  close_stdin(child);
+  uv_close((uv_handle_t *) &child->out, child_close_cb);
+  uv_close((uv_handle_t *) &child->process, child_close_cb);
+}
+
+static void exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  proc_child_t *child = (proc_child_t *) process->data;
+  child->exited = 1;
+  close_child(child);
+}
+
+static int spawn_child(proc_pool_t *pool, proc_child_t *child) {
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[3];
+  int r;
+
+  child->pool = pool;
+  child->alive = 0;
+  child->broken = 0;
+  child->exited = 0;
+  child->inflight = 0;
+  child->head = child->tail = NULL;
+  frame_ring_init(&child->ring);
+  frame_ring_attach(&child->ring, child->ring_buf, PROC_POOL_RING_SIZE);
+
+  uv_pipe_init(pool->loop, &child->in, 0);
+  uv_pipe_init(pool->loop, &child->out, 0);
+  child->in.data = child->out.data = child->process.data = child;
+
+  // 管道的读写方向是从子进程这边看的
+  stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+  stdio[0].data.stream = (uv_stream_t *) &child->in;
+  stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+  stdio[1].data.stream = (uv_stream_t *) &child->out;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = 2;
+
+  memset(&options, 0, sizeof(options));
+  options.file = pool->options.file;
+  options.args = pool->options.args;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  // 失败的时候三个句柄也都要关
+  child->handles = 3;
+  r = uv_spawn(pool->loop, &child->process, &options);
+  if (r == 0) {
+    r = uv_read_start((uv_stream_t *) &child->out, alloc_cb, read_cb);
+  }
+  if (r < 0) {
+    close_child(child);
+    return r;
+  }
+  child->alive = 1;
+  return 0;
+}
+
+static void dispatch(proc_pool_t *pool) {
+  proc_child_t *child;
+  proc_job_t *job;
+  int r;
+
+  while (pool->queue_head != NULL && (child = pick(pool)) != NULL) {
+    job = pool->queue_head;
+    pool->queue_head = job->next;
+    if (pool->queue_head == NULL) {
+      pool->queue_tail = NULL;
+    }
+    pool->queue_len--;
+    r = send_job(child, job);
+    if (r < 0) {
+      fail_job(pool, job, r);
+    }
+  }
+}
+
+int proc_pool_init(uv_loop_t *loop, proc_pool_t *pool, const proc_pool_options_t *options) {
+  int i, r;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->loop = loop;
+  pool->options = *options;
+  if (pool->options.children <= 0) {
+    pool->options.children = 1;
+  }
+  if (pool->options.max_inflight <= 0) {
+    pool->options.max_inflight = 1;
+  }
+
+  pool->children = calloc(pool->options.children, sizeof(proc_child_t));
+  if (pool->children == NULL) {
+    return UV_ENOMEM;
+  }
+  for (i = 0; i < pool->options.children; i++) {
+    pool->children[i].ring_buf = malloc(PROC_POOL_RING_SIZE);
+    if (pool->children[i].ring_buf == NULL) {
+      while (i > 0) {
+        free(pool->children[--i].ring_buf);
+      }
+      free(pool->children);
+      pool->children = NULL;
+      return UV_ENOMEM;
+    }
+  }
+  for (i = 0; i < pool->options.children; i++) {
+    pool->running++;
+    r = spawn_child(pool, &pool->children[i]);
+    if (r < 0) {
+      // 启动失败的那个已经在关句柄了，前面起来的关掉stdin让它们退出，
+      // 和proc_pool_close一样，最后一个句柄关完的时候释放子进程和环形缓冲
+      pool->closing = 1;
+      while (i > 0) {
+        close_stdin(&pool->children[--i]);
+      }
+      return r;
+    }
+  }
+  return 0;
+}
+
+int proc_pool_submit(proc_pool_t *pool, proc_job_t *job, const uv_buf_t *payload, proc_job_cb cb) {
+  proc_child_t *child;
+  int r;
+
+  if (pool->closing) {
+    return UV_ECANCELED;
+  }
+  if (payload->len > PROC_POOL_MAX_MESSAGE) {
+    return UV_E2BIG;
+  }
+  job->payload = *payload;
+  job->cb = cb;
+  job->child = NULL;
+  job->next = NULL;
+  pool->stats.submitted++;
+
+  // 前面还有排队的就不要插队
+  if (pool->queue_head == NULL && (child = pick(pool)) != NULL) {
+    r = send_job(child, job);
+    if (r < 0) {
+      pool->stats.submitted--;
+    }
+    return r;
+  }
+
+  if (pool->queue_tail) pool->queue_tail->next = job;
+  else pool->queue_head = job;
+  pool->queue_tail = job;
+  pool->stats.queued++;
+  if (++pool->queue_len > pool->stats.max_queue) {
+    pool->stats.max_queue = pool->queue_len;
+  }
+  return 0;
+}
+
+void proc_pool_close(proc_pool_t *pool, proc_pool_close_cb close_cb) {
+  proc_job_t *job;
+  int i;
+
+  pool->closing = 1;
+  pool->close_cb = close_cb;
+  while ((job = pool->queue_head) != NULL) {
+    pool->queue_head = job->next;
+    pool->queue_len--;
+    fail_job(pool, job, UV_ECANCELED);
+  }
+  pool->queue_tail = NULL;
+
+  // 子进程读到EOF自己退出，exit_cb里把剩下的句柄关掉
+  for (i = 0; i < pool->options.children; i++) {
+    if (pool->children[i].alive && pool->children[i].inflight == 0) {
+      close_stdin(&pool->children[i]);
+    }
+  }
+}
+
+void proc_pool_print_stats(proc_pool_t *pool, FILE *stream) {
+  proc_pool_stats_t *stats = &pool->stats;
+  int i;
+
+  fprintf(stream, "proc pool: submitted[%llu], completed[%llu], failed[%llu], queued[%llu], max queue[%llu], "
+                  "respawns[%llu], per child[",
+          (unsigned long long) stats->submitted, (unsigned long long) stats->completed,
+          (unsigned long long) stats->failed, (unsigned long long) stats->queued,
+          (unsigned long long) stats->max_queue, (unsigned long long) stats->respawns);
+  for (i = 0; i < pool->options.children; i++) {
+    fprintf(stream, i ? " %llu" : "%llu", (unsigned long long) pool->children[i].completed);
+  }
+  fprintf(stream, "]\n");
+}
+
+static int read_full(int fd, char *buf, size_t len) {
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    n = read(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return uv_translate_sys_error(errno);
+    }
+    if (n == 0) {
+      // 在帧的开头碰到EOF是正常结束
+      return done == 0 ? 0 : UV_EOF;
+    }
+    done += n;
+  }
+  return 1;
+}
+
+static int write_full(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return uv_translate_sys_error(errno);
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int proc_pool_serve(proc_pool_handler handler) {
+  char header[FRAME_HEADER_SIZE];
+  char *job = malloc(PROC_POOL_MAX_MESSAGE);
+  char *result = malloc(FRAME_HEADER_SIZE + PROC_POOL_MAX_MESSAGE);
+  uint32_t len;
+  size_t n;
+  int r;
+
+  if (job == NULL || result == NULL) {
+    free(job);
+    free(result);
+    return UV_ENOMEM;
+  }
+  for (;;) {
+    r = read_full(0, header, FRAME_HEADER_SIZE);
+    if (r <= 0) {
+      break;
+    }
+    len = get32(header);
+    if (len > PROC_POOL_MAX_MESSAGE) {
+      r = UV_E2BIG;
+      break;
+    }
+    r = read_full(0, job, len);
+    if (r < 0 || (r == 0 && len > 0)) {
+      r = r < 0 ? r : UV_EOF;
+      break;
+    }
+    n = handler(job, len, result + FRAME_HEADER_SIZE, PROC_POOL_MAX_MESSAGE);
+    put32(result, (uint32_t) n);
+    r = write_full(1, result, FRAME_HEADER_SIZE + n);
+    if (r < 0) {
+      break;
+    }
+  }
+  free(job);
+  free(result);
+  return r;
+}
@@ -0,0 +1,107 @@
+/*
+ * 预先启动的子进程池
+ * 每个任务都uv_spawn一次的话，fork/exec、动态链接、子进程初始化的开销每次都要付，任务本身只有几百微秒的时候这些开销占了大头。
+ * 这里一开始就启动children个常驻的子进程，任务通过它们的stdin/stdout管道来回传：
+ * 1、父子之间的协议是长度帧：4字节大端长度 + 内容，父进程往子进程的stdin写任务，子进程按收到的顺序一个个做，
+ *    结果以同样的格式写到stdout；父进程这边用framing.c的环形缓冲切帧，所以结果和在途任务的FIFO一一对应，不需要任务ID
+ * 2、每个子进程最多同时有max_inflight个任务在途，任务交给在途最少的子进程，都满了就在池子里排队
+ * 3、子进程挂了，它的在途任务以UV_EPIPE回调，然后重新启动一个补上；回复不合协议(不是长度帧或者多回了结果)的子进程
+ *    不再派任务、停止读它的结果并杀掉，在途任务以UV_EPROTO回调
+ * 4、关闭时关掉子进程的stdin，子进程读到EOF自己退出，所有子进程都退出之后回调close_cb
+ * 子进程那一边调用proc_pool_serve，它是一个阻塞的读-处理-写循环，不需要libuv。
+ */
+#ifndef LIBUV_DEMO_PROC_POOL_H
+#define LIBUV_DEMO_PROC_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+#include "framing.h"
+
+#define PROC_POOL_RING_SIZE (256 * 1024)
+// 任务和结果的最大长度，一帧最多占环形缓冲的一半
+#define PROC_POOL_MAX_MESSAGE (PROC_POOL_RING_SIZE / 2 - FRAME_HEADER_SIZE)
+
+typedef struct proc_pool_s proc_pool_t;
+typedef struct proc_child_s proc_child_t;
+typedef struct proc_job_s proc_job_t;
+
+// result只在回调期间有效
+typedef void (*proc_job_cb)(proc_job_t *job, int status, const uv_buf_t *result);
+typedef void (*proc_pool_close_cb)(proc_pool_t *pool);
+// 子进程里处理一个任务，把结果写进result(最多PROC_POOL_MAX_MESSAGE字节)，返回结果的长度
+typedef size_t (*proc_pool_handler)(const char *job, size_t len, char *result, size_t cap);
+
+struct proc_job_s {
+  void *data;
+  uv_buf_t payload;             // 回调之前要一直有效
+  proc_job_cb cb;
+  proc_child_t *child;
+  uv_write_t write_req;
+  char header[FRAME_HEADER_SIZE];
+  proc_job_t *next;
+};
+
+struct proc_child_s {
+  proc_pool_t *pool;
+  uv_process_t process;
+  uv_pipe_t in;                 // 子进程的stdin，父进程写
+  uv_pipe_t out;                // 子进程的stdout，父进程读
+  frame_ring_t ring;
+  proc_job_t *head;             // 在途的任务，按写出去的顺序
+  proc_job_t *tail;
+  char *ring_buf;
+  int inflight;
+  int alive;
+  int broken;                   // 回复不合协议，在途任务的结果都不能信了
+  int exited;                   // 自己退出的，句柄关完之后要重新启动
+  int handles;
+  uint64_t completed;
+};
+
+typedef struct {
+  const char *file;
+  char **args;
+  int children;
+  int max_inflight;
+} proc_pool_options_t;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t queued;              // 提交的时候所有子进程都满了、要排队的次数
+  uint64_t max_queue;
+  uint64_t respawns;
+} proc_pool_stats_t;
+
+struct proc_pool_s {
+  uv_loop_t *loop;
+  void *data;
+  proc_pool_options_t options;
+  proc_child_t *children;
+  proc_job_t *queue_head;
+  proc_job_t *queue_tail;
+  uint64_t queue_len;
+  int closing;
+  int running;                  // 还没完全退出的子进程
+  proc_pool_close_cb close_cb;
+  proc_pool_stats_t stats;
+};
+
+// 有子进程启动失败时返回错误，这时pool已经不能用了，也不要再调用proc_pool_close：已经启动的子进程会被关掉stdin，
+// 在loop里退出之后子进程和环形缓冲一起释放，所以pool要一直有效到loop跑完。内存不够返回UV_ENOMEM时什么都不用等
+int proc_pool_init(uv_loop_t *loop, proc_pool_t *pool, const proc_pool_options_t *options);
+
+// payload超过PROC_POOL_MAX_MESSAGE时返回UV_E2BIG
+int proc_pool_submit(proc_pool_t *pool, proc_job_t *job, const uv_buf_t *payload, proc_job_cb cb);
+
+// 排队的任务以UV_ECANCELED回调，在途的任务等子进程做完；close_cb之后pool里的子进程都释放了
+void proc_pool_close(proc_pool_t *pool, proc_pool_close_cb close_cb);
+
+void proc_pool_print_stats(proc_pool_t *pool, FILE *stream);
+
+// 在子进程里调用，处理到stdin的EOF为止，正常结束返回0
+int proc_pool_serve(proc_pool_handler handler);
+
+#endif //LIBUV_DEMO_PROC_POOL_H
@@ -2,10 +2,18 @@
  * 利用libuv创建进程都是用的这个方法：uv_spawn，libuv通过起另外一个进程去执行对应的文件
  * 子进程的打印信息通过配置参数可以打印出来的
  * https://stackoverflow.com/questions/14751504/capture-a-child-processs-stdout-with-libuv
+ * 用法：
+ * ProcessHandle                        起一个FsHandle子进程，继承stdout/stderr
+ * ProcessHandle pool [children] [jobs] 起children个常驻的worker子进程(proc_pool.h)，把jobs个任务分给它们做
+ * ProcessHandle worker                 进程池的子进程，从stdin读任务，结果写到stdout
+ * ProcessHandle capture <file> [args...] 运行file，stdout/stderr按行读回来(proc_capture.h)，加上前缀打印
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include "uv.h"
 #include "common.h"
+#include "proc_pool.h"
+#include "proc_capture.h"
 
 char exepath[PATH_MAX];
 
@@ -28,15 +36,126 @@ char* exepath_for_process() {
   return exepath;
 }
 
-int main() {
+// 任务是要忙多少微秒，结果是谁做的、做了多久
+static size_t worker_handler(const char *job, size_t len, char *result, size_t cap) {
+  char text[32];
+  uint64_t start = uv_hrtime();
+  uint64_t us;
+
+  snprintf(text, sizeof(text), "%.*s", (int) (len < sizeof(text) ? len : sizeof(text) - 1), job);
+  us = strtoull(text, NULL, 10);
+  while (uv_hrtime() - start < us * 1000) {
+  }
+  return (size_t) snprintf(result, cap, "pid %d spun %lluus", uv_os_getpid(), (unsigned long long) us);
+}
+
+static int pool_jobs = 100;
+static int pool_done;
+static proc_job_t *pool_job_list;
+static char (*pool_payloads)[16];
+
+static void pool_close_cb(proc_pool_t *pool) {
+  printf("pool closed\n");
+}
+
+static void pool_job_cb(proc_job_t *job, int status, const uv_buf_t *result) {
+  proc_pool_t *pool = (proc_pool_t *) job->data;
+
+  if (status < 0) {
+    printf("job %d failed: %s\n", (int) (job - pool_job_list), uv_strerror(status));
+  } else if (job - pool_job_list < 5) {
+    printf("job %d: %.*s\n", (int) (job - pool_job_list), (int) result->len, result->base);
+  }
+  if (++pool_done == pool_jobs) {
+    proc_pool_print_stats(pool, stdout);
+    proc_pool_close(pool, pool_close_cb);
+  }
+}
+
+static int run_pool(uv_loop_t *loop, int children) {
+  size_t size = PATH_MAX;
+  char *args[3] = { exepath, "worker", NULL };
+  proc_pool_options_t options;
+  proc_pool_t pool;
+  uv_buf_t payload;
+  uint64_t start;
+  int i, r;
+
+  r = uv_exepath(exepath, &size);
+  CHECK(r, "uv_exepath");
+
+  memset(&options, 0, sizeof(options));
+  options.file = exepath;
+  options.args = args;
+  options.children = children;
+  options.max_inflight = 2;
+  r = proc_pool_init(loop, &pool, &options);
+  CHECK(r, "proc_pool_init");
+
+  pool_job_list = calloc(pool_jobs, sizeof(proc_job_t));
+  pool_payloads = calloc(pool_jobs, sizeof(pool_payloads[0]));
+  if (pool_job_list == NULL || pool_payloads == NULL) {
+    CHECK(UV_ENOMEM, "calloc");
+  }
+  start = uv_hrtime();
+  for (i = 0; i < pool_jobs; i++) {
+    snprintf(pool_payloads[i], sizeof(pool_payloads[i]), "%d", 100 + i % 10 * 100);
+    payload = uv_buf_init(pool_payloads[i], (unsigned int) strlen(pool_payloads[i]));
+    pool_job_list[i].data = &pool;
+    r = proc_pool_submit(&pool, &pool_job_list[i], &payload, pool_job_cb);
+    CHECK(r, "proc_pool_submit");
+  }
+  uv_run(loop, UV_RUN_DEFAULT);
+  printf("%d jobs on %d children in %.2fms\n", pool_jobs, children, (uv_hrtime() - start) / 1e6);
+  free(pool_job_list);
+  free(pool_payloads);
+  return 0;
+}
+
+static void capture_line_cb(proc_capture_t *capture, int fd, const char *line, size_t len) {
+  printf("[%s] %.*s\n", fd == 1 ? "out" : "err", (int) len, line);
+}
+
+static void capture_done_cb(proc_capture_t *capture, int64_t exit_status, int term_signal) {
+  proc_capture_print_stats(capture, stdout);
+  printf("Process exited with status %lld, signal %d\n", (long long) exit_status, term_signal);
+}
+
+static int run_capture(uv_loop_t *loop, char **args) {
+  proc_capture_options_t options;
+  proc_capture_t capture;
+  int r;
+
+  memset(&options, 0, sizeof(options));
+  options.file = args[0];
+  options.args = args;
+  r = proc_capture_spawn(loop, &capture, &options, capture_line_cb, capture_done_cb);
+  CHECK(r, "proc_capture_spawn");
+  return uv_run(loop, UV_RUN_DEFAULT);
+}
+
+int main(int argc, char **argv) {
   uv_loop_t *loop = uv_default_loop();
   int r = 0;
   uv_process_t process_handle;
   uv_process_options_t options;
 
+  if (argc > 1 && strcmp(argv[1], "worker") == 0) {
+    return proc_pool_serve(worker_handler) < 0 ? 1 : 0;
+  }
+  if (argc > 2 && strcmp(argv[1], "capture") == 0) {
+    return run_capture(loop, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "pool") == 0) {
+    if (argc > 3) pool_jobs = atoi(argv[3]);
+    return run_pool(loop, argc > 2 ? atoi(argv[2]) : get_cpu_count());
+  }
+
   const char* exepath = exepath_for_process();
   char *args[3] = { (char*) exepath, NULL, NULL };
 
+  memset(&options, 0, sizeof(options));
+
   options.exit_cb = on_exit;
   options.file = exepath;
   options.args = args;
@@ -9,21 +9,225 @@
  *    4.3、开始读取客户端请求的数据：uv_read_start()
  *    4.4、读取结束之后做对应操作，如果需要响应客户端数据，调用uv_write，回写数据即可。
  * 除了上述知识点，本demo还用到了timer句柄。
+ *
+ * 读到的数据先经过framing.h的分帧：一次read里的多条命令会被逐条切出来，半条命令留在连接的环形缓冲里等下次read，
+ * 回复先放进连接的输出队列，同一轮事件循环里产生的回复在check阶段统一用一次uv_write(多个uv_buf_t)写回给客户端，
+ * uv_write_t从分片的请求池里复用。客户端不读回复导致libuv的写队列超过OUTPUT_HIGH_WATER时暂停读取这个连接，
+ * 等写队列降到OUTPUT_LOW_WATER以下再恢复，避免不读数据的客户端把服务器的内存撑爆。
+ *
+ * 分片模式(TcpHandle N，N<=0表示按CPU个数)：
+ * 单个loop只能用满一个核，分片模式下启动N个线程，每个线程有自己的uv_loop_t和监听句柄，
+ * 这些监听socket都打开了SO_REUSEPORT并绑定在同一个HOST:PORT上，由内核把新连接分散到各个线程。
+ * 主线程的loop只跑定时器，每10秒打印一次各分片的连接数和请求数。
+ *
+ * 文件服务(GET <path>)：path相对于启动时指定的root，不允许出现".."。回复不管请求是哪种帧，都是"OK <size>\n"加上文件内容，
+ * 打开失败时回复"ERR ..."。文件内容用uv_fs_sendfile从页缓存直接写进socket，不经过用户态缓冲：
+ * 1、打开的fd按分片缓存在fd_cache里(见fd_cache.h)，热门文件不用每次都open/fstat/close
+ * 2、sendfile直接写socket，不经过libuv的写队列，所以要等前面的回复都交给内核之后才能开始，
+ *    GET后面的回复也要排在这个GET后面，等文件发完再写
+ * 3、每次最多发FILE_CHUNK_SIZE，socket缓冲满了(EAGAIN或者只发出去一部分)就用uv_poll_t等socket可写再接着发。
+ *    poll用的是dup出来的fd，不会和连接自己的uv_tcp_t抢同一个fd的epoll注册
+ * 环境变量TCP_SENDFILE=0时改成uv_fs_read读到缓冲里再uv_write，用来对比。
+ * 注意：有的libuv版本(比如1.44)在Linux上会先试copy_file_range，目标是socket时失败后直接走read/write模拟，
+ * 每次只搬8KiB，还会在线程池里poll等socket，sendfile反而比读+uv_write慢，对比之前先确认libuv的版本。
+ * 用法：TcpHandle [shards] [root]
  */
 
 #include <stdio.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include "uv.h"
 #include "common.h"
+#include "framing.h"
+#include "dispatcher.h"
+#include "fd_cache.h"
 
 
 #define HOST "0.0.0.0"
 #define PORT 9999
 
-// 静态tcp句柄
-static uv_tcp_t tcp_server_handle;
+// 写队列超过高水位暂停读，降到低水位以下恢复
+#define OUTPUT_HIGH_WATER (256 * 1024)
+#define OUTPUT_LOW_WATER  (64 * 1024)
+
+// GET每次最多发这么多字节
+#define FILE_CHUNK_SIZE (256 * 1024)
+// 一个连接排队的GET超过这个数就暂停读它的请求
+#define FILE_JOBS_MAX 16
+#define FD_CACHE_CAPACITY 256
+#define FD_CACHE_VALID_MS 1000
+
+typedef struct tcp_client_s tcp_client_t;
+typedef struct file_job_s file_job_t;
+
+// 每个分片一个loop、一个监听句柄、一个读缓冲池，以及给定时器看的计数器
+// 计数器由分片线程写、主线程读，所以用原子变量
+typedef struct {
+  int id;
+  uv_loop_t *loop;
+  uv_thread_t thread;
+  uv_tcp_t tcp_server_handle;
+  buf_pool_t buf_pool;
+  // uv_write_t也是固定大小的，直接用buf_pool做它的空闲链表
+  buf_pool_t write_req_pool;
+  // 这一轮事件循环里有回复要写的连接，在check阶段统一flush
+  uv_check_t flush_handle;
+  tcp_client_t *dirty_clients;
+  fd_cache_t fd_cache;
+  atomic_ullong connections;  // 累计接受的连接数
+  atomic_ullong active;       // 当前还没关闭的连接数
+  atomic_ullong requests;     // 累计处理的请求数
+  atomic_ullong writes;       // 累计调用uv_write的次数
+  atomic_ullong paused;       // 累计因为写队列过高暂停读的次数
+  atomic_ullong files;        // 累计发完的文件数
+} tcp_shard_t;
+
+static tcp_shard_t *shards;
+static int shard_count = 1;
+static const char *root = ".";
+static int use_sendfile = 1;
+
+// 每个客户端连接的状态，handle放在第一个，这样uv_tcp_t *和tcp_client_t *可以直接互相转换
+struct tcp_client_s {
+  uv_tcp_t handle;
+  tcp_shard_t *shard;
+  frame_ring_t ring;
+  // 输出队列：这一轮事件循环里攒下来的回复，check阶段用一次uv_write发出去
+  uv_buf_t *replies;
+  size_t reply_count;
+  size_t reply_cap;
+  int dirty;                  // 是否已经在分片的dirty_clients链表里
+  tcp_client_t *next_dirty;
+  int reading_paused;         // 是否因为写队列过高或者GET排队太多暂停了读
+  frame_type_t frame_type;    // 正在分发的这一帧的格式
+  // 还没发完的GET，按请求的顺序排队，只有队头在发
+  file_job_t *jobs_head;
+  file_job_t *jobs_tail;
+  int job_count;
+  int eof;                    // 客户端已经发完了，GET都发完之后再shutdown
+  int shutdown;
+  buf_pool_waiter_t waiter;   // 读缓冲池借不到slab时排队等归还
+};
+
+typedef enum {
+  JOB_OPENING,  // 等fd_cache
+  JOB_READY,    // 打开好了(或者失败了)，等前面的回复写完
+  JOB_HEADER,   // "OK <size>\n"已经交给uv_write，等它写进内核
+  JOB_SENDING   // 正在发文件内容
+} job_state_t;
+
+struct file_job_s {
+  tcp_client_t *client;       // 连接关闭之后置为NULL，等在途的请求回来再释放
+  file_job_t *next;
+  job_state_t state;
+  frame_type_t type;
+  int status;                 // 打开失败的错误码
+  int busy;                   // 有fd_cache或者uv_fs、uv_write请求在途
+  fd_cache_entry_t *entry;
+  uint64_t offset;
+  size_t chunk;               // 正在发的这一块的长度
+  uv_os_fd_t sock;            // dup出来的socket，给sendfile和poll用，-1表示还没有
+  uv_poll_t poll;
+  uv_fs_t req;
+  char *buf;                  // TCP_SENDFILE=0时读文件的缓冲
+  char header[32];
+  // 排在这个GET后面的回复，GET发完之后才能写
+  uv_buf_t *replies;
+  size_t reply_count;
+  size_t reply_cap;
+};
+
+// 命令表：新增命令只需要在这里加一行，回复在编译期就编码好了，分发时直接引用静态内存
+const command_reply_t *get_handler(const command_t *command, const uv_buf_t *args, void *ctx);
+
+static const command_t commands[] = {
+  { "Hello", NULL, COMMAND_REPLY("world\n") },
+  { "Libuv", NULL, COMMAND_REPLY("I love\n") },
+  // path不合法时回复这条，其他情况由处理函数自己回复
+  { "GET", get_handler, COMMAND_REPLY("ERR bad path\n") },
+};
+
+static const command_reply_t unknown_reply = COMMAND_REPLY("Unknown argot\n");
+static const command_reply_t not_found_reply = COMMAND_REPLY("ERR not found\n");
+static const command_reply_t not_file_reply = COMMAND_REPLY("ERR not a file\n");
+static const command_reply_t io_error_reply = COMMAND_REPLY("ERR io\n");
+
+// 所有分片共用一个分发表，初始化之后只读，不需要加锁
+static dispatcher_t dispatcher;
+
+void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+void flush_cb(uv_check_t *handle);
+void pump_jobs(tcp_client_t *client);
+
+void push_reply(uv_buf_t **replies, size_t *count, size_t *cap, uv_buf_t buf) {
+  if (*count == *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    *replies = realloc(*replies, *cap * sizeof(uv_buf_t));
+  }
+  (*replies)[(*count)++] = buf;
+}
+
+// 第一次有回复的时候挂到分片的dirty链表上，等check阶段统一flush
+void mark_dirty(tcp_client_t *client) {
+  if (!client->dirty) {
+    tcp_shard_t *shard = client->shard;
+    client->dirty = 1;
+    client->next_dirty = shard->dirty_clients;
+    if (shard->dirty_clients == NULL) {
+      uv_check_start(&shard->flush_handle, flush_cb);
+    }
+    shard->dirty_clients = client;
+  }
+}
+
+void job_close_cb(uv_handle_t *handle) {
+  file_job_t *job = handle->data;
+  close(job->sock);
+  free(job);
+}
+
+void job_free(file_job_t *job) {
+  if (job->entry != NULL) {
+    fd_cache_release(job->entry);
+  }
+  free(job->replies);
+  free(job->buf);
+
+  // poll句柄关掉之后才能关dup出来的fd
+  if (job->sock >= 0) {
+    job->poll.data = job;
+    uv_close((uv_handle_t *) &job->poll, job_close_cb);
+    return;
+  }
+  free(job);
+}
+
+void close_cb(uv_handle_t *handle) {
+  tcp_client_t *client = (tcp_client_t *) handle;
+  file_job_t *job = client->jobs_head;
+  atomic_fetch_sub_explicit(&client->shard->active, 1, memory_order_relaxed);
+
+  // 还有请求在途的GET先留着，等请求回来再释放
+  while (job != NULL) {
+    file_job_t *next = job->next;
+    if (job->busy) {
+      job->client = NULL;
+    } else {
+      job_free(job);
+    }
+    job = next;
+  }
+
+  buf_pool_unwait(buf_pool_from_loop(handle->loop), &client->waiter);
+
+  // 环形缓冲里可能还留着半帧，内存要还给池子
+  if (client->ring.base != NULL) {
+    buf_pool_free(buf_pool_from_loop(handle->loop), frame_ring_detach(&client->ring));
+  }
+  frame_ring_release(&client->ring);
 
-void close_cb(uv_handle_t *client) {
   // 释放这个tcp_client_handle
+  free(client->replies);
   free(client);
   printf("connection closed\n");
 }
@@ -35,71 +239,590 @@ void shutdown_cb(uv_shutdown_t *req, int status) {
 }
 
 void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-  buf->base = malloc(suggested_size);
-  buf->len = suggested_size;
-  if (buf->base == NULL) {
-    printf("alloc_cb malloc buffer error\n");
+  tcp_client_t *client = (tcp_client_t *) handle;
+
+  // 连接空闲的时候环形缓冲的内存是还给池子的，有数据要读的时候再借一块slab
+  if (client->ring.base == NULL) {
+    uv_buf_t slab = buf_pool_alloc(buf_pool_from_loop(handle->loop));
+    if (slab.base == NULL) {
+      printf("alloc_cb buffer pool exhausted\n");
+      *buf = slab;
+      return;
+    }
+    frame_ring_attach(&client->ring, slab.base, slab.len);
+  }
+
+  // 直接读到环形缓冲的空闲区域里
+  *buf = frame_ring_writable(&client->ring);
+}
+
+// 客户端不读回复导致写队列过高，或者排队的GET太多，就暂停读它的请求；两者都降下来之后再恢复
+void update_reading(tcp_client_t *client) {
+  uv_stream_t *stream = (uv_stream_t *) &client->handle;
+  size_t queued;
+
+  if (uv_is_closing((uv_handle_t *) stream) || client->eof) {
+    return;
+  }
+
+  queued = uv_stream_get_write_queue_size(stream);
+  if (!client->reading_paused && (queued > OUTPUT_HIGH_WATER || client->job_count >= FILE_JOBS_MAX)) {
+    client->reading_paused = 1;
+    uv_read_stop(stream);
+    atomic_fetch_add_explicit(&client->shard->paused, 1, memory_order_relaxed);
+  } else if (client->reading_paused && queued <= OUTPUT_LOW_WATER && client->job_count < FILE_JOBS_MAX) {
+    client->reading_paused = 0;
+    uv_read_start(stream, alloc_cb, read_cb);
   }
 }
 
 void write_cb(uv_write_t* req, int status) {
-  CHECK(status, "write_cb");
-  // 释放掉我们之前分配的uv_write_req
+  tcp_client_t *client = (tcp_client_t *) req->handle;
+
+  // 连接被关闭的时候还没写完的请求会以UV_ECANCELED回调，这不是错误
+  if (status < 0 && status != UV_ECANCELED) {
+    fprintf(stderr, "write_cb: [%s: %s]\n", uv_err_name(status), uv_strerror(status));
+  }
 
-  printf("server had reponsed\n");
+  // uv_write_t还给请求池，回复的buf都是静态的，不需要释放
+  buf_pool_free(&client->shard->write_req_pool, (char *) req);
 
-  write_req_t *write_req = (write_req_t *)req;
+  // 客户端开始读回复了，写队列降下来之后恢复读取；排队的GET也可能在等写队列清空
+  if (!uv_is_closing((uv_handle_t *) client)) {
+    update_reading(client);
+    pump_jobs(client);
+  }
+}
+
+void queue_reply(tcp_client_t *client, uv_buf_t buf) {
+  // 前面还有GET没发完，回复排在最后一个GET后面，保证回复的顺序和请求一致
+  if (client->jobs_tail != NULL) {
+    file_job_t *job = client->jobs_tail;
+    push_reply(&job->replies, &job->reply_count, &job->reply_cap, buf);
+    return;
+  }
+
+  push_reply(&client->replies, &client->reply_count, &client->reply_cap, buf);
+  mark_dirty(client);
+}
+
+// 长度帧：头和内容是两个buf，内容不带\n
+int reply_bufs(const command_reply_t *reply, frame_type_t type, uv_buf_t bufs[2]) {
+  if (type == FRAME_LENGTH) {
+    bufs[0] = uv_buf_init((char *) reply->header, FRAME_HEADER_SIZE);
+    bufs[1] = reply->body;
+    return 2;
+  }
+  bufs[0] = reply->line;
+  return 1;
+}
 
-  // 这里不再需要特殊释放，因为这里的Buf不是malloc的
-//  free(write_req->buf.base);
-  free(write_req);
+void reply_to_client(tcp_client_t *client, const command_reply_t *reply, frame_type_t type) {
+  uv_buf_t bufs[2];
+  int i, n = reply_bufs(reply, type, bufs);
+
+  for (i = 0; i < n; i++) {
+    queue_reply(client, bufs[i]);
+  }
 }
 
-void write_to_client(char *resp, uv_stream_t* stream) {
+// 用一次uv_write把bufs写出去，uv_write会拷贝uv_buf_t数组，所以bufs可以马上复用
+void write_bufs(tcp_client_t *client, uv_buf_t *bufs, size_t count) {
   int r = 0;
-  write_req_t * write_req = malloc(sizeof(uv_fs_t));
-  write_req->buf = uv_buf_init(resp, sizeof(resp));
-  r = uv_write(&write_req->req, stream, &write_req->buf, sizeof(resp), write_cb);
+  uv_stream_t *stream = (uv_stream_t *) &client->handle;
+
+  uv_buf_t slab = buf_pool_alloc(&client->shard->write_req_pool);
+  if (slab.base == NULL) {
+    CHECK(UV_ENOMEM, "write_req_pool");
+  }
+
+  uv_write_t *write_req = (uv_write_t *) slab.base;
+  r = uv_write(write_req, stream, bufs, count, write_cb);
   CHECK(r, "uv_write");
+  atomic_fetch_add_explicit(&client->shard->writes, 1, memory_order_relaxed);
+
+  // uv_write会先尝试直接写，写不完的部分才留在写队列里，说明客户端没有及时读取，暂停读它的请求
+  update_reading(client);
+}
+
+// 把攒下来的所有回复用一次uv_write写出去
+void flush_replies(tcp_client_t *client) {
+  uv_stream_t *stream = (uv_stream_t *) &client->handle;
+
+  if (client->reply_count == 0) {
+    return;
+  }
+
+  // 连接已经在关闭了，回复也就不用再写了
+  if (uv_is_closing((uv_handle_t *) stream)) {
+    client->reply_count = 0;
+    return;
+  }
+
+  write_bufs(client, client->replies, client->reply_count);
+  client->reply_count = 0;
+
+  // 回复都交出去了，排在后面的GET可能可以开始了
+  pump_jobs(client);
+}
+
+// check阶段在所有I/O回调之后，这一轮产生的回复在这里一次性写出去
+void flush_cb(uv_check_t *handle) {
+  tcp_shard_t *shard = handle->data;
+  tcp_client_t *client;
+
+  // flush的时候GET可能当场发完，排在它后面的回复又把连接挂回链表，所以一直flush到链表为空
+  while ((client = shard->dirty_clients) != NULL) {
+    shard->dirty_clients = NULL;
+    while (client != NULL) {
+      tcp_client_t *next = client->next_dirty;
+      client->dirty = 0;
+      client->next_dirty = NULL;
+      flush_replies(client);
+      client = next;
+    }
+  }
+  uv_check_stop(handle);
+}
+
+// shutdown之后就不能再写了，所以输出队列里的回复要先写出去
+void shutdown_client(tcp_client_t *client) {
+  int r = 0;
+  uv_stream_t *stream = (uv_stream_t *) &client->handle;
+
+  client->shutdown = 1;
+  flush_replies(client);
+  uv_shutdown_t *shutdown_req = malloc(sizeof(uv_shutdown_t));
+  r = uv_shutdown(shutdown_req, stream, shutdown_cb);
+  CHECK(r, "uv_shutdown");
+}
+
+// 文件发到一半出错，已经回复了长度，只能断开连接
+void abort_job(file_job_t *job, int status) {
+  fprintf(stderr, "sending %s: [%s: %s]\n", job->entry ? job->entry->path : "file",
+          uv_err_name(status), uv_strerror(status));
+  if (!uv_is_closing((uv_handle_t *) job->client)) {
+    uv_close((uv_handle_t *) job->client, close_cb);
+  }
+}
+
+// 队头的GET发完了，排在它后面的回复转到连接的输出队列里，接着处理下一个GET
+void job_finish(file_job_t *job) {
+  tcp_client_t *client = job->client;
+  size_t i;
+
+  client->jobs_head = job->next;
+  if (client->jobs_head == NULL) {
+    client->jobs_tail = NULL;
+  }
+  client->job_count--;
+  if (job->status == 0) {
+    atomic_fetch_add_explicit(&client->shard->files, 1, memory_order_relaxed);
+  }
+
+  for (i = 0; i < job->reply_count; i++) {
+    push_reply(&client->replies, &client->reply_count, &client->reply_cap, job->replies[i]);
+  }
+  if (client->reply_count > 0) {
+    mark_dirty(client);
+  }
+  job_free(job);
+
+  update_reading(client);
+  pump_jobs(client);
+}
+
+void send_chunk(file_job_t *job);
+
+void poll_cb(uv_poll_t *handle, int status, int events) {
+  file_job_t *job = handle->data;
+
+  uv_poll_stop(handle);
+  if (uv_is_closing((uv_handle_t *) job->client)) {
+    return;
+  }
+  if (status < 0) {
+    abort_job(job, status);
+    return;
+  }
+  send_chunk(job);
+}
+
+void sendfile_cb(uv_fs_t *req) {
+  file_job_t *job = req->data;
+  ssize_t result = req->result;
+
+  uv_fs_req_cleanup(req);
+  job->busy = 0;
+  if (job->client == NULL) {
+    job_free(job);
+    return;
+  }
+  if (uv_is_closing((uv_handle_t *) job->client)) {
+    return;
+  }
+
+  if (result < 0 && result != UV_EAGAIN) {
+    abort_job(job, (int) result);
+    return;
+  }
+  // 和file_read_cb一样，还没发完就返回0说明文件被截短了，不能再去等可写
+  if (result == 0) {
+    abort_job(job, UV_EIO);
+    return;
+  }
+  if (result > 0) {
+    job->offset += result;
+  }
+
+  // socket缓冲满了，等它可写了再发
+  if (job->offset < job->entry->size && (result == UV_EAGAIN || (size_t) result < job->chunk)) {
+    job->poll.data = job;
+    uv_poll_start(&job->poll, UV_WRITABLE, poll_cb);
+    return;
+  }
+  send_chunk(job);
+}
+
+void file_write_cb(uv_write_t *req, int status) {
+  file_job_t *job = req->data;
+  tcp_client_t *client = (tcp_client_t *) req->handle;
+
+  buf_pool_free(&client->shard->write_req_pool, (char *) req);
+  job->busy = 0;
+
+  // 连接关闭的时候会先以UV_ECANCELED回调，之后close_cb再释放job
+  if (status < 0) {
+    if (status != UV_ECANCELED) {
+      abort_job(job, status);
+    }
+    return;
+  }
+  job->offset += job->chunk;
+  send_chunk(job);
+}
+
+void file_read_cb(uv_fs_t *req) {
+  file_job_t *job = req->data;
+  ssize_t result = req->result;
+  uv_write_t *write_req;
+  uv_buf_t buf;
+  int r;
+
+  uv_fs_req_cleanup(req);
+  job->busy = 0;
+  if (job->client == NULL) {
+    job_free(job);
+    return;
+  }
+  if (uv_is_closing((uv_handle_t *) job->client)) {
+    return;
+  }
+
+  // 读到0说明文件在发送的过程中被截短了，长度已经回复出去，没法补救
+  if (result <= 0) {
+    abort_job(job, result < 0 ? (int) result : UV_EIO);
+    return;
+  }
+
+  // 缓冲要等这次写完才能读下一块，所以写完一块再读一块，速度也就被socket的可写速度限制住了
+  write_req = (uv_write_t *) buf_pool_alloc(&job->client->shard->write_req_pool).base;
+  if (write_req == NULL) {
+    CHECK(UV_ENOMEM, "write_req_pool");
+  }
+  write_req->data = job;
+  job->chunk = (size_t) result;
+  buf = uv_buf_init(job->buf, (unsigned int) result);
+  r = uv_write(write_req, (uv_stream_t *) job->client, &buf, 1, file_write_cb);
+  if (r) {
+    buf_pool_free(&job->client->shard->write_req_pool, (char *) write_req);
+    abort_job(job, r);
+    return;
+  }
+  job->busy = 1;
+}
+
+// 发下一块，发完了就结束这个GET
+void send_chunk(file_job_t *job) {
+  uv_loop_t *loop = job->client->handle.loop;
+  uint64_t remaining = job->entry->size - job->offset;
+  uv_buf_t buf;
+  int r;
+
+  if (remaining == 0) {
+    job_finish(job);
+    return;
+  }
+
+  job->chunk = remaining > FILE_CHUNK_SIZE ? FILE_CHUNK_SIZE : (size_t) remaining;
+  job->req.data = job;
+  if (use_sendfile) {
+    r = uv_fs_sendfile(loop, &job->req, job->sock, job->entry->file, (int64_t) job->offset, job->chunk, sendfile_cb);
+  } else {
+    buf = uv_buf_init(job->buf, (unsigned int) job->chunk);
+    r = uv_fs_read(loop, &job->req, job->entry->file, &buf, 1, (int64_t) job->offset, file_read_cb);
+  }
+  if (r) {
+    abort_job(job, r);
+    return;
+  }
+  job->busy = 1;
+}
+
+// 准备好sendfile要用的socket：dup一份给poll和sendfile用
+int start_sending(file_job_t *job) {
+  uv_os_fd_t fd;
+  int r;
+
+  if (!use_sendfile) {
+    job->buf = malloc(FILE_CHUNK_SIZE);
+    return job->buf ? 0 : UV_ENOMEM;
+  }
+
+  r = uv_fileno((uv_handle_t *) job->client, &fd);
+  if (r) {
+    return r;
+  }
+  fd = dup(fd);
+  if (fd < 0) {
+    return uv_translate_sys_error(errno);
+  }
+  r = uv_poll_init_socket(job->client->handle.loop, &job->poll, fd);
+  if (r) {
+    close(fd);
+    return r;
+  }
+  job->sock = fd;
+  return 0;
+}
+
+const command_reply_t *open_error_reply(int status) {
+  switch (status) {
+    case UV_ENOENT:
+    case UV_ENOTDIR:
+      return &not_found_reply;
+    case UV_EISDIR:
+    case UV_EINVAL:
+      return &not_file_reply;
+    default:
+      return &io_error_reply;
+  }
+}
+
+// 推进队头的GET：sendfile直接写socket，必须等前面的回复都已经交给内核(写队列为空)才能开始
+void pump_jobs(tcp_client_t *client) {
+  uv_stream_t *stream = (uv_stream_t *) &client->handle;
+  file_job_t *job = client->jobs_head;
+  uv_buf_t bufs[2];
+  int i, n, r;
+
+  if (uv_is_closing((uv_handle_t *) stream)) {
+    return;
+  }
+
+  if (job == NULL) {
+    // 客户端早就发完了，等的就是这些GET
+    if (client->eof && !client->shutdown) {
+      shutdown_client(client);
+    }
+    return;
+  }
+
+  if (job->state == JOB_OPENING || job->state == JOB_SENDING ||
+      client->reply_count > 0 || uv_stream_get_write_queue_size(stream) > 0) {
+    return;
+  }
+
+  if (job->state == JOB_HEADER) {
+    job->state = JOB_SENDING;
+    send_chunk(job);
+    return;
+  }
+
+  // JOB_READY：打开失败就回复错误，写到输出队列的最前面
+  if (job->status < 0) {
+    n = reply_bufs(open_error_reply(job->status), job->type, bufs);
+    for (i = 0; i < n; i++) {
+      push_reply(&client->replies, &client->reply_count, &client->reply_cap, bufs[i]);
+    }
+    mark_dirty(client);
+    job_finish(job);
+    return;
+  }
+
+  r = start_sending(job);
+  if (r) {
+    job->status = r;
+    abort_job(job, r);
+    return;
+  }
+
+  // 先写长度，写进内核之后(一般uv_write当场就写完了)再开始发内容
+  snprintf(job->header, sizeof(job->header), "OK %llu\n", (unsigned long long) job->entry->size);
+  job->state = JOB_HEADER;
+  bufs[0] = uv_buf_init(job->header, strlen(job->header));
+  write_bufs(client, bufs, 1);
+  pump_jobs(client);
+}
+
+void file_open_cb(fd_cache_entry_t *entry, int status, void *arg) {
+  file_job_t *job = arg;
+
+  job->busy = 0;
+  job->entry = entry;
+  job->status = status;
+  job->state = JOB_READY;
+  if (job->client == NULL) {
+    job_free(job);
+    return;
+  }
+  pump_jobs(job->client);
+}
+
+// 把请求里的路径拼到root下面，不允许空路径和".."，开头的/当作root
+int resolve_path(const uv_buf_t *args, char *path, size_t size) {
+  const char *p = args->base;
+  const char *end = args->base + args->len;
+  const char *segment;
+
+  while (p < end && *p == '/') {
+    p++;
+  }
+  if (p == end || memchr(p, '\0', end - p) != NULL) {
+    return 0;
+  }
+
+  for (segment = p; segment < end; ) {
+    const char *slash = memchr(segment, '/', end - segment);
+    const char *next = slash ? slash : end;
+    if (next - segment == 2 && segment[0] == '.' && segment[1] == '.') {
+      return 0;
+    }
+    segment = next + 1;
+  }
+
+  return snprintf(path, size, "%s/%.*s", root, (int) (end - p), p) < (int) size;
+}
+
+// GET <path>：排到连接的GET队列里，回复由pump_jobs负责，这里返回NULL
+const command_reply_t *get_handler(const command_t *command, const uv_buf_t *args, void *ctx) {
+  tcp_client_t *client = ctx;
+  char path[PATH_MAX];
+  file_job_t *job;
+  int r;
+
+  if (!resolve_path(args, path, sizeof(path))) {
+    return &command->reply;
+  }
+
+  job = calloc(1, sizeof(file_job_t));
+  if (job == NULL) {
+    return &io_error_reply;
+  }
+  job->client = client;
+  job->type = client->frame_type;
+  job->sock = -1;
+  job->state = JOB_OPENING;
+  job->busy = 1;
+
+  // 先排进队列再去拿fd，缓存命中的时候file_open_cb会在fd_cache_acquire里面就被调用
+  if (client->jobs_tail != NULL) {
+    client->jobs_tail->next = job;
+  } else {
+    client->jobs_head = job;
+  }
+  client->jobs_tail = job;
+  client->job_count++;
+  update_reading(client);
+
+  r = fd_cache_acquire(&client->shard->fd_cache, path, file_open_cb, job);
+  if (r) {
+    file_open_cb(NULL, r, job);
+  }
+  return NULL;
+}
+
+int frame_cb_handler(frame_t *frame, void *arg) {
+  tcp_client_t *client = arg;
+  atomic_fetch_add_explicit(&client->shard->requests, 1, memory_order_relaxed);
+
+  // 查命令表，不认识的命令返回错误的消息告知客户端；处理函数返回NULL表示它自己负责回复
+  client->frame_type = frame->type;
+  const command_reply_t *reply = dispatcher_dispatch(&dispatcher, &frame->payload, &unknown_reply, client);
+  if (reply != NULL) {
+    reply_to_client(client, reply, frame->type);
+  }
+  return 0;
+}
+
+// 池子里有slab归还了，没有因为别的原因暂停的话重新开始读
+void resume_reading(buf_pool_waiter_t *waiter) {
+  tcp_client_t *client = (tcp_client_t *) waiter->data;
+
+  if (!uv_is_closing((uv_handle_t *) &client->handle) && !client->eof && !client->reading_paused) {
+    uv_read_start((uv_stream_t *) &client->handle, alloc_cb, read_cb);
+  }
 }
 
 void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
   int r = 0;
+  tcp_client_t *client = (tcp_client_t *) stream;
+
   // 读数据包最重要的是判断nread这个字段
+  if (nread == UV_ENOBUFS) {
+    // 缓冲池已经到了高水位，这次什么都没读；fd还是可读的，不停读的话loop会一直空转，等有slab归还再恢复
+    buf_pool_wait(buf_pool_from_loop(stream->loop), &client->waiter, stream, resume_reading);
+    return;
+  }
+
   if (nread < 0) {
     if (nread != UV_EOF) {
-      CHECK(nread, "read_cb");
+      // 连接出错(比如被客户端reset)只影响这一个连接，直接关闭
+      fprintf(stderr, "read_cb: [%s: %s]\n", uv_err_name(nread), uv_strerror(nread));
+      uv_close((uv_handle_t *) stream, close_cb);
+      return;
     }
 
-    free(buf->base);
-
-    // 读取数据到结尾了，客户端没有数据需要发送了
-    uv_shutdown_t *shutdown_req = malloc(sizeof(uv_shutdown_t));
-    r = uv_shutdown(shutdown_req, stream, shutdown_cb);
-    CHECK(r, "uv_shutdown");
+    // 读取数据到结尾了，客户端没有数据需要发送了；还有GET没发完的话，等它们发完再shutdown
+    client->eof = 1;
+    if (client->jobs_head == NULL) {
+      shutdown_client(client);
+    }
     return;
   }
 
-  if (nread == 0) {
-    free(buf->base);
+  if (nread > 0) {
+    frame_ring_commit(&client->ring, nread);
+  }
+
+  // 切出这次能切出的所有完整命令，回复先放进输出队列，等check阶段统一写回去
+  r = frame_ring_parse(&client->ring, frame_cb_handler, client);
+
+  if (r < 0) {
+    fprintf(stderr, "read_cb: bad frame [%s: %s]\n", uv_err_name(r), uv_strerror(r));
+    uv_close((uv_handle_t *) stream, close_cb);
     return;
   }
 
-  // 正常读取数据，判断数据是不是我们想要的，不是的话就返回错误的消息告知客户端
-  if (!strcmp("Hello\n", buf->base)) {
-    write_to_client("world\n", stream);
-  } else if (!strcmp("Libuv\n", buf->base)) {
-    write_to_client("I love\n", stream);
-  } else {
-    write_to_client("Unknown argot\n", stream);
+  // 没有残留的半帧，就把环形缓冲的内存还给池子
+  if (client->ring.base != NULL && frame_ring_empty(&client->ring)) {
+    buf_pool_free(buf_pool_from_loop(stream->loop), frame_ring_detach(&client->ring));
   }
 }
 
 void connection_cb(uv_stream_t *server, int status) {
   int r = 0;
   // 初始化客户端的tcp句柄
-  uv_tcp_t *tcp_client_handle = malloc(sizeof(uv_tcp_t));
+  tcp_client_t *client = calloc(1, sizeof(tcp_client_t));
+  uv_tcp_t *tcp_client_handle = &client->handle;
   r = uv_tcp_init(server->loop, tcp_client_handle);
+  frame_ring_init(&client->ring);
+  client->waiter.data = client;
+
+  // 客户端记住自己属于哪个分片，方便在回调里更新计数
+  tcp_shard_t *shard = server->data;
+  client->shard = shard;
+  atomic_fetch_add_explicit(&shard->active, 1, memory_order_relaxed);
 
   // 接受这个连接
   r = uv_accept(server, (uv_stream_t *)tcp_client_handle);
@@ -112,46 +835,152 @@ void connection_cb(uv_stream_t *server, int status) {
 
     r = uv_shutdown(shutdown_req, (uv_stream_t *)tcp_client_handle, shutdown_cb);
     CHECK(r, "uv_shutdown");
+    return;
   }
 
+  atomic_fetch_add_explicit(&shard->connections, 1, memory_order_relaxed);
+
+  // 回复已经在check阶段攒成一次写了，不需要Nagle再攒；GET的"OK <size>\n"和文件末尾不满一个包的数据
+  // 开着Nagle的话要等对端的延迟ACK，每个小文件多40ms
+  uv_tcp_nodelay(tcp_client_handle, 1);
+
   // 连接接受成功之后，开始读取客户端传输的数据
   // 这里将uv_tcp_t换成uv_pipe_t也是没问题的，那样的话就是使用uv_pipe_init来初始化了
   r = uv_read_start((uv_stream_t *)tcp_client_handle, alloc_cb, read_cb);
 }
 
 void timer_cb(uv_timer_t *handle) {
-  uv_print_active_handles(handle->loop, stderr);
+  int i;
+  // 各个分片的loop在别的线程上跑，不能在这里调用uv_print_active_handles，改为打印每个分片的计数
+  for (i = 0; i < shard_count; i++) {
+    tcp_shard_t *shard = &shards[i];
+    fprintf(stderr, "shard[%d] connections[%llu], active[%llu], requests[%llu], writes[%llu], paused[%llu], "
+                    "files[%llu]\n",
+            shard->id,
+            atomic_load_explicit(&shard->connections, memory_order_relaxed),
+            atomic_load_explicit(&shard->active, memory_order_relaxed),
+            atomic_load_explicit(&shard->requests, memory_order_relaxed),
+            atomic_load_explicit(&shard->writes, memory_order_relaxed),
+            atomic_load_explicit(&shard->paused, memory_order_relaxed),
+            atomic_load_explicit(&shard->files, memory_order_relaxed));
+  }
+  // 单loop模式下缓冲池和定时器在同一个线程，可以直接读
+  if (shard_count == 1) {
+    buf_pool_print_stats(buf_pool_from_loop(handle->loop), stderr);
+    fd_cache_print_stats(&shards[0].fd_cache, stderr);
+  }
   printf("loop is alive[%d], timer handle is active[%d], now[%lld], hrtime[%lld]\n",
-      uv_loop_alive(handle->loop), uv_is_active((uv_handle_t *)handle), uv_now(handle->loop), uv_hrtime());
+      uv_loop_alive(handle->loop), uv_is_active((uv_handle_t *)handle), (long long) uv_now(handle->loop), (long long) uv_hrtime());
 }
 
-int main() {
-  uv_loop_t *loop = uv_default_loop();
+// 初始化分片的监听句柄并开始监听，reuseport为1时通过SO_REUSEPORT和其他分片共享同一个端口
+void shard_listen(tcp_shard_t *shard, const struct sockaddr_in *addr, int reuseport) {
   int r = 0;
 
+  // 初始化读缓冲池并挂到loop上
+  buf_pool_init(&shard->buf_pool, BUF_POOL_SLAB_SIZE, BUF_POOL_MAX_BYTES);
+  buf_pool_attach(shard->loop, &shard->buf_pool);
+
+  // 写请求池不设上限，每个连接写队列的长度已经由高水位限制住了
+  buf_pool_init(&shard->write_req_pool, sizeof(uv_write_t), SIZE_MAX);
+
+  r = fd_cache_init(&shard->fd_cache, shard->loop, FD_CACHE_CAPACITY, FD_CACHE_VALID_MS);
+  CHECK(r, "fd_cache_init");
+
+  r = uv_check_init(shard->loop, &shard->flush_handle);
+  CHECK(r, "uv_check_init");
+  shard->flush_handle.data = shard;
+
   // 初始化tcp句柄，这里不会启动任何socket
-  r = uv_tcp_init(loop, &tcp_server_handle);
+  r = uv_tcp_init(shard->loop, &shard->tcp_server_handle);
   CHECK(r, "uv_tcp_init");
+  shard->tcp_server_handle.data = shard;
+
+  if (reuseport) {
+    // 自己创建socket并bind，然后交给libuv
+    uv_os_sock_t sock;
+    r = reuseport_socket(SOCK_STREAM, (const struct sockaddr *) addr, sizeof(*addr), &sock);
+    CHECK(r, "reuseport_socket");
+    r = uv_tcp_open(&shard->tcp_server_handle, sock);
+    CHECK(r, "uv_tcp_open");
+  } else {
+    // 绑定
+    r = uv_tcp_bind(&shard->tcp_server_handle, (const struct sockaddr *) addr, AF_INET);
+    CHECK(r, "uv_tcp_bind");
+  }
+
+  // 开始监听连接
+  r = uv_listen((uv_stream_t *)&shard->tcp_server_handle, SOMAXCONN, connection_cb);
+  CHECK(r, "uv_listen");
+}
+
+// 分片线程的入口：每个线程有自己的loop，互不共享任何句柄
+void shard_run(void *arg) {
+  tcp_shard_t *shard = arg;
+  struct sockaddr_in addr;
+  int r = uv_ip4_addr(HOST, PORT, &addr);
+  CHECK(r, "uv_ipv4_addr");
+
+  shard_listen(shard, &addr, 1);
+  uv_run(shard->loop, UV_RUN_DEFAULT);
+}
 
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  int r = 0;
+  int i;
+
+  // 第一个参数是分片个数，<=0时每个CPU一个分片
+  if (argc > 1) {
+    shard_count = atoi(argv[1]);
+    if (shard_count <= 0) {
+      shard_count = get_cpu_count();
+    }
+  }
+  // 第二个参数是GET的根目录
+  if (argc > 2) {
+    root = argv[2];
+  }
+  if (getenv("TCP_SENDFILE") != NULL) {
+    use_sendfile = atoi(getenv("TCP_SENDFILE")) != 0;
+  }
+
+  // 客户端在文件发到一半的时候断开，sendfile写socket会收到SIGPIPE(它不像send那样能带MSG_NOSIGNAL)，
+  // 忽略掉之后只是返回EPIPE，由sendfile_cb关闭这个连接
+  signal(SIGPIPE, SIG_IGN);
+
+  shards = calloc(shard_count, sizeof(tcp_shard_t));
+  r = dispatcher_init(&dispatcher, commands, sizeof(commands) / sizeof(commands[0]));
+  CHECK(r, "dispatcher_init");
 
   // 初始化跨平台可用的ipv4地址
   struct sockaddr_in addr;
   r = uv_ip4_addr(HOST, PORT, &addr);
   CHECK(r, "uv_ipv4_addr");
 
-  // 绑定
-  r = uv_tcp_bind(&tcp_server_handle, (struct sockaddr *) &addr, AF_INET);
-  CHECK(r, "uv_tcp_bind");
-
-  // 开始监听连接
-  r = uv_listen((uv_stream_t *)&tcp_server_handle, SOMAXCONN, connection_cb);
-  CHECK(r, "uv_listen");
+  if (shard_count == 1) {
+    // 单loop模式：直接在默认loop上监听
+    shards[0].loop = loop;
+    shard_listen(&shards[0], &addr, 0);
+  } else {
+    for (i = 0; i < shard_count; i++) {
+      tcp_shard_t *shard = &shards[i];
+      shard->id = i;
+      shard->loop = malloc(sizeof(uv_loop_t));
+      r = uv_loop_init(shard->loop);
+      CHECK(r, "uv_loop_init");
+
+      r = uv_thread_create(&shard->thread, shard_run, shard);
+      CHECK(r, "uv_thread_create");
+    }
+  }
 
   // The stdout file handle (which printf writes to) is by default line buffered.
   // That means output is buffered until there is a newline, when the buffer is flushed.
   // That's why you should always end your output with a newline.
   // 所以如果你这里的printf打印后不加\n的话，所有的打印都会积攒在一起，直到有\n
-  printf("tcp server listen at %s:%d\n", HOST, PORT);
+  printf("tcp server listen at %s:%d, shards[%d], root[%s], %s\n", HOST, PORT, shard_count, root,
+         use_sendfile ? "sendfile" : "read+write");
 
 
   // 增加一个定时器去询问当前是不是一直有活跃的句柄，以此来验证某些观点
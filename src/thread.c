@@ -7,17 +7,33 @@
  * 1、线程间通信
  * 2、线程池调度
  * 3、线程间读写数据同步原语
+ * 4、线程池只有一个FIFO队列，批量任务会把延迟敏感的任务堵在后面，work_sched在它前面按优先级排队(见work_sched.h)
+ * 5、uv_async_send会被合并，消息不能放在全局缓冲里，每条消息挂到async_queue的无锁队列上，async_cb一次取走一整批(见async_queue.h)
  */
 #include <stdio.h>
 #include <unistd.h>
 #include "uv.h"
 #include "common.h"
+#include "work_sched.h"
+#include "async_queue.h"
 
 int shareMemory = 0;
 uv_rwlock_t numlock;
 uv_barrier_t barrier;
-uv_async_t async_handle;
-char msg[50];
+async_queue_t msg_queue;
+
+// 每条消息单独分配，挂在msg_queue上，不会被别的线程覆盖
+typedef struct {
+  async_queue_node_t node;
+  char text[50];
+} thread_msg_t;
+
+#define SCHED_BULK_JOBS 5
+work_sched_t sched;
+int bulk_class;
+int urgent_class;
+work_item_t sched_items[SCHED_BULK_JOBS + 1];
+int sched_done = 0;
 
 // work_cb是会从线程池中调度一个线程去执行
 void work_cb(uv_work_t *req) {
@@ -29,10 +45,13 @@ void work_cb(uv_work_t *req) {
 
   // 发送消息给eventloop线程
   int r = 0;
-  sprintf(msg, "This msg from another thread: 0x%lx", (unsigned long int) uv_thread_self());
-  async_handle.data = (void *) &msg;
-  r = uv_async_send(&async_handle);
-  CHECK(r, "uv_async_send");
+  thread_msg_t *msg = malloc(sizeof(thread_msg_t));
+  if (msg == NULL) {
+    CHECK(UV_ENOMEM, "malloc");
+  }
+  sprintf(msg->text, "This msg from another thread: 0x%lx", (unsigned long int) uv_thread_self());
+  r = async_queue_push(&msg_queue, &msg->node);
+  CHECK(r, "async_queue_push");
 }
 
 // after_work_cb是在event loop线程中执行
@@ -41,16 +60,56 @@ void after_work_cb(uv_work_t *req, int status) {
   printf("after_work_cb thread id 0x%lx\n", (unsigned long int) uv_thread_self());
 }
 
-void async_cb(uv_async_t *handle) {
+// 一次uv_async_send唤醒之后，队列里攒下的每条消息都会回调一次
+void msg_cb(async_queue_t *queue, async_queue_node_t *node) {
+  thread_msg_t *msg = (thread_msg_t *) node;
+
   printf("I am async callback, calling from event loop thread, pid=>%d\n", uv_os_getpid());
   printf("async_cb thread id 0x%lx\n", (unsigned long int) uv_thread_self());
 
-  char *msg = (char *)handle->data;
-
-  printf("I am receiving msg: %s\n", msg);
+  printf("I am receiving msg: %s\n", msg->text);
+  free(msg);
 
   // 关闭掉async句柄，让进程退出
-//  uv_close((uv_handle_t *)&async_handle, NULL);
+//  async_queue_close(&msg_queue, NULL);
+}
+
+// 模拟一个要占线程200ms的任务
+void sched_work_cb(work_item_t *item) {
+  usleep(200 * 1000);
+}
+
+void sched_after_cb(work_item_t *item, int status) {
+  printf("[%s/%d] %s, waited %llums\n", sched.classes[item->cls].name, (int) (item - sched_items),
+         status == 0 ? "done" : uv_err_name(status),
+         status == 0 ? (unsigned long long) (item->started_at - item->queued_at) / 1000000 : 0ULL);
+
+  if (++sched_done == SCHED_BULK_JOBS + 1) {
+    work_sched_print_stats(&sched, stdout);
+    work_sched_close(&sched, NULL);
+  }
+}
+
+// 先提交一批批量任务，再提交一个紧急任务：批量任务最多占线程数-1个线程，紧急任务不用等它们跑完
+void sched_demo(uv_loop_t *loop) {
+  int r = 0;
+  int i;
+
+  r = work_sched_init(loop, &sched, 0);
+  CHECK(r, "work_sched_init");
+  urgent_class = work_sched_add_class(&sched, "urgent", 0);
+  bulk_class = work_sched_add_class(&sched, "bulk", sched.max_running > 1 ? sched.max_running - 1 : 1);
+
+  for (i = 0; i < SCHED_BULK_JOBS; i++) {
+    r = work_sched_submit(&sched, &sched_items[i], bulk_class, sched_work_cb, sched_after_cb);
+    CHECK(r, "work_sched_submit");
+  }
+  r = work_sched_submit(&sched, &sched_items[SCHED_BULK_JOBS], urgent_class, sched_work_cb, sched_after_cb);
+  CHECK(r, "work_sched_submit");
+
+  // 最后一个批量任务还在work_sched的队列里排队，可以直接取消
+  r = work_sched_cancel(&sched_items[SCHED_BULK_JOBS - 1]);
+  CHECK(r, "work_sched_cancel");
 }
 
 void timer_cb(uv_timer_t *handle) {
@@ -114,26 +173,30 @@ int main() {
 
   printf("I am the master process, processId => %d\n", uv_os_getpid());
 
+  // msg_queue要在work_cb里发消息之前初始化好，不然线程池里的线程可能先跑到uv_async_send
+  // 初始化这个方法之后，进程不会主动退出，只有close掉才会
+  r = async_queue_init(loop, &msg_queue, msg_cb);
+  CHECK(r, "async_queue_init");
+
   // 首先示例uv_queue_wok的用法
   uv_work_t work_handle;
-//  uv_work_t work_handle1;
-//  uv_work_t work_handle2;
-//  uv_work_t work_handle3;
-//  uv_work_t work_handle4;
+  uv_work_t work_handle1;
+  uv_work_t work_handle2;
+  uv_work_t work_handle3;
+  uv_work_t work_handle4;
 
   // 演示当需要线程的事件个数超过线程池的大小的时候，也就是当前没有空闲线程处理最后一个uv_queue_work，最后的一个请求将被挂起
-  // 直到有空闲的线程
+  // 直到有空闲的线程。这5个work_cb几乎同时发消息，每条都挂在msg_queue上，一条也不会丢
   r = uv_queue_work(loop, &work_handle, work_cb, after_work_cb);
-//  r = uv_queue_work(loop, &work_handle1, work_cb, after_work_cb);
-//  r = uv_queue_work(loop, &work_handle2, work_cb, after_work_cb);
-//  r = uv_queue_work(loop, &work_handle3, work_cb, after_work_cb);
-//  r = uv_queue_work(loop, &work_handle4, work_cb, after_work_cb);
+  r = uv_queue_work(loop, &work_handle1, work_cb, after_work_cb);
+  r = uv_queue_work(loop, &work_handle2, work_cb, after_work_cb);
+  r = uv_queue_work(loop, &work_handle3, work_cb, after_work_cb);
+  r = uv_queue_work(loop, &work_handle4, work_cb, after_work_cb);
 
   CHECK(r, "uv_queue_work");
 
-  // 接着测试async_handle的用法,初始化这个方法之后，进程不会主动退出，只有close掉才会
-  r = uv_async_init(loop, &async_handle, async_cb);
-  CHECK(r, "uv_async_init");
+  // 按优先级排队的写法
+  sched_demo(loop);
 
 
   // 第三种是自己手动创建线程：uv_thread_create
@@ -3,14 +3,29 @@
  *  1、初始化接收端的uv_udp_t: uv_udp_init(loop, &receive_socket_handle)
  *  2、绑定地址：uv_udp_bind
  *  3、开始接收消息：uv_udp_recv_start
- *  4、uv_udp_recv_start里执行回调，可以使用下面方法回写数据发送给客户端
- *    4.1、uv_udp_init初始化send_socket_handle
- *    4.2、uv_udp_bind绑定发送者的地址，地址可以从recv获取
- *    4.3、uv_udp_send发送指定消息
+ *  4、uv_udp_recv_start里执行回调，直接用接收的receive_socket_handle把数据原样回给发送者
  *  除了上述知识点外，本demo还是用到signal句柄。
+ *
+ *  为了扛住高包量，收发都是成批进行的：
+ *  1、libuv >= 1.37时用UV_UDP_RECVMMSG初始化句柄，一次recvmmsg收多个包到一块共享的大缓冲里，
+ *     每个包以UV_UDP_MMSG_CHUNK回调一次，最后以nread=0、addr=NULL回调一次表示这一批结束
+ *  2、回复先记在batch里(指向共享缓冲，不拷贝)，这一批结束时一起发出去：Linux上直接对句柄的fd调用sendmmsg，
+ *     其他平台逐个uv_udp_try_send
+ *  3、内核发送缓冲满了(EAGAIN)或者libuv里还有排队的发送请求时，把包拷贝到缓冲池里，退回到uv_udp_send排队发送
+ *  定时器每10秒打印一次收发的包速率。
+ *
+ *  多socket模式(UdpHandle N，N<=0表示按CPU个数)：
+ *  一个socket只有一个接收队列，一个loop也只能用满一个核，高峰时内核会因为接收队列满而丢包。
+ *  多socket模式下打开N个SO_REUSEPORT的socket绑定在同一个HOST:PORT，每个socket一个线程一个loop，内核按四元组把包分散到各个socket。
+ *  主线程的定时器汇总每个socket的收发包数、字节数和丢包数，收到SIGINT之后通知所有loop关闭句柄退出，再退出主loop。
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include "uv.h"
 #include "common.h"
 
@@ -18,97 +33,451 @@
 #define HOST "127.0.0.1"
 #define PORT 9999
 
-// receive套接字句柄
-static uv_udp_t receive_socket_handle;
+// 一次recvmmsg最多收多少个包，libuv内部的上限也是20
+#define UDP_BATCH_SIZE 20
+// udp包的最大长度，libuv按这个大小切分共享缓冲
+#define UDP_DGRAM_SIZE (64 * 1024)
 
-void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-  buf->base = malloc(suggested_size);
-  buf->len = suggested_size;
-  if (buf->base == NULL) {
-    printf("alloc_cb malloc buffer error\n");
+#if UV_VERSION_HEX >= 0x012500
+#define UDP_USE_RECVMMSG 1
+#endif
+// uv_udp_using_recvmmsg从1.39才有，1.37、1.38只能打印初始化时是否请求了recvmmsg
+#if UV_VERSION_HEX >= 0x012700
+#define UDP_USING_RECVMMSG(handle) uv_udp_using_recvmmsg(handle)
+#elif defined(UDP_USE_RECVMMSG)
+#define UDP_USING_RECVMMSG(handle) 1
+#else
+#define UDP_USING_RECVMMSG(handle) 0
+#endif
+
+// 计数器由socket所在的线程写、主线程的定时器读
+#define UDP_STAT_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define UDP_STAT_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+// 这一批里等待回复的包，buf指向共享的接收缓冲
+typedef struct {
+  uv_buf_t buf;
+  struct sockaddr_storage addr;
+} udp_reply_t;
+
+// 退回到uv_udp_send排队发送的时候用的请求，数据从缓冲池里拷贝一份
+typedef struct {
+  uv_udp_send_t req;
+  uv_buf_t buf;
+} udp_send_req_t;
+
+typedef struct {
+  int id;
+  uv_loop_t *loop;
+  uv_thread_t thread;
+  // 主线程通过它通知socket所在的loop退出
+  uv_async_t stop_async;
+  // receive套接字句柄，收和回复都用它
+  uv_udp_t receive_socket_handle;
+  // 所有包共享的接收缓冲，可以装下UDP_BATCH_SIZE个最大的包
+  char *recv_buf;
+  udp_reply_t batch[UDP_BATCH_SIZE];
+  int batch_count;
+  // 排队发送时的数据缓冲池挂在loop上，请求本身用另一个池子
+  buf_pool_t buf_pool;
+  buf_pool_t send_req_pool;
+  atomic_ullong rx_packets;
+  atomic_ullong rx_bytes;
+  atomic_ullong tx_packets;
+  atomic_ullong tx_batches;   // 调用sendmmsg/try_send成批发送的次数
+  atomic_ullong tx_queued;    // 退回到uv_udp_send排队的包数
+  atomic_ullong tx_dropped;   // 发送失败被丢掉的包数
+  // 下面只有主线程的定时器用，用来算速率
+  uint64_t last_rx;
+  uint64_t last_tx;
+} udp_server_t;
+
+static udp_server_t *servers;
+static int server_count = 1;
+
+void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+
+void send_cb(uv_udp_send_t* req, int status) {
+  udp_server_t *udp_server = req->handle->data;
+  udp_send_req_t *send_req = (udp_send_req_t *) req;
+
+  if (status < 0) {
+    if (status != UV_ECANCELED) {
+      fprintf(stderr, "send_cb: [%s: %s]\n", uv_err_name(status), uv_strerror(status));
+    }
+    UDP_STAT_ADD(udp_server->tx_dropped, 1);
+  } else {
+    UDP_STAT_ADD(udp_server->tx_packets, 1);
   }
+
+  // 排队发送的数据是从缓冲池拷贝出来的，发送完成之后归还
+  buf_pool_free(&udp_server->buf_pool, send_req->buf.base);
+  buf_pool_free(&udp_server->send_req_pool, (char *) send_req);
 }
 
-void send_cb(uv_udp_send_t* req, int status) {
-//  CHECK(status, "send_cb");
-  printf("callback.......");
-//  free(req);
+// 内核暂时发不出去的包，拷贝一份交给libuv排队发送
+void queue_send(udp_server_t *udp_server, udp_reply_t *reply) {
+  int r = 0;
+  uv_buf_t data = buf_pool_alloc(&udp_server->buf_pool);
+  uv_buf_t slab = buf_pool_alloc(&udp_server->send_req_pool);
+
+  if (data.base == NULL || slab.base == NULL) {
+    buf_pool_free(&udp_server->buf_pool, data.base);
+    buf_pool_free(&udp_server->send_req_pool, slab.base);
+    UDP_STAT_ADD(udp_server->tx_dropped, 1);
+    return;
+  }
+
+  udp_send_req_t *send_req = (udp_send_req_t *) slab.base;
+  memcpy(data.base, reply->buf.base, reply->buf.len);
+  send_req->buf = uv_buf_init(data.base, reply->buf.len);
+
+  r = uv_udp_send(&send_req->req, &udp_server->receive_socket_handle, &send_req->buf, 1,
+                  (const struct sockaddr *) &reply->addr, send_cb);
+  if (r < 0) {
+    buf_pool_free(&udp_server->buf_pool, data.base);
+    buf_pool_free(&udp_server->send_req_pool, slab.base);
+    UDP_STAT_ADD(udp_server->tx_dropped, 1);
+    return;
+  }
+  UDP_STAT_ADD(udp_server->tx_queued, 1);
 }
 
+#ifdef __linux__
+// 一次sendmmsg把整批回复发出去，返回处理掉的个数，0表示发送缓冲满了
+int send_batch(udp_server_t *udp_server, int count) {
+  struct mmsghdr msgs[UDP_BATCH_SIZE];
+  struct iovec iovs[UDP_BATCH_SIZE];
+  uv_os_fd_t fd;
+  int i, r;
+
+  r = uv_fileno((uv_handle_t *) &udp_server->receive_socket_handle, &fd);
+  if (r < 0) {
+    return 0;
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < count; i++) {
+    udp_reply_t *reply = &udp_server->batch[i];
+    iovs[i].iov_base = reply->buf.base;
+    iovs[i].iov_len = reply->buf.len;
+    msgs[i].msg_hdr.msg_name = &reply->addr;
+    msgs[i].msg_hdr.msg_namelen = reply->addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                                                   : sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
 
+  do {
+    r = sendmmsg(fd, msgs, count, 0);
+  } while (r < 0 && errno == EINTR);
+
+  // EAGAIN说明发送缓冲满了，剩下的交给调用方排队；其他错误只影响第一个包，跳过它
+  if (r < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    UDP_STAT_ADD(udp_server->tx_dropped, 1);
+    return 1;
+  }
+  UDP_STAT_ADD(udp_server->tx_packets, r);
+  return r;
+}
+#else
+// 没有sendmmsg的平台逐个uv_udp_try_send，返回处理掉的个数，0表示发送缓冲满了
+int send_batch(udp_server_t *udp_server, int count) {
+  int i, r;
+  for (i = 0; i < count; i++) {
+    udp_reply_t *reply = &udp_server->batch[i];
+    r = uv_udp_try_send(&udp_server->receive_socket_handle, &reply->buf, 1, (const struct sockaddr *) &reply->addr);
+    if (r == UV_EAGAIN) {
+      break;
+    }
+    if (r < 0) {
+      UDP_STAT_ADD(udp_server->tx_dropped, 1);
+    } else {
+      UDP_STAT_ADD(udp_server->tx_packets, 1);
+    }
+  }
+  return i;
+}
+#endif
+
+// 把这一批攒下来的回复发出去，发不出去的退回排队发送；调用之后共享缓冲就可以复用了
+void flush_batch(udp_server_t *udp_server) {
+  int i;
+
+  // libuv里已经有排队的包时直接发会乱序，所以也跟着排队
+  while (udp_server->batch_count > 0 &&
+         uv_udp_get_send_queue_count(&udp_server->receive_socket_handle) == 0) {
+    int n = send_batch(udp_server, udp_server->batch_count);
+    if (n == 0) {
+      break;
+    }
+    UDP_STAT_ADD(udp_server->tx_batches, 1);
+    // 剩下的包挪到前面，下一轮接着发
+    udp_server->batch_count -= n;
+    memmove(udp_server->batch, udp_server->batch + n, udp_server->batch_count * sizeof(udp_reply_t));
+  }
+
+  for (i = 0; i < udp_server->batch_count; i++) {
+    queue_send(udp_server, &udp_server->batch[i]);
+  }
+  udp_server->batch_count = 0;
+}
+
+void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  udp_server_t *udp_server = handle->data;
+
+  // 共享缓冲马上要被新的数据覆盖，还没发出去的回复要先发掉
+  flush_batch(udp_server);
+  *buf = uv_buf_init(udp_server->recv_buf, UDP_BATCH_SIZE * UDP_DGRAM_SIZE);
+}
 
 void receive_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned int flags) {
-  int r = 0;
+  udp_server_t *udp_server = handle->data;
+
   // 读数据包最重要的是判断nread这个字段
   if (nread < 0) {
     // 因为udp不是使用stream形式，所以这里不需要使用uv_shutdown，直接调用uv_close
-    fprintf(stderr, "recv error unexpected\n");
+    fprintf(stderr, "recv error unexpected: %s\n", uv_strerror(nread));
+    udp_server->batch_count = 0;
     uv_close((uv_handle_t *)handle, NULL);
-    free(buf->base);
     return;
   }
 
-  char sender[21] = { 0 };
-  uv_ip4_name((struct sockaddr_in*) addr, sender, 20);
-  fprintf(stderr, "recv from %s\n", sender);
+  // nread为0且addr为NULL说明这一批收完了(或者没有数据可读)，把攒下来的回复发出去
+  if (addr == NULL) {
+    flush_batch(udp_server);
+    return;
+  }
+
+  UDP_STAT_ADD(udp_server->rx_packets, 1);
+  UDP_STAT_ADD(udp_server->rx_bytes, nread);
+
+  // 被截断的包不回复
+  if (flags & UV_UDP_PARTIAL) {
+    UDP_STAT_ADD(udp_server->tx_dropped, 1);
+    return;
+  }
+
+  if (udp_server->batch_count == UDP_BATCH_SIZE) {
+    flush_batch(udp_server);
+  }
+
+  // 反向发送消息给客户端，这里只记下来，等这一批结束再一起发
+  udp_reply_t *reply = &udp_server->batch[udp_server->batch_count++];
+  reply->buf = uv_buf_init(buf->base, nread);
+  memcpy(&reply->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+}
+
+#ifdef __linux__
+// 内核因为接收队列满丢掉的包数：在/proc/net/udp里按socket的inode找到drops那一列
+uint64_t socket_drops(udp_server_t *udp_server) {
+  static const char *tables[] = { "/proc/net/udp", "/proc/net/udp6" };
+  uv_os_fd_t fd;
+  struct stat st;
+  char line[512];
+  size_t i;
 
+  if (uv_fileno((uv_handle_t *) &udp_server->receive_socket_handle, &fd) < 0 || fstat(fd, &st) < 0) {
+    return 0;
+  }
 
-  uv_udp_t send_socket_handle;
-  uv_udp_send_t *send_req = malloc(sizeof(send_req));
-  uv_buf_t newBuf = uv_buf_init(buf->base, nread);
-  struct sockaddr_in client_addr;
-  r = uv_ip4_addr(sender, 60581, &client_addr);
-  // 反向发送消息给客户端
-//   r = uv_udp_init(req->loop, &send_socket_handle);
-//   CHECK(r, "uv_udp_init");
-//   r = uv_udp_bind(&client_addr, addr, 0);
-//   CHECK(r, "uv_udp_bind");
+  for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    FILE *file = fopen(tables[i], "r");
+    if (file == NULL) {
+      continue;
+    }
 
-   r = uv_udp_send(send_req, &send_socket_handle, &newBuf, nread, addr, send_cb);
-  CHECK(r, "uv_udp_send");
-  // r = uv_udp_recv_stop(handle)
+    while (fgets(line, sizeof(line), file) != NULL) {
+      unsigned long inode;
+      unsigned long long drops;
+      // sl local rem st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode ref pointer drops
+      if (sscanf(line, " %*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %llu", &inode, &drops) == 2 &&
+          inode == (unsigned long) st.st_ino) {
+        fclose(file);
+        return drops;
+      }
+    }
+    fclose(file);
+  }
+  return 0;
+}
+#else
+uint64_t socket_drops(udp_server_t *udp_server) {
+  return 0;
 }
+#endif
 
 void timer_cb(uv_timer_t *handle) {
-  uv_print_active_handles(handle->loop, stderr);
+  double seconds = uv_timer_get_repeat(handle) / 1000.0;
+  uint64_t total_rx = 0;
+  uint64_t total_tx = 0;
+  uint64_t total_drops = 0;
+  int i;
+
+  for (i = 0; i < server_count; i++) {
+    udp_server_t *udp_server = &servers[i];
+    uint64_t rx = UDP_STAT_GET(udp_server->rx_packets);
+    uint64_t tx = UDP_STAT_GET(udp_server->tx_packets);
+    uint64_t drops = socket_drops(udp_server);
+
+    fprintf(stderr, "socket[%d] rx[%llu pkts, %.0f pps, %llu bytes, %llu kernel drops], "
+                    "tx[%llu pkts, %.0f pps, %llu batches, %llu queued, %llu dropped]\n",
+            udp_server->id,
+            (unsigned long long) rx, (rx - udp_server->last_rx) / seconds,
+            (unsigned long long) UDP_STAT_GET(udp_server->rx_bytes), (unsigned long long) drops,
+            (unsigned long long) tx, (tx - udp_server->last_tx) / seconds,
+            (unsigned long long) UDP_STAT_GET(udp_server->tx_batches),
+            (unsigned long long) UDP_STAT_GET(udp_server->tx_queued),
+            (unsigned long long) UDP_STAT_GET(udp_server->tx_dropped));
+
+    total_rx += rx - udp_server->last_rx;
+    total_tx += tx - udp_server->last_tx;
+    total_drops += drops;
+    udp_server->last_rx = rx;
+    udp_server->last_tx = tx;
+  }
+
+  fprintf(stderr, "total sockets[%d], rx[%.0f pps], tx[%.0f pps], kernel drops[%llu], recvmmsg[%d]\n",
+          server_count, total_rx / seconds, total_tx / seconds, (unsigned long long) total_drops,
+          UDP_USING_RECVMMSG(&servers[0].receive_socket_handle));
+
+  // 单socket模式下缓冲池和定时器在同一个线程，可以直接读
+  if (server_count == 1) {
+    buf_pool_print_stats(buf_pool_from_loop(handle->loop), stderr);
+  }
+}
+
+void close_walk_cb(uv_handle_t *handle, void *arg) {
+  if (!uv_is_closing(handle)) {
+    uv_close(handle, NULL);
+  }
 }
+
+// 在socket自己的loop上执行：关闭这个loop上的所有句柄，没有活跃句柄之后uv_run就会返回
+void stop_cb(uv_async_t *handle) {
+  uv_walk(handle->loop, close_walk_cb, NULL);
+}
+
 void signal_cb(uv_signal_t *handle, int signum) {
+  int i;
   printf("signal_cb: recvd CTRL+C shutting down\n");
-  uv_stop(uv_default_loop()); //stops the event loop
+
+  if (server_count == 1) {
+    uv_stop(uv_default_loop()); //stops the event loop
+    return;
+  }
+
+  // 通知所有socket的loop退出，等线程都结束之后再停主loop
+  for (i = 0; i < server_count; i++) {
+    uv_async_send(&servers[i].stop_async);
+  }
+  for (i = 0; i < server_count; i++) {
+    uv_thread_join(&servers[i].thread);
+    uv_loop_close(servers[i].loop);
+  }
+  uv_stop(handle->loop);
 }
 
-int main() {
-  uv_loop_t *loop = uv_default_loop();
+// 初始化一个socket以及它所在loop上的句柄，reuseport为1时通过SO_REUSEPORT和其他socket共享同一个端口
+void server_setup(udp_server_t *udp_server, const struct sockaddr_in *addr, int reuseport) {
   int r = 0;
 
-  // 初始化udp句柄
-  r = uv_udp_init(loop, &receive_socket_handle);
+  // 初始化缓冲池并挂到loop上，只有排队发送的包才会用到
+  buf_pool_init(&udp_server->buf_pool, BUF_POOL_SLAB_SIZE, BUF_POOL_MAX_BYTES);
+  buf_pool_attach(udp_server->loop, &udp_server->buf_pool);
+  buf_pool_init(&udp_server->send_req_pool, sizeof(udp_send_req_t), SIZE_MAX);
+
+  udp_server->recv_buf = malloc(UDP_BATCH_SIZE * UDP_DGRAM_SIZE);
+
+  r = uv_async_init(udp_server->loop, &udp_server->stop_async, stop_cb);
+  CHECK(r, "uv_async_init");
+
+  // 初始化udp句柄，支持的话打开recvmmsg
+  // 指定AF_INET的话libuv会马上创建socket，之后就不能再uv_udp_open了，所以reuseport时用AF_UNSPEC
+#ifdef UDP_USE_RECVMMSG
+  r = uv_udp_init_ex(udp_server->loop, &udp_server->receive_socket_handle,
+                     (reuseport ? AF_UNSPEC : AF_INET) | UV_UDP_RECVMMSG);
+#else
+  r = uv_udp_init(udp_server->loop, &udp_server->receive_socket_handle);
+#endif
   CHECK(r, "uv_udp_init");
+  udp_server->receive_socket_handle.data = udp_server;
+
+  if (reuseport) {
+    // 自己创建socket并bind，然后交给libuv
+    uv_os_sock_t sock;
+    r = reuseport_socket(SOCK_DGRAM, (const struct sockaddr *) addr, sizeof(*addr), &sock);
+    CHECK(r, "reuseport_socket");
+    r = uv_udp_open(&udp_server->receive_socket_handle, sock);
+    CHECK(r, "uv_udp_open");
+  } else {
+    // 绑定
+    r = uv_udp_bind(&udp_server->receive_socket_handle, (const struct sockaddr *) addr, 0);
+    CHECK(r, "uv_udp_bind");
+  }
 
+  // 开始接收消息
+  r = uv_udp_recv_start(&udp_server->receive_socket_handle, alloc_cb, receive_cb);
+  CHECK(r, "uv_udp_recv_start");
+}
+
+// socket线程的入口：句柄在主线程已经初始化好了，这里只跑loop
+void server_run(void *arg) {
+  udp_server_t *udp_server = arg;
+  uv_run(udp_server->loop, UV_RUN_DEFAULT);
+}
+
+int main(int argc, char **argv) {
+  uv_loop_t *loop = uv_default_loop();
+  int r = 0;
+  int i;
+
+  // 第一个参数是socket个数，<=0时每个CPU一个socket
+  if (argc > 1) {
+    server_count = atoi(argv[1]);
+    if (server_count <= 0) {
+      server_count = get_cpu_count();
+    }
+  }
+
+  servers = calloc(server_count, sizeof(udp_server_t));
 
   // 初始化跨平台可用的ipv4地址
   struct sockaddr_in addr;
   r = uv_ip4_addr(HOST, PORT, &addr);
   CHECK(r, "uv_ipv4_addr");
 
-  // 绑定
-  r = uv_udp_bind(&receive_socket_handle, (const struct sockaddr *) &addr, 0);
-  CHECK(r, "uv_udp_bind");
+  if (server_count == 1) {
+    // 单socket模式：直接在默认loop上收发
+    servers[0].loop = loop;
+    server_setup(&servers[0], &addr, 0);
+  } else {
+    // loop还没开始跑的时候在主线程初始化它上面的句柄是安全的
+    for (i = 0; i < server_count; i++) {
+      udp_server_t *udp_server = &servers[i];
+      udp_server->id = i;
+      udp_server->loop = malloc(sizeof(uv_loop_t));
+      r = uv_loop_init(udp_server->loop);
+      CHECK(r, "uv_loop_init");
+      server_setup(udp_server, &addr, 1);
 
-  // 开始接收消息
-  r = uv_udp_recv_start(&receive_socket_handle, alloc_cb, receive_cb);
-  CHECK(r, "uv_udp_recv_start");
+      r = uv_thread_create(&udp_server->thread, server_run, udp_server);
+      CHECK(r, "uv_thread_create");
+    }
+  }
 
-  printf("udp server listen at %s:%d\n", HOST, PORT);
+  printf("udp server listen at %s:%d, sockets[%d]\n", HOST, PORT, server_count);
 
 
-  // 增加一个定时器去询问当前是不是一直有活跃的句柄，以此来验证某些观点
+  // 增加一个定时器，每10秒钟打印一次收发速率
   uv_timer_t timer_handle;
   r = uv_timer_init(loop, &timer_handle);
   CHECK(r, "uv_timer_init");
 
-  // 每10秒钟调用定时器回调一次
-  r = uv_timer_start(&timer_handle, timer_cb, 10 * 1000, 0);
+  r = uv_timer_start(&timer_handle, timer_cb, 10 * 1000, 10 * 1000);
 
   // 增加signal的监听
   uv_signal_t signal_handle;
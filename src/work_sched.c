@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include "work_sched.h"
+
+#define WORK_HIST_SUB_BITS 2
+
+static void pump(work_sched_t *sched);
+static void idle_cb(uv_idle_t *handle);
+
+// 小于WORK_HIST_SUB_BUCKETS的值一档一个，之后每个2的幂次分WORK_HIST_SUB_BUCKETS档
+static int hist_index(uint64_t usec) {
+  int msb = 63;
+  int index;
+
+  if (usec < WORK_HIST_SUB_BUCKETS) {
+    return (int) usec;
+  }
+  while (!(usec >> msb)) {
+    msb--;
+  }
+  index = (msb - WORK_HIST_SUB_BITS + 1) * WORK_HIST_SUB_BUCKETS +
+          (int) ((usec >> (msb - WORK_HIST_SUB_BITS)) & (WORK_HIST_SUB_BUCKETS - 1));
+  return index < WORK_HIST_BUCKETS ? index : WORK_HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_upper(int index) {
+  int shift;
+
+  if (index < WORK_HIST_SUB_BUCKETS) {
+    return (uint64_t) index;
+  }
+  shift = index / WORK_HIST_SUB_BUCKETS - 1;
+  return ((uint64_t) (WORK_HIST_SUB_BUCKETS + index % WORK_HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void work_hist_record(work_hist_t *hist, uint64_t usec) {
+  hist->counts[hist_index(usec)]++;
+  hist->total++;
+  if (usec > hist->max) {
+    hist->max = usec;
+  }
+}
+
+uint64_t work_hist_percentile(const work_hist_t *hist, double p) {
+  uint64_t rank = (uint64_t) (p * hist->total + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  if (hist->total == 0) {
+    return 0;
+  }
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (i = 0; i < WORK_HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      // 最后一档的上界可能比实际的最大值大得多
+      return hist_upper(i) < hist->max ? hist_upper(i) : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+static int threadpool_size(void) {
+  const char *size = getenv("UV_THREADPOOL_SIZE");
+  int n = size != NULL ? atoi(size) : 0;
+  return n > 0 ? n : 4;
+}
+
+int work_sched_init(uv_loop_t *loop, work_sched_t *sched, int max_running) {
+  memset(sched, 0, sizeof(*sched));
+  sched->loop = loop;
+  sched->max_running = max_running > 0 ? max_running : threadpool_size();
+  sched->idle.data = sched;
+  return uv_idle_init(loop, &sched->idle);
+}
+
+int work_sched_add_class(work_sched_t *sched, const char *name, int limit) {
+  work_class_t *cls;
+
+  if (sched->class_count == WORK_SCHED_MAX_CLASSES) {
+    return UV_ENOSPC;
+  }
+  cls = &sched->classes[sched->class_count];
+  cls->name = name;
+  cls->limit = limit;
+  return sched->class_count++;
+}
+
+static void unlink_item(work_class_t *cls, work_item_t *item) {
+  if (item->prev) item->prev->next = item->next;
+  else cls->head = item->next;
+  if (item->next) item->next->prev = item->prev;
+  else cls->tail = item->prev;
+  item->prev = item->next = NULL;
+  cls->queued--;
+}
+
+static void work_cb(uv_work_t *req) {
+  work_item_t *item = (work_item_t *) req;
+
+  item->started_at = uv_hrtime();
+  item->work_cb(item);
+  item->finished_at = uv_hrtime();
+}
+
+static void after_work_cb(uv_work_t *req, int status) {
+  work_item_t *item = (work_item_t *) req;
+  work_sched_t *sched = item->sched;
+  work_class_t *cls = &sched->classes[item->cls];
+
+  item->state = WORK_ITEM_DONE;
+  cls->running--;
+  sched->running--;
+  if (status == UV_ECANCELED) {
+    cls->cancelled++;
+  } else {
+    cls->completed++;
+    work_hist_record(&cls->wait, (item->started_at - item->queued_at) / 1000);
+    work_hist_record(&cls->run, (item->finished_at - item->started_at) / 1000);
+  }
+
+  if (item->after_cb) {
+    item->after_cb(item, status);
+  }
+  pump(sched);
+}
+
+// 还有空闲线程的时候，从优先级最高、没到自己上限的类别里取一个交给线程池
+static void pump(work_sched_t *sched) {
+  work_class_t *cls;
+  work_item_t *item;
+  int i, r;
+
+  while (sched->running < sched->max_running) {
+    cls = NULL;
+    for (i = 0; i < sched->class_count; i++) {
+      if (sched->classes[i].head != NULL &&
+          (sched->classes[i].limit <= 0 || sched->classes[i].running < sched->classes[i].limit)) {
+        cls = &sched->classes[i];
+        break;
+      }
+    }
+    if (cls == NULL) {
+      return;
+    }
+
+    item = cls->head;
+    unlink_item(cls, item);
+    r = uv_queue_work(sched->loop, &item->req, work_cb, after_work_cb);
+    if (r) {
+      // uv_queue_work只会在参数不对的时候失败，当作取消处理；已经不在类别的队列里了，
+      // 和work_sched_cancel一样标成DONE，之后再cancel它不会去摘链表
+      item->state = WORK_ITEM_DONE;
+      item->next = sched->cancelled;
+      sched->cancelled = item;
+      uv_idle_start(&sched->idle, idle_cb);
+      continue;
+    }
+    item->state = WORK_ITEM_SUBMITTED;
+    cls->running++;
+    cls->submitted++;
+    sched->running++;
+  }
+}
+
+// 从队列里摘掉的任务在这里回调，不在work_sched_cancel里直接回调，和uv_cancel的行为保持一致
+static void idle_cb(uv_idle_t *handle) {
+  work_sched_t *sched = handle->data;
+  work_item_t *item;
+
+  uv_idle_stop(handle);
+  while ((item = sched->cancelled) != NULL) {
+    sched->cancelled = item->next;
+    item->next = NULL;
+    item->state = WORK_ITEM_DONE;
+    sched->classes[item->cls].cancelled++;
+    if (item->after_cb) {
+      item->after_cb(item, UV_ECANCELED);
+    }
+  }
+}
+
+int work_sched_submit(work_sched_t *sched, work_item_t *item, int cls, work_item_cb work_cb,
+                      work_item_after_cb after_cb) {
+  work_class_t *c;
+
+  if (cls < 0 || cls >= sched->class_count || work_cb == NULL) {
+    return UV_EINVAL;
+  }
+
+  c = &sched->classes[cls];
+  item->sched = sched;
+  item->cls = cls;
+  item->state = WORK_ITEM_QUEUED;
+  item->queued_at = uv_hrtime();
+  item->started_at = item->finished_at = 0;
+  item->work_cb = work_cb;
+  item->after_cb = after_cb;
+  item->next = NULL;
+  item->prev = c->tail;
+  if (c->tail) c->tail->next = item;
+  else c->head = item;
+  c->tail = item;
+  if (++c->queued > c->max_queued) {
+    c->max_queued = c->queued;
+  }
+
+  pump(sched);
+  return 0;
+}
+
+int work_sched_cancel(work_item_t *item) {
+  work_sched_t *sched = item->sched;
+
+  switch (item->state) {
+    case WORK_ITEM_QUEUED:
+      unlink_item(&sched->classes[item->cls], item);
+      item->state = WORK_ITEM_DONE;
+      item->next = sched->cancelled;
+      sched->cancelled = item;
+      uv_idle_start(&sched->idle, idle_cb);
+      return 0;
+    case WORK_ITEM_SUBMITTED:
+      // 线程已经开始跑这个任务的话uv_cancel返回UV_EBUSY
+      return uv_cancel((uv_req_t *) &item->req);
+    default:
+      return UV_EINVAL;
+  }
+}
+
+static void idle_close_cb(uv_handle_t *handle) {
+  work_sched_t *sched = handle->data;
+  if (sched->close_cb) {
+    sched->close_cb(sched);
+  }
+}
+
+void work_sched_close(work_sched_t *sched, work_sched_close_cb close_cb) {
+  sched->close_cb = close_cb;
+  uv_close((uv_handle_t *) &sched->idle, idle_close_cb);
+}
+
+void work_sched_print_stats(work_sched_t *sched, FILE *stream) {
+  int i;
+
+  for (i = 0; i < sched->class_count; i++) {
+    work_class_t *cls = &sched->classes[i];
+    fprintf(stream, "work class %s: completed[%llu], cancelled[%llu], queued[%zu], running[%d], max queued[%zu], "
+                    "wait p50[%lluus] p99[%lluus] max[%lluus], run p50[%lluus] p99[%lluus] max[%lluus]\n",
+            cls->name, (unsigned long long) cls->completed, (unsigned long long) cls->cancelled, cls->queued,
+            cls->running, cls->max_queued,
+            (unsigned long long) work_hist_percentile(&cls->wait, 0.5),
+            (unsigned long long) work_hist_percentile(&cls->wait, 0.99), (unsigned long long) cls->wait.max,
+            (unsigned long long) work_hist_percentile(&cls->run, 0.5),
+            (unsigned long long) work_hist_percentile(&cls->run, 0.99), (unsigned long long) cls->run.max);
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ * 挡在libuv线程池前面的优先级调度
+ * libuv的线程池只有一个FIFO队列，uv_queue_work交进去的请求超过线程数之后就按先来后到排队，
+ * 一大批批量任务排在前面的时候，后来的延迟敏感任务只能干等。这里的做法是：
+ * 1、任务先按优先级类别排在自己的队列里，不直接交给线程池；同时交给线程池的任务数不超过max_running
+ *    (默认就是线程池的线程数)，所以libuv的FIFO队列里基本不会有积压，排队都发生在这里
+ * 2、有线程空出来的时候从优先级最高的类别开始挑，每个类别还可以限制自己最多同时占几个线程，
+ *    比如批量任务限制成线程数-1，就总有一个线程留给高优先级的任务
+ * 3、还在这里排队的任务直接从队列里摘掉，已经交给线程池但是还没开始跑的用uv_cancel取消，都以UV_ECANCELED回调after_cb；
+ *    已经在跑的取消不了，返回UV_EBUSY
+ * 4、每个类别记录两个直方图：排队时间(提交到线程里开始跑)和运行时间，按2的幂次分段、每段再分4档，单位微秒
+ * 线程池是整个进程共享的，文件和DNS请求也在里面排队，它们占着线程的时候交进去的任务还是要在libuv的队列里等，
+ * 所以有大量文件IO的程序可以把max_running设得比线程数小一点。
+ */
+#ifndef LIBUV_DEMO_WORK_SCHED_H
+#define LIBUV_DEMO_WORK_SCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+#define WORK_SCHED_MAX_CLASSES 8
+#define WORK_HIST_SUB_BUCKETS 4
+#define WORK_HIST_BUCKETS 128
+
+typedef struct work_sched_s work_sched_t;
+typedef struct work_item_s work_item_t;
+
+typedef void (*work_item_cb)(work_item_t *item);                    // 在线程池里调用
+typedef void (*work_item_after_cb)(work_item_t *item, int status);  // 在loop线程里调用
+typedef void (*work_sched_close_cb)(work_sched_t *sched);
+
+typedef struct {
+  uint64_t counts[WORK_HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;                 // 微秒
+} work_hist_t;
+
+typedef enum {
+  WORK_ITEM_QUEUED,             // 在这里排队
+  WORK_ITEM_SUBMITTED,          // 交给了线程池
+  WORK_ITEM_DONE
+} work_item_state_t;
+
+struct work_item_s {
+  uv_work_t req;
+  void *data;
+  work_sched_t *sched;
+  int cls;
+  work_item_state_t state;
+  uint64_t queued_at;
+  uint64_t started_at;          // 线程里写，after_cb之后才在loop线程里读
+  uint64_t finished_at;
+  work_item_cb work_cb;
+  work_item_after_cb after_cb;
+  work_item_t *prev;
+  work_item_t *next;
+};
+
+typedef struct {
+  const char *name;
+  int limit;                    // 最多同时占几个线程，<=0表示只受max_running限制
+  int running;                  // 交给线程池还没回来的
+  size_t queued;
+  work_item_t *head;
+  work_item_t *tail;
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t cancelled;
+  size_t max_queued;
+  work_hist_t wait;
+  work_hist_t run;
+} work_class_t;
+
+struct work_sched_s {
+  void *data;
+  uv_loop_t *loop;
+  int max_running;
+  int running;
+  int class_count;
+  work_class_t classes[WORK_SCHED_MAX_CLASSES];
+  work_item_t *cancelled;       // 从队列里摘掉、等着在idle回调里回调after_cb的
+  uv_idle_t idle;
+  work_sched_close_cb close_cb;
+};
+
+// max_running <= 0时用UV_THREADPOOL_SIZE(没设置时是4)
+int work_sched_init(uv_loop_t *loop, work_sched_t *sched, int max_running);
+
+// 先加的类别优先级高，返回类别的下标，超过WORK_SCHED_MAX_CLASSES时返回UV_ENOSPC
+int work_sched_add_class(work_sched_t *sched, const char *name, int limit);
+
+int work_sched_submit(work_sched_t *sched, work_item_t *item, int cls, work_item_cb work_cb,
+                      work_item_after_cb after_cb);
+
+// 成功时after_cb之后会以UV_ECANCELED回调，已经在跑的返回UV_EBUSY，已经结束的返回UV_EINVAL
+int work_sched_cancel(work_item_t *item);
+
+// 所有提交的任务都回调过之后才能关
+void work_sched_close(work_sched_t *sched, work_sched_close_cb close_cb);
+
+void work_hist_record(work_hist_t *hist, uint64_t usec);
+
+// 返回第p(0~1)分位所在档的上界，单位微秒
+uint64_t work_hist_percentile(const work_hist_t *hist, double p);
+
+void work_sched_print_stats(work_sched_t *sched, FILE *stream);
+
+#endif //LIBUV_DEMO_WORK_SCHED_H
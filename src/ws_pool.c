@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "ws_pool.h"
+#include "common.h"
+
+/*
+ * Chase-Lev双端队列，内存序按Lê等人的"Correct and Efficient Work-Stealing for Weak Memory Models"，
+ * 用gcc/clang的__atomic内建函数。只有队列的主人调用deque_push/deque_take，别的线程只调用deque_steal
+ */
+static ws_array_t *array_new(int64_t size) {
+  ws_array_t *array = malloc(sizeof(ws_array_t) + (size - 1) * sizeof(ws_task_t *));
+  if (array != NULL) {
+    array->mask = size - 1;
+    array->retired = NULL;
+  }
+  return array;
+}
+
+static int deque_init(ws_deque_t *deque) {
+  memset(deque, 0, sizeof(*deque));
+  deque->array = array_new(WS_DEQUE_INITIAL_SIZE);
+  return deque->array ? 0 : UV_ENOMEM;
+}
+
+static void deque_free(ws_deque_t *deque) {
+  ws_array_t *array = deque->array;
+  while (array != NULL) {
+    ws_array_t *retired = array->retired;
+    free(array);
+    array = retired;
+  }
+}
+
+// 满了就翻倍，旧数组挂在新数组的retired上
+static ws_array_t *deque_grow(ws_deque_t *deque, ws_array_t *array, int64_t top, int64_t bottom) {
+  ws_array_t *bigger = array_new((array->mask + 1) * 2);
+  int64_t i;
+
+  if (bigger == NULL) {
+    return NULL;
+  }
+  for (i = top; i < bottom; i++) {
+    __atomic_store_n(&bigger->slots[i & bigger->mask], __atomic_load_n(&array->slots[i & array->mask],
+                                                                        __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  }
+  bigger->retired = array;
+  __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+  return bigger;
+}
+
+static int deque_push(ws_deque_t *deque, ws_task_t *task) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  ws_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+  if (bottom - top > array->mask) {
+    array = deque_grow(deque, array, top, bottom);
+    if (array == NULL) {
+      return UV_ENOMEM;
+    }
+  }
+  __atomic_store_n(&array->slots[bottom & array->mask], task, __ATOMIC_RELAXED);
+  // 论文里是release屏障加relaxed写，这里直接用release写，偷的线程acquire读bottom之后就能看到任务的内容
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static ws_task_t *deque_take(ws_deque_t *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  ws_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  int64_t top;
+  ws_task_t *task = NULL;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top <= bottom) {
+    task = __atomic_load_n(&array->slots[bottom & array->mask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // 只剩最后一个，和偷的线程抢
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        task = NULL;
+      }
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+static ws_task_t *deque_steal(ws_deque_t *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  int64_t bottom;
+  ws_array_t *array;
+  ws_task_t *task;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  task = __atomic_load_n(&array->slots[top & array->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return task;
+}
+
+static int deque_empty(ws_deque_t *deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void run(ws_worker_t *worker, ws_task_t *task);
+
+// 有线程在睡的时候才去拿锁唤醒，和park里的检查配对，两边都是先写后读、中间有seq_cst
+static void wake_one(ws_pool_t *pool) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    uv_mutex_lock(&pool->mutex);
+    uv_cond_signal(&pool->cond);
+    uv_mutex_unlock(&pool->mutex);
+  }
+}
+
+// 调用的时候持有pool->mutex
+static int has_work(ws_pool_t *pool) {
+  int i;
+
+  if (pool->inject_head != NULL) {
+    return 1;
+  }
+  for (i = 0; i < pool->threads; i++) {
+    if (!deque_empty(&pool->workers[i].deque)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void park(ws_worker_t *worker) {
+  ws_pool_t *pool = worker->pool;
+
+  uv_mutex_lock(&pool->mutex);
+  __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+  while (!pool->stopping && !has_work(pool)) {
+    worker->stats.parks++;
+    uv_cond_wait(&pool->cond, &pool->mutex);
+  }
+  __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+  uv_mutex_unlock(&pool->mutex);
+}
+
+// 从注入队列取一小批，第一个自己跑，剩下的压进自己的队列
+static ws_task_t *take_injected(ws_worker_t *worker) {
+  ws_pool_t *pool = worker->pool;
+  ws_task_t *task, *rest, *next;
+  int n = 0;
+
+  if (__atomic_load_n(&pool->injected, __ATOMIC_ACQUIRE) == 0) {
+    return NULL;
+  }
+
+  uv_mutex_lock(&pool->mutex);
+  task = pool->inject_head;
+  rest = task;
+  while (rest != NULL && n < WS_INJECT_BATCH) {
+    rest = rest->next;
+    n++;
+  }
+  pool->inject_head = rest;
+  if (rest == NULL) {
+    pool->inject_tail = NULL;
+  }
+  __atomic_sub_fetch(&pool->injected, n, __ATOMIC_RELEASE);
+  uv_mutex_unlock(&pool->mutex);
+
+  if (task == NULL) {
+    return NULL;
+  }
+  worker->stats.injected += n;
+  if (n == 1) {
+    return task;
+  }
+
+  // 压进队列之后马上就可能被偷走跑完，next要先读出来
+  for (rest = task->next; --n > 0; rest = next) {
+    next = rest->next;
+    if (deque_push(&worker->deque, rest)) {
+      run(worker, rest);
+    }
+  }
+  wake_one(pool);
+  return task;
+}
+
+static ws_task_t *steal_any(ws_worker_t *worker) {
+  ws_pool_t *pool = worker->pool;
+  ws_task_t *task;
+  int i, victim;
+
+  // xorshift
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+  victim = (int) (worker->seed % pool->threads);
+
+  for (i = 0; i < pool->threads; i++, victim = (victim + 1) % pool->threads) {
+    if (&pool->workers[victim] == worker) {
+      continue;
+    }
+    task = deque_steal(&pool->workers[victim].deque);
+    if (task != NULL) {
+      worker->stats.stolen++;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void post_done(ws_pool_t *pool, ws_task_t *task) {
+  int was_empty;
+
+  task->next = NULL;
+  uv_mutex_lock(&pool->done_mutex);
+  was_empty = pool->done_head == NULL;
+  if (pool->done_tail) pool->done_tail->next = task;
+  else pool->done_head = task;
+  pool->done_tail = task;
+  uv_mutex_unlock(&pool->done_mutex);
+
+  // 链表不为空说明已经通知过了，async_cb还没来得及取
+  if (was_empty) {
+    uv_async_send(&pool->async);
+  }
+}
+
+// 自己和子任务都完成了才算完成，完成之后再去减父任务的计数
+static void finish(ws_task_t *task) {
+  while (task != NULL && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    ws_task_t *parent = task->parent;
+    if (task->after_cb) {
+      post_done(task->pool, task);
+    }
+    task = parent;
+  }
+}
+
+static void run(ws_worker_t *worker, ws_task_t *task) {
+  task->worker = worker;
+  task->work_cb(task);
+  worker->stats.executed++;
+  finish(task);
+}
+
+static void worker_main(void *arg) {
+  ws_worker_t *worker = arg;
+  ws_pool_t *pool = worker->pool;
+  ws_task_t *task;
+  int idle = 0;
+
+  while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+    task = deque_take(&worker->deque);
+    if (task == NULL) task = take_injected(worker);
+    if (task == NULL) task = steal_any(worker);
+    if (task != NULL) {
+      idle = 0;
+      run(worker, task);
+      continue;
+    }
+
+    if (++idle < WS_SPIN_ROUNDS) {
+      sched_yield();
+      continue;
+    }
+    idle = 0;
+    park(worker);
+  }
+}
+
+static void async_cb(uv_async_t *handle) {
+  ws_pool_t *pool = handle->data;
+  ws_task_t *task, *next;
+
+  uv_mutex_lock(&pool->done_mutex);
+  task = pool->done_head;
+  pool->done_head = pool->done_tail = NULL;
+  uv_mutex_unlock(&pool->done_mutex);
+
+  pool->wakeups++;
+  for (; task != NULL; task = next) {
+    next = task->next;
+    pool->completions++;
+    task->after_cb(task);
+  }
+}
+
+// 让已经起来的count个线程退出并等它们结束
+static void stop_threads(ws_pool_t *pool, int count) {
+  int i;
+
+  uv_mutex_lock(&pool->mutex);
+  __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+  uv_cond_broadcast(&pool->cond);
+  uv_mutex_unlock(&pool->mutex);
+
+  for (i = 0; i < count; i++) {
+    uv_thread_join(&pool->workers[i].thread);
+  }
+}
+
+static void free_workers(ws_pool_t *pool) {
+  int i;
+
+  for (i = 0; i < pool->threads; i++) {
+    deque_free(&pool->workers[i].deque);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+}
+
+static void destroy_locks(ws_pool_t *pool) {
+  uv_mutex_destroy(&pool->mutex);
+  uv_mutex_destroy(&pool->done_mutex);
+  uv_cond_destroy(&pool->cond);
+}
+
+int ws_pool_init(uv_loop_t *loop, ws_pool_t *pool, int threads) {
+  int i, r;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->loop = loop;
+  pool->threads = threads > 0 ? threads : get_cpu_count();
+  pool->workers = calloc(pool->threads, sizeof(ws_worker_t));
+  if (pool->workers == NULL) {
+    return UV_ENOMEM;
+  }
+
+  for (i = 0; i < pool->threads; i++) {
+    ws_worker_t *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->seed = 2654435761u * (i + 1);
+    r = deque_init(&worker->deque);
+    if (r) {
+      free_workers(pool);
+      return r;
+    }
+  }
+
+  uv_mutex_init(&pool->mutex);
+  uv_mutex_init(&pool->done_mutex);
+  uv_cond_init(&pool->cond);
+
+  // 线程先于async起来：还没有任务的时候线程只会睡在cond上，碰不到async，
+  // 后面哪一步失败都只要停掉已经起来的线程，不用等loop去关句柄
+  for (i = 0; i < pool->threads; i++) {
+    r = uv_thread_create(&pool->workers[i].thread, worker_main, &pool->workers[i]);
+    if (r) {
+      stop_threads(pool, i);
+      break;
+    }
+  }
+  if (r == 0) {
+    r = uv_async_init(loop, &pool->async, async_cb);
+    if (r) {
+      stop_threads(pool, pool->threads);
+    }
+  }
+  if (r) {
+    destroy_locks(pool);
+    free_workers(pool);
+    return r;
+  }
+  pool->async.data = pool;
+  return 0;
+}
+
+int ws_pool_submit(ws_pool_t *pool, ws_task_t *task, ws_work_cb work_cb, ws_after_cb after_cb) {
+  task->pool = pool;
+  task->worker = NULL;
+  task->parent = NULL;
+  task->work_cb = work_cb;
+  task->after_cb = after_cb;
+  task->pending = 1;
+  task->next = NULL;
+
+  uv_mutex_lock(&pool->mutex);
+  if (pool->inject_tail) pool->inject_tail->next = task;
+  else pool->inject_head = task;
+  pool->inject_tail = task;
+  __atomic_add_fetch(&pool->injected, 1, __ATOMIC_RELEASE);
+  uv_mutex_unlock(&pool->mutex);
+
+  wake_one(pool);
+  return 0;
+}
+
+void ws_pool_spawn(ws_task_t *parent, ws_task_t *child, ws_work_cb work_cb, ws_after_cb after_cb) {
+  ws_worker_t *worker = parent->worker;
+
+  child->pool = parent->pool;
+  child->worker = NULL;
+  child->parent = parent;
+  child->work_cb = work_cb;
+  child->after_cb = after_cb;
+  child->pending = 1;
+  child->next = NULL;
+  __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+
+  // 队列扩容失败就在当前线程直接跑
+  if (deque_push(&worker->deque, child)) {
+    run(worker, child);
+    return;
+  }
+  wake_one(parent->pool);
+}
+
+static void async_close_cb(uv_handle_t *handle) {
+  ws_pool_t *pool = handle->data;
+  // close_cb里还可以打印统计，之后再释放
+  if (pool->close_cb) {
+    pool->close_cb(pool);
+  }
+  free(pool->workers);
+  pool->workers = NULL;
+}
+
+void ws_pool_close(ws_pool_t *pool, ws_pool_close_cb close_cb) {
+  int i;
+
+  stop_threads(pool, pool->threads);
+  for (i = 0; i < pool->threads; i++) {
+    deque_free(&pool->workers[i].deque);
+  }
+  destroy_locks(pool);
+  pool->close_cb = close_cb;
+  uv_close((uv_handle_t *) &pool->async, async_close_cb);
+}
+
+void ws_pool_print_stats(ws_pool_t *pool, FILE *stream) {
+  ws_worker_stats_t total;
+  int i;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < pool->threads; i++) {
+    total.executed += pool->workers[i].stats.executed;
+    total.stolen += pool->workers[i].stats.stolen;
+    total.injected += pool->workers[i].stats.injected;
+    total.parks += pool->workers[i].stats.parks;
+  }
+  fprintf(stream, "ws pool: threads[%d], executed[%llu], stolen[%llu], injected[%llu], parks[%llu], "
+                  "completions[%llu], wakeups[%llu]\n",
+          pool->threads, (unsigned long long) total.executed, (unsigned long long) total.stolen,
+          (unsigned long long) total.injected, (unsigned long long) total.parks,
+          (unsigned long long) pool->completions, (unsigned long long) pool->wakeups);
+}
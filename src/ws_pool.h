@@ -0,0 +1,107 @@
+/*
+ * CPU密集型小任务用的work-stealing线程池
+ * uv_queue_work背后是整个进程共享的一个线程池、一个加锁的FIFO队列，文件和DNS请求也在里面排队，
+ * 几微秒的任务大部分时间都花在抢这把锁和loop线程的往返上，任务里再拆子任务也只能一个个交回loop线程再提交。
+ * 这里用uv_thread_create起threads个专用线程：
+ * 1、每个线程一个Chase-Lev双端队列，自己在底部压入/取出(不加锁)，空闲的线程从别人的顶部偷(一次CAS)
+ * 2、loop线程提交的任务先放进一个加锁的注入队列，线程一次取一小批，剩下的压进自己的队列给别人偷
+ * 3、任务在work_cb里可以用ws_pool_spawn拆子任务，子任务压进当前线程自己的队列；
+ *    一个任务在它的work_cb返回并且所有子任务都完成之后才算完成(fork/join)，完成之后才回调after_cb
+ * 4、完成的任务挂到一个链表上，链表从空变成非空的时候uv_async_send一次，async_cb在loop线程上一次回调一整批
+ * 5、线程先自旋着偷一会儿，一直没活干就在条件变量上睡，有新任务并且有人在睡的时候才去唤醒
+ * 队列扩容之后旧的数组可能还有线程在偷，不马上释放，留到ws_pool_close时一起释放。
+ */
+#ifndef LIBUV_DEMO_WS_POOL_H
+#define LIBUV_DEMO_WS_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "uv.h"
+
+#define WS_DEQUE_INITIAL_SIZE 1024
+#define WS_INJECT_BATCH 16
+#define WS_SPIN_ROUNDS 64
+
+typedef struct ws_pool_s ws_pool_t;
+typedef struct ws_task_s ws_task_t;
+typedef struct ws_worker_s ws_worker_t;
+
+typedef void (*ws_work_cb)(ws_task_t *task);      // 在池子的线程里调用
+typedef void (*ws_after_cb)(ws_task_t *task);     // 在loop线程里调用
+typedef void (*ws_pool_close_cb)(ws_pool_t *pool);
+
+struct ws_task_s {
+  void *data;
+  ws_pool_t *pool;
+  ws_worker_t *worker;          // 正在跑这个任务的线程，ws_pool_spawn用
+  ws_task_t *parent;
+  ws_work_cb work_cb;
+  ws_after_cb after_cb;
+  int pending;                  // 自己 + 还没完成的子任务
+  ws_task_t *next;              // 注入队列和完成链表
+};
+
+typedef struct ws_array_s {
+  int64_t mask;
+  struct ws_array_s *retired;   // 扩容之前的数组
+  ws_task_t *slots[1];
+} ws_array_t;
+
+typedef struct {
+  int64_t top;                  // 别人从这里偷
+  char pad[64 - sizeof(int64_t)];
+  int64_t bottom;               // 自己在这里压入、取出
+  ws_array_t *array;
+} ws_deque_t;
+
+typedef struct {
+  uint64_t executed;
+  uint64_t stolen;              // 从别人队列里偷到的
+  uint64_t injected;            // 从注入队列里取的
+  uint64_t parks;               // 睡下的次数
+} ws_worker_stats_t;
+
+struct ws_worker_s {
+  ws_deque_t deque;
+  ws_pool_t *pool;
+  uv_thread_t thread;
+  uint32_t seed;                // 选偷谁用的随机数
+  ws_worker_stats_t stats;
+};
+
+struct ws_pool_s {
+  void *data;
+  uv_loop_t *loop;
+  int threads;
+  ws_worker_t *workers;
+  int stopping;
+  int sleepers;
+  uv_mutex_t mutex;             // 注入队列和睡眠
+  uv_cond_t cond;
+  ws_task_t *inject_head;
+  ws_task_t *inject_tail;
+  int injected;
+  uv_mutex_t done_mutex;
+  ws_task_t *done_head;
+  ws_task_t *done_tail;
+  uv_async_t async;
+  uint64_t completions;
+  uint64_t wakeups;             // async_cb的次数
+  ws_pool_close_cb close_cb;
+};
+
+// threads <= 0时每个CPU一个线程
+int ws_pool_init(uv_loop_t *loop, ws_pool_t *pool, int threads);
+
+// 在loop线程里提交，after_cb可以为NULL
+int ws_pool_submit(ws_pool_t *pool, ws_task_t *task, ws_work_cb work_cb, ws_after_cb after_cb);
+
+// 只能在parent的work_cb里调用，child完成之前parent不会完成
+void ws_pool_spawn(ws_task_t *parent, ws_task_t *child, ws_work_cb work_cb, ws_after_cb after_cb);
+
+// 所有提交的任务都回调过之后才能关，会等线程退出；close_cb里还可以打印统计，之后池子的内存才释放
+void ws_pool_close(ws_pool_t *pool, ws_pool_close_cb close_cb);
+
+void ws_pool_print_stats(ws_pool_t *pool, FILE *stream);
+
+#endif //LIBUV_DEMO_WS_POOL_H